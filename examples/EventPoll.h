@@ -29,8 +29,13 @@
 #  include <config.h>
 #endif // HAVE_CONFIG_H
 
-#ifdef HAVE_EPOLL
+#ifdef HAVE_IO_URING
+#  include "EventPoll_io_uring.h"
+#elif HAVE_EPOLL
 #  include "EventPoll_epoll.h"
+namespace spdylay {
+typedef EpollEventPoll EventPoll;
+} // namespace spdylay
 #elif HAVE_KQUEUE
 #  include "EventPoll_kqueue.h"
 #endif // HAVE_KQUEUE
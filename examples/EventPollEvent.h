@@ -31,12 +31,18 @@ enum EventPollEvent {
   EP_POLLIN = 1,
   EP_POLLOUT = 1 << 1,
   EP_POLLHUP = 1 << 2,
-  EP_POLLERR = 1 << 3
+  EP_POLLERR = 1 << 3,
+  // Only used in EventPoll::ctl_event(). The events are reported
+  // when the state changes (edge-triggered).
+  EP_POLLET = 1 << 4
 };
 
 enum EventPollOp {
   EP_ADD,
-  EP_MOD
+  EP_MOD,
+  // Stops watching the file descriptor. |events| and |user_data| are
+  // ignored. Must be called before the file descriptor is closed.
+  EP_DEL
 };
 
 } // namespace spdylay
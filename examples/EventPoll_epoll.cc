@@ -30,7 +30,7 @@
 
 namespace spdylay {
 
-EventPoll::EventPoll(size_t max_events)
+EpollEventPoll::EpollEventPoll(size_t max_events)
   : max_events_(max_events), num_events_(0)
 {
   epfd_ = epoll_create(1);
@@ -38,7 +38,7 @@ EventPoll::EventPoll(size_t max_events)
   evlist_ = new epoll_event[max_events_];
 }
 
-EventPoll::~EventPoll()
+EpollEventPoll::~EpollEventPoll()
 {
   if(epfd_ != -1) {
     close(epfd_);
@@ -46,7 +46,7 @@ EventPoll::~EventPoll()
   delete [] evlist_;
 }
     
-int EventPoll::poll(int timeout)
+int EpollEventPoll::poll(int timeout)
 {
   num_events_ = 0;
   int n = epoll_wait(epfd_, evlist_, max_events_, timeout);
@@ -56,17 +56,17 @@ int EventPoll::poll(int timeout)
   return n;
 }
 
-int EventPoll::get_num_events()
+int EpollEventPoll::get_num_events()
 {
   return num_events_;
 }
 
-void* EventPoll::get_user_data(size_t p)
+void* EpollEventPoll::get_user_data(size_t p)
 {
   return evlist_[p].data.ptr;
 }
 
-int EventPoll::get_events(size_t p)
+int EpollEventPoll::get_events(size_t p)
 {
   int events = 0;
   int revents = evlist_[p].events;
@@ -96,21 +96,53 @@ int update_event(int epfd, int op, int fd, int events, void *user_data)
   if(events & EP_POLLOUT) {
     ev.events |= EPOLLOUT;
   }
+  if(events & EP_POLLET) {
+    ev.events |= EPOLLET;
+  }
   ev.data.ptr = user_data;
   return epoll_ctl(epfd, op, fd, &ev);
 }
 } // namespace
 
-int EventPoll::ctl_event(int op, int fd, int events, void *user_data)
+int EpollEventPoll::ctl_event(int op, int fd, int events, void *user_data)
 {
+  if(fd < 0) {
+    return -1;
+  }
   if(op == EP_ADD) {
     op = EPOLL_CTL_ADD;
   } else if(op == EP_MOD) {
+    if(same_interest(fd, events, user_data)) {
+      return 0;
+    }
     op = EPOLL_CTL_MOD;
+  } else if(op == EP_DEL) {
+    op = EPOLL_CTL_DEL;
+    events = 0;
+    user_data = 0;
   } else {
     return -1;
   }
-  return update_event(epfd_, op, fd, events, user_data);
+  int r = update_event(epfd_, op, fd, events, user_data);
+  if(r == 0) {
+    set_interest(fd, events, user_data);
+  }
+  return r;
+}
+
+void EpollEventPoll::set_interest(int fd, int events, void *user_data)
+{
+  if(interest_.size() <= static_cast<size_t>(fd)) {
+    interest_.resize(fd+1);
+  }
+  interest_[fd].events = events;
+  interest_[fd].user_data = user_data;
+}
+
+bool EpollEventPoll::same_interest(int fd, int events, void *user_data) const
+{
+  return static_cast<size_t>(fd) < interest_.size() &&
+    interest_[fd].events == events && interest_[fd].user_data == user_data;
 }
 
 } // namespace spdylay
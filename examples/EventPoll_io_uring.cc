@@ -0,0 +1,340 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "EventPoll_io_uring.h"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+namespace spdylay {
+
+namespace {
+// The user data of the requests to remove the poll request. Their
+// completions are ignored.
+const uint64_t REMOVE_USER_DATA = UINT64_MAX;
+} // namespace
+
+namespace {
+uint64_t make_user_data(int fd, uint32_t gen)
+{
+  return (static_cast<uint64_t>(fd) << 32) | gen;
+}
+} // namespace
+
+EventPoll::EventPoll(size_t max_events)
+  : epoll_(0), ring_fd_(-1), ring_(MAP_FAILED), ring_size_(0),
+    sqes_(reinterpret_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size_(0),
+    max_events_(max_events), evlist_(max_events), num_events_(0)
+{
+  // At most one poll request and one remove request are queued for
+  // each event reported by poll().
+  if(setup_ring(std::max(max_events*2, static_cast<size_t>(256))) == -1) {
+    teardown_ring();
+    epoll_ = new EpollEventPoll(max_events);
+  }
+}
+
+EventPoll::~EventPoll()
+{
+  teardown_ring();
+  delete epoll_;
+}
+
+int EventPoll::setup_ring(size_t entries)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CLAMP;
+  ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if(ring_fd_ == -1) {
+    return -1;
+  }
+  // We need a single mapping for SQ and CQ rings, the completions
+  // which are not dropped on CQ overflow, and the timeout argument of
+  // io_uring_enter().
+  const unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+    IORING_FEAT_EXT_ARG;
+  if((params.features & features) != features) {
+    return -1;
+  }
+  ring_size_ = std::max(params.sq_off.array +
+                        params.sq_entries*sizeof(unsigned int),
+                        params.cq_off.cqes +
+                        params.cq_entries*sizeof(io_uring_cqe));
+  ring_ = mmap(0, ring_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if(ring_ == MAP_FAILED) {
+    return -1;
+  }
+  sqes_size_ = params.sq_entries*sizeof(io_uring_sqe);
+  void *sqes = mmap(0, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    return -1;
+  }
+  sqes_ = reinterpret_cast<io_uring_sqe*>(sqes);
+  uint8_t *ring = reinterpret_cast<uint8_t*>(ring_);
+  sq_head_ = reinterpret_cast<unsigned int*>(ring+params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned int*>(ring+params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned int*>(ring+params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned int*>(ring+params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = reinterpret_cast<unsigned int*>(ring+params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned int*>(ring+params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned int*>(ring+params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(ring+params.cq_off.cqes);
+  return 0;
+}
+
+void EventPoll::teardown_ring()
+{
+  if(reinterpret_cast<void*>(sqes_) != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(MAP_FAILED);
+  }
+  if(ring_ != MAP_FAILED) {
+    munmap(ring_, ring_size_);
+    ring_ = MAP_FAILED;
+  }
+  if(ring_fd_ != -1) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+int EventPoll::enter(unsigned int min_complete, int timeout)
+{
+  unsigned int to_submit = *sq_tail_ -
+    __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  unsigned int flags = 0;
+  io_uring_getevents_arg arg;
+  __kernel_timespec ts;
+  memset(&arg, 0, sizeof(arg));
+  if(min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if(timeout >= 0) {
+      ts.tv_sec = timeout/1000;
+      ts.tv_nsec = (timeout%1000)*1000000;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+  }
+  return syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                 flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : 0,
+                 sizeof(arg));
+}
+
+io_uring_sqe* EventPoll::get_sqe()
+{
+  unsigned int tail = *sq_tail_;
+  if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    // Submit the queued requests to make room.
+    if(enter(0, 0) == -1 ||
+       tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      return 0;
+    }
+  }
+  unsigned int index = tail & *sq_mask_;
+  io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(io_uring_sqe));
+  sq_array_[index] = index;
+  // The kernel reads the SQE only in io_uring_enter(), which is
+  // called after the caller fills it.
+  __atomic_store_n(sq_tail_, tail+1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+int EventPoll::poll(int timeout)
+{
+  if(epoll_) {
+    return epoll_->poll(timeout);
+  }
+  num_events_ = 0;
+  // The completions left by the previous call are reported without
+  // waiting.
+  unsigned int min_complete =
+    *cq_head_ == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) ? 1 : 0;
+  if(min_complete > 0 || *sq_tail_ != *sq_head_) {
+    if(enter(min_complete, timeout) == -1) {
+      if(errno == ETIME) {
+        return 0;
+      }
+      return -1;
+    }
+  }
+  reap_events();
+  return num_events_;
+}
+
+void EventPoll::reap_events()
+{
+  unsigned int head = *cq_head_;
+  unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for(; head != tail && num_events_ < max_events_; ++head) {
+    io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+    if(cqe->user_data == REMOVE_USER_DATA) {
+      continue;
+    }
+    size_t fd = cqe->user_data >> 32;
+    uint32_t gen = cqe->user_data & 0xffffffffu;
+    if(fd >= interest_.size()) {
+      continue;
+    }
+    Interest& in = interest_[fd];
+    if(!in.armed || in.gen != gen) {
+      // The registration has been replaced.
+      continue;
+    }
+    // The multishot request for the edge-triggered registration stays
+    // armed while the kernel tells so. Otherwise ctl_event() arms it
+    // again.
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+      in.armed = false;
+    }
+    Event& ev = evlist_[num_events_++];
+    ev.user_data = in.user_data;
+    ev.events = 0;
+    if(cqe->res < 0) {
+      ev.events |= EP_POLLERR;
+      continue;
+    }
+    if(cqe->res & POLLIN) {
+      ev.events |= EP_POLLIN;
+    }
+    if(cqe->res & POLLOUT) {
+      ev.events |= EP_POLLOUT;
+    }
+    if(cqe->res & POLLHUP) {
+      ev.events |= EP_POLLHUP;
+    }
+    if(cqe->res & POLLERR) {
+      ev.events |= EP_POLLERR;
+    }
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+int EventPoll::get_num_events()
+{
+  if(epoll_) {
+    return epoll_->get_num_events();
+  }
+  return num_events_;
+}
+
+void* EventPoll::get_user_data(size_t p)
+{
+  if(epoll_) {
+    return epoll_->get_user_data(p);
+  }
+  return evlist_[p].user_data;
+}
+
+int EventPoll::get_events(size_t p)
+{
+  if(epoll_) {
+    return epoll_->get_events(p);
+  }
+  return evlist_[p].events;
+}
+
+int EventPoll::ctl_event(int op, int fd, int events, void *user_data)
+{
+  if(epoll_) {
+    return epoll_->ctl_event(op, fd, events, user_data);
+  }
+  if(fd < 0 || (op != EP_ADD && op != EP_MOD && op != EP_DEL)) {
+    return -1;
+  }
+  if(interest_.size() <= static_cast<size_t>(fd)) {
+    interest_.resize(fd+1);
+  }
+  Interest& in = interest_[fd];
+  if(op == EP_MOD && in.armed &&
+     in.events == events && in.user_data == user_data) {
+    return 0;
+  }
+  io_uring_sqe *sqe;
+  if(in.armed) {
+    // Cancel the pending registration. The poll request holds the
+    // file, so it is cancelled even if EP_ADD is used for the reused
+    // file descriptor, and EP_DEL must be used before the file
+    // descriptor is closed.
+    sqe = get_sqe();
+    if(!sqe) {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(fd, in.gen);
+    sqe->user_data = REMOVE_USER_DATA;
+    in.armed = false;
+  }
+  ++in.gen;
+  if(op == EP_DEL) {
+    in.events = 0;
+    in.user_data = 0;
+    return 0;
+  }
+  in.events = events;
+  in.user_data = user_data;
+  uint32_t mask = 0;
+  if(events & EP_POLLIN) {
+    mask |= POLLIN;
+  }
+  if(events & EP_POLLOUT) {
+    mask |= POLLOUT;
+  }
+  if(mask == 0) {
+    return 0;
+  }
+  sqe = get_sqe();
+  if(!sqe) {
+    return -1;
+  }
+  if(events & EP_POLLET) {
+    // The multishot request reports the events each time the state
+    // changes, without being submitted again.
+    mask |= EPOLLET;
+    sqe->len = IORING_POLL_ADD_MULTI;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  mask = (mask << 16) | (mask >> 16);
+#endif // __BYTE_ORDER == __BIG_ENDIAN
+  sqe->poll32_events = mask;
+  sqe->user_data = make_user_data(fd, in.gen);
+  in.armed = true;
+  return 0;
+}
+
+} // namespace spdylay
@@ -0,0 +1,110 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef EVENT_POLL_IO_URING_H
+#define EVENT_POLL_IO_URING_H
+
+#include <stdint.h>
+#include <cstdlib>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "EventPollEvent.h"
+#include "EventPoll_epoll.h"
+
+namespace spdylay {
+
+// EventPoll implemented with the poll requests of io_uring. The
+// changes of interest made by ctl_event() are queued in the
+// submission queue and submitted in the same io_uring_enter() call
+// which waits for the events. Each level-triggered registration
+// reports at most one event, after which ctl_event() must be called
+// to watch the file descriptor again. The edge-triggered one
+// (EP_POLLET) uses multishot poll request and stays armed. If
+// io_uring is not available at run time, epoll is used instead.
+class EventPoll {
+public:
+  EventPoll(size_t max_events);
+  ~EventPoll();
+  // Returns 0 if this function succeeds, or -1.
+  // On success
+  int poll(int timeout);
+  // Returns number of events detected in previous call of poll().
+  int get_num_events();
+  // Returns events of p-eth event.
+  int get_events(size_t p);
+  // Returns user data of p-th event.
+  void* get_user_data(size_t p);
+  // Adds/Modifies/Deletes event to watch. If |op| is EP_MOD and |events| and
+  // |user_data| are the same as the ones of the pending registration
+  // for |fd|, this function does nothing.
+  int ctl_event(int op, int fd, int events, void *user_data);
+private:
+  struct Interest {
+    int events;
+    void *user_data;
+    // Incremented on each registration so that the completion of the
+    // removed registration is ignored.
+    uint32_t gen;
+    // true if the registration has not been completed yet, or the
+    // multishot request is still active.
+    bool armed;
+  };
+  struct Event {
+    int events;
+    void *user_data;
+  };
+  int setup_ring(size_t entries);
+  void teardown_ring();
+  io_uring_sqe* get_sqe();
+  int enter(unsigned int min_complete, int timeout);
+  void reap_events();
+
+  // Used if io_uring is not available.
+  EpollEventPoll *epoll_;
+  int ring_fd_;
+  // SQ and CQ rings share this mapping.
+  void *ring_;
+  size_t ring_size_;
+  io_uring_sqe *sqes_;
+  size_t sqes_size_;
+  unsigned int *sq_head_;
+  unsigned int *sq_tail_;
+  unsigned int *sq_mask_;
+  unsigned int *sq_array_;
+  unsigned int sq_entries_;
+  unsigned int *cq_head_;
+  unsigned int *cq_tail_;
+  unsigned int *cq_mask_;
+  io_uring_cqe *cqes_;
+  std::vector<Interest> interest_;
+  size_t max_events_;
+  std::vector<Event> evlist_;
+  size_t num_events_;
+};
+
+} // namespace spdylay
+
+#endif // EVENT_POLL_IO_URING_H
@@ -94,20 +94,64 @@ namespace {
 int update_event(int kq, int fd, int events, void *user_data)
 {
   struct kevent changelist[2];
+  int flags = EV_ADD | ((events & EP_POLLET) ? EV_CLEAR : 0);
   EV_SET(&changelist[0], fd, EVFILT_READ,
-         EV_ADD | ((events & EP_POLLIN) ? EV_ENABLE : EV_DISABLE),
+         flags | ((events & EP_POLLIN) ? EV_ENABLE : EV_DISABLE),
          0, 0, user_data);
   EV_SET(&changelist[1], fd, EVFILT_WRITE,
-         EV_ADD | ((events & EP_POLLOUT) ? EV_ENABLE : EV_DISABLE),
+         flags | ((events & EP_POLLOUT) ? EV_ENABLE : EV_DISABLE),
          0, 0, user_data);
   timespec ts = { 0, 0 };
   return kevent(kq, changelist, 2, changelist, 0, &ts);
 }
 } // namespace
 
+namespace {
+int delete_event(int kq, int fd)
+{
+  struct kevent changelist[2];
+  EV_SET(&changelist[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+  EV_SET(&changelist[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+  timespec ts = { 0, 0 };
+  return kevent(kq, changelist, 2, changelist, 0, &ts);
+}
+} // namespace
+
 int EventPoll::ctl_event(int op, int fd, int events, void *user_data)
 {
-  return update_event(kq_, fd, events, user_data);
+  if(fd < 0) {
+    return -1;
+  }
+  if(op == EP_MOD && same_interest(fd, events, user_data)) {
+    return 0;
+  }
+  int r;
+  if(op == EP_DEL) {
+    events = 0;
+    user_data = 0;
+    r = delete_event(kq_, fd);
+  } else {
+    r = update_event(kq_, fd, events, user_data);
+  }
+  if(r == 0) {
+    set_interest(fd, events, user_data);
+  }
+  return r;
+}
+
+void EventPoll::set_interest(int fd, int events, void *user_data)
+{
+  if(interest_.size() <= static_cast<size_t>(fd)) {
+    interest_.resize(fd+1);
+  }
+  interest_[fd].events = events;
+  interest_[fd].user_data = user_data;
+}
+
+bool EventPoll::same_interest(int fd, int events, void *user_data) const
+{
+  return static_cast<size_t>(fd) < interest_.size() &&
+    interest_[fd].events == events && interest_[fd].user_data == user_data;
 }
 
 } // namespace spdylay
@@ -26,6 +26,7 @@
 #define EVENT_POLL_KQUEUE_H
 
 #include <cstdlib>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/event.h>
@@ -48,9 +49,23 @@ public:
   int get_events(size_t p);
   // Returns user data of p-th event.
   void* get_user_data(size_t p);
-  // Adds/Modifies event to watch.
+  // Adds/Modifies/Deletes event to watch. If |op| is EP_MOD and |events| and
+  // |user_data| are the same as the last ones for |fd|, this function
+  // returns 0 without a system call.
   int ctl_event(int op, int fd, int events, void *user_data);
 private:
+  struct Interest {
+    int events;
+    void *user_data;
+  };
+  // Updates the interest of |fd| after the successful system call.
+  void set_interest(int fd, int events, void *user_data);
+  // Returns true if the interest of |fd| is not changed.
+  bool same_interest(int fd, int events, void *user_data) const;
+  // The interest registered for each file descriptor, indexed by file
+  // descriptor. The entry of closed file descriptor is stale, but it
+  // is overwritten by EP_ADD when the file descriptor is reused.
+  std::vector<Interest> interest_;
   int kq_;
   size_t max_events_;
   struct kevent *evlist_;
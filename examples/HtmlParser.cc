@@ -24,143 +24,407 @@
  */
 #include "HtmlParser.h"
 
+#include <cstring>
+
 #include "util.h"
 #include "uri.h"
 
 namespace spdylay {
 
-ParserData::ParserData(const std::string& base_uri)
-  : base_uri(base_uri)
-{}
+namespace {
+enum {
+  TEXT,
+  // After '<'
+  TAG_OPEN,
+  TAG_NAME,
+  BEFORE_ATTR_NAME,
+  ATTR_NAME,
+  AFTER_ATTR_NAME,
+  BEFORE_ATTR_VALUE,
+  ATTR_VALUE_QUOTED,
+  ATTR_VALUE_UNQUOTED,
+  // After "<!"
+  MARKUP_DECL,
+  // After "<!-"
+  MARKUP_DECL_DASH,
+  COMMENT,
+  // <!DOCTYPE>, <?...> and the like. Skipped until '>'.
+  BOGUS_COMMENT
+};
+} // namespace
 
-HtmlParser::HtmlParser(const std::string& base_uri)
-  : base_uri_(base_uri),
-    parser_ctx_(0),
-    parser_data_(base_uri)
-{}
+namespace {
+enum {
+  TAG_OTHER,
+  TAG_LINK,
+  TAG_IMG,
+  TAG_SCRIPT,
+  TAG_STYLE
+};
+} // namespace
 
-HtmlParser::~HtmlParser()
+namespace {
+bool is_space(char c)
 {
-  htmlFreeParserCtxt(parser_ctx_);
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
 }
+} // namespace
 
 namespace {
-const char* get_attr(const xmlChar **attrs, const char *name)
+char lowcase(char c)
 {
-  for(; *attrs; attrs += 2) {
-    if(util::strieq(reinterpret_cast<const char*>(attrs[0]), name)) {
-      return reinterpret_cast<const char*>(attrs[1]);
-    }
-  }
-  return 0;
+  return 'A' <= c && c <= 'Z' ? c-'A'+'a' : c;
 }
 } // namespace
 
 namespace {
-void start_element_func
-(void* user_data,
- const xmlChar *name,
- const xmlChar **attrs)
+// Appends |c| to |buf| of length |*len| in lower case. If |buf| is
+// full, |*len| is set to MAX_NAME_LENGTH+1 so that the name does not
+// match any known name.
+void append_name(char *buf, size_t *len, char c)
 {
-  ParserData *parser_data = reinterpret_cast<ParserData*>(user_data);
-  if(util::strieq(reinterpret_cast<const char*>(name), "link")) {
-    const char *rel_attr = get_attr(attrs, "rel");
-    const char *href_attr = get_attr(attrs, "href");
-    if((util::strieq(rel_attr, "shortcut icon") ||
-        util::strieq(rel_attr, "stylesheet")) &&
-       href_attr) {
-      std::string uri = uri::joinUri(parser_data->base_uri, href_attr);
-      parser_data->links.push_back(uri);
-    }
-  } else if(util::strieq(reinterpret_cast<const char*>(name), "img")) {
-    const char *src_attr = get_attr(attrs, "src");
-    if(src_attr) {
-      std::string uri = uri::joinUri(parser_data->base_uri, src_attr);
-      parser_data->links.push_back(uri);
-    }
+  if(*len < HtmlParser::MAX_NAME_LENGTH) {
+    buf[(*len)++] = lowcase(c);
+    buf[*len] = '\0';
+  } else {
+    *len = HtmlParser::MAX_NAME_LENGTH+1;
   }
 }
 } // namespace
 
 namespace {
-xmlSAXHandler saxHandler =
-  {
-    0, // internalSubsetSAXFunc
-    0, // isStandaloneSAXFunc
-    0, // hasInternalSubsetSAXFunc
-    0, // hasExternalSubsetSAXFunc
-    0, // resolveEntitySAXFunc
-    0, // getEntitySAXFunc
-    0, // entityDeclSAXFunc
-    0, // notationDeclSAXFunc
-    0, // attributeDeclSAXFunc
-    0, // elementDeclSAXFunc
-    0, //   unparsedEntityDeclSAXFunc
-    0, //   setDocumentLocatorSAXFunc
-    0, //   startDocumentSAXFunc
-    0, //   endDocumentSAXFunc
-    &start_element_func, //   startElementSAXFunc
-    0, //   endElementSAXFunc
-    0, //   referenceSAXFunc
-    0, //   charactersSAXFunc
-    0, //   ignorableWhitespaceSAXFunc
-    0, //   processingInstructionSAXFunc
-    0, //   commentSAXFunc
-    0, //   warningSAXFunc
-    0, //   errorSAXFunc
-    0, //   fatalErrorSAXFunc
-    0, //   getParameterEntitySAXFunc
-    0, //   cdataBlockSAXFunc
-    0, //   externalSubsetSAXFunc
-    0, //   unsigned int        initialized
-    0, //   void *      _private
-    0, //   startElementNsSAX2Func
-    0, //   endElementNsSAX2Func
-    0, //   xmlStructuredErrorFunc
-  };
+bool name_eq(const char *buf, size_t len, const char *name)
+{
+  return len <= HtmlParser::MAX_NAME_LENGTH && strcmp(buf, name) == 0;
+}
 } // namespace
 
-int HtmlParser::parse_chunk(const char *chunk, size_t size, int fin)
+namespace {
+// Replaces the character references used in URI in |buf| of length
+// |len| and returns the new length.
+size_t decode_entities(char *buf, size_t len)
 {
-  if(!parser_ctx_) {
-    parser_ctx_ = htmlCreatePushParserCtxt(&saxHandler,
-                                           &parser_data_,
-                                           chunk, size,
-                                           base_uri_.c_str(),
-                                           XML_CHAR_ENCODING_NONE);
-    if(!parser_ctx_) {
-      return -1;
-    } else {
-      if(fin) {
-        return parse_chunk_internal(0, 0, fin);
-      } else {
-        return 0;
+  static const struct {
+    const char *name;
+    size_t len;
+    char c;
+  } entities[] = {
+    { "&amp;", 5, '&' },
+    { "&quot;", 6, '"' },
+    { "&apos;", 6, '\'' },
+    { "&#39;", 5, '\'' },
+    { "&lt;", 4, '<' },
+    { "&gt;", 4, '>' }
+  };
+  size_t j = 0;
+  for(size_t i = 0; i < len;) {
+    if(buf[i] == '&') {
+      size_t k;
+      for(k = 0; k < sizeof(entities)/sizeof(entities[0]); ++k) {
+        if(len-i >= entities[k].len &&
+           memcmp(buf+i, entities[k].name, entities[k].len) == 0) {
+          break;
+        }
+      }
+      if(k < sizeof(entities)/sizeof(entities[0])) {
+        buf[j++] = entities[k].c;
+        i += entities[k].len;
+        continue;
       }
     }
+    buf[j++] = buf[i++];
+  }
+  return j;
+}
+} // namespace
+
+HtmlParser::HtmlParser(const std::string& base_uri)
+  : base_uri_(base_uri),
+    state_(TEXT),
+    tag_(TAG_OTHER),
+    raw_tag_(TAG_OTHER),
+    end_tag_(false),
+    dashes_(0),
+    quote_(0),
+    capture_(false),
+    rel_asset_(false),
+    name_len_(0),
+    attr_name_len_(0),
+    value_len_(0),
+    link_len_(0)
+{}
+
+HtmlParser::~HtmlParser()
+{}
+
+void HtmlParser::start_tag()
+{
+  if(name_eq(name_, name_len_, "link")) {
+    tag_ = TAG_LINK;
+  } else if(name_eq(name_, name_len_, "img")) {
+    tag_ = TAG_IMG;
+  } else if(name_eq(name_, name_len_, "script")) {
+    tag_ = TAG_SCRIPT;
+  } else if(name_eq(name_, name_len_, "style")) {
+    tag_ = TAG_STYLE;
   } else {
-    return parse_chunk_internal(chunk, size, fin);
+    tag_ = TAG_OTHER;
   }
+  rel_asset_ = false;
+  link_len_ = 0;
 }
 
-int HtmlParser::parse_chunk_internal(const char *chunk, size_t size,
-                                     int fin)
+void HtmlParser::end_tag()
 {
-  int rv = htmlParseChunk(parser_ctx_, chunk, size, fin);
-  if(rv == 0) {
-    return 0;
+  state_ = TEXT;
+  if(end_tag_) {
+    if(tag_ == raw_tag_) {
+      raw_tag_ = TAG_OTHER;
+    }
+    return;
+  }
+  if(link_len_ > 0 &&
+     ((tag_ == TAG_LINK && rel_asset_) ||
+      tag_ == TAG_IMG || tag_ == TAG_SCRIPT)) {
+    links_.push_back(uri::joinUri(base_uri_, std::string(link_, link_len_)));
+  }
+  if(tag_ == TAG_SCRIPT || tag_ == TAG_STYLE) {
+    raw_tag_ = tag_;
+  }
+}
+
+void HtmlParser::start_attr_value()
+{
+  value_len_ = 0;
+  capture_ = !end_tag_ &&
+    (((tag_ == TAG_IMG || tag_ == TAG_SCRIPT) &&
+      name_eq(attr_name_, attr_name_len_, "src")) ||
+     (tag_ == TAG_LINK &&
+      (name_eq(attr_name_, attr_name_len_, "href") ||
+       name_eq(attr_name_, attr_name_len_, "rel"))));
+}
+
+void HtmlParser::end_attr_value()
+{
+  if(!capture_ || value_len_ > MAX_VALUE_LENGTH) {
+    return;
+  }
+  capture_ = false;
+  size_t first = 0;
+  while(first < value_len_ && is_space(value_[first])) {
+    ++first;
+  }
+  while(value_len_ > first && is_space(value_[value_len_-1])) {
+    --value_len_;
+  }
+  value_[value_len_] = '\0';
+  if(name_eq(attr_name_, attr_name_len_, "rel")) {
+    rel_asset_ = util::strieq(value_+first, "stylesheet") ||
+      util::strieq(value_+first, "shortcut icon");
   } else {
-    return -1;
+    link_len_ = decode_entities(value_+first, value_len_-first);
+    memcpy(link_, value_+first, link_len_);
+  }
+}
+
+int HtmlParser::parse_chunk(const char *chunk, size_t size, int fin)
+{
+  const char *p = chunk;
+  const char *end = chunk+size;
+  while(p != end) {
+    char c = *p;
+    switch(state_) {
+    case TEXT: {
+      // Most of the document is text. memchr() is usually vectorized
+      // by the C library.
+      const char *lt = static_cast<const char*>(memchr(p, '<', end-p));
+      if(!lt) {
+        p = end;
+        continue;
+      }
+      p = lt+1;
+      state_ = TAG_OPEN;
+      continue;
+    }
+    case TAG_OPEN:
+      if(c == '/') {
+        end_tag_ = true;
+        name_len_ = 0;
+        state_ = TAG_NAME;
+      } else if(raw_tag_ != TAG_OTHER) {
+        // Only the end tag closes the raw text.
+        state_ = TEXT;
+        continue;
+      } else if(util::isAlpha(c)) {
+        end_tag_ = false;
+        name_len_ = 0;
+        append_name(name_, &name_len_, c);
+        state_ = TAG_NAME;
+      } else if(c == '!') {
+        state_ = MARKUP_DECL;
+      } else if(c == '?') {
+        state_ = BOGUS_COMMENT;
+      } else {
+        state_ = TEXT;
+        continue;
+      }
+      break;
+    case TAG_NAME:
+      if(is_space(c) || c == '/' || c == '>') {
+        start_tag();
+        if(raw_tag_ != TAG_OTHER && tag_ != raw_tag_) {
+          // "</" in raw text which does not end it, like "a</b >".
+          state_ = TEXT;
+        } else if(c == '>') {
+          end_tag();
+        } else {
+          state_ = BEFORE_ATTR_NAME;
+        }
+      } else if(raw_tag_ != TAG_OTHER && !util::isAlpha(c)) {
+        // Not an end tag, like "a</b)" or "a</b</script>". The
+        // character is parsed again as text.
+        state_ = TEXT;
+        continue;
+      } else {
+        append_name(name_, &name_len_, c);
+      }
+      break;
+    case BEFORE_ATTR_NAME:
+      if(c == '>') {
+        end_tag();
+      } else if(!is_space(c) && c != '/') {
+        attr_name_len_ = 0;
+        append_name(attr_name_, &attr_name_len_, c);
+        state_ = ATTR_NAME;
+      }
+      break;
+    case ATTR_NAME:
+      if(c == '=') {
+        state_ = BEFORE_ATTR_VALUE;
+      } else if(is_space(c)) {
+        state_ = AFTER_ATTR_NAME;
+      } else if(c == '/') {
+        state_ = BEFORE_ATTR_NAME;
+      } else if(c == '>') {
+        end_tag();
+      } else {
+        append_name(attr_name_, &attr_name_len_, c);
+      }
+      break;
+    case AFTER_ATTR_NAME:
+      if(c == '=') {
+        state_ = BEFORE_ATTR_VALUE;
+      } else if(c == '>') {
+        end_tag();
+      } else if(c == '/') {
+        state_ = BEFORE_ATTR_NAME;
+      } else if(!is_space(c)) {
+        attr_name_len_ = 0;
+        append_name(attr_name_, &attr_name_len_, c);
+        state_ = ATTR_NAME;
+      }
+      break;
+    case BEFORE_ATTR_VALUE:
+      if(c == '"' || c == '\'') {
+        quote_ = c;
+        start_attr_value();
+        state_ = ATTR_VALUE_QUOTED;
+      } else if(c == '>') {
+        end_tag();
+      } else if(!is_space(c)) {
+        start_attr_value();
+        state_ = ATTR_VALUE_UNQUOTED;
+        continue;
+      }
+      break;
+    case ATTR_VALUE_QUOTED: {
+      const char *q = static_cast<const char*>(memchr(p, quote_, end-p));
+      const char *last = q ? q : end;
+      if(capture_ && value_len_ <= MAX_VALUE_LENGTH) {
+        size_t len = last-p;
+        if(value_len_+len <= MAX_VALUE_LENGTH) {
+          memcpy(value_+value_len_, p, len);
+          value_len_ += len;
+        } else {
+          value_len_ = MAX_VALUE_LENGTH+1;
+        }
+      }
+      if(!q) {
+        p = end;
+        continue;
+      }
+      end_attr_value();
+      state_ = BEFORE_ATTR_NAME;
+      p = q+1;
+      continue;
+    }
+    case ATTR_VALUE_UNQUOTED:
+      if(is_space(c) || c == '>') {
+        end_attr_value();
+        if(c == '>') {
+          end_tag();
+        } else {
+          state_ = BEFORE_ATTR_NAME;
+        }
+      } else if(capture_ && value_len_ <= MAX_VALUE_LENGTH) {
+        if(value_len_ < MAX_VALUE_LENGTH) {
+          value_[value_len_++] = c;
+        } else {
+          value_len_ = MAX_VALUE_LENGTH+1;
+        }
+      }
+      break;
+    case MARKUP_DECL:
+      state_ = c == '-' ? MARKUP_DECL_DASH : BOGUS_COMMENT;
+      if(c == '>') {
+        state_ = TEXT;
+      }
+      break;
+    case MARKUP_DECL_DASH:
+      if(c == '-') {
+        dashes_ = 0;
+        state_ = COMMENT;
+      } else {
+        state_ = c == '>' ? TEXT : BOGUS_COMMENT;
+      }
+      break;
+    case COMMENT:
+      if(c == '-') {
+        ++dashes_;
+      } else if(c == '>' && dashes_ >= 2) {
+        state_ = TEXT;
+      } else {
+        dashes_ = 0;
+      }
+      break;
+    case BOGUS_COMMENT: {
+      const char *gt = static_cast<const char*>(memchr(p, '>', end-p));
+      if(!gt) {
+        p = end;
+        continue;
+      }
+      p = gt+1;
+      state_ = TEXT;
+      continue;
+    }
+    }
+    ++p;
   }
+  if(fin) {
+    // The incomplete tag at the end of the document is discarded.
+    state_ = TEXT;
+  }
+  return 0;
 }
 
 const std::vector<std::string>& HtmlParser::get_links() const
 {
-  return parser_data_.links;
+  return links_;
 }
 
 void HtmlParser::clear_links()
 {
-  parser_data_.links.clear();
+  links_.clear();
 }
 
 } // namespace spdylay
@@ -32,52 +32,65 @@
 #include <vector>
 #include <string>
 
-#ifdef HAVE_LIBXML2
-
-#include <libxml/HTMLparser.h>
-
 namespace spdylay {
 
-struct ParserData {
-  std::string base_uri;
-  std::vector<std::string> links;
-  ParserData(const std::string& base_uri);
-};
-
+// Extracts the links to the assets from HTML document which is given
+// in chunks. The links are the href of <link rel="stylesheet"> and
+// <link rel="shortcut icon">, and the src of <img> and <script>. Each
+// link is available in get_links() as soon as the chunk containing
+// the end of its tag is parsed, so the asset can be requested before
+// the rest of the document arrives.
+//
+// This is not a full HTML parser. It only tokenizes tags, attributes,
+// comments and the contents of <script> and <style>. The state is
+// kept in fixed size buffers, so that parsing does not allocate
+// memory except for the links found. An attribute value longer than
+// MAX_VALUE_LENGTH is ignored.
 class HtmlParser {
 public:
   HtmlParser(const std::string& base_uri);
   ~HtmlParser();
+  // Parses |chunk| of |size| bytes. Pass nonzero |fin| with the last
+  // chunk. This function always succeeds and returns 0.
   int parse_chunk(const char *chunk, size_t size, int fin);
   const std::vector<std::string>& get_links() const;
   void clear_links();
+
+  enum {
+    MAX_NAME_LENGTH = 15,
+    MAX_VALUE_LENGTH = 2047
+  };
 private:
-  int parse_chunk_internal(const char *chunk, size_t size, int fin);
+  void start_tag();
+  void end_tag();
+  void start_attr_value();
+  void end_attr_value();
 
   std::string base_uri_;
-  htmlParserCtxtPtr parser_ctx_;
-  ParserData parser_data_;
-};
-
-} // namespace spdylay
-
-#else // !HAVE_LIBXML2
-
-namespace spdylay {
-
-class HtmlParser {
-public:
-  HtmlParser(const std::string& base_uri) {}
-  ~HtmlParser() {}
-  int parse_chunk(const char *chunk, size_t size, int fin) { return 0; }
-  const std::vector<std::string>& get_links() const { return links_; }
-  void clear_links() {}
-private:
   std::vector<std::string> links_;
+  int state_;
+  // The tag being parsed, or the element whose content is raw text
+  // (<script> or <style>).
+  int tag_;
+  int raw_tag_;
+  bool end_tag_;
+  // The number of consecutive '-' seen in comment.
+  int dashes_;
+  char quote_;
+  // True if the value of the current attribute is stored in value_.
+  bool capture_;
+  // True if rel attribute of <link> denotes an asset.
+  bool rel_asset_;
+  size_t name_len_;
+  size_t attr_name_len_;
+  size_t value_len_;
+  size_t link_len_;
+  char name_[MAX_NAME_LENGTH+1];
+  char attr_name_[MAX_NAME_LENGTH+1];
+  char value_[MAX_VALUE_LENGTH+1];
+  char link_[MAX_VALUE_LENGTH+1];
 };
 
 } // namespace spdylay
 
-#endif // !HAVE_LIBXML2
-
 #endif // HTML_PARSER_H
@@ -0,0 +1,161 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "HtmlParser_test.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <CUnit/CUnit.h>
+
+#include "HtmlParser.h"
+
+namespace spdylay {
+
+namespace {
+const char BASE_URI[] = "http://example.org/dir/index.html";
+} // namespace
+
+namespace {
+// Parses |html| in chunks of |chunk_size| bytes and returns the links
+// found.
+std::vector<std::string> parse(const std::string& html, size_t chunk_size)
+{
+  HtmlParser parser(BASE_URI);
+  for(size_t i = 0; i < html.size(); i += chunk_size) {
+    size_t len = std::min(chunk_size, html.size()-i);
+    parser.parse_chunk(html.c_str()+i, len, i+len == html.size());
+  }
+  return parser.get_links();
+}
+} // namespace
+
+namespace {
+std::vector<std::string> parse(const std::string& html)
+{
+  return parse(html, html.size());
+}
+} // namespace
+
+void test_html_parser_links(void)
+{
+  std::vector<std::string> links = parse
+    ("<html><head>"
+     "<link rel=\"stylesheet\" href=\"/a.css\">"
+     "<LINK HREF='b.css' REL='StyleSheet'/>"
+     "<link rel=\"shortcut icon\" href=\"/favicon.ico\">"
+     "<link rel=\"alternate\" href=\"/feed.xml\">"
+     "<script src=/c.js></script>"
+     "</head><body>"
+     "<img alt=\"x\" src=\" d.png \">"
+     "<IMG SRC=\"e.png?x=1&amp;y=2\">"
+     "<img src=\"\">"
+     "<a href=\"/page.html\">link</a>"
+     "</body></html>");
+  CU_ASSERT(6 == links.size());
+  if(links.size() == 6) {
+    CU_ASSERT("http://example.org/a.css" == links[0]);
+    CU_ASSERT("http://example.org/dir/b.css" == links[1]);
+    CU_ASSERT("http://example.org/favicon.ico" == links[2]);
+    CU_ASSERT("http://example.org/c.js" == links[3]);
+    CU_ASSERT("http://example.org/dir/d.png" == links[4]);
+    CU_ASSERT("http://example.org/dir/e.png?x=1&y=2" == links[5]);
+  }
+
+  // The link is available as soon as its tag is parsed, and the
+  // incomplete tag at the end of the document is discarded.
+  HtmlParser parser(BASE_URI);
+  const char html[] = "<img src=\"/a.png\"><img src=\"/b.png\"";
+  parser.parse_chunk(html, 18, 0);
+  CU_ASSERT(1 == parser.get_links().size());
+  parser.clear_links();
+  CU_ASSERT(parser.get_links().empty());
+  parser.parse_chunk(html+18, sizeof(html)-1-18, 1);
+  CU_ASSERT(parser.get_links().empty());
+}
+
+void test_html_parser_raw_text(void)
+{
+  // The tags in <script> and <style> are not parsed until their end
+  // tags.
+  std::vector<std::string> links = parse
+    ("<script>document.write('<img src=\"/no1.png\">');"
+     "if(a<b && c</d) {} if(e</f </g</script>"
+     "<script>x</scRIPT >"
+     "<style>p { background: url(x.png) } <link rel=stylesheet href=/no2.css>"
+     "</style>"
+     "<img src=/a.png>"
+     "<script src=\"/b.js\"></script>"
+     "<img src=/c.png>");
+  CU_ASSERT(3 == links.size());
+  if(links.size() == 3) {
+    CU_ASSERT("http://example.org/a.png" == links[0]);
+    CU_ASSERT("http://example.org/b.js" == links[1]);
+    CU_ASSERT("http://example.org/c.png" == links[2]);
+  }
+}
+
+void test_html_parser_comment(void)
+{
+  std::vector<std::string> links = parse
+    ("<!DOCTYPE html><?xml version=\"1.0\"?>"
+     "<!-- <img src=/no1.png> -- <img src=/no2.png> --->"
+     "<!----><img src=/a.png>"
+     "<!-- -> <img src=/no3.png> - -><img src=/no4.png>-->"
+     "<img src=/b.png>");
+  CU_ASSERT(2 == links.size());
+  if(links.size() == 2) {
+    CU_ASSERT("http://example.org/a.png" == links[0]);
+    CU_ASSERT("http://example.org/b.png" == links[1]);
+  }
+}
+
+void test_html_parser_chunks(void)
+{
+  std::string html =
+    "<!DOCTYPE html><html><head>"
+    "<LINK rel = 'stylesheet' href = \"/a.css\" >"
+    "<script>var s = '<img src=/no.png>'; if(a</b) {}</script>"
+    "<!-- <img src=/no.png> -->"
+    "</head><body>"
+    "<img src=\"/b.png?x=1&amp;y=&lt;2&gt;\" alt=\"&amp;\">"
+    "<img src=c.png>"
+    "</body></html>";
+  std::vector<std::string> expected = parse(html);
+  CU_ASSERT(3 == expected.size());
+  if(expected.size() == 3) {
+    CU_ASSERT("http://example.org/a.css" == expected[0]);
+    CU_ASSERT("http://example.org/b.png?x=1&y=<2>" == expected[1]);
+    CU_ASSERT("http://example.org/dir/c.png" == expected[2]);
+  }
+  // Every split point, including the ones in the middle of tag names,
+  // attributes, entities, comments and the end tag of raw text, gives
+  // the same result.
+  for(size_t chunk_size = 1; chunk_size < html.size(); ++chunk_size) {
+    CU_ASSERT(expected == parse(html, chunk_size));
+  }
+}
+
+} // namespace spdylay
@@ -25,6 +25,7 @@
 #include "SpdyServer.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -32,8 +33,11 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <pthread.h>
 #include <cassert>
 #include <set>
+#include <list>
+#include <algorithm>
 #include <iostream>
 
 #include <openssl/err.h>
@@ -57,16 +61,252 @@ const std::string SPDYD_SERVER = "spdyd spdylay/" SPDYLAY_VERSION;
 } // namespace
 
 Config::Config(): verbose(false), daemon(false), port(0), data_ptr(0),
-                  spdy3_only(false), verify_client(false)
+                  spdy3_only(false), verify_client(false),
+                  cache_size(16*1024*1024), num_worker(1),
+                  edge_triggered(false)
 {}
 
+// A response body kept in memory by ResponseCache. The entry is
+// reference counted: the cache holds one reference while the entry is
+// indexed, and each Request sending the body holds one.
+struct CacheEntry {
+  enum State {
+    // The file does not exist.
+    FILE_MISSING,
+    // The file exists, but it is too large or not a regular file.
+    FILE_UNCACHED,
+    // The file content is in body.
+    FILE_CACHED
+  };
+  std::string path;
+  std::string body;
+  State state;
+  time_t mtime;
+  off_t size;
+  // The time when the file was stat'ed last.
+  time_t checked;
+  int refcnt;
+  CacheEntry(const std::string& path, time_t now)
+    : path(path), state(FILE_MISSING), mtime(0), size(0), checked(now),
+      refcnt(1)
+  {}
+};
+
+// Cache of small files and status pages. The files are looked up by
+// path, and the cached content is used as long as the modification
+// time and the size of the file are unchanged. Each Sessions has its
+// own ResponseCache.
+class ResponseCache {
+public:
+  ResponseCache(size_t max_size);
+  ~ResponseCache();
+  // Returns the entry for the file |path|, or 0 if the cache is
+  // disabled. The file is stat'ed again if the entry has not been
+  // checked for CHECK_INTERVAL seconds.
+  CacheEntry* lookup_file(const std::string& path, time_t now);
+  // Returns the gzip-encoded HTML page for |status|.
+  CacheEntry* get_status_page(const std::string& status, uint16_t port);
+  static void retain(CacheEntry *ent);
+  static void release(CacheEntry *ent);
+private:
+  typedef std::list<CacheEntry*> EntryList;
+  void remove(EntryList::iterator i);
+
+  // Most recently used entry is at front.
+  EntryList lru_;
+  std::map<std::string, EntryList::iterator> index_;
+  std::map<std::string, CacheEntry*> status_pages_;
+  size_t size_;
+  size_t max_size_;
+};
+
+namespace {
+// Files larger than this are not kept in memory.
+const off_t MAX_CACHED_FILE_SIZE = 64*1024;
+const time_t CHECK_INTERVAL = 1;
+} // namespace
+
+ResponseCache::ResponseCache(size_t max_size)
+  : size_(0),
+    max_size_(max_size)
+{}
+
+ResponseCache::~ResponseCache()
+{
+  for(EntryList::iterator i = lru_.begin(); i != lru_.end(); ++i) {
+    release(*i);
+  }
+  for(std::map<std::string, CacheEntry*>::iterator i = status_pages_.begin();
+      i != status_pages_.end(); ++i) {
+    release((*i).second);
+  }
+}
+
+void ResponseCache::retain(CacheEntry *ent)
+{
+  ++ent->refcnt;
+}
+
+void ResponseCache::release(CacheEntry *ent)
+{
+  if(--ent->refcnt == 0) {
+    delete ent;
+  }
+}
+
+namespace {
+size_t entry_size(const CacheEntry *ent)
+{
+  return sizeof(CacheEntry) + ent->path.size() + ent->body.size();
+}
+} // namespace
+
+namespace {
+// Reads the file |path| into |ent|.
+void load_file(CacheEntry *ent, const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1) {
+    return;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    close(fd);
+    return;
+  }
+  ent->state = CacheEntry::FILE_UNCACHED;
+  ent->mtime = st.st_mtime;
+  ent->size = st.st_size;
+  if(S_ISREG(st.st_mode) && st.st_size <= MAX_CACHED_FILE_SIZE) {
+    ent->body.resize(st.st_size);
+    size_t off = 0;
+    while(off < ent->body.size()) {
+      ssize_t r;
+      while((r = pread(fd, &ent->body[off], ent->body.size()-off,
+                       off)) == -1 && errno == EINTR);
+      if(r <= 0) {
+        break;
+      }
+      off += r;
+    }
+    if(off == ent->body.size()) {
+      ent->state = CacheEntry::FILE_CACHED;
+    } else {
+      ent->body.clear();
+    }
+  }
+  close(fd);
+}
+} // namespace
+
+CacheEntry* ResponseCache::lookup_file(const std::string& path, time_t now)
+{
+  if(max_size_ == 0) {
+    return 0;
+  }
+  std::map<std::string, EntryList::iterator>::iterator i = index_.find(path);
+  if(i != index_.end()) {
+    CacheEntry *ent = *(*i).second;
+    if(now - ent->checked < CHECK_INTERVAL) {
+      lru_.splice(lru_.begin(), lru_, (*i).second);
+      return ent;
+    }
+    struct stat st;
+    bool found = stat(path.c_str(), &st) == 0;
+    if(found ? ent->state != CacheEntry::FILE_MISSING &&
+       st.st_mtime == ent->mtime && st.st_size == ent->size :
+       ent->state == CacheEntry::FILE_MISSING) {
+      ent->checked = now;
+      lru_.splice(lru_.begin(), lru_, (*i).second);
+      return ent;
+    }
+    remove((*i).second);
+  }
+  CacheEntry *ent = new CacheEntry(path, now);
+  load_file(ent, path);
+  lru_.push_front(ent);
+  index_[path] = lru_.begin();
+  size_ += entry_size(ent);
+  while(size_ > max_size_ && lru_.size() > 1) {
+    remove(--lru_.end());
+  }
+  return ent;
+}
+
+void ResponseCache::remove(EntryList::iterator i)
+{
+  CacheEntry *ent = *i;
+  size_ -= entry_size(ent);
+  index_.erase(ent->path);
+  lru_.erase(i);
+  release(ent);
+}
+
+namespace {
+// Compresses |data| in gzip format.
+std::string gzip_encode(const std::string& data)
+{
+  z_stream zst;
+  memset(&zst, 0, sizeof(zst));
+  // 31 = 16 + 15: gzip header and the default window size.
+  if(deflateInit2(&zst, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+                  Z_DEFAULT_STRATEGY) != Z_OK) {
+    return "";
+  }
+  std::string out(deflateBound(&zst, data.size()), '\0');
+  zst.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zst.avail_in = data.size();
+  zst.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  zst.avail_out = out.size();
+  if(deflate(&zst, Z_FINISH) != Z_STREAM_END) {
+    out.clear();
+  } else {
+    out.resize(zst.total_out);
+  }
+  deflateEnd(&zst);
+  return out;
+}
+} // namespace
+
+CacheEntry* ResponseCache::get_status_page(const std::string& status,
+                                           uint16_t port)
+{
+  std::map<std::string, CacheEntry*>::iterator i = status_pages_.find(status);
+  if(i != status_pages_.end()) {
+    return (*i).second;
+  }
+  std::stringstream ss;
+  ss << "<html><head><title>" << status << "</title></head><body>"
+     << "<h1>" << status << "</h1>"
+     << "<hr>"
+     << "<address>" << SPDYD_SERVER << " at port " << port
+     << "</address>"
+     << "</body></html>";
+  CacheEntry *ent = new CacheEntry(status, time(0));
+  ent->body = gzip_encode(ss.str());
+  ent->state = CacheEntry::FILE_CACHED;
+  ent->size = ent->body.size();
+  status_pages_[status] = ent;
+  return ent;
+}
+
 Request::Request(int32_t stream_id)
   : stream_id(stream_id),
-    file(-1)
+    file(-1),
+    file_map(0),
+    cache_entry(0),
+    file_offset(0),
+    file_length(0)
 {}
 
 Request::~Request()
 {
+  if(file_map) {
+    munmap(file_map, file_length);
+  }
+  if(cache_entry) {
+    ResponseCache::release(cache_entry);
+  }
   if(file != -1) {
     close(file);
   }
@@ -83,9 +323,12 @@ void on_close(Sessions &sessions, EventHandler *hd);
 
 class Sessions {
 public:
-  Sessions(int max_events, SSL_CTX *ssl_ctx)
+  Sessions(int max_events, SSL_CTX *ssl_ctx, size_t cache_size,
+           bool edge_triggered)
     : eventPoll_(max_events),
-      ssl_ctx_(ssl_ctx)
+      ssl_ctx_(ssl_ctx),
+      cache_(cache_size),
+      edge_triggered_(edge_triggered)
   {}
   ~Sessions()
   {
@@ -94,7 +337,6 @@ public:
       on_close(*this, *i);
       delete *i;
     }
-    SSL_CTX_free(ssl_ctx_);
   }
   void add_handler(EventHandler *handler)
   {
@@ -121,6 +363,10 @@ public:
   {
     return update_poll_internal(handler, EP_MOD);
   }
+  int remove_poll(EventHandler *handler)
+  {
+    return eventPoll_.ctl_event(EP_DEL, handler->fd(), 0, 0);
+  }
   int poll(int timeout)
   {
     return eventPoll_.poll(timeout);
@@ -133,15 +379,26 @@ public:
   {
     return eventPoll_.get_events(p);
   }
+  ResponseCache* get_response_cache()
+  {
+    return &cache_;
+  }
 private:
   int update_poll_internal(EventHandler *handler, int op)
   {
     int events = 0;
-    if(handler->want_read()) {
-      events |= EP_POLLIN;
-    }
-    if(handler->want_write()) {
-      events |= EP_POLLOUT;
+    if(edge_triggered_) {
+      // The handlers read and write until the operation would block,
+      // so we watch both events all the time and the interest is
+      // never changed after the handler is registered.
+      events = EP_POLLIN | EP_POLLOUT | EP_POLLET;
+    } else {
+      if(handler->want_read()) {
+        events |= EP_POLLIN;
+      }
+      if(handler->want_write()) {
+        events |= EP_POLLOUT;
+      }
     }
     return eventPoll_.ctl_event(op, handler->fd(), events, handler);
   }
@@ -149,6 +406,8 @@ private:
   std::set<EventHandler*> handlers_;
   EventPoll eventPoll_;
   SSL_CTX *ssl_ctx_;
+  ResponseCache cache_;
+  bool edge_triggered_;
 };
 
 namespace {
@@ -173,10 +432,10 @@ SpdyEventHandler::SpdyEventHandler(const Config* config,
                                    int fd, SSL *ssl,
                                    uint16_t version,
                                    const spdylay_session_callbacks *callbacks,
-                                   int64_t session_id)
+                                   int64_t session_id, ResponseCache *cache)
   : EventHandler(config),
     fd_(fd), ssl_(ssl), version_(version), session_id_(session_id),
-    want_write_(false)
+    want_write_(false), cache_(cache), wbuflen_(0)
 {
   int r;
   r = spdylay_session_server_new(&session_, version, callbacks, this);
@@ -216,6 +475,12 @@ int SpdyEventHandler::execute(Sessions *sessions)
   if(r == 0) {
     r = spdylay_session_send(session_);
   }
+  if(r == 0) {
+    ssize_t rv = flush_data();
+    if(rv < 0 && !would_block(rv)) {
+      r = -1;
+    }
+  }
   return r;
 }
 
@@ -226,7 +491,7 @@ bool SpdyEventHandler::want_read()
 
 bool SpdyEventHandler::want_write()
 {
-  return spdylay_session_want_write(session_) || want_write_;
+  return spdylay_session_want_write(session_) || want_write_ || wbuflen_ > 0;
 }
 
 int SpdyEventHandler::fd() const
@@ -237,14 +502,38 @@ int SpdyEventHandler::fd() const
 bool SpdyEventHandler::finish()
 {
   return !spdylay_session_want_read(session_) &&
-    !spdylay_session_want_write(session_);
+    !spdylay_session_want_write(session_) && wbuflen_ == 0;
 }
 
 ssize_t SpdyEventHandler::send_data(const uint8_t *data, size_t len, int flags)
 {
-  ssize_t r;
+  if(wbuflen_ > 0 && wbuflen_+len > sizeof(wbuf_)) {
+    ssize_t r = flush_data();
+    if(r < 0) {
+      return r;
+    }
+  }
+  if(len >= sizeof(wbuf_)) {
+    ERR_clear_error();
+    return SSL_write(ssl_, data, len);
+  }
+  memcpy(wbuf_+wbuflen_, data, len);
+  wbuflen_ += len;
+  return len;
+}
+
+ssize_t SpdyEventHandler::flush_data()
+{
+  if(wbuflen_ == 0) {
+    return 0;
+  }
   ERR_clear_error();
-  r = SSL_write(ssl_, data, len);
+  // SSL_MODE_ENABLE_PARTIAL_WRITE is not set, so the whole buffer is
+  // written, or it must be retried with the same arguments.
+  ssize_t r = SSL_write(ssl_, wbuf_, wbuflen_);
+  if(r > 0) {
+    wbuflen_ = 0;
+  }
   return r;
 }
 
@@ -272,6 +561,7 @@ int SpdyEventHandler::submit_file_response(const std::string& status,
                                            int32_t stream_id,
                                            time_t last_modified,
                                            off_t file_length,
+                                           const char *content_encoding,
                                            spdylay_data_provider *data_prd)
 {
   std::string date_str = util::http_date(time(0));
@@ -285,12 +575,21 @@ int SpdyEventHandler::submit_file_response(const std::string& status,
     "cache-control", "max-age=3600",
     "date", date_str.c_str(),
     0, 0,
+    0, 0,
+    0, 0,
     0
   };
+  size_t nvlen = 12;
   if(last_modified != 0) {
     last_modified_str = util::http_date(last_modified);
-    nv[12] = "last-modified";
-    nv[13] = last_modified_str.c_str();
+    nv[nvlen++] = "last-modified";
+    nv[nvlen++] = last_modified_str.c_str();
+  }
+  if(content_encoding) {
+    nv[nvlen++] = "content-encoding";
+    nv[nvlen++] = content_encoding;
+    nv[nvlen++] = "vary";
+    nv[nvlen++] = "accept-encoding";
   }
   return spdylay_submit_response(session_, stream_id, nv, data_prd);
 }
@@ -356,6 +655,11 @@ int64_t SpdyEventHandler::session_id() const
   return session_id_;
 }
 
+ResponseCache* SpdyEventHandler::response_cache() const
+{
+  return cache_;
+}
+
 namespace {
 ssize_t hd_send_callback(spdylay_session *session,
                          const uint8_t *data, size_t len, int flags,
@@ -411,6 +715,89 @@ ssize_t file_read_callback
   }
 }
 
+namespace {
+// Copies the response body from the file mapped into memory. The
+// pages are taken from the page cache without read(2).
+ssize_t mapped_file_read_callback
+(spdylay_session *session, int32_t stream_id,
+ uint8_t *buf, size_t length, int *eof,
+ spdylay_data_source *source, void *user_data)
+{
+  Request *req = reinterpret_cast<Request*>(source->ptr);
+  size_t n = std::min(length,
+                      static_cast<size_t>(req->file_length-req->file_offset));
+  memcpy(buf, reinterpret_cast<uint8_t*>(req->file_map)+req->file_offset, n);
+  req->file_offset += n;
+  if(req->file_offset == req->file_length) {
+    *eof = 1;
+  }
+  return n;
+}
+} // namespace
+
+namespace {
+// Copies the response body from req->cache_entry.
+ssize_t cache_entry_read_callback
+(spdylay_session *session, int32_t stream_id,
+ uint8_t *buf, size_t length, int *eof,
+ spdylay_data_source *source, void *user_data)
+{
+  Request *req = reinterpret_cast<Request*>(source->ptr);
+  const std::string& body = req->cache_entry->body;
+  size_t n = std::min(length, body.size()-req->file_offset);
+  memcpy(buf, body.data()+req->file_offset, n);
+  req->file_offset += n;
+  if(static_cast<size_t>(req->file_offset) == body.size()) {
+    *eof = 1;
+  }
+  return n;
+}
+} // namespace
+
+namespace {
+// Reads the response body by pread(2) at the offset kept in Request,
+// so that the file position is not used.
+ssize_t pread_file_read_callback
+(spdylay_session *session, int32_t stream_id,
+ uint8_t *buf, size_t length, int *eof,
+ spdylay_data_source *source, void *user_data)
+{
+  Request *req = reinterpret_cast<Request*>(source->ptr);
+  ssize_t r;
+  while((r = pread(req->file, buf, length, req->file_offset)) == -1 &&
+        errno == EINTR);
+  if(r == -1) {
+    return SPDYLAY_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  req->file_offset += r;
+  if(r == 0 || req->file_offset >= req->file_length) {
+    *eof = 1;
+  }
+  return r;
+}
+} // namespace
+
+namespace {
+// Sets up |data_prd| to send the regular file req->file. The file is
+// mapped into memory if possible. Otherwise it is read by pread(2).
+void prepare_file_data_provider(Request *req, spdylay_data_provider *data_prd)
+{
+  data_prd->source.ptr = req;
+  if(req->file_length > 0) {
+    void *addr = mmap(0, req->file_length, PROT_READ, MAP_PRIVATE, req->file,
+                      0);
+    if(addr != MAP_FAILED) {
+      madvise(addr, req->file_length, MADV_SEQUENTIAL);
+      req->file_map = addr;
+      data_prd->read_callback = mapped_file_read_callback;
+      return;
+    }
+  }
+  posix_fadvise(req->file, 0, 0, POSIX_FADV_SEQUENTIAL);
+  data_prd->read_callback = pread_file_read_callback;
+}
+} // namespace
+
 namespace {
 bool check_url(const std::string& url)
 {
@@ -427,33 +814,76 @@ namespace {
 void prepare_status_response(Request *req, SpdyEventHandler *hd,
                              const std::string& status)
 {
-  int pipefd[2];
-  if(pipe(pipefd) == -1) {
-    hd->submit_response(status, req->stream_id, 0);
+  CacheEntry *ent = hd->response_cache()->get_status_page(status,
+                                                          hd->config()->port);
+  ResponseCache::retain(ent);
+  req->cache_entry = ent;
+  spdylay_data_provider data_prd;
+  data_prd.source.ptr = req;
+  data_prd.read_callback = cache_entry_read_callback;
+  std::vector<std::pair<std::string, std::string> > headers;
+  headers.push_back(std::make_pair("content-encoding", "gzip"));
+  headers.push_back(std::make_pair("content-type",
+                                   "text/html; charset=UTF-8"));
+  hd->submit_response(status, req->stream_id, headers, &data_prd);
+}
+} // namespace
+
+namespace {
+// Sends the file |path| as the response. If |content_encoding| is
+// not NULL, the file is sent with content-encoding header field with
+// that value. Returns false if the file is not found.
+bool serve_file(Request *req, SpdyEventHandler *hd, const std::string& path,
+                const char *content_encoding,
+                bool last_mod_found, time_t last_mod)
+{
+  CacheEntry *ent = hd->response_cache()->lookup_file(path, time(0));
+  if(ent) {
+    if(ent->state == CacheEntry::FILE_MISSING) {
+      return false;
+    }
+    if(ent->state == CacheEntry::FILE_CACHED) {
+      if(last_mod_found && ent->mtime <= last_mod) {
+        prepare_status_response(req, hd, STATUS_304);
+        return true;
+      }
+      ResponseCache::retain(ent);
+      req->cache_entry = ent;
+      spdylay_data_provider data_prd;
+      data_prd.source.ptr = req;
+      data_prd.read_callback = cache_entry_read_callback;
+      hd->submit_file_response(STATUS_200, req->stream_id, ent->mtime,
+                               ent->body.size(), content_encoding,
+                               &data_prd);
+      return true;
+    }
+  }
+  int file = open(path.c_str(), O_RDONLY);
+  if(file == -1) {
+    return false;
+  }
+  struct stat buf;
+  if(fstat(file, &buf) == -1) {
+    close(file);
+    return false;
+  }
+  if(last_mod_found && buf.st_mtime <= last_mod) {
+    close(file);
+    prepare_status_response(req, hd, STATUS_304);
+    return true;
+  }
+  req->file = file;
+  req->file_length = buf.st_size;
+  spdylay_data_provider data_prd;
+  if(S_ISREG(buf.st_mode)) {
+    prepare_file_data_provider(req, &data_prd);
   } else {
-    std::stringstream ss;
-    ss << "<html><head><title>" << status << "</title></head><body>"
-       << "<h1>" << status << "</h1>"
-       << "<hr>"
-       << "<address>" << SPDYD_SERVER << " at port " << hd->config()->port
-       << "</address>"
-       << "</body></html>";
-    std::string body = ss.str();
-    gzFile write_fd = gzdopen(pipefd[1], "w");
-    gzwrite(write_fd, body.c_str(), body.size());
-    gzclose(write_fd);
-    close(pipefd[1]);
-
-    req->file = pipefd[0];
-    spdylay_data_provider data_prd;
-    data_prd.source.fd = pipefd[0];
+    data_prd.source.fd = file;
     data_prd.read_callback = file_read_callback;
-    std::vector<std::pair<std::string, std::string> > headers;
-    headers.push_back(std::make_pair("content-encoding", "gzip"));
-    headers.push_back(std::make_pair("content-type",
-                                     "text/html; charset=UTF-8"));
-    hd->submit_response(status, req->stream_id, headers, &data_prd);
   }
+  hd->submit_file_response(STATUS_200, req->stream_id, buf.st_mtime,
+                           buf.st_size, content_encoding, &data_prd);
+  return true;
 }
 } // namespace
 
@@ -468,6 +898,7 @@ void prepare_response(Request *req, SpdyEventHandler *hd)
   bool host_found = false;
   time_t last_mod = 0;
   bool last_mod_found = false;
+  bool accept_gzip = false;
   for(int i = 0; i < (int)req->headers.size(); ++i) {
     const std::string &field = req->headers[i].first;
     const std::string &value = req->headers[i].second;
@@ -485,6 +916,8 @@ void prepare_response(Request *req, SpdyEventHandler *hd)
     } else if(!last_mod_found && field == "if-modified-since") {
       last_mod_found = true;
       last_mod = util::parse_http_date(value);
+    } else if(field == "accept-encoding") {
+      accept_gzip = util::strifind(value.c_str(), "gzip");
     }
   }
   if(!url_found || !method_found || !scheme_found || !version_found ||
@@ -510,26 +943,12 @@ void prepare_response(Request *req, SpdyEventHandler *hd)
   if(path[path.size()-1] == '/') {
     path += DEFAULT_HTML;
   }
-  int file = open(path.c_str(), O_RDONLY);
-  if(file == -1) {
+  if(accept_gzip && serve_file(req, hd, path+".gz", "gzip",
+                               last_mod_found, last_mod)) {
+    return;
+  }
+  if(!serve_file(req, hd, path, 0, last_mod_found, last_mod)) {
     prepare_status_response(req, hd, STATUS_404);
-  } else {
-    struct stat buf;
-    if(fstat(file, &buf) == -1) {
-      close(file);
-      prepare_status_response(req, hd, STATUS_404);
-    } else {
-      req->file = file;
-      spdylay_data_provider data_prd;
-      data_prd.source.fd = file;
-      data_prd.read_callback = file_read_callback;
-      if(last_mod_found && buf.st_mtime <= last_mod) {
-        prepare_status_response(req, hd, STATUS_304);
-      } else {
-        hd->submit_file_response(STATUS_200, req->stream_id, buf.st_mtime,
-                                 buf.st_size, &data_prd);
-      }
-    }
   }
 }
 } // namespace
@@ -748,13 +1167,17 @@ private:
     callbacks.on_request_recv_callback = config()->on_request_recv_callback;
     SpdyEventHandler *hd = new SpdyEventHandler(config(),
                                                 fd_, ssl_, version_, &callbacks,
-                                                session_id_);
+                                                session_id_,
+                                                sessions->get_response_cache());
     if(sessions->mod_poll(hd) == -1) {
       // fd_, ssl_ are freed by ~SpdyEventHandler()
       delete hd;
     } else {
       sessions->add_handler(hd);
     }
+    // fd_ is now owned by hd. This prevents on_close() from removing
+    // the registration of hd.
+    fd_ = -1;
   }
   
   int fd_;
@@ -775,9 +1198,14 @@ public:
   {}
   virtual int execute(Sessions *sessions)
   {
-    int cfd;
-    while((cfd = accept(fd_, 0, 0)) == -1 && errno == EINTR);
-    if(cfd != -1) {
+    // Accept all pending connections. In edge-triggered mode, we are
+    // not notified again for the connections left in the queue.
+    while(1) {
+      int cfd;
+      while((cfd = accept(fd_, 0, 0)) == -1 && errno == EINTR);
+      if(cfd == -1) {
+        break;
+      }
       if(make_non_block(cfd) == -1 ||
          set_tcp_nodelay(cfd) == -1) {
         close(cfd);
@@ -812,7 +1240,7 @@ private:
       return;
     }
     SSLAcceptEventHandler *hd = new SSLAcceptEventHandler
-      (config(), cfd, ssl, ++(*session_id_seed_ptr_));
+      (config(), cfd, ssl, __sync_add_and_fetch(session_id_seed_ptr_, 1));
     if(sessions->add_poll(hd) == -1) {
       delete hd;
       SSL_free(ssl);
@@ -823,12 +1251,14 @@ private:
   }
 
   int fd_;
+  // Shared by all worker threads.
   int64_t *session_id_seed_ptr_;
 };
 
 namespace {
 void on_close(Sessions &sessions, EventHandler *hd)
 {
+  sessions.remove_poll(hd);
   sessions.remove_handler(hd);
   delete hd;
 }
@@ -850,20 +1280,25 @@ SpdyServer::~SpdyServer()
 }
 
 int SpdyServer::listen()
+{
+  return make_listen_sockets(sfd_, config_->verbose);
+}
+
+int SpdyServer::make_listen_sockets(int *sfd, bool verbose)
 {
   int families[] = { AF_INET, AF_INET6 };
   bool bind_ok = false;
   for(int i = 0; i < 2; ++i) {
     const char* ipv = (families[i] == AF_INET ? "IPv4" : "IPv6");
-    int sfd = make_listen_socket(config_->host, config_->port, families[i]);
-    if(sfd == -1) {
+    sfd[i] = make_listen_socket(config_->host, config_->port, families[i],
+                                config_->num_worker > 1);
+    if(sfd[i] == -1) {
       std::cerr << ipv << ": Could not listen on port " << config_->port
                 << std::endl;
       continue;
     }
-    make_non_block(sfd);
-    sfd_[i] = sfd;
-    if(config_->verbose) {
+    make_non_block(sfd[i]);
+    if(verbose) {
       std::cout << ipv << ": listen on port " << config_->port << std::endl;
     }
     bind_ok = true;
@@ -895,73 +1330,40 @@ int verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
 }
 } // namespace
 
-int SpdyServer::run()
-{
+namespace {
+// The per-thread state of the server. Each worker has its own
+// EventPoll and Sessions and they are only accessed from that
+// thread. SSL_CTX and the session ID seed are shared.
+struct WorkerInfo {
+  const Config *config;
   SSL_CTX *ssl_ctx;
-  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
-  if(!ssl_ctx) {
-    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
-    return -1;
-  }
-  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL|SSL_OP_NO_SSLv2);
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
-  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-  if(SSL_CTX_use_PrivateKey_file(ssl_ctx,
-                                 config_->private_key_file.c_str(),
-                                 SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "SSL_CTX_use_PrivateKey_file failed." << std::endl;
-    return -1;
-  }
-  if(SSL_CTX_use_certificate_file(ssl_ctx, config_->cert_file.c_str(),
-                                  SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "SSL_CTX_use_certificate_file failed." << std::endl;
-    return -1;
-  }
-  if(SSL_CTX_check_private_key(ssl_ctx) != 1) {
-    std::cerr << "SSL_CTX_check_private_key failed." << std::endl;
-    return -1;
-  }
-  if(config_->verify_client) {
-    SSL_CTX_set_verify(ssl_ctx,
-                       SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE |
-                       SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
-                       verify_callback);
-  }
-  // We speaks "spdy/2" and "spdy/3".
-  std::pair<unsigned char*, size_t> next_proto;
-  unsigned char proto_list[14];
-
-  if(config_->spdy3_only) {
-    proto_list[0] = 6;
-    memcpy(&proto_list[1], "spdy/3", 6);
-    next_proto.first = proto_list;
-    next_proto.second = 7;
-  } else {
-    proto_list[0] = 6;
-    memcpy(&proto_list[1], "spdy/3", 6);
-    proto_list[7] = 6;
-    memcpy(&proto_list[8], "spdy/2", 6);
-    next_proto.first = proto_list;
-    next_proto.second = sizeof(proto_list);
-  }
-
-  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, next_proto_cb, &next_proto);
+  int sfd[2];
+  int64_t *session_id_seed_ptr;
+};
+} // namespace
 
+namespace {
+int run_worker(WorkerInfo *info)
+{
+  const Config *config = info->config;
   const size_t MAX_EVENTS = 256;
-  Sessions sessions(MAX_EVENTS, ssl_ctx);
+  Sessions sessions(MAX_EVENTS, info->ssl_ctx, config->cache_size,
+                    config->edge_triggered);
 
-  int64_t session_id_seed = 0;
   int families[] = { AF_INET, AF_INET6 };
   bool bind_ok = false;
   for(int i = 0; i < 2; ++i) {
+    if(info->sfd[i] == -1) {
+      continue;
+    }
     const char* ipv = (families[i] == AF_INET ? "IPv4" : "IPv6");
-    ListenEventHandler *listen_hd = new ListenEventHandler(config_,
-                                                           sfd_[i],
-                                                           &session_id_seed);
+    ListenEventHandler *listen_hd = new ListenEventHandler
+      (config, info->sfd[i], info->session_id_seed_ptr);
     if(sessions.add_poll(listen_hd) == -1) {
       std::cerr <<  ipv << ": Adding listening socket to poll failed."
                 << std::endl;
       delete listen_hd;
+      continue;
     }
     sessions.add_handler(listen_hd);
     bind_ok = true;
@@ -1012,5 +1414,121 @@ int SpdyServer::run()
   }
   return 0;
 }
+} // namespace
+
+namespace {
+void* start_worker(void *arg)
+{
+  WorkerInfo *info = reinterpret_cast<WorkerInfo*>(arg);
+  run_worker(info);
+  return 0;
+}
+} // namespace
+
+int SpdyServer::run()
+{
+  SSL_CTX *ssl_ctx;
+  ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  if(!ssl_ctx) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL|SSL_OP_NO_SSLv2);
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+  if(SSL_CTX_use_PrivateKey_file(ssl_ctx,
+                                 config_->private_key_file.c_str(),
+                                 SSL_FILETYPE_PEM) != 1) {
+    std::cerr << "SSL_CTX_use_PrivateKey_file failed." << std::endl;
+    return -1;
+  }
+  if(SSL_CTX_use_certificate_file(ssl_ctx, config_->cert_file.c_str(),
+                                  SSL_FILETYPE_PEM) != 1) {
+    std::cerr << "SSL_CTX_use_certificate_file failed." << std::endl;
+    return -1;
+  }
+  if(SSL_CTX_check_private_key(ssl_ctx) != 1) {
+    std::cerr << "SSL_CTX_check_private_key failed." << std::endl;
+    return -1;
+  }
+  if(config_->verify_client) {
+    SSL_CTX_set_verify(ssl_ctx,
+                       SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE |
+                       SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                       verify_callback);
+  }
+  // We speaks "spdy/2" and "spdy/3".
+  std::pair<unsigned char*, size_t> next_proto;
+  unsigned char proto_list[14];
+
+  if(config_->spdy3_only) {
+    proto_list[0] = 6;
+    memcpy(&proto_list[1], "spdy/3", 6);
+    next_proto.first = proto_list;
+    next_proto.second = 7;
+  } else {
+    proto_list[0] = 6;
+    memcpy(&proto_list[1], "spdy/3", 6);
+    proto_list[7] = 6;
+    memcpy(&proto_list[8], "spdy/2", 6);
+    next_proto.first = proto_list;
+    next_proto.second = sizeof(proto_list);
+  }
+
+  SSL_CTX_set_next_protos_advertised_cb(ssl_ctx, next_proto_cb, &next_proto);
+
+  int64_t session_id_seed = 0;
+  size_t num_worker = std::max(config_->num_worker, static_cast<size_t>(1));
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if(num_worker > 1) {
+    setup_ssl_lock();
+  }
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+  // The calling thread runs the event loop of the first worker. The
+  // other workers have their own listening sockets if SO_REUSEPORT is
+  // available, so that the kernel distributes the incoming
+  // connections among them. Otherwise they share the listening
+  // sockets of the first worker.
+  std::vector<WorkerInfo*> workers;
+  for(size_t i = 0; i < num_worker; ++i) {
+    WorkerInfo *info = new WorkerInfo();
+    info->config = config_;
+    info->ssl_ctx = ssl_ctx;
+    info->session_id_seed_ptr = &session_id_seed;
+    if(i == 0) {
+      memcpy(info->sfd, sfd_, sizeof(sfd_));
+    } else {
+#ifdef SO_REUSEPORT
+      if(make_listen_sockets(info->sfd, false) == -1) {
+        delete info;
+        return -1;
+      }
+#else // !SO_REUSEPORT
+      memcpy(info->sfd, sfd_, sizeof(sfd_));
+#endif // !SO_REUSEPORT
+    }
+    workers.push_back(info);
+  }
+  for(size_t i = 1; i < num_worker; ++i) {
+    pthread_t thread;
+    int rv = pthread_create(&thread, 0, start_worker, workers[i]);
+    if(rv != 0) {
+      std::cerr << "pthread_create() failed: " << strerror(rv) << std::endl;
+      return -1;
+    }
+    pthread_detach(thread);
+    if(config_->verbose) {
+      std::cout << "Worker thread #" << i << " started" << std::endl;
+    }
+  }
+  int rv = run_worker(workers[0]);
+  // Other workers are still running. The process is expected to exit
+  // soon, so we leave the shared objects as they are.
+  if(num_worker == 1) {
+    delete workers[0];
+    SSL_CTX_free(ssl_ctx);
+  }
+  return rv;
+}
 
 } // namespace spdylay
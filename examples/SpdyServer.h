@@ -52,10 +52,19 @@ struct Config {
   void *data_ptr;
   bool spdy3_only;
   bool verify_client;
+  // The maximum number of bytes of the files kept in memory by each
+  // worker. 0 disables the file cache.
+  size_t cache_size;
+  // The number of threads, each of which runs its own event loop.
+  size_t num_worker;
+  // If true, the sockets are watched in edge-triggered mode.
+  bool edge_triggered;
   Config();
 };
 
 class Sessions;
+struct CacheEntry;
+class ResponseCache;
 
 class EventHandler {
 public:
@@ -87,6 +96,16 @@ struct Request {
   int32_t stream_id;
   std::vector<std::pair<std::string, std::string> > headers;
   int file;
+  // The file mapped into memory to send the response body, or 0 if
+  // it is not mapped.
+  void *file_map;
+  // The cached response body being sent, or 0. The reference is
+  // released when the request is deleted.
+  CacheEntry *cache_entry;
+  // The offset of the response body to be sent next and the length
+  // of the file.
+  off_t file_offset;
+  off_t file_length;
   std::pair<std::string, size_t> response_body;
   Request(int32_t stream_id);
   ~Request();
@@ -97,7 +116,7 @@ public:
   SpdyEventHandler(const Config* config,
                    int fd, SSL *ssl, uint16_t version,
                    const spdylay_session_callbacks *callbacks,
-                   int64_t session_id);
+                   int64_t session_id, ResponseCache *cache);
   virtual ~SpdyEventHandler();
   virtual int execute(Sessions *sessions);
   virtual bool want_read();
@@ -113,10 +132,17 @@ public:
 
   bool would_block(int r);
 
+  // Writes the data buffered by send_data(). Returns the return value
+  // of SSL_write(), or 0 if there is no buffered data.
+  ssize_t flush_data();
+
+  // If |content_encoding| is not NULL, content-encoding header field
+  // with that value is added.
   int submit_file_response(const std::string& status,
                            int32_t stream_id,
                            time_t last_modified,
                            off_t file_length,
+                           const char *content_encoding,
                            spdylay_data_provider *data_prd);
 
   int submit_response(const std::string& status,
@@ -133,6 +159,7 @@ public:
   void remove_stream(int32_t stream_id);
   Request* get_stream(int32_t stream_id);
   int64_t session_id() const;
+  ResponseCache* response_cache() const;
 private:
   spdylay_session *session_;
   int fd_;
@@ -141,6 +168,11 @@ private:
   int64_t session_id_;
   bool want_write_;
   std::map<int32_t, Request*> id2req_;
+  ResponseCache *cache_;
+  // The frames serialized in one execute() are written in one
+  // SSL_write() if they fit in this buffer.
+  uint8_t wbuf_[16384];
+  size_t wbuflen_;
 };
 
 class SpdyServer {
@@ -150,6 +182,10 @@ public:
   int listen();
   int run();
 private:
+  // Opens the listening sockets for IPv4 and IPv6 and stores them in
+  // |sfd|. Returns 0 if at least one of them is opened.
+  int make_listen_sockets(int *sfd, bool verbose);
+
   const Config *config_;
   int sfd_[2];
 };
@@ -0,0 +1,92 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <CUnit/Basic.h>
+// include test cases' include files here
+#include "shrpx_http_test.h"
+#include "shrpx_token_bucket_test.h"
+#include "HtmlParser_test.h"
+
+static int init_suite1(void)
+{
+  return 0;
+}
+
+static int clean_suite1(void)
+{
+  return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   CU_pSuite pSuite = NULL;
+   unsigned int num_tests_failed;
+
+   // initialize the CUnit test registry
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   // add a suite to the registry
+   pSuite = CU_add_suite("shrpx_TestSuite", init_suite1, clean_suite1);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   // add the tests to the suite
+   if(!CU_add_test(pSuite, "http_lookup_token",
+                   shrpx::test_http_lookup_token) ||
+      !CU_add_test(pSuite, "http_headers", shrpx::test_http_headers) ||
+      !CU_add_test(pSuite, "token_bucket", shrpx::test_token_bucket) ||
+      !CU_add_test(pSuite, "token_bucket_fraction",
+                   shrpx::test_token_bucket_fraction) ||
+      !CU_add_test(pSuite, "token_bucket_wait_time",
+                   shrpx::test_token_bucket_wait_time) ||
+      !CU_add_test(pSuite, "html_parser_links",
+                   spdylay::test_html_parser_links) ||
+      !CU_add_test(pSuite, "html_parser_raw_text",
+                   spdylay::test_html_parser_raw_text) ||
+      !CU_add_test(pSuite, "html_parser_comment",
+                   spdylay::test_html_parser_comment) ||
+      !CU_add_test(pSuite, "html_parser_chunks",
+                   spdylay::test_html_parser_chunks)) {
+     CU_cleanup_registry();
+     return CU_get_error();
+   }
+
+   // Run all tests using the CUnit Basic interface
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   num_tests_failed = CU_get_number_of_tests_failed();
+   CU_cleanup_registry();
+   if(CU_get_error() == CUE_SUCCESS) {
+     return num_tests_failed;
+   } else {
+     printf("CUnit Error: %s\n", CU_get_error_msg());
+     return CU_get_error();
+   }
+}
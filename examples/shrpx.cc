@@ -30,24 +30,36 @@
 #include <netdb.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <limits.h>
 
 #include <limits>
 #include <cstdlib>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #include <event2/listener.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
 
 #include <spdylay/spdylay.h>
 
 #include "shrpx_config.h"
 #include "shrpx_listen_handler.h"
 #include "shrpx_ssl.h"
+#include "shrpx_stat.h"
+#include "util.h"
+
+using namespace spdylay;
 
 namespace shrpx {
 
@@ -69,7 +81,9 @@ bool is_ipv6_numeric_addr(const char *host)
 } // namespace
 
 namespace {
-int cache_downstream_host_address()
+// Resolves the downstream host in configuration and stores the first
+// address in |addr|. Returns 0 if it succeeds, or -1.
+int resolve_downstream_addr(DownstreamAddr *addr)
 {
   addrinfo hints;
   int rv;
@@ -87,8 +101,8 @@ int cache_downstream_host_address()
 
   rv = getaddrinfo(get_config()->downstream_host, service, &hints, &res);
   if(rv != 0) {
-    LOG(FATAL) << "Unable to get downstream address: " << gai_strerror(rv);
-    DIE();
+    LOG(ERROR) << "Unable to get downstream address: " << gai_strerror(rv);
+    return -1;
   }
 
   char host[NI_MAXHOST];
@@ -100,11 +114,12 @@ int cache_downstream_host_address()
               << ", port "
               << get_config()->downstream_port;
   } else {
-    LOG(FATAL) << gai_strerror(rv);
-    DIE();
+    LOG(ERROR) << gai_strerror(rv);
+    freeaddrinfo(res);
+    return -1;
   }
-  memcpy(&mod_config()->downstream_addr, res->ai_addr, res->ai_addrlen);
-  mod_config()->downstream_addrlen = res->ai_addrlen;
+  memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+  addr->addrlen = res->ai_addrlen;
   freeaddrinfo(res);
   return 0;
 }
@@ -117,6 +132,21 @@ void evlistener_errorcb(evconnlistener *listener, void *ptr)
 }
 } // namespace
 
+namespace {
+evconnlistener* new_evlistener(ListenHandler *handler, int fd)
+{
+  evconnlistener *evlistener = evconnlistener_new
+    (handler->get_evbase(),
+     ssl_acceptcb,
+     handler,
+     LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
+     512,
+     fd);
+  evconnlistener_set_error_cb(evlistener, evlistener_errorcb);
+  return evlistener;
+}
+} // namespace
+
 namespace {
 evconnlistener* create_evlistener(ListenHandler *handler, int family)
 {
@@ -187,52 +217,321 @@ evconnlistener* create_evlistener(ListenHandler *handler, int family)
     return 0;
   }
 
-  evconnlistener *evlistener = evconnlistener_new
-    (handler->get_evbase(),
-     ssl_acceptcb,
-     handler,
-     LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
-     512,
-     fd);
-  evconnlistener_set_error_cb(evlistener, evlistener_errorcb);
-  return evlistener;
+  return new_evlistener(handler, fd);
+}
+} // namespace
+
+namespace {
+// The environment variables which pass the listening sockets to the
+// new binary on upgrade.
+const char ENV_LISTENER_FDS[] = "SHRPX_LISTENER_FDS";
+const char ENV_ADMIN_FD[] = "SHRPX_ADMIN_FD";
+} // namespace
+
+namespace {
+// Creates the listeners from the sockets inherited from the old
+// binary and appends them to |evlisteners|.
+void inherit_evlisteners(std::vector<evconnlistener*>& evlisteners,
+                         ListenHandler *handler)
+{
+  const char *fds = getenv(ENV_LISTENER_FDS);
+  if(!fds) {
+    return;
+  }
+  const char *p = fds;
+  for(;;) {
+    char *end;
+    errno = 0;
+    long int fd = strtol(p, &end, 10);
+    if(errno != 0 || end == p || fd < 0) {
+      LOG(ERROR) << "Invalid " << ENV_LISTENER_FDS << ": " << fds;
+      break;
+    }
+    LOG(INFO) << "Listening on inherited socket " << fd;
+    evlisteners.push_back(new_evlistener(handler, fd));
+    if(*end != ',') {
+      break;
+    }
+    p = end+1;
+  }
+  // Do not pass them to the binary executed by this process.
+  unsetenv(ENV_LISTENER_FDS);
+}
+} // namespace
+
+namespace {
+void log_tls_stats_cb(evutil_socket_t sig, short events, void *arg)
+{
+  const ssl::TLSStats& stats = ssl::get_stats();
+  LOG(WARNING) << "TLS handshakes=" << stats.handshakes
+               << " resumed=" << stats.resumed_handshakes
+               << " session_cache_hits=" << stats.session_cache_hits
+               << " session_cache_misses=" << stats.session_cache_misses
+               << " session_cache_timeouts=" << stats.session_cache_timeouts
+               << " session_cache_entries="
+               << ssl::get_session_cache_entries()
+               << " ticket_hits=" << stats.ticket_hits
+               << " ticket_misses=" << stats.ticket_misses;
+}
+} // namespace
+
+namespace {
+void metrics_cb(evhttp_request *req, void *arg)
+{
+  ListenHandler *listener_handler = reinterpret_cast<ListenHandler*>(arg);
+  WorkerStat stat;
+  listener_handler->get_stat(&stat);
+  evbuffer *buf = evbuffer_new();
+  write_metrics(buf, stat);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain; version=0.0.4");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf);
+  evbuffer_free(buf);
+}
+} // namespace
+
+namespace {
+// The objects of the main thread used by the signal handlers.
+struct MainContext {
+  ListenHandler *listener_handler;
+  std::vector<evconnlistener*> evlisteners;
+  evhttp *admin;
+  evhttp_bound_socket *admin_socket;
+  // The arguments to execute the new binary, and the working
+  // directory they are relative to.
+  char **argv;
+  std::string cwd;
+  bool graceful_shutdown;
+};
+} // namespace
+
+namespace {
+void reload_cb(evutil_socket_t sig, short events, void *arg)
+{
+  MainContext *ctx = reinterpret_cast<MainContext*>(arg);
+  LOG(WARNING) << "Reloading certificate, session ticket keys and "
+               << "downstream address";
+  DownstreamAddr addr;
+  if(resolve_downstream_addr(&addr) == 0) {
+    mod_config()->downstream_addr = addr;
+  } else {
+    LOG(ERROR) << "Keeping current downstream address";
+    addr = get_config()->downstream_addr;
+  }
+  if(ssl::reload_ticket_keys() == -1) {
+    LOG(ERROR) << "Keeping current session ticket keys";
+  }
+  SSL_CTX *ssl_ctx = ssl::create_ssl_context();
+  if(!ssl_ctx) {
+    LOG(ERROR) << "Keeping current certificate";
+    ssl_ctx = ctx->listener_handler->get_ssl_ctx();
+    ssl::ref_ssl_context(ssl_ctx);
+  }
+  ctx->listener_handler->reload(ssl_ctx, addr);
+}
+} // namespace
+
+namespace {
+void upgrade_cb(evutil_socket_t sig, short events, void *arg)
+{
+  MainContext *ctx = reinterpret_cast<MainContext*>(arg);
+  if(ctx->evlisteners.empty()) {
+    LOG(WARNING) << "Not listening. Binary upgrade is ignored";
+    return;
+  }
+  std::vector<int> fds;
+  std::string fdlist;
+  for(size_t i = 0; i < ctx->evlisteners.size(); ++i) {
+    fds.push_back(evconnlistener_get_fd(ctx->evlisteners[i]));
+    if(i > 0) {
+      fdlist += ",";
+    }
+    fdlist += util::to_str(fds.back());
+  }
+  setenv(ENV_LISTENER_FDS, fdlist.c_str(), 1);
+  if(ctx->admin_socket) {
+    fds.push_back(evhttp_bound_socket_get_fd(ctx->admin_socket));
+    setenv(ENV_ADMIN_FD, util::to_str(fds.back()).c_str(), 1);
+  }
+  rlimit rlim;
+  int maxfd = 1024;
+  if(getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY) {
+    maxfd = rlim.rlim_cur;
+  }
+  pid_t pid = fork();
+  if(pid == 0) {
+    // Only the listening sockets are passed to the new binary. The
+    // client and downstream connections stay in this process.
+    for(int fd = 3; fd < maxfd; ++fd) {
+      if(std::find(fds.begin(), fds.end(), fd) == fds.end()) {
+        close(fd);
+      } else {
+        fcntl(fd, F_SETFD, 0);
+      }
+    }
+    // daemon() changed the working directory to '/'.
+    if(!ctx->cwd.empty() && chdir(ctx->cwd.c_str()) == -1) {
+      _exit(EXIT_FAILURE);
+    }
+    execvp(ctx->argv[0], ctx->argv);
+    _exit(EXIT_FAILURE);
+  }
+  unsetenv(ENV_LISTENER_FDS);
+  unsetenv(ENV_ADMIN_FD);
+  if(pid == -1) {
+    LOG(ERROR) << "fork() failed: " << strerror(errno);
+    return;
+  }
+  LOG(WARNING) << "Started new binary, pid=" << pid << ". Send SIGQUIT to "
+               << "pid=" << getpid() << " to shut down the old one";
+}
+} // namespace
+
+namespace {
+void graceful_shutdown_cb(evutil_socket_t sig, short events, void *arg)
+{
+  MainContext *ctx = reinterpret_cast<MainContext*>(arg);
+  if(ctx->graceful_shutdown) {
+    return;
+  }
+  ctx->graceful_shutdown = true;
+  LOG(WARNING) << "Graceful shutdown started";
+  // The new binary keeps accepting on the inherited sockets.
+  for(size_t i = 0; i < ctx->evlisteners.size(); ++i) {
+    evconnlistener_free(ctx->evlisteners[i]);
+  }
+  ctx->evlisteners.clear();
+  if(ctx->admin_socket) {
+    evhttp_del_accept_socket(ctx->admin, ctx->admin_socket);
+    ctx->admin_socket = 0;
+  }
+  ctx->listener_handler->graceful_shutdown();
 }
 } // namespace
 
 namespace {
-int event_loop()
+int event_loop(char **argv, const std::string& cwd)
 {
   event_base *evbase = event_base_new();
 
-  ListenHandler *listener_handler = new ListenHandler(evbase);
+  if(ssl::init_ticket_keys(evbase) == -1) {
+    LOG(FATAL) << "Failed to initialize session ticket keys";
+    exit(EXIT_FAILURE);
+  }
 
-  evconnlistener *evlistener6, *evlistener4;
-  evlistener6 = create_evlistener(listener_handler, AF_INET6);
-  evlistener4 = create_evlistener(listener_handler, AF_INET);
-  if(!evlistener6 && !evlistener4) {
+  SSL_CTX *ssl_ctx = ssl::create_ssl_context();
+  if(!ssl_ctx) {
+    LOG(FATAL) << "Failed to create SSL_CTX";
+    exit(EXIT_FAILURE);
+  }
+
+  MainContext ctx;
+  ctx.listener_handler = new ListenHandler(evbase, ssl_ctx);
+  ctx.admin = 0;
+  ctx.admin_socket = 0;
+  ctx.argv = argv;
+  ctx.cwd = cwd;
+  ctx.graceful_shutdown = false;
+
+  // SIGUSR1 dumps the TLS session resumption statistics to the log.
+  event *tls_stats_ev = evsignal_new(evbase, SIGUSR1, log_tls_stats_cb, 0);
+  evsignal_add(tls_stats_ev, 0);
+  // SIGHUP reloads the certificate, the session ticket keys and the
+  // downstream address. SIGUSR2 executes the new binary which takes
+  // over the listening sockets, and SIGQUIT shuts down this process
+  // after the requests in progress are finished.
+  event *reload_ev = evsignal_new(evbase, SIGHUP, reload_cb, &ctx);
+  evsignal_add(reload_ev, 0);
+  event *upgrade_ev = evsignal_new(evbase, SIGUSR2, upgrade_cb, &ctx);
+  evsignal_add(upgrade_ev, 0);
+  event *graceful_shutdown_ev = evsignal_new(evbase, SIGQUIT,
+                                             graceful_shutdown_cb, &ctx);
+  evsignal_add(graceful_shutdown_ev, 0);
+
+  inherit_evlisteners(ctx.evlisteners, ctx.listener_handler);
+  if(ctx.evlisteners.empty()) {
+    evconnlistener *evlistener;
+    evlistener = create_evlistener(ctx.listener_handler, AF_INET6);
+    if(evlistener) {
+      ctx.evlisteners.push_back(evlistener);
+    }
+    evlistener = create_evlistener(ctx.listener_handler, AF_INET);
+    if(evlistener) {
+      ctx.evlisteners.push_back(evlistener);
+    }
+  }
+  if(ctx.evlisteners.empty()) {
     LOG(FATAL) << "Failed to listen on address "
                << get_config()->host << ", port " << get_config()->port;
     exit(EXIT_FAILURE);
   }
 
   if(get_config()->num_worker > 1) {
-    listener_handler->create_worker_thread(get_config()->num_worker);
+    ctx.listener_handler->create_worker_thread(get_config()->num_worker);
+  }
+
+  // The statistics are served by the main thread, which aggregates
+  // the counters of the worker threads on each request.
+  if(get_config()->admin_port) {
+    ctx.admin = evhttp_new(evbase);
+    const char *admin_fd = getenv(ENV_ADMIN_FD);
+    if(admin_fd) {
+      ctx.admin_socket = evhttp_accept_socket_with_handle
+        (ctx.admin, strtol(admin_fd, 0, 10));
+      unsetenv(ENV_ADMIN_FD);
+    } else {
+      ctx.admin_socket = evhttp_bind_socket_with_handle
+        (ctx.admin, get_config()->admin_host, get_config()->admin_port);
+    }
+    if(!ctx.admin_socket) {
+      LOG(FATAL) << "Failed to listen on admin address "
+                 << get_config()->admin_host << ", port "
+                 << get_config()->admin_port;
+      exit(EXIT_FAILURE);
+    }
+    evhttp_set_allowed_methods(ctx.admin, EVHTTP_REQ_GET);
+    evhttp_set_cb(ctx.admin, "/metrics", metrics_cb, ctx.listener_handler);
   }
 
   if(ENABLE_LOG) {
     LOG(INFO) << "Entering event loop";
   }
   event_base_loop(evbase, 0);
-  if(evlistener4) {
-    evconnlistener_free(evlistener4);
+  for(size_t i = 0; i < ctx.evlisteners.size(); ++i) {
+    evconnlistener_free(ctx.evlisteners[i]);
   }
-  if(evlistener6) {
-    evconnlistener_free(evlistener6);
+  if(ctx.admin) {
+    evhttp_free(ctx.admin);
   }
+  event_free(graceful_shutdown_ev);
+  event_free(upgrade_ev);
+  event_free(reload_ev);
+  event_free(tls_stats_ev);
   return 0;
 }
 } // namespace
 
+namespace {
+// Prepends |dir| to |*path| if it is relative. The symbolic links in
+// the path are not resolved so that they can be replaced before
+// reload.
+void make_absolute_path(const char **path, const std::string& dir)
+{
+  if((*path)[0] != '/') {
+    *path = strdup((dir + "/" + *path).c_str());
+  }
+}
+} // namespace
+
+namespace {
+void make_absolute_path(std::string *path, const std::string& dir)
+{
+  if(!path->empty() && (*path)[0] != '/') {
+    *path = dir + "/" + *path;
+  }
+}
+} // namespace
+
 namespace {
 void fill_default_config()
 {
@@ -268,6 +567,95 @@ void fill_default_config()
 
   mod_config()->spdy_max_concurrent_streams =
     SPDYLAY_INITIAL_MAX_CONCURRENT_STREAMS;
+  mod_config()->spdy_max_downstream_connections = 0;
+
+  mod_config()->upstream_read_chunk_size = 16*1024;
+
+  mod_config()->http_cache_size = 0;
+  mod_config()->http_cache_max_object_size = 1024*1024;
+
+  mod_config()->tls_session_cache_size = 20*1024;
+
+  mod_config()->admin_host = "127.0.0.1";
+  mod_config()->admin_port = 0;
+
+  mod_config()->read_rate = 0;
+  mod_config()->write_rate = 0;
+  mod_config()->worker_read_rate = 0;
+  mod_config()->worker_write_rate = 0;
+  mod_config()->spdy_stream_write_rate = 0;
+
+  mod_config()->downstream_warm_connections = 0;
+  mod_config()->downstream_tcp_fastopen = false;
+
+  mod_config()->max_connections = 0;
+  mod_config()->max_requests = 0;
+  mod_config()->max_event_loop_lag.tv_sec = 0;
+  mod_config()->max_event_loop_lag.tv_usec = 0;
+}
+} // namespace
+
+namespace {
+// The token bucket is refilled every 100ms, so that the connection
+// does not send the bytes of whole second at once.
+const int RATE_LIMIT_TICKS_PER_SEC = 10;
+} // namespace
+
+namespace {
+// Returns the token bucket configuration for |read_rate| and
+// |write_rate| bytes per second, or 0 if both are unlimited. The
+// burst is the bytes of one second.
+ev_token_bucket_cfg* create_rate_limit_cfg(size_t read_rate,
+                                           size_t write_rate)
+{
+  if(read_rate == 0 && write_rate == 0) {
+    return 0;
+  }
+  // The SSL/TLS bufferevent truncates the limit to int, so
+  // EV_RATE_LIMIT_MAX cannot be used for the unlimited direction.
+  size_t unlimited = std::numeric_limits<int>::max();
+  size_t read_tick_rate = unlimited, read_burst = unlimited;
+  size_t write_tick_rate = unlimited, write_burst = unlimited;
+  if(read_rate > 0) {
+    read_tick_rate = std::max(static_cast<size_t>(1),
+                              read_rate / RATE_LIMIT_TICKS_PER_SEC);
+    read_burst = std::max(read_tick_rate, read_rate);
+  }
+  if(write_rate > 0) {
+    write_tick_rate = std::max(static_cast<size_t>(1),
+                               write_rate / RATE_LIMIT_TICKS_PER_SEC);
+    write_burst = std::max(write_tick_rate, write_rate);
+  }
+  timeval tick = { 0, 1000000 / RATE_LIMIT_TICKS_PER_SEC };
+  return ev_token_bucket_cfg_new(read_tick_rate, read_burst,
+                                 write_tick_rate, write_burst, &tick);
+}
+} // namespace
+
+namespace {
+// Parses |s| as the number of bytes. The suffix K or M multiplies
+// the number by 1024 or 1048576 respectively. Returns -1 if |s| is
+// invalid.
+int parse_size(size_t *size_ptr, const char *s)
+{
+  char *end;
+  errno = 0;
+  unsigned long int n = strtoul(s, &end, 10);
+  if(errno != 0 || end == s) {
+    return -1;
+  }
+  if(*end == 'K' || *end == 'k') {
+    n *= 1024;
+    ++end;
+  } else if(*end == 'M' || *end == 'm') {
+    n *= 1024*1024;
+    ++end;
+  }
+  if(*end != '\0') {
+    return -1;
+  }
+  *size_ptr = n;
+  return 0;
 }
 } // namespace
 
@@ -332,18 +720,169 @@ void print_help(std::ostream& out)
       << "                       Set the number of worker threads.\n"
       << "                       Default: "
       << get_config()->num_worker << "\n"
+      << "    --backend-warm-connections=<NUM>\n"
+      << "                       Set the number of backend connections\n"
+      << "                       which each worker thread establishes in\n"
+      << "                       advance. A request which needs a new\n"
+      << "                       backend connection takes one of them\n"
+      << "                       instead of waiting for TCP handshake, and\n"
+      << "                       the replacement is made in background.\n"
+      << "                       0 disables them.\n"
+      << "                       Default: "
+      << get_config()->downstream_warm_connections << "\n"
+      << "    --backend-tcp-fastopen\n"
+      << "                       Use TCP Fast Open for the backend\n"
+      << "                       connections made on demand, so that the\n"
+      << "                       request headers are sent in SYN once the\n"
+      << "                       backend server issues a cookie.\n"
       << "    -c, --spdy-max-concurrent-streams=<NUM>\n"
       << "                       Set the maximum number of the concurrent\n"
       << "                       streams in one SPDY session.\n"
       << "                       Default: "
       << get_config()->spdy_max_concurrent_streams << "\n"
+      << "    --spdy-max-backend-connections=<NUM>\n"
+      << "                       Set the maximum number of backend\n"
+      << "                       connections used by one SPDY session at\n"
+      << "                       the same time. The requests exceeding it\n"
+      << "                       wait and are sent to the backend in the\n"
+      << "                       order of SPDY priority. The requests with\n"
+      << "                       body never wait. 0 means unlimited.\n"
+      << "                       Default: "
+      << get_config()->spdy_max_downstream_connections << "\n"
+      << "    --max-connections=<NUM>\n"
+      << "                       Set the maximum number of client\n"
+      << "                       connections per worker thread. The\n"
+      << "                       connections exceeding it are closed\n"
+      << "                       before SSL/TLS handshake. 0 means\n"
+      << "                       unlimited.\n"
+      << "                       Default: "
+      << get_config()->max_connections << "\n"
+      << "    --max-requests=<NUM>\n"
+      << "                       Set the maximum number of requests in\n"
+      << "                       progress per worker thread. The requests\n"
+      << "                       exceeding it are refused with SPDY\n"
+      << "                       REFUSED_STREAM or HTTP 503 before they\n"
+      << "                       are sent to the backend. 0 means\n"
+      << "                       unlimited.\n"
+      << "                       Default: "
+      << get_config()->max_requests << "\n"
+      << "    --max-event-loop-lag=<MSEC>\n"
+      << "                       While the event loop of a worker thread\n"
+      << "                       lags more than MSEC milliseconds, the\n"
+      << "                       thread closes new connections and refuses\n"
+      << "                       new requests as above. 0 disables the\n"
+      << "                       check.\n"
+      << "                       Default: "
+      << get_config()->max_event_loop_lag.tv_sec*1000 +
+         get_config()->max_event_loop_lag.tv_usec/1000 << "\n"
+      << "    --upstream-read-chunk-size=<SIZE>\n"
+      << "                       Set the maximum number of bytes of HTTPS\n"
+      << "                       request passed to the parser at once. The\n"
+      << "                       downstream output buffer is checked after\n"
+      << "                       each chunk. K and M suffix are accepted.\n"
+      << "                       Default: "
+      << get_config()->upstream_read_chunk_size << "\n"
+      << "    --read-rate=<RATE>\n"
+      << "                       Set the maximum average read rate of each\n"
+      << "                       client connection in bytes per second. K\n"
+      << "                       and M suffix are accepted. 0 means\n"
+      << "                       unlimited.\n"
+      << "                       Default: "
+      << get_config()->read_rate << "\n"
+      << "    --write-rate=<RATE>\n"
+      << "                       Set the maximum average write rate of each\n"
+      << "                       client connection in bytes per second. K\n"
+      << "                       and M suffix are accepted. 0 means\n"
+      << "                       unlimited.\n"
+      << "                       Default: "
+      << get_config()->write_rate << "\n"
+      << "    --worker-read-rate=<RATE>\n"
+      << "                       Set the maximum average read rate of all\n"
+      << "                       client connections of one worker thread\n"
+      << "                       in bytes per second. The connections share\n"
+      << "                       the bandwidth. K and M suffix are accepted.\n"
+      << "                       0 means unlimited.\n"
+      << "                       Default: "
+      << get_config()->worker_read_rate << "\n"
+      << "    --worker-write-rate=<RATE>\n"
+      << "                       Set the maximum average write rate of all\n"
+      << "                       client connections of one worker thread\n"
+      << "                       in bytes per second. The connections share\n"
+      << "                       the bandwidth. K and M suffix are accepted.\n"
+      << "                       0 means unlimited.\n"
+      << "                       Default: "
+      << get_config()->worker_write_rate << "\n"
+      << "    --spdy-stream-write-rate=<RATE>\n"
+      << "                       Set the maximum average rate of the\n"
+      << "                       response body of each SPDY stream in bytes\n"
+      << "                       per second. The other streams of the\n"
+      << "                       session can use the remaining bandwidth.\n"
+      << "                       K and M suffix are accepted. 0 means\n"
+      << "                       unlimited.\n"
+      << "                       Default: "
+      << get_config()->spdy_stream_write_rate << "\n"
+      << "    --cache-size=<SIZE>\n"
+      << "                       Set the maximum size of the response cache\n"
+      << "                       per worker thread in bytes. K and M suffix\n"
+      << "                       are accepted. 0 disables the cache.\n"
+      << "                       Default: "
+      << get_config()->http_cache_size << "\n"
+      << "    --cache-max-object-size=<SIZE>\n"
+      << "                       Set the maximum size of a response body\n"
+      << "                       which is stored in the response cache.\n"
+      << "                       Default: "
+      << get_config()->http_cache_max_object_size << "\n"
+      << "    --tls-session-cache-size=<NUM>\n"
+      << "                       Set the maximum number of TLS sessions\n"
+      << "                       in the session cache shared by all worker\n"
+      << "                       threads. 0 disables the session cache.\n"
+      << "                       Default: "
+      << get_config()->tls_session_cache_size << "\n"
+      << "    --tls-ticket-key-file=<PATH>\n"
+      << "                       Read the key to encrypt and decrypt TLS\n"
+      << "                       session tickets from the file at PATH. The\n"
+      << "                       file must contain 48 bytes: 16 bytes key\n"
+      << "                       name, 16 bytes AES key and 16 bytes HMAC\n"
+      << "                       key. This option can be used several\n"
+      << "                       times. The first key is used to encrypt\n"
+      << "                       new tickets and the rest are only used to\n"
+      << "                       decrypt tickets, which allows the keys to\n"
+      << "                       be rotated. If this option is not used,\n"
+      << "                       the key is generated randomly and rotated\n"
+      << "                       every hour.\n"
       << "    -L, --log-level=<LEVEL>\n"
       << "                       Set the severity level of log output.\n"
       << "                       INFO, WARNING, ERROR and FATAL.\n"
       << "                       Default: WARNING\n"
+      << "    --access-log=<PATH>\n"
+      << "                       Write access log to the file at PATH.\n"
+      << "                       Each line is in LTSV format.\n"
+      << "    --admin=<HOST,PORT>\n"
+      << "                       Serve the statistics in Prometheus text\n"
+      << "                       format at http://HOST:PORT/metrics. The\n"
+      << "                       server has no access control, so bind it\n"
+      << "                       to a local address. The statistics of\n"
+      << "                       the worker threads are updated every\n"
+      << "                       second.\n"
       << "    -D, --daemon       Run in a background. If -D is used, the\n"
       << "                       current working directory is changed to '/'.\n"
+      << "                       The relative paths of the private key,\n"
+      << "                       certificate and ticket key files are\n"
+      << "                       resolved before that.\n"
       << "    -h, --help         Print this help.\n"
+      << "\n"
+      << "SIGNALS:\n"
+      << "    SIGHUP             Reload the private key, certificate and\n"
+      << "                       session ticket key files, and resolve the\n"
+      << "                       backend host again. The new connections\n"
+      << "                       use them.\n"
+      << "    SIGUSR2            Execute the binary with the same arguments.\n"
+      << "                       It accepts connections on the listening\n"
+      << "                       sockets of this process. Use absolute\n"
+      << "                       paths if -D is used.\n"
+      << "    SIGQUIT            Stop accepting connections and exit after\n"
+      << "                       the requests in progress are finished.\n"
+      << "                       SPDY clients are sent GOAWAY.\n"
       << std::endl;
 }
 } // namespace
@@ -358,8 +897,11 @@ int main(int argc, char **argv)
   uint16_t frontend_port;
   char backend_host[NI_MAXHOST];
   uint16_t backend_port;
+  char admin_host[NI_MAXHOST];
+  uint16_t admin_port;
 
   while(1) {
+    int flag;
     static option long_options[] = {
       {"backend", required_argument, 0, 'b' },
       {"frontend", required_argument, 0, 'f' },
@@ -368,6 +910,24 @@ int main(int argc, char **argv)
       {"log-level", required_argument, 0, 'L' },
       {"daemon", no_argument, 0, 'D' },
       {"help", no_argument, 0, 'h' },
+      {"cache-size", required_argument, &flag, 1 },
+      {"cache-max-object-size", required_argument, &flag, 2 },
+      {"access-log", required_argument, &flag, 3 },
+      {"tls-session-cache-size", required_argument, &flag, 4 },
+      {"tls-ticket-key-file", required_argument, &flag, 5 },
+      {"upstream-read-chunk-size", required_argument, &flag, 6 },
+      {"admin", required_argument, &flag, 7 },
+      {"spdy-max-backend-connections", required_argument, &flag, 8 },
+      {"read-rate", required_argument, &flag, 9 },
+      {"write-rate", required_argument, &flag, 10 },
+      {"worker-read-rate", required_argument, &flag, 11 },
+      {"worker-write-rate", required_argument, &flag, 12 },
+      {"spdy-stream-write-rate", required_argument, &flag, 13 },
+      {"backend-warm-connections", required_argument, &flag, 14 },
+      {"backend-tcp-fastopen", no_argument, &flag, 15 },
+      {"max-connections", required_argument, &flag, 16 },
+      {"max-requests", required_argument, &flag, 17 },
+      {"max-event-loop-lag", required_argument, &flag, 18 },
       {0, 0, 0, 0 }
     };
     int option_index = 0;
@@ -415,6 +975,128 @@ int main(int argc, char **argv)
       break;
     case '?':
       exit(EXIT_FAILURE);
+    case 0:
+      switch(flag) {
+      case 1:
+        // --cache-size
+        if(parse_size(&mod_config()->http_cache_size, optarg) == -1) {
+          std::cerr << "Invalid cache size: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 2:
+        // --cache-max-object-size
+        if(parse_size(&mod_config()->http_cache_max_object_size,
+                      optarg) == -1) {
+          std::cerr << "Invalid cache object size: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 3:
+        // --access-log
+        if(Log::open_access_log(optarg) == -1) {
+          std::cerr << "Could not open access log " << optarg << ": "
+                    << strerror(errno) << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 4:
+        // --tls-session-cache-size
+        mod_config()->tls_session_cache_size = strtoul(optarg, 0, 10);
+        break;
+      case 5:
+        // --tls-ticket-key-file
+        mod_config()->tls_ticket_key_files.push_back(optarg);
+        break;
+      case 6:
+        // --upstream-read-chunk-size
+        if(parse_size(&mod_config()->upstream_read_chunk_size,
+                      optarg) == -1 ||
+           get_config()->upstream_read_chunk_size == 0) {
+          std::cerr << "Invalid read chunk size: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 7:
+        // --admin
+        if(split_host_port(admin_host, sizeof(admin_host),
+                           &admin_port, optarg) == -1) {
+          exit(EXIT_FAILURE);
+        }
+        mod_config()->admin_host = admin_host;
+        mod_config()->admin_port = admin_port;
+        break;
+      case 8:
+        // --spdy-max-backend-connections
+        mod_config()->spdy_max_downstream_connections =
+          strtoul(optarg, 0, 10);
+        break;
+      case 9:
+        // --read-rate
+        if(parse_size(&mod_config()->read_rate, optarg) == -1) {
+          std::cerr << "Invalid read rate: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 10:
+        // --write-rate
+        if(parse_size(&mod_config()->write_rate, optarg) == -1) {
+          std::cerr << "Invalid write rate: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 11:
+        // --worker-read-rate
+        if(parse_size(&mod_config()->worker_read_rate, optarg) == -1) {
+          std::cerr << "Invalid worker read rate: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 12:
+        // --worker-write-rate
+        if(parse_size(&mod_config()->worker_write_rate, optarg) == -1) {
+          std::cerr << "Invalid worker write rate: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 13:
+        // --spdy-stream-write-rate
+        if(parse_size(&mod_config()->spdy_stream_write_rate,
+                      optarg) == -1) {
+          std::cerr << "Invalid stream write rate: " << optarg << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 14:
+        // --backend-warm-connections
+        mod_config()->downstream_warm_connections = strtoul(optarg, 0, 10);
+        break;
+      case 15:
+        // --backend-tcp-fastopen
+#ifdef TCP_FASTOPEN_CONNECT
+        mod_config()->downstream_tcp_fastopen = true;
+#else // !TCP_FASTOPEN_CONNECT
+        std::cerr << "TCP Fast Open is not supported on this platform. "
+                  << "--backend-tcp-fastopen is ignored." << std::endl;
+#endif // !TCP_FASTOPEN_CONNECT
+        break;
+      case 16:
+        // --max-connections
+        mod_config()->max_connections = strtoul(optarg, 0, 10);
+        break;
+      case 17:
+        // --max-requests
+        mod_config()->max_requests = strtoul(optarg, 0, 10);
+        break;
+      case 18: {
+        // --max-event-loop-lag
+        unsigned long int msec = strtoul(optarg, 0, 10);
+        mod_config()->max_event_loop_lag.tv_sec = msec / 1000;
+        mod_config()->max_event_loop_lag.tv_usec = (msec % 1000) * 1000;
+        break;
+      }
+      }
+      break;
     default:
       break;
     }
@@ -446,17 +1128,44 @@ int main(int argc, char **argv)
   }
   mod_config()->downstream_hostport = hostport;
 
-  if(cache_downstream_host_address() == -1) {
+  if(resolve_downstream_addr(&mod_config()->downstream_addr) == -1) {
     exit(EXIT_FAILURE);
   }
 
+  mod_config()->rate_limit_cfg =
+    create_rate_limit_cfg(get_config()->read_rate, get_config()->write_rate);
+  mod_config()->worker_rate_limit_cfg =
+    create_rate_limit_cfg(get_config()->worker_read_rate,
+                          get_config()->worker_write_rate);
+
+  std::string cwd;
   if(get_config()->daemon) {
+    // The files are read again on SIGHUP, and the new binary is
+    // executed with the same arguments on SIGUSR2. Resolve them
+    // against the current working directory, which daemon() changes.
+    char buf[PATH_MAX];
+    if(getcwd(buf, sizeof(buf)) == 0) {
+      perror("getcwd");
+      exit(EXIT_FAILURE);
+    }
+    cwd = buf;
+    make_absolute_path(&mod_config()->private_key_file, cwd);
+    make_absolute_path(&mod_config()->cert_file, cwd);
+    std::vector<std::string>& files = mod_config()->tls_ticket_key_files;
+    for(size_t i = 0; i < files.size(); ++i) {
+      make_absolute_path(&files[i], cwd);
+    }
     if(daemon(0, 0) == -1) {
       perror("daemon");
       exit(EXIT_FAILURE);
     }
   }
 
+  // Log messages are written by the dedicated thread so that event
+  // loops are not blocked by the slow output.
+  Log::start_writer();
+  Log::register_thread();
+
   struct sigaction act;
   memset(&act, 0, sizeof(struct sigaction));
   act.sa_handler = SIG_IGN;
@@ -465,11 +1174,17 @@ int main(int argc, char **argv)
   OpenSSL_add_all_algorithms();
   SSL_load_error_strings();
   SSL_library_init();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
   ssl::setup_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
 
-  event_loop();
+  event_loop(argv, cwd);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
   ssl::teardown_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+
+  Log::stop_writer();
 
   return 0;
 }
@@ -0,0 +1,121 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_admission_control.h"
+
+#include "shrpx_config.h"
+#include "shrpx_log.h"
+#include "shrpx_stat.h"
+
+namespace shrpx {
+
+namespace {
+const timeval SHRPX_LAG_CHECK_INTERVAL = { 0, 100000 };
+} // namespace
+
+namespace {
+void lag_evcb(evutil_socket_t fd, short what, void *arg)
+{
+  AdmissionControl *ac = reinterpret_cast<AdmissionControl*>(arg);
+  ac->on_lag_timer();
+}
+} // namespace
+
+AdmissionControl::AdmissionControl(event_base *evbase, WorkerStat *stat)
+  : stat_(stat),
+    lag_ev_(0),
+    overloaded_(false)
+{
+  const timeval& max_lag = get_config()->max_event_loop_lag;
+  if(max_lag.tv_sec > 0 || max_lag.tv_usec > 0) {
+    lag_ev_ = evtimer_new(evbase, lag_evcb, this);
+    gettimeofday(&lag_expected_, 0);
+    timeradd(&lag_expected_, &SHRPX_LAG_CHECK_INTERVAL, &lag_expected_);
+    evtimer_add(lag_ev_, &SHRPX_LAG_CHECK_INTERVAL);
+  }
+}
+
+AdmissionControl::~AdmissionControl()
+{
+  if(lag_ev_) {
+    event_free(lag_ev_);
+  }
+}
+
+bool AdmissionControl::admit_connection(size_t num_connections)
+{
+  size_t max = get_config()->max_connections;
+  if(max > 0 && num_connections >= max) {
+    ++stat_->shed_connections_limit;
+    return false;
+  }
+  if(overloaded_) {
+    ++stat_->shed_connections_overload;
+    return false;
+  }
+  return true;
+}
+
+bool AdmissionControl::admit_request()
+{
+  size_t max = get_config()->max_requests;
+  if(max > 0 && stat_->active_requests > static_cast<int64_t>(max)) {
+    ++stat_->shed_requests_limit;
+    return false;
+  }
+  if(overloaded_) {
+    ++stat_->shed_requests_overload;
+    return false;
+  }
+  return true;
+}
+
+bool AdmissionControl::get_overloaded() const
+{
+  return overloaded_;
+}
+
+void AdmissionControl::on_lag_timer()
+{
+  timeval now;
+  gettimeofday(&now, 0);
+  int64_t lag =
+    static_cast<int64_t>(now.tv_sec - lag_expected_.tv_sec)*1000000 +
+    now.tv_usec - lag_expected_.tv_usec;
+  if(lag < 0) {
+    lag = 0;
+  }
+  stat_->event_loop_lag.record(lag);
+  const timeval& max_lag = get_config()->max_event_loop_lag;
+  bool overloaded = lag > max_lag.tv_sec * 1000000LL + max_lag.tv_usec;
+  if(overloaded != overloaded_) {
+    LOG(WARNING) << "Event loop lag " << lag/1000 << "ms: "
+                 << (overloaded ? "shedding load" : "recovered");
+    overloaded_ = overloaded;
+  }
+  timeradd(&now, &SHRPX_LAG_CHECK_INTERVAL, &lag_expected_);
+  evtimer_add(lag_ev_, &SHRPX_LAG_CHECK_INTERVAL);
+}
+
+} // namespace shrpx
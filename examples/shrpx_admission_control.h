@@ -0,0 +1,69 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_ADMISSION_CONTROL_H
+#define SHRPX_ADMISSION_CONTROL_H
+
+#include "shrpx.h"
+
+#include <sys/time.h>
+
+#include <event.h>
+
+namespace shrpx {
+
+struct WorkerStat;
+
+// Sheds the connections and the requests which exceed the limits of
+// one thread before any work is done for them. The thread is also
+// regarded as overloaded while its event loop lags behind a periodic
+// timer more than max_event_loop_lag. Each worker thread has its own
+// AdmissionControl and it is only accessed from that thread.
+class AdmissionControl {
+public:
+  // |stat| is owned by the caller. The shed connections and requests
+  // are counted in it.
+  AdmissionControl(event_base *evbase, WorkerStat *stat);
+  ~AdmissionControl();
+  // Returns true if a new connection can be accepted while this
+  // thread has |num_connections| connections.
+  bool admit_connection(size_t num_connections);
+  // Returns true if a new request can be sent to the downstream
+  // server. The request must be counted in active_requests already.
+  bool admit_request();
+  bool get_overloaded() const;
+  void on_lag_timer();
+private:
+  WorkerStat *stat_;
+  // Fires every SHRPX_LAG_CHECK_INTERVAL to measure event loop lag,
+  // or 0 if the lag is not checked.
+  event *lag_ev_;
+  // The time when lag_ev_ should fire.
+  timeval lag_expected_;
+  bool overloaded_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_ADMISSION_CONTROL_H
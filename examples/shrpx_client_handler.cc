@@ -24,11 +24,15 @@
  */
 #include "shrpx_client_handler.h"
 
+#include <vector>
+
 #include "shrpx_upstream.h"
 #include "shrpx_spdy_upstream.h"
 #include "shrpx_https_upstream.h"
 #include "shrpx_config.h"
 #include "shrpx_downstream_connection.h"
+#include "shrpx_stat.h"
+#include "shrpx_admission_control.h"
 
 namespace shrpx {
 
@@ -55,7 +59,9 @@ void upstream_writecb(bufferevent *bev, void *arg)
     delete handler;
   } else {
     Upstream *upstream = handler->get_upstream();
-    upstream->on_write();
+    if(upstream->on_write() != 0) {
+      delete handler;
+    }
   }
 }
 } // namespace
@@ -96,6 +102,12 @@ void upstream_eventcb(bufferevent *bev, short events, void *arg)
       // bytes.  The read callback is not called until new data
       // come. So consume input buffer here.
       handler->get_upstream()->on_read();
+      // The graceful shutdown may have been started during the
+      // handshake.
+      if(handler->get_graceful_shutdown() &&
+         handler->start_graceful_shutdown() != 0) {
+        delete handler;
+      }
     }
   }
 }
@@ -106,10 +118,21 @@ ClientHandler::ClientHandler(bufferevent *bev, SSL *ssl, const char *ipaddr)
     ssl_(ssl),
     upstream_(0),
     ipaddr_(ipaddr),
-    should_close_after_write_(false)
+    should_close_after_write_(false),
+    http_cache_(0),
+    downstream_pool_(0),
+    stat_(0),
+    downstream_addr_(0),
+    warm_pool_(0),
+    admission_control_(0),
+    handler_set_(0)
 {
+  gettimeofday(&create_time_, 0);
   bufferevent_enable(bev_, EV_READ | EV_WRITE);
   bufferevent_setwatermark(bev_, EV_READ, 0, SHRPX_READ_WARTER_MARK);
+  if(get_config()->rate_limit_cfg) {
+    bufferevent_set_rate_limit(bev_, get_config()->rate_limit_cfg);
+  }
   set_upstream_timeouts(&get_config()->upstream_read_timeout,
                         &get_config()->upstream_write_timeout);
   set_bev_cb(0, upstream_writecb, upstream_eventcb);
@@ -132,6 +155,12 @@ ClientHandler::~ClientHandler()
       i != dconn_pool_.end(); ++i) {
     delete *i;
   }
+  if(stat_) {
+    --stat_->active_connections;
+  }
+  if(handler_set_) {
+    handler_set_->remove(this);
+  }
   if(ENABLE_LOG) {
     LOG(INFO) << "Deleted";
   }
@@ -167,6 +196,10 @@ void ClientHandler::set_upstream_timeouts(const timeval *read_timeout,
 
 int ClientHandler::validate_next_proto()
 {
+  // This function is called when the handshake is completed.
+  if(stat_) {
+    stat_->tls_handshake_time.record(elapsed_usec(create_time_));
+  }
   const unsigned char *next_proto = 0;
   unsigned int next_proto_len;
   SSL_get0_next_proto_negotiated(ssl_, &next_proto, &next_proto_len);
@@ -177,14 +210,27 @@ int ClientHandler::validate_next_proto()
     }
     uint16_t version = spdylay_npn_get_version(next_proto, next_proto_len);
     if(version) {
+      if(stat_) {
+        if(version == SPDYLAY_PROTO_SPDY3) {
+          ++stat_->npn_spdy3;
+        } else {
+          ++stat_->npn_spdy2;
+        }
+      }
       SpdyUpstream *spdy_upstream = new SpdyUpstream(version, this);
       upstream_ = spdy_upstream;
       return 0;
     }
+    if(stat_) {
+      ++stat_->npn_other;
+    }
   } else {
     if(ENABLE_LOG) {
       LOG(INFO) << "No proto negotiated.";
     }
+    if(stat_) {
+      ++stat_->npn_none;
+    }
   }
   if(ENABLE_LOG) {
     LOG(INFO) << "Use HTTP/1.1";
@@ -250,8 +296,186 @@ DownstreamConnection* ClientHandler::get_downstream_connection()
       LOG(INFO) << "Reuse downstream connection " << dconn
                 << " from pool";
     }
+    if(stat_) {
+      ++stat_->downstream_connection_reused;
+    }
     return dconn;
   }
 }
 
+void ClientHandler::set_http_cache(HttpCache *cache)
+{
+  http_cache_ = cache;
+}
+
+HttpCache* ClientHandler::get_http_cache() const
+{
+  return http_cache_;
+}
+
+void ClientHandler::set_downstream_pool(DownstreamPool *pool)
+{
+  downstream_pool_ = pool;
+}
+
+DownstreamPool* ClientHandler::get_downstream_pool() const
+{
+  return downstream_pool_;
+}
+
+void ClientHandler::set_worker_stat(WorkerStat *stat)
+{
+  stat_ = stat;
+  if(stat_) {
+    ++stat_->accepted_connections;
+    ++stat_->active_connections;
+  }
+}
+
+WorkerStat* ClientHandler::get_worker_stat() const
+{
+  return stat_;
+}
+
+void ClientHandler::set_downstream_addr(const DownstreamAddr *addr)
+{
+  downstream_addr_ = addr;
+}
+
+const DownstreamAddr* ClientHandler::get_downstream_addr() const
+{
+  return downstream_addr_;
+}
+
+void ClientHandler::set_downstream_warm_pool(DownstreamWarmPool *pool)
+{
+  warm_pool_ = pool;
+}
+
+DownstreamWarmPool* ClientHandler::get_downstream_warm_pool() const
+{
+  return warm_pool_;
+}
+
+void ClientHandler::set_admission_control(AdmissionControl *ac)
+{
+  admission_control_ = ac;
+}
+
+bool ClientHandler::admit_request()
+{
+  return !admission_control_ || admission_control_->admit_request();
+}
+
+void ClientHandler::set_handler_set(ClientHandlerSet *handler_set)
+{
+  handler_set_ = handler_set;
+  handler_set_->add(this);
+}
+
+bool ClientHandler::get_graceful_shutdown() const
+{
+  return handler_set_ && handler_set_->get_graceful_shutdown();
+}
+
+int ClientHandler::start_graceful_shutdown()
+{
+  if(!upstream_) {
+    // The handshake is not completed yet. The upstream is shut down
+    // when it is created.
+    return 0;
+  }
+  return upstream_->start_graceful_shutdown();
+}
+
+void ClientHandler::clear_downstream_connection_pool()
+{
+  for(std::set<DownstreamConnection*>::iterator i = dconn_pool_.begin();
+      i != dconn_pool_.end(); ++i) {
+    delete *i;
+  }
+  dconn_pool_.clear();
+}
+
+ClientHandlerSet::ClientHandlerSet(DrainedCallback cb, void *arg)
+  : rate_limit_group_(0),
+    cb_(cb),
+    arg_(arg),
+    graceful_shutdown_(false),
+    drained_(false)
+{}
+
+ClientHandlerSet::~ClientHandlerSet()
+{
+  if(rate_limit_group_) {
+    bufferevent_rate_limit_group_free(rate_limit_group_);
+  }
+}
+
+size_t ClientHandlerSet::size() const
+{
+  return handlers_.size();
+}
+
+void ClientHandlerSet::add(ClientHandler *handler)
+{
+  handlers_.insert(handler);
+  if(get_config()->worker_rate_limit_cfg) {
+    if(!rate_limit_group_) {
+      rate_limit_group_ = bufferevent_rate_limit_group_new
+        (handler->get_evbase(), get_config()->worker_rate_limit_cfg);
+    }
+    if(rate_limit_group_) {
+      bufferevent_add_to_rate_limit_group(handler->get_bev(),
+                                          rate_limit_group_);
+    }
+  }
+}
+
+void ClientHandlerSet::remove(ClientHandler *handler)
+{
+  handlers_.erase(handler);
+  check_drained();
+}
+
+void ClientHandlerSet::start_graceful_shutdown()
+{
+  if(graceful_shutdown_) {
+    return;
+  }
+  graceful_shutdown_ = true;
+  // Deleting a handler removes it from handlers_.
+  std::vector<ClientHandler*> handlers(handlers_.begin(), handlers_.end());
+  for(size_t i = 0; i < handlers.size(); ++i) {
+    if(handlers[i]->start_graceful_shutdown() != 0) {
+      delete handlers[i];
+    }
+  }
+  check_drained();
+}
+
+bool ClientHandlerSet::get_graceful_shutdown() const
+{
+  return graceful_shutdown_;
+}
+
+void ClientHandlerSet::clear_downstream_connection_pools()
+{
+  for(std::set<ClientHandler*>::iterator i = handlers_.begin();
+      i != handlers_.end(); ++i) {
+    (*i)->clear_downstream_connection_pool();
+  }
+}
+
+void ClientHandlerSet::check_drained()
+{
+  if(graceful_shutdown_ && !drained_ && handlers_.empty()) {
+    drained_ = true;
+    if(ENABLE_LOG) {
+      LOG(INFO) << "All connections are closed";
+    }
+    cb_(arg_);
+  }
+}
+
 } // namespace shrpx
@@ -36,6 +36,13 @@ namespace shrpx {
 
 class Upstream;
 class DownstreamConnection;
+class HttpCache;
+class DownstreamPool;
+class ClientHandlerSet;
+class DownstreamWarmPool;
+class AdmissionControl;
+struct WorkerStat;
+struct DownstreamAddr;
 
 class ClientHandler {
 public:
@@ -58,16 +65,97 @@ public:
   void pool_downstream_connection(DownstreamConnection *dconn);
   void remove_downstream_connection(DownstreamConnection *dconn);
   DownstreamConnection* get_downstream_connection();
+  // |cache| is owned by the caller and may be NULL if caching is
+  // disabled.
+  void set_http_cache(HttpCache *cache);
+  HttpCache* get_http_cache() const;
+  // |pool| is owned by the caller.
+  void set_downstream_pool(DownstreamPool *pool);
+  DownstreamPool* get_downstream_pool() const;
+  // |stat| is owned by the caller. This object is counted as an
+  // accepted and active connection in |stat|. If no WorkerStat is
+  // set, the statistics are not collected.
+  void set_worker_stat(WorkerStat *stat);
+  WorkerStat* get_worker_stat() const;
+  // |addr| is owned by the caller. It may be updated on reload, which
+  // affects the downstream connections created after that.
+  void set_downstream_addr(const DownstreamAddr *addr);
+  const DownstreamAddr* get_downstream_addr() const;
+  // |pool| is owned by the caller and may be NULL if the warm
+  // downstream connections are disabled.
+  void set_downstream_warm_pool(DownstreamWarmPool *pool);
+  DownstreamWarmPool* get_downstream_warm_pool() const;
+  // |ac| is owned by the caller.
+  void set_admission_control(AdmissionControl *ac);
+  // Returns true if a new request can be sent to the downstream
+  // server. Otherwise the request must be refused.
+  bool admit_request();
+  // Adds this object to |handler_set|, which is owned by the
+  // caller. This object removes itself when it is deleted.
+  void set_handler_set(ClientHandlerSet *handler_set);
+  // Returns true if the graceful shutdown of the handler set has
+  // been started.
+  bool get_graceful_shutdown() const;
+  // Lets the upstream finish the requests in progress and close the
+  // connection. Returns -1 if this object should be deleted
+  // immediately.
+  int start_graceful_shutdown();
+  // Deletes the idle downstream connections in the pool.
+  void clear_downstream_connection_pool();
 private:
   bufferevent *bev_;
   SSL *ssl_;
   Upstream *upstream_;
   std::string ipaddr_;
   bool should_close_after_write_;
+  HttpCache *http_cache_;
+  DownstreamPool *downstream_pool_;
+  WorkerStat *stat_;
+  const DownstreamAddr *downstream_addr_;
+  DownstreamWarmPool *warm_pool_;
+  AdmissionControl *admission_control_;
+  ClientHandlerSet *handler_set_;
+  // The time when this object is created, which is used to measure
+  // the time of SSL/TLS handshake.
+  timeval create_time_;
 
   std::set<DownstreamConnection*> dconn_pool_;
 };
 
+// The ClientHandler objects of one thread. Each worker thread has its
+// own ClientHandlerSet and it is only accessed from that thread.
+class ClientHandlerSet {
+public:
+  typedef void (*DrainedCallback)(void *arg);
+  // |cb| is called with |arg| when the last connection is closed
+  // after the graceful shutdown is started.
+  ClientHandlerSet(DrainedCallback cb, void *arg);
+  ~ClientHandlerSet();
+  size_t size() const;
+  // Adds |handler|. If the rate limit per thread is configured, the
+  // connection of |handler| joins the rate limit group of this set.
+  void add(ClientHandler *handler);
+  void remove(ClientHandler *handler);
+  // Stops taking new requests from the connections. SPDY sessions
+  // are sent GOAWAY and idle HTTPS connections are closed. The
+  // connections accepted after this call are shut down as soon as
+  // the handshake is completed.
+  void start_graceful_shutdown();
+  bool get_graceful_shutdown() const;
+  // Deletes the pooled downstream connections of all ClientHandlers.
+  void clear_downstream_connection_pools();
+private:
+  void check_drained();
+
+  std::set<ClientHandler*> handlers_;
+  // Created when the first handler is added.
+  bufferevent_rate_limit_group *rate_limit_group_;
+  DrainedCallback cb_;
+  void *arg_;
+  bool graceful_shutdown_;
+  bool drained_;
+};
+
 } // namespace shrpx
 
 #endif // SHRPX_CLIENT_HANDLER_H
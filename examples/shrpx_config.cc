@@ -38,9 +38,27 @@ Config::Config()
     downstream_host(0),
     downstream_port(0),
     downstream_hostport(0),
-    downstream_addrlen(0),
+    downstream_addr(),
     num_worker(0),
-    spdy_max_concurrent_streams(0)
+    spdy_max_concurrent_streams(0),
+    spdy_max_downstream_connections(0),
+    upstream_read_chunk_size(0),
+    http_cache_size(0),
+    http_cache_max_object_size(0),
+    tls_session_cache_size(0),
+    admin_host(0),
+    admin_port(0),
+    read_rate(0),
+    write_rate(0),
+    worker_read_rate(0),
+    worker_write_rate(0),
+    rate_limit_cfg(0),
+    worker_rate_limit_cfg(0),
+    spdy_stream_write_rate(0),
+    downstream_warm_connections(0),
+    downstream_tcp_fastopen(false),
+    max_connections(0),
+    max_requests(0)
 {}
 
 namespace {
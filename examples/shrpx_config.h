@@ -34,6 +34,9 @@
 #include <arpa/inet.h>
 
 #include <string>
+#include <vector>
+
+struct ev_token_bucket_cfg;
 
 namespace shrpx {
 
@@ -44,6 +47,11 @@ union sockaddr_union {
   sockaddr_in in;
 };
 
+struct DownstreamAddr {
+  sockaddr_union addr;
+  size_t addrlen;
+};
+
 struct Config {
   bool verbose;
   bool daemon;
@@ -56,8 +64,9 @@ struct Config {
   const char *downstream_host;
   uint16_t downstream_port;
   const char *downstream_hostport;
-  sockaddr_union downstream_addr;
-  size_t downstream_addrlen;
+  // The address resolved at startup or the last reload. Each worker
+  // thread has its own copy.
+  DownstreamAddr downstream_addr;
   timeval upstream_read_timeout;
   timeval upstream_write_timeout;
   timeval spdy_upstream_read_timeout;
@@ -67,6 +76,54 @@ struct Config {
   timeval downstream_idle_read_timeout;
   size_t num_worker;
   size_t spdy_max_concurrent_streams;
+  // The maximum number of downstream connections used by one SPDY
+  // session at the same time. 0 means unlimited.
+  size_t spdy_max_downstream_connections;
+  // The maximum number of bytes of HTTPS upstream input passed to the
+  // request parser at once.
+  size_t upstream_read_chunk_size;
+  // The maximum number of bytes of cached responses per thread. 0
+  // disables the response cache.
+  size_t http_cache_size;
+  // The maximum size of a response body which can be cached.
+  size_t http_cache_max_object_size;
+  // The maximum number of TLS sessions in the session cache. 0
+  // disables the session cache.
+  size_t tls_session_cache_size;
+  // The files containing session ticket keys. The first one is used
+  // to encrypt tickets.
+  std::vector<std::string> tls_ticket_key_files;
+  // The address of the admin HTTP server which exports the
+  // statistics. 0 port disables the server.
+  const char *admin_host;
+  uint16_t admin_port;
+  // Rate limits of each client connection and of all client
+  // connections of one thread in bytes per second. 0 means
+  // unlimited.
+  size_t read_rate;
+  size_t write_rate;
+  size_t worker_read_rate;
+  size_t worker_write_rate;
+  // The token bucket configurations created from the above rates, or
+  // 0 if unlimited.
+  ev_token_bucket_cfg *rate_limit_cfg;
+  ev_token_bucket_cfg *worker_rate_limit_cfg;
+  // Rate limit of the response body of each SPDY stream in bytes per
+  // second. 0 means unlimited.
+  size_t spdy_stream_write_rate;
+  // The number of the connections to the downstream server which
+  // each thread establishes in advance. 0 disables them.
+  size_t downstream_warm_connections;
+  // Use TCP Fast Open for the connections to the downstream server
+  // made on demand.
+  bool downstream_tcp_fastopen;
+  // The maximum number of client connections and of requests in
+  // progress per thread. 0 means unlimited.
+  size_t max_connections;
+  size_t max_requests;
+  // The thread sheds new connections and requests while its event
+  // loop lags more than this. 0 disables the check.
+  timeval max_event_loop_lag;
   Config();
 };
 
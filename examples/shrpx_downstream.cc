@@ -25,6 +25,8 @@
 #include "shrpx_downstream.h"
 
 #include <cassert>
+#include <algorithm>
+#include <iterator>
 
 #include "shrpx_upstream.h"
 #include "shrpx_client_handler.h"
@@ -32,6 +34,8 @@
 #include "shrpx_error.h"
 #include "shrpx_http.h"
 #include "shrpx_downstream_connection.h"
+#include "shrpx_http_cache.h"
+#include "shrpx_stat.h"
 #include "util.h"
 
 using namespace spdylay;
@@ -39,29 +43,14 @@ using namespace spdylay;
 namespace shrpx {
 
 Downstream::Downstream(Upstream *upstream, int stream_id, int priority)
-  : upstream_(upstream),
-    dconn_(0),
-    stream_id_(stream_id),
-    priority_(priority),
-    ioctrl_(0),
-    request_state_(INITIAL),
-    request_major_(1),
-    request_minor_(1),
-    chunked_request_(false),
-    request_connection_close_(false),
-    request_expect_100_continue_(false),
-    response_state_(INITIAL),
-    response_http_status_(0),
-    response_major_(1),
-    response_minor_(1),
-    chunked_response_(false),
-    response_connection_close_(false),
+  : ioctrl_(0),
+    stat_(0),
     response_htp_(htparser_new()),
     response_body_buf_(0),
-    recv_window_size_(0)
+    parse_input_(0),
+    response_cache_entry_(0)
 {
-  htparser_init(response_htp_, htp_type_response);
-  htparser_set_userdata(response_htp_, this);
+  init(upstream, stream_id, priority);
 }
 
 Downstream::~Downstream()
@@ -69,19 +58,119 @@ Downstream::~Downstream()
   if(ENABLE_LOG) {
     LOG(INFO) << "Deleting downstream " << this;
   }
+  release();
   if(response_body_buf_) {
     // Passing NULL to evbuffer_free() causes segmentation fault.
     evbuffer_free(response_body_buf_);
   }
-  if(dconn_) {
-    delete dconn_;
-  }
   free(response_htp_);
   if(ENABLE_LOG) {
     LOG(INFO) << "Deleted";
   }
 }
 
+void Downstream::init(Upstream *upstream, int stream_id, int priority)
+{
+  upstream_ = upstream;
+  dconn_ = 0;
+  stream_id_ = stream_id;
+  priority_ = priority;
+  ioctrl_ = IOControl(0);
+  request_state_ = INITIAL;
+  request_major_ = 1;
+  request_minor_ = 1;
+  chunked_request_ = false;
+  request_connection_close_ = false;
+  request_expect_100_continue_ = false;
+  response_state_ = INITIAL;
+  response_http_status_ = 0;
+  response_major_ = 1;
+  response_minor_ = 1;
+  chunked_response_ = false;
+  response_connection_close_ = false;
+  leader_ = 0;
+  pausing_leader_ = false;
+  paused_followers_ = 0;
+  in_flight_ = false;
+  recv_window_size_ = 0;
+  response_bodylen_ = 0;
+  response_source_ = "backend";
+  gettimeofday(&request_start_time_, 0);
+  request_sent_time_ = request_start_time_;
+  response_bucket_.init(get_config()->spdy_stream_write_rate,
+                        get_config()->spdy_stream_write_rate,
+                        &request_start_time_);
+  stat_ = upstream->get_client_handler()->get_worker_stat();
+  if(stat_) {
+    ++stat_->requests;
+    ++stat_->active_requests;
+  }
+  htparser_init(response_htp_, htp_type_response);
+  htparser_set_userdata(response_htp_, this);
+}
+
+void Downstream::release()
+{
+  if(Log::access_log_enabled() && !request_method_.empty()) {
+    write_access_log();
+  }
+  if(stat_) {
+    // The destructor calls this function again for the object in
+    // DownstreamPool.
+    --stat_->active_requests;
+    stat_->request_time.record(elapsed_usec(request_start_time_));
+    stat_ = 0;
+  }
+  if(leader_) {
+    unpause_leader();
+    leader_->remove_follower(this);
+    leader_ = 0;
+  }
+  if(in_flight_) {
+    upstream_->get_client_handler()->get_http_cache()->remove_in_flight(this);
+    in_flight_ = false;
+  }
+  if(!followers_.empty()) {
+    if(dconn_ && response_state_ == HEADER_COMPLETE) {
+      // The response body is still coming. Keep it going for the
+      // followers.
+      hand_over_response();
+    } else {
+      // If the response header has not been completed, the followers
+      // have not been checked against it. Let each of them fetch
+      // the response by itself.
+      std::vector<Downstream*> followers;
+      followers.swap(followers_);
+      for(size_t i = 0; i < followers.size(); ++i) {
+        release_follower(followers[i]);
+      }
+    }
+  }
+  if(response_body_buf_) {
+    evbuffer_setcb(response_body_buf_, 0, 0);
+    evbuffer_drain(response_body_buf_,
+                   evbuffer_get_length(response_body_buf_));
+  }
+  if(dconn_) {
+    // This sets dconn_ to NULL.
+    delete dconn_;
+  }
+  delete response_cache_entry_;
+  response_cache_entry_ = 0;
+  // The storage of the strings and header fields is kept for the next
+  // request.
+  request_method_.clear();
+  request_path_.clear();
+  request_headers_.clear();
+  response_headers_.clear();
+}
+
+size_t Downstream::get_storage_size() const
+{
+  return request_method_.capacity() + request_path_.capacity() +
+    request_headers_.capacity() + response_headers_.capacity();
+}
+
 void Downstream::set_downstream_connection(DownstreamConnection *dconn)
 {
   dconn_ = dconn;
@@ -99,12 +188,39 @@ DownstreamConnection* Downstream::get_downstream_connection()
 
 void Downstream::pause_read(IOCtrlReason reason)
 {
-  ioctrl_.pause_read(reason);
+  if(leader_) {
+    // The leader counts the followers which paused it, so that one
+    // follower does not resume reading for the others.
+    if(!pausing_leader_) {
+      pausing_leader_ = true;
+      if(leader_->paused_followers_++ == 0) {
+        leader_->ioctrl_.pause_read(SHRPX_FOLLOWER_BLOCK);
+      }
+    }
+  } else {
+    ioctrl_.pause_read(reason);
+  }
 }
 
 bool Downstream::resume_read(IOCtrlReason reason)
 {
-  return ioctrl_.resume_read(reason);
+  if(leader_) {
+    return unpause_leader();
+  } else {
+    return ioctrl_.resume_read(reason);
+  }
+}
+
+bool Downstream::unpause_leader()
+{
+  if(!pausing_leader_) {
+    return false;
+  }
+  pausing_leader_ = false;
+  if(--leader_->paused_followers_ == 0) {
+    return leader_->ioctrl_.resume_read(SHRPX_FOLLOWER_BLOCK);
+  }
+  return false;
 }
 
 void Downstream::force_resume_read()
@@ -113,70 +229,74 @@ void Downstream::force_resume_read()
 }
 
 namespace {
-void check_header_field(bool *result, const Headers::value_type &item,
-                        const char *name, const char *value)
+void check_header_field(bool *result, const char *value, const char *token)
 {
-  if(util::strieq(item.first.c_str(), name)) {
-    if(util::strifind(item.second.c_str(), value)) {
-      *result = true;
-    }
+  if(util::strifind(value, token)) {
+    *result = true;
   }
 }
 } // namespace
 
 namespace {
-void check_transfer_encoding_chunked(bool *chunked,
-                                     const Headers::value_type &item)
+void check_connection_close(bool *connection_close, const char *value)
 {
-  return check_header_field(chunked, item, "transfer-encoding", "chunked");
+  if(util::strifind(value, "close")) {
+    *connection_close = true;
+  } else if(util::strifind(value, "keep-alive")) {
+    *connection_close = false;
+  }
 }
 } // namespace
 
-namespace {
-void check_expect_100_continue(bool *res,
-                               const Headers::value_type& item)
+const Headers& Downstream::get_request_headers() const
 {
-  return check_header_field(res, item, "expect", "100-continue");
+  return request_headers_;
 }
-} // namespace
 
-namespace {
-void check_connection_close(bool *connection_close,
-                            const Headers::value_type &item)
-{
-  if(util::strieq(item.first.c_str(), "connection")) {
-    if(util::strifind(item.second.c_str(), "close")) {
-      *connection_close = true;
-    } else if(util::strifind(item.second.c_str(), "keep-alive")) {
-      *connection_close = false;
-    }
+void Downstream::add_request_header(const char *name, size_t namelen,
+                                    const char *value, size_t valuelen)
+{
+  request_headers_.add(name, namelen, value, valuelen);
+}
+
+void Downstream::set_last_request_header_value(const char *value,
+                                               size_t valuelen)
+{
+  request_headers_.set_last_value(value, valuelen);
+  size_t last = request_headers_.size()-1;
+  value = request_headers_.value(last);
+  switch(http::lookup_token(request_headers_.name(last),
+                            request_headers_.namelen(last))) {
+  case http::HD_TRANSFER_ENCODING:
+    check_header_field(&chunked_request_, value, "chunked");
+    break;
+  case http::HD_EXPECT:
+    check_header_field(&request_expect_100_continue_, value, "100-continue");
+    break;
+  case http::HD_CONNECTION:
+    check_connection_close(&request_connection_close_, value);
+    break;
   }
 }
-} // namespace
 
-void Downstream::add_request_header(const std::string& name,
-                                    const std::string& value)
+void Downstream::set_request_method(const char *method, size_t len)
 {
-  request_headers_.push_back(std::make_pair(name, value));
+  request_method_.assign(method, len);
 }
 
-void Downstream::set_last_request_header_value(const std::string& value)
+const std::string& Downstream::get_request_method() const
 {
-  Headers::value_type &item = request_headers_.back();
-  item.second = value;
-  check_transfer_encoding_chunked(&chunked_request_, item);
-  check_expect_100_continue(&request_expect_100_continue_, item);
-  check_connection_close(&request_connection_close_, item);
+  return request_method_;
 }
 
-void Downstream::set_request_method(const std::string& method)
+void Downstream::set_request_path(const char *path, size_t len)
 {
-  request_method_ = method;
+  request_path_.assign(path, len);
 }
 
-void Downstream::set_request_path(const std::string& path)
+const std::string& Downstream::get_request_path() const
 {
-  request_path_ = path;
+  return request_path_;
 }
 
 void Downstream::set_request_major(int major)
@@ -258,69 +378,19 @@ bool Downstream::get_output_buffer_full()
 // Downstream. Otherwise, the program will crash.
 int Downstream::push_request_headers()
 {
-  bool xff_found = false;
-  std::string hdrs = request_method_;
-  hdrs += " ";
-  hdrs += request_path_;
-  hdrs += " ";
-  hdrs += "HTTP/1.1\r\n";
-  hdrs += "Host: ";
-  hdrs += get_config()->downstream_hostport;
-  hdrs += "\r\n";
-  std::string via_value;
-  for(Headers::const_iterator i = request_headers_.begin();
-      i != request_headers_.end(); ++i) {
-    if(util::strieq((*i).first.c_str(), "X-Forwarded-Proto") ||
-       util::strieq((*i).first.c_str(), "host") ||
-       util::strieq((*i).first.c_str(), "keep-alive") ||
-       util::strieq((*i).first.c_str(), "connection") ||
-       util::strieq((*i).first.c_str(), "proxy-connection")) {
-      continue;
-    }
-    if(util::strieq((*i).first.c_str(), "via")) {
-      via_value = (*i).second;
-      continue;
-    }
-    if(util::strieq((*i).first.c_str(), "expect") &&
-       util::strifind((*i).second.c_str(), "100-continue")) {
-      continue;
-    }
-    hdrs += (*i).first;
-    hdrs += ": ";
-    hdrs += (*i).second;
-    if(!xff_found && util::strieq((*i).first.c_str(), "X-Forwarded-For")) {
-      xff_found = true;
-      hdrs += ", ";
-      hdrs += upstream_->get_client_handler()->get_ipaddr();
-    }
-    hdrs += "\r\n";
-  }
-  if(request_connection_close_) {
-    hdrs += "Connection: close\r\n";
-  }
-  if(!xff_found) {
-    hdrs += "X-Forwarded-For: ";
-    hdrs += upstream_->get_client_handler()->get_ipaddr();
-    hdrs += "\r\n";
-  }
-  hdrs += "X-Forwarded-Proto: https\r\n";
-
-  hdrs += "Via: ";
-  hdrs += via_value;
-  if(!via_value.empty()) {
-    hdrs += ", ";
-  }
-  hdrs += http::create_via_header_value(request_major_, request_minor_);
-  hdrs += "\r\n";
-
-  hdrs += "\r\n";
+  bufferevent *bev = dconn_->get_bev();
+  evbuffer *output = bufferevent_get_output(bev);
+  std::string hdrs;
+  http::write_request_headers(output, request_method_, request_path_,
+                              request_major_, request_minor_,
+                              request_headers_, request_connection_close_,
+                              upstream_->get_client_handler()->get_ipaddr(),
+                              ENABLE_LOG ? &hdrs : 0);
   if(ENABLE_LOG) {
     LOG(INFO) << "Downstream request headers\n" << hdrs;
   }
-  bufferevent *bev = dconn_->get_bev();
-  evbuffer *output = bufferevent_get_output(bev);
-  evbuffer_add(output, hdrs.c_str(), hdrs.size());
 
+  gettimeofday(&request_sent_time_, 0);
   dconn_->start_waiting_response();
   return 0;
 }
@@ -352,6 +422,9 @@ int Downstream::push_upload_data_chunk(const uint8_t *data, size_t datalen)
     return -1;
   }
   res += rv;
+  if(stat_) {
+    stat_->request_body_bytes += datalen;
+  }
   if(chunked_request_) {
     rv = evbuffer_add(output, "\r\n", 2);
     if(rv == -1) {
@@ -362,9 +435,42 @@ int Downstream::push_upload_data_chunk(const uint8_t *data, size_t datalen)
   return res;
 }
 
-int Downstream::end_upload_data()
+int Downstream::push_upload_data_chunk(evbuffer *src, size_t datalen)
 {
+  if(!dconn_) {
+    LOG(WARNING) << "dconn_ is NULL";
+    evbuffer_drain(src, datalen);
+    return 0;
+  }
+  int rv;
+  bufferevent *bev = dconn_->get_bev();
+  evbuffer *output = bufferevent_get_output(bev);
+  if(chunked_request_) {
+    char chunk_size_hex[16];
+    rv = snprintf(chunk_size_hex, sizeof(chunk_size_hex), "%X\r\n",
+                  static_cast<unsigned int>(datalen));
+    if(evbuffer_add(output, chunk_size_hex, rv) == -1) {
+      return -1;
+    }
+  }
+  rv = evbuffer_remove_buffer(src, output, datalen);
+  if(rv != static_cast<int>(datalen)) {
+    return -1;
+  }
+  if(stat_) {
+    stat_->request_body_bytes += datalen;
+  }
   if(chunked_request_) {
+    if(evbuffer_add(output, "\r\n", 2) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int Downstream::end_upload_data()
+{
+  if(chunked_request_ && dconn_) {
     bufferevent *bev = dconn_->get_bev();
     evbuffer *output = bufferevent_get_output(bev);
     evbuffer_add(output, "0\r\n\r\n", 5);
@@ -377,18 +483,27 @@ const Headers& Downstream::get_response_headers() const
   return response_headers_;
 }
 
-void Downstream::add_response_header(const std::string& name,
-                                     const std::string& value)
+void Downstream::add_response_header(const char *name, size_t namelen,
+                                     const char *value, size_t valuelen)
 {
-  response_headers_.push_back(std::make_pair(name, value));
+  response_headers_.add(name, namelen, value, valuelen);
 }
 
-void Downstream::set_last_response_header_value(const std::string& value)
+void Downstream::set_last_response_header_value(const char *value,
+                                                size_t valuelen)
 {
-  Headers::value_type &item = response_headers_.back();
-  item.second = value;
-  check_transfer_encoding_chunked(&chunked_response_, item);
-  check_connection_close(&response_connection_close_, item);
+  response_headers_.set_last_value(value, valuelen);
+  size_t last = response_headers_.size()-1;
+  value = response_headers_.value(last);
+  switch(http::lookup_token(response_headers_.name(last),
+                            response_headers_.namelen(last))) {
+  case http::HD_TRANSFER_ENCODING:
+    check_header_field(&chunked_response_, value, "chunked");
+    break;
+  case http::HD_CONNECTION:
+    check_connection_close(&response_connection_close_, value);
+    break;
+  }
 }
 
 unsigned int Downstream::get_response_http_status() const
@@ -440,6 +555,9 @@ int htp_hdrs_completecb(htparser *htp)
   downstream->set_response_major(htparser_get_major(htp));
   downstream->set_response_minor(htparser_get_minor(htp));
   downstream->set_response_state(Downstream::HEADER_COMPLETE);
+  downstream->record_response_time();
+  downstream->start_response_caching();
+  downstream->relay_response_header();
   downstream->get_upstream()->on_downstream_header_complete(downstream);
   return 0;
 }
@@ -450,7 +568,7 @@ int htp_hdr_keycb(htparser *htp, const char *data, size_t len)
 {
   Downstream *downstream;
   downstream = reinterpret_cast<Downstream*>(htparser_get_userdata(htp));
-  downstream->add_response_header(std::string(data, len), "");
+  downstream->add_response_header(data, len, "", 0);
   return 0;
 }
 } // namespace
@@ -460,7 +578,7 @@ int htp_hdr_valcb(htparser *htp, const char *data, size_t len)
 {
   Downstream *downstream;
   downstream = reinterpret_cast<Downstream*>(htparser_get_userdata(htp));
-  downstream->set_last_response_header_value(std::string(data, len));
+  downstream->set_last_response_header_value(data, len);
   return 0;
 }
 } // namespace
@@ -470,6 +588,9 @@ int htp_bodycb(htparser *htp, const char *data, size_t len)
 {
   Downstream *downstream;
   downstream = reinterpret_cast<Downstream*>(htparser_get_userdata(htp));
+  downstream->append_response_caching
+    (reinterpret_cast<const uint8_t*>(data), len);
+  downstream->relay_response_body(reinterpret_cast<const uint8_t*>(data), len);
   downstream->get_upstream()->on_downstream_body
     (downstream, reinterpret_cast<const uint8_t*>(data), len);
   return 0;
@@ -482,6 +603,9 @@ int htp_body_completecb(htparser *htp)
   Downstream *downstream;
   downstream = reinterpret_cast<Downstream*>(htparser_get_userdata(htp));
   downstream->set_response_state(Downstream::MSG_COMPLETE);
+  // Upstream may delete downstream in on_downstream_body_complete().
+  downstream->finish_response_caching();
+  downstream->relay_response_body_complete();
   downstream->get_upstream()->on_downstream_body_complete(downstream);
   return 0;
 }
@@ -509,15 +633,45 @@ htparse_hooks htp_hooks = {
 };
 } // namespace
 
+namespace {
+const int PARSE_IOVCNT = 16;
+} // namespace
+
 int Downstream::parse_http_response()
 {
   bufferevent *bev = dconn_->get_bev();
   evbuffer *input = bufferevent_get_input(bev);
-  unsigned char *mem = evbuffer_pullup(input, -1);
-  size_t nread = htparser_run(response_htp_, &htp_hooks,
-                              reinterpret_cast<const char*>(mem),
-                              evbuffer_get_length(input));
-  evbuffer_drain(input, nread);
+  // Feed htparser with each chain of the input buffer in place. Using
+  // evbuffer_pullup() here makes the whole response body contiguous,
+  // which costs an extra memmove of every body byte which spans
+  // chains. The body is moved out of the input buffer by
+  // move_response_body() while the chains are parsed.
+  parse_input_ = input;
+  bool stop = false;
+  while(!stop && evbuffer_get_length(input) > 0) {
+    evbuffer_iovec vec[PARSE_IOVCNT];
+    int nvec = evbuffer_peek(input, -1, 0, vec, PARSE_IOVCNT);
+    if(nvec > PARSE_IOVCNT) {
+      nvec = PARSE_IOVCNT;
+    }
+    size_t nread = 0;
+    parse_removed_ = 0;
+    for(int i = 0; i < nvec; ++i) {
+      parse_base_ = reinterpret_cast<const uint8_t*>(vec[i].iov_base);
+      parse_offset_ = nread;
+      size_t rv = htparser_run(response_htp_, &htp_hooks,
+                               reinterpret_cast<const char*>(vec[i].iov_base),
+                               vec[i].iov_len);
+      nread += rv;
+      if(rv < vec[i].iov_len ||
+         htparser_get_error(response_htp_) != htparse_error_none) {
+        stop = true;
+        break;
+      }
+    }
+    evbuffer_drain(input, nread - parse_removed_);
+  }
+  parse_input_ = 0;
   if(htparser_get_error(response_htp_) == htparse_error_none) {
     return 0;
   } else {
@@ -556,8 +710,8 @@ int Downstream::init_response_body_buf()
     if(response_body_buf_ == 0) {
       DIE();
     }
-    evbuffer_setcb(response_body_buf_, body_buf_cb, this);
   }
+  evbuffer_setcb(response_body_buf_, body_buf_cb, this);
   return 0;
 }
 
@@ -566,11 +720,340 @@ evbuffer* Downstream::get_response_body_buf()
   return response_body_buf_;
 }
 
+int Downstream::move_response_body(evbuffer *dst, const uint8_t *data,
+                                   size_t len)
+{
+  if(!parse_input_ || data < parse_base_) {
+    return -1;
+  }
+  size_t off = parse_offset_ + (data - parse_base_);
+  // The bytes before |data| have been parsed already.
+  evbuffer_drain(parse_input_, off - parse_removed_);
+  // htparser does not read the body again, and the chains which
+  // remain to be parsed are not touched, so the pointers peeked in
+  // parse_http_response() stay valid.
+  evbuffer_remove_buffer(parse_input_, dst, len);
+  parse_removed_ = off + len;
+  return 0;
+}
+
+bool Downstream::response_from_cache()
+{
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  if(!cache) {
+    return false;
+  }
+  time_t now = time(0);
+  const HttpCacheEntry *ent = cache->lookup(this, now);
+  if(!ent) {
+    if(stat_) {
+      ++stat_->cache_misses;
+    }
+    return false;
+  }
+  if(stat_) {
+    ++stat_->cache_hits;
+  }
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Serving " << request_path_ << " from cache";
+  }
+  response_source_ = "cache";
+  response_http_status_ = ent->status;
+  response_major_ = ent->major;
+  response_minor_ = ent->minor;
+  response_headers_ = ent->headers;
+  std::string age = util::to_str(ent->initial_age + now - ent->response_time);
+  response_headers_.add("Age", 3, age.c_str(), age.size());
+  std::string content_length = util::to_str(ent->body.size());
+  response_headers_.add("Content-Length", 14,
+                        content_length.c_str(), content_length.size());
+  chunked_response_ = false;
+  response_connection_close_ = false;
+  response_state_ = HEADER_COMPLETE;
+  upstream_->on_downstream_header_complete(this);
+  if(!ent->body.empty()) {
+    upstream_->on_downstream_body
+      (this, reinterpret_cast<const uint8_t*>(ent->body.data()),
+       ent->body.size());
+  }
+  response_state_ = MSG_COMPLETE;
+  upstream_->on_downstream_body_complete(this);
+  return true;
+}
+
+void Downstream::start_response_caching()
+{
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  if(cache) {
+    delete response_cache_entry_;
+    response_cache_entry_ = cache->create_entry(this, time(0));
+  }
+}
+
+void Downstream::append_response_caching(const uint8_t *data, size_t len)
+{
+  if(!response_cache_entry_) {
+    return;
+  }
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  if(response_cache_entry_->body.size() + len >
+     cache->get_max_entry_size()) {
+    delete response_cache_entry_;
+    response_cache_entry_ = 0;
+    return;
+  }
+  response_cache_entry_->body.append(reinterpret_cast<const char*>(data),
+                                     len);
+}
+
+void Downstream::finish_response_caching()
+{
+  if(!response_cache_entry_) {
+    return;
+  }
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  cache->store(response_cache_entry_);
+  response_cache_entry_ = 0;
+}
+
+bool Downstream::follow_in_flight_request()
+{
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  if(!cache) {
+    return false;
+  }
+  Downstream *leader = cache->find_in_flight(this);
+  if(!leader || leader == this) {
+    return false;
+  }
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Downstream " << this << " follows in-flight request "
+              << leader << " for " << request_path_;
+  }
+  leader->followers_.push_back(this);
+  leader_ = leader;
+  response_source_ = "coalesced";
+  if(stat_) {
+    ++stat_->coalesced_requests;
+  }
+  return true;
+}
+
+void Downstream::register_in_flight()
+{
+  HttpCache *cache = upstream_->get_client_handler()->get_http_cache();
+  if(cache) {
+    in_flight_ = cache->add_in_flight(this);
+  }
+}
+
+Downstream* Downstream::get_leader() const
+{
+  return leader_;
+}
+
+void Downstream::remove_follower(Downstream *follower)
+{
+  followers_.erase(std::remove(followers_.begin(), followers_.end(), follower),
+                   followers_.end());
+}
+
+void Downstream::release_follower(Downstream *follower)
+{
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Releasing follower " << follower << " of " << this;
+  }
+  follower->unpause_leader();
+  follower->leader_ = 0;
+  follower->response_source_ = "backend";
+  follower->get_upstream()->on_downstream_abort(follower);
+}
+
+void Downstream::hand_over_response()
+{
+  std::vector<Downstream*> followers;
+  followers.swap(followers_);
+  Downstream *leader = followers[0];
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Handing over response for " << request_path_
+              << " from " << this << " to " << leader;
+  }
+  // The new leader paused this object if its response body buffer
+  // was full. It now pauses the downstream connection by itself.
+  bool leader_paused = leader->pausing_leader_;
+  leader->pausing_leader_ = false;
+  leader->leader_ = 0;
+  for(size_t i = 1; i < followers.size(); ++i) {
+    followers[i]->leader_ = leader;
+    leader->followers_.push_back(followers[i]);
+    if(followers[i]->pausing_leader_) {
+      ++leader->paused_followers_;
+    }
+  }
+  // The new leader takes over the parser in the middle of the
+  // response, so it needs the response state parsed so far.
+  leader->response_state_ = response_state_;
+  leader->response_http_status_ = response_http_status_;
+  leader->response_major_ = response_major_;
+  leader->response_minor_ = response_minor_;
+  leader->chunked_response_ = chunked_response_;
+  leader->response_connection_close_ = response_connection_close_;
+  leader->response_headers_ = response_headers_;
+  std::swap(response_htp_, leader->response_htp_);
+  htparser_set_userdata(response_htp_, this);
+  htparser_set_userdata(leader->response_htp_, leader);
+  std::swap(response_cache_entry_, leader->response_cache_entry_);
+  // relay_response_header() has removed this object from the in-flight
+  // requests when the header was complete.
+  assert(!in_flight_);
+  DownstreamConnection *dconn = dconn_;
+  set_downstream_connection(0);
+  // attach_downstream() never fails because the connection has been
+  // established already.
+  dconn->attach_downstream(leader);
+  dconn->start_waiting_response();
+  if(leader_paused) {
+    leader->pause_read(SHRPX_NO_BUFFER);
+  }
+  if(leader->paused_followers_ > 0) {
+    leader->ioctrl_.pause_read(SHRPX_FOLLOWER_BLOCK);
+  }
+}
+
+namespace {
+// Returns true if the request header fields nominated by |vary| have
+// the same values in |a| and |b|.
+bool vary_match(const char *vary, const Headers& a, const Headers& b)
+{
+  std::vector<std::string> names;
+  util::split(vary, vary+strlen(vary), std::back_inserter(names), ',', true);
+  for(std::vector<std::string>::const_iterator i = names.begin();
+      i != names.end(); ++i) {
+    const char *va = a.find((*i).c_str());
+    const char *vb = b.find((*i).c_str());
+    if(strcmp(va ? va : "", vb ? vb : "") != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+void Downstream::relay_response_header()
+{
+  if(in_flight_) {
+    upstream_->get_client_handler()->get_http_cache()->remove_in_flight(this);
+    in_flight_ = false;
+  }
+  if(followers_.empty()) {
+    return;
+  }
+  std::vector<Downstream*> followers;
+  followers.swap(followers_);
+  const char *vary = response_headers_.find("vary");
+  for(size_t i = 0; i < followers.size(); ++i) {
+    Downstream *follower = followers[i];
+    // Only the response which can be cached is shared. Otherwise, it
+    // may be private to the leader.
+    if(!response_cache_entry_ ||
+       (vary && !vary_match(vary, request_headers_,
+                            follower->request_headers_))) {
+      release_follower(follower);
+      continue;
+    }
+    followers_.push_back(follower);
+    follower->response_http_status_ = response_http_status_;
+    follower->response_major_ = response_major_;
+    follower->response_minor_ = response_minor_;
+    follower->response_headers_ = response_headers_;
+    follower->chunked_response_ = chunked_response_;
+    follower->response_state_ = HEADER_COMPLETE;
+    follower->get_upstream()->on_downstream_header_complete(follower);
+  }
+}
+
+void Downstream::relay_response_body(const uint8_t *data, size_t len)
+{
+  for(size_t i = 0; i < followers_.size(); ++i) {
+    followers_[i]->get_upstream()->on_downstream_body(followers_[i], data,
+                                                      len);
+  }
+}
+
+void Downstream::relay_response_body_complete()
+{
+  std::vector<Downstream*> followers;
+  followers.swap(followers_);
+  for(size_t i = 0; i < followers.size(); ++i) {
+    followers[i]->response_state_ = MSG_COMPLETE;
+    followers[i]->get_upstream()->on_downstream_body_complete(followers[i]);
+    followers[i]->pausing_leader_ = false;
+    followers[i]->leader_ = 0;
+  }
+  if(paused_followers_ > 0) {
+    paused_followers_ = 0;
+    ioctrl_.resume_read(SHRPX_FOLLOWER_BLOCK);
+  }
+}
+
+TokenBucket* Downstream::get_response_bucket()
+{
+  return &response_bucket_;
+}
+
+void Downstream::add_response_bodylen(size_t len)
+{
+  response_bodylen_ += len;
+  if(stat_) {
+    stat_->response_body_bytes += len;
+  }
+}
+
+void Downstream::record_response_time()
+{
+  if(stat_) {
+    stat_->downstream_response_time.record(elapsed_usec(request_sent_time_));
+  }
+}
+
+void Downstream::write_access_log()
+{
+  timeval now;
+  gettimeofday(&now, 0);
+  double reqtime = (now.tv_sec - request_start_time_.tv_sec) +
+    (now.tv_usec - request_start_time_.tv_usec)/1000000.0;
+  char timestr[64];
+  tm tms;
+  localtime_r(&now.tv_sec, &tms);
+  strftime(timestr, sizeof(timestr), "%d/%b/%Y:%H:%M:%S %z", &tms);
+  char buf[128];
+  std::string rec = "time:[";
+  rec += timestr;
+  rec += "]\thost:";
+  rec += upstream_->get_client_handler()->get_ipaddr();
+  rec += "\tmethod:";
+  rec += request_method_;
+  rec += "\tpath:";
+  rec += request_path_;
+  snprintf(buf, sizeof(buf),
+           "\tstatus:%u\tsize:%lld\tsource:%s\treqtime:%.3f",
+           response_http_status_,
+           static_cast<long long int>(response_bodylen_),
+           response_source_, reqtime);
+  rec += buf;
+  Log::access_log(rec);
+}
+
 void Downstream::set_priority(int pri)
 {
   priority_ = pri;
 }
 
+int Downstream::get_priority() const
+{
+  return priority_;
+}
+
 int32_t Downstream::get_recv_window_size() const
 {
   return recv_window_size_;
@@ -586,4 +1069,51 @@ void Downstream::set_recv_window_size(int32_t new_size)
   recv_window_size_ = new_size;
 }
 
+namespace {
+// The maximum number of Downstream objects kept in DownstreamPool.
+const size_t DOWNSTREAM_POOL_MAX_FREE = 256;
+// Downstream objects whose storage has grown beyond this size are
+// deleted rather than kept in DownstreamPool.
+const size_t DOWNSTREAM_POOL_MAX_STORAGE_SIZE = 16*1024;
+} // namespace
+
+DownstreamPool::DownstreamPool()
+{}
+
+DownstreamPool::~DownstreamPool()
+{
+  for(size_t i = 0; i < free_.size(); ++i) {
+    delete free_[i];
+  }
+}
+
+Downstream* DownstreamPool::get(Upstream *upstream, int stream_id,
+                                int priority)
+{
+  if(free_.empty()) {
+    return new Downstream(upstream, stream_id, priority);
+  }
+  Downstream *downstream = free_.back();
+  free_.pop_back();
+  downstream->init(upstream, stream_id, priority);
+  return downstream;
+}
+
+void DownstreamPool::put(Downstream *downstream)
+{
+  if(free_.size() >= DOWNSTREAM_POOL_MAX_FREE) {
+    delete downstream;
+    return;
+  }
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Recycling downstream " << downstream;
+  }
+  downstream->release();
+  if(downstream->get_storage_size() > DOWNSTREAM_POOL_MAX_STORAGE_SIZE) {
+    delete downstream;
+    return;
+  }
+  free_.push_back(downstream);
+}
+
 } // namespace shrpx
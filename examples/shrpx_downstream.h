@@ -28,6 +28,7 @@
 #include "shrpx.h"
 
 #include <stdint.h>
+#include <sys/time.h>
 
 #include <vector>
 #include <string>
@@ -40,13 +41,15 @@ extern "C" {
 }
 
 #include "shrpx_io_control.h"
+#include "shrpx_http.h"
+#include "shrpx_token_bucket.h"
 
 namespace shrpx {
 
 class Upstream;
 class DownstreamConnection;
-
-typedef std::vector<std::pair<std::string, std::string> > Headers;
+struct HttpCacheEntry;
+struct WorkerStat;
 
 class Downstream {
 public:
@@ -55,6 +58,7 @@ public:
   Upstream* get_upstream() const;
   int32_t get_stream_id() const;
   void set_priority(int pri);
+  int get_priority() const;
   void pause_read(IOCtrlReason reason);
   bool resume_read(IOCtrlReason reason);
   void force_resume_read();
@@ -68,10 +72,13 @@ public:
   void set_recv_window_size(int32_t new_size);
   // downstream request API
   const Headers& get_request_headers() const;
-  void add_request_header(const std::string& name, const std::string& value);
-  void set_last_request_header_value(const std::string& value);
-  void set_request_method(const std::string& method);
-  void set_request_path(const std::string& path);
+  void add_request_header(const char *name, size_t namelen,
+                          const char *value, size_t valuelen);
+  void set_last_request_header_value(const char *value, size_t valuelen);
+  void set_request_method(const char *method, size_t len);
+  const std::string& get_request_method() const;
+  void set_request_path(const char *path, size_t len);
+  const std::string& get_request_path() const;
   void set_request_major(int major);
   void set_request_minor(int minor);
   int get_request_major() const;
@@ -82,6 +89,9 @@ public:
   void set_request_connection_close(bool f);
   bool get_expect_100_continue() const;
   int push_upload_data_chunk(const uint8_t *data, size_t datalen);
+  // Moves |datalen| bytes at the head of |src| to the downstream
+  // connection. Whole chains of |src| are moved without copying.
+  int push_upload_data_chunk(evbuffer *src, size_t datalen);
   int end_upload_data();
   enum {
     INITIAL,
@@ -95,8 +105,9 @@ public:
   int get_request_state() const;
   // downstream response API
   const Headers& get_response_headers() const;
-  void add_response_header(const std::string& name, const std::string& value);
-  void set_last_response_header_value(const std::string& value);
+  void add_response_header(const char *name, size_t namelen,
+                           const char *value, size_t valuelen);
+  void set_last_response_header_value(const char *value, size_t valuelen);
   unsigned int get_response_http_status() const;
   void set_response_http_status(unsigned int status);
   void set_response_major(int major);
@@ -110,12 +121,79 @@ public:
   int get_response_state() const;
   int init_response_body_buf();
   evbuffer* get_response_body_buf();
+  // Moves the response body |data| of length |len|, which is passed
+  // from parse_http_response() to Upstream::on_downstream_body(),
+  // from the input buffer of the downstream connection to |dst|.
+  // Whole chains are moved without copying. Returns 0 if it
+  // succeeds, or -1 if |data| is not in the input buffer being
+  // parsed, in which case the caller has to copy it.
+  int move_response_body(evbuffer *dst, const uint8_t *data, size_t len);
+  // Returns the token bucket which limits the rate of the response
+  // body sent to upstream. It is initialized with
+  // spdy_stream_write_rate when this object is created.
+  TokenBucket* get_response_bucket();
+  // Adds |len| to the number of response body bytes sent to
+  // upstream. The value is written to access log.
+  void add_response_bodylen(size_t len);
+  // Records the time from sending the request headers to receiving
+  // the response headers in the statistics.
+  void record_response_time();
+  // Serves the response from the cache of ClientHandler if there is
+  // a fresh entry for this request. The response is passed to
+  // Upstream in the same way as the one from downstream connection.
+  // Returns true if the response was served from the cache.
+  bool response_from_cache();
+  // Starts recording the response to store it in the cache when it
+  // is completed. Call this function when the response headers are
+  // received.
+  void start_response_caching();
+  void append_response_caching(const uint8_t *data, size_t len);
+  void finish_response_caching();
+  // Makes this request follow the request for the same resource
+  // which is waiting for the response from downstream server, so
+  // that the response of the leader is relayed to this object. Read
+  // control of this object is forwarded to the leader. Returns true
+  // if this object becomes a follower.
+  bool follow_in_flight_request();
+  // Registers this request so that the subsequent requests for the
+  // same resource can follow it until the response header arrives.
+  void register_in_flight();
+  Downstream* get_leader() const;
+  void remove_follower(Downstream *follower);
+  // Relays the response to the followers. The followers whose
+  // request does not match the response are released.
+  void relay_response_header();
+  void relay_response_body(const uint8_t *data, size_t len);
+  void relay_response_body_complete();
 private:
+  friend class DownstreamPool;
+  // Initializes the state for a new request. The storage allocated
+  // for the previous request is reused.
+  void init(Upstream *upstream, int stream_id, int priority);
+  // Finishes the current request: the access log is written, the
+  // followers and the downstream connection are released.
+  void release();
+  // Returns the number of bytes allocated for the strings and the
+  // header fields.
+  size_t get_storage_size() const;
+  void release_follower(Downstream *follower);
+  // Cancels the pause of the leader by this follower. Returns true
+  // if the leader resumes reading.
+  bool unpause_leader();
+  // Hands over the downstream connection and the response in
+  // progress to the first follower, which becomes the new leader.
+  // This must be called after the response header is completed.
+  void hand_over_response();
+  void write_access_log();
+
   Upstream *upstream_;
   DownstreamConnection *dconn_;
   int32_t stream_id_;
   int priority_;
   IOControl ioctrl_;
+  // The statistics of the worker thread, or 0 if this object is
+  // released.
+  WorkerStat *stat_;
   int request_state_;
   std::string request_method_;
   std::string request_path_;
@@ -137,7 +215,50 @@ private:
   // This buffer is used to temporarily store downstream response
   // body. Spdylay reads data from this in the callback.
   evbuffer *response_body_buf_;
+  // The input buffer being parsed by parse_http_response(), or 0.
+  evbuffer *parse_input_;
+  // The chain passed to htparser and its offset in parse_input_
+  // when the chains were peeked.
+  const uint8_t *parse_base_;
+  size_t parse_offset_;
+  // The number of bytes removed from the head of parse_input_ since
+  // the chains were peeked.
+  size_t parse_removed_;
+  TokenBucket response_bucket_;
+  // The cache entry being recorded from the response.
+  HttpCacheEntry *response_cache_entry_;
+  // The request this object follows, or 0.
+  Downstream *leader_;
+  std::vector<Downstream*> followers_;
+  // True if this follower paused reading of the leader.
+  bool pausing_leader_;
+  // The number of the followers which paused reading of this object.
+  size_t paused_followers_;
+  bool in_flight_;
   int32_t recv_window_size_;
+  timeval request_start_time_;
+  timeval request_sent_time_;
+  int64_t response_bodylen_;
+  // Where the response comes from: "backend", "cache" or
+  // "coalesced".
+  const char *response_source_;
+};
+
+// Free list of Downstream objects. A Downstream object put in this
+// pool is reset rather than deleted, and keeps its header storage and
+// buffers for the next request. Each worker thread has its own
+// DownstreamPool and it is only accessed from that thread.
+class DownstreamPool {
+public:
+  DownstreamPool();
+  ~DownstreamPool();
+  // Returns Downstream object for the new request, reusing the
+  // released one if available.
+  Downstream* get(Upstream *upstream, int stream_id, int priority);
+  // Releases |downstream|. Use this instead of deleting it.
+  void put(Downstream *downstream);
+private:
+  std::vector<Downstream*> free_;
 };
 
 } // namespace shrpx
@@ -24,14 +24,62 @@
  */
 #include "shrpx_downstream_connection.h"
 
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include "shrpx_client_handler.h"
 #include "shrpx_upstream.h"
 #include "shrpx_downstream.h"
 #include "shrpx_config.h"
 #include "shrpx_error.h"
+#include "shrpx_stat.h"
+#include "shrpx_downstream_warm_pool.h"
 
 namespace shrpx {
 
+namespace {
+// Returns new bufferevent connecting to |addr|, or 0 if connect()
+// fails. With TCP Fast Open, the SYN is sent with the request
+// headers, which are written before the connection is established.
+bufferevent* connect_downstream(event_base *evbase,
+                                const DownstreamAddr *addr)
+{
+  evutil_socket_t fd = -1;
+#ifdef TCP_FASTOPEN_CONNECT
+  if(get_config()->downstream_tcp_fastopen) {
+    fd = socket(addr->addr.sa.sa_family, SOCK_STREAM, 0);
+    if(fd == -1) {
+      return 0;
+    }
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+    int val = 1;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                  reinterpret_cast<char*>(&val), sizeof(val)) == -1 &&
+       ENABLE_LOG) {
+      LOG(INFO) << "Setting option TCP_FASTOPEN_CONNECT failed";
+    }
+  }
+#endif // TCP_FASTOPEN_CONNECT
+  bufferevent *bev = bufferevent_socket_new
+    (evbase, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  if(!bev) {
+    if(fd != -1) {
+      close(fd);
+    }
+    return 0;
+  }
+  int rv = bufferevent_socket_connect
+    (bev, const_cast<sockaddr*>(&addr->addr.sa), addr->addrlen);
+  if(rv != 0) {
+    bufferevent_free(bev);
+    return 0;
+  }
+  return bev;
+}
+} // namespace
+
 DownstreamConnection::DownstreamConnection(ClientHandler *client_handler)
   : client_handler_(client_handler),
     bev_(0),
@@ -60,25 +108,42 @@ int DownstreamConnection::attach_downstream(Downstream *downstream)
               << "downstream " << downstream;
   }
   Upstream *upstream = downstream->get_upstream();
+  WorkerStat *stat = client_handler_->get_worker_stat();
   if(!bev_) {
-    event_base *evbase = client_handler_->get_evbase();
-    bev_ = bufferevent_socket_new
-      (evbase, -1,
-       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);    
-    int rv = bufferevent_socket_connect
-      (bev_,
-       // TODO maybe not thread-safe?
-       const_cast<sockaddr*>(&get_config()->downstream_addr.sa),
-       get_config()->downstream_addrlen);
-    if(rv != 0) {
-      bufferevent_free(bev_);
-      bev_ = 0;
-      return SHRPX_ERR_NETWORK;
+    DownstreamWarmPool *warm_pool =
+      client_handler_->get_downstream_warm_pool();
+    if(warm_pool) {
+      bev_ = warm_pool->get();
     }
-    if(ENABLE_LOG) {
-      LOG(INFO) << "Connecting to downstream server " << this;
+    if(bev_) {
+      if(ENABLE_LOG) {
+        LOG(INFO) << "Using warm downstream connection " << this;
+      }
+      if(stat) {
+        ++stat->downstream_connection_warm;
+        stat->downstream_connect_wait_time.record(0);
+      }
+    } else {
+      gettimeofday(&connect_start_time_, 0);
+      bev_ = connect_downstream(client_handler_->get_evbase(),
+                                client_handler_->get_downstream_addr());
+      if(!bev_) {
+        return SHRPX_ERR_NETWORK;
+      }
+      if(ENABLE_LOG) {
+        LOG(INFO) << "Connecting to downstream server " << this;
+      }
+      if(stat) {
+        ++stat->downstream_connection_created;
+      }
     }
+  } else if(stat) {
+    // Reused from the pool of ClientHandler.
+    stat->downstream_connect_wait_time.record(0);
   }
+  // The connection may be handed over from the request of the other
+  // ClientHandler.
+  client_handler_ = upstream->get_client_handler();
   downstream->set_downstream_connection(this);
   downstream_ = downstream;
   bufferevent_setwatermark(bev_, EV_READ, 0, SHRPX_READ_WARTER_MARK);
@@ -110,6 +175,16 @@ void DownstreamConnection::start_waiting_response()
   }
 }
 
+void DownstreamConnection::on_connected()
+{
+  WorkerStat *stat = client_handler_->get_worker_stat();
+  if(stat) {
+    int64_t usec = elapsed_usec(connect_start_time_);
+    stat->downstream_connect_time.record(usec);
+    stat->downstream_connect_wait_time.record(usec);
+  }
+}
+
 namespace {
 // Gets called when DownstreamConnection is pooled in ClientHandler.
 void idle_eventcb(bufferevent *bev, short events, void *arg)
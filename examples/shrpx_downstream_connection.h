@@ -27,6 +27,8 @@
 
 #include "shrpx.h"
 
+#include <sys/time.h>
+
 #include <event.h>
 #include <event2/bufferevent.h>
 
@@ -47,10 +49,14 @@ public:
   ClientHandler* get_client_handler();
   Downstream* get_downstream();
   void start_waiting_response();
+  // Called when the connection to the downstream server is
+  // established.
+  void on_connected();
 private:
   ClientHandler *client_handler_;
   bufferevent *bev_;
   Downstream *downstream_;
+  timeval connect_start_time_;
 };
 
 } // namespace shrpx
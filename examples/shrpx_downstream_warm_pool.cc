@@ -0,0 +1,176 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_downstream_warm_pool.h"
+
+#include "shrpx_config.h"
+#include "shrpx_log.h"
+
+namespace shrpx {
+
+namespace {
+void warm_eventcb(bufferevent *bev, short events, void *arg)
+{
+  DownstreamWarmPool *pool = reinterpret_cast<DownstreamWarmPool*>(arg);
+  pool->on_event(bev, events);
+}
+} // namespace
+
+namespace {
+void retry_evcb(evutil_socket_t fd, short what, void *arg)
+{
+  DownstreamWarmPool *pool = reinterpret_cast<DownstreamWarmPool*>(arg);
+  pool->fill();
+}
+} // namespace
+
+DownstreamWarmPool::DownstreamWarmPool(event_base *evbase,
+                                       const DownstreamAddr *addr,
+                                       size_t size)
+  : evbase_(evbase),
+    addr_(addr),
+    size_(size),
+    retry_ev_(evtimer_new(evbase, retry_evcb, this)),
+    shutdown_(false)
+{
+  fill();
+}
+
+DownstreamWarmPool::~DownstreamWarmPool()
+{
+  clear();
+  event_free(retry_ev_);
+}
+
+bufferevent* DownstreamWarmPool::get()
+{
+  while(!connected_.empty()) {
+    bufferevent *bev = *connected_.begin();
+    connected_.erase(connected_.begin());
+    if(!shutdown_) {
+      connect_one();
+    }
+    // The server may have sent something like 408 response before
+    // closing the connection.
+    if(evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
+      bufferevent_free(bev);
+      continue;
+    }
+    bufferevent_setcb(bev, 0, 0, 0, 0);
+    return bev;
+  }
+  return 0;
+}
+
+void DownstreamWarmPool::reset()
+{
+  clear();
+  fill();
+}
+
+void DownstreamWarmPool::shutdown()
+{
+  shutdown_ = true;
+  clear();
+  evtimer_del(retry_ev_);
+}
+
+void DownstreamWarmPool::fill()
+{
+  while(!shutdown_ && connecting_.size() + connected_.size() < size_) {
+    if(connect_one() == -1) {
+      break;
+    }
+  }
+}
+
+int DownstreamWarmPool::connect_one()
+{
+  bufferevent *bev = bufferevent_socket_new
+    (evbase_, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  if(!bev) {
+    schedule_retry();
+    return -1;
+  }
+  bufferevent_setcb(bev, 0, 0, warm_eventcb, this);
+  int rv = bufferevent_socket_connect
+    (bev, const_cast<sockaddr*>(&addr_->addr.sa), addr_->addrlen);
+  if(rv != 0) {
+    bufferevent_free(bev);
+    schedule_retry();
+    return -1;
+  }
+  connecting_.insert(bev);
+  return 0;
+}
+
+void DownstreamWarmPool::schedule_retry()
+{
+  if(!evtimer_pending(retry_ev_, 0)) {
+    timeval tv = { 1, 0 };
+    evtimer_add(retry_ev_, &tv);
+  }
+}
+
+void DownstreamWarmPool::on_event(bufferevent *bev, short events)
+{
+  if(events & BEV_EVENT_CONNECTED) {
+    if(ENABLE_LOG) {
+      LOG(INFO) << "Warm downstream connection " << bev << " established";
+    }
+    connecting_.erase(bev);
+    connected_.insert(bev);
+    // Enable read to notice that the server closes the connection.
+    bufferevent_enable(bev, EV_READ);
+    return;
+  }
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Warm downstream connection " << bev << " closed";
+  }
+  remove(bev);
+  schedule_retry();
+}
+
+void DownstreamWarmPool::remove(bufferevent *bev)
+{
+  connecting_.erase(bev);
+  connected_.erase(bev);
+  bufferevent_free(bev);
+}
+
+void DownstreamWarmPool::clear()
+{
+  for(std::set<bufferevent*>::iterator i = connecting_.begin();
+      i != connecting_.end(); ++i) {
+    bufferevent_free(*i);
+  }
+  for(std::set<bufferevent*>::iterator i = connected_.begin();
+      i != connected_.end(); ++i) {
+    bufferevent_free(*i);
+  }
+  connecting_.clear();
+  connected_.clear();
+}
+
+} // namespace shrpx
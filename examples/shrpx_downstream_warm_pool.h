@@ -0,0 +1,83 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_DOWNSTREAM_WARM_POOL_H
+#define SHRPX_DOWNSTREAM_WARM_POOL_H
+
+#include "shrpx.h"
+
+#include <set>
+
+#include <event.h>
+#include <event2/bufferevent.h>
+
+namespace shrpx {
+
+struct DownstreamAddr;
+
+// Connections to the downstream server which are established before
+// the requests arrive, so that the first request on a new downstream
+// connection does not wait for TCP handshake. The pool is refilled
+// when a connection is taken. Each worker thread has its own pool and
+// it is only accessed from that thread.
+class DownstreamWarmPool {
+public:
+  // |addr| is owned by the caller. It may be updated, in which case
+  // reset() must be called.
+  DownstreamWarmPool(event_base *evbase, const DownstreamAddr *addr,
+                     size_t size);
+  ~DownstreamWarmPool();
+  // Returns the established connection without callbacks, or 0 if
+  // none is available. The caller owns the returned bufferevent.
+  bufferevent* get();
+  // Closes all connections and makes new ones to the current
+  // address.
+  void reset();
+  // Closes all connections and stops making new ones.
+  void shutdown();
+  // Makes new connections up to the pool size.
+  void fill();
+  void on_event(bufferevent *bev, short events);
+private:
+  // Starts a new connection. Returns 0 if it succeeds, or -1, in
+  // which case the pool is refilled later.
+  int connect_one();
+  void schedule_retry();
+  void remove(bufferevent *bev);
+  void clear();
+
+  event_base *evbase_;
+  const DownstreamAddr *addr_;
+  size_t size_;
+  std::set<bufferevent*> connecting_;
+  std::set<bufferevent*> connected_;
+  // Refills the pool after a while when a connection fails, so that
+  // an unreachable server is not retried in a tight loop.
+  event *retry_ev_;
+  bool shutdown_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_DOWNSTREAM_WARM_POOL_H
@@ -24,7 +24,9 @@
  */
 #include "shrpx_http.h"
 
+#include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #include "shrpx_config.h"
 #include "util.h"
@@ -34,6 +36,86 @@ using namespace spdylay;
 
 namespace shrpx {
 
+size_t Headers::size() const
+{
+  return fields_.size();
+}
+
+bool Headers::empty() const
+{
+  return fields_.empty();
+}
+
+const char* Headers::name(size_t i) const
+{
+  return buf_.c_str() + fields_[i].name;
+}
+
+size_t Headers::namelen(size_t i) const
+{
+  return fields_[i].namelen;
+}
+
+const char* Headers::value(size_t i) const
+{
+  return buf_.c_str() + fields_[i].value;
+}
+
+size_t Headers::valuelen(size_t i) const
+{
+  return fields_[i].valuelen;
+}
+
+const char* Headers::find(const char *name) const
+{
+  for(size_t i = 0; i < fields_.size(); ++i) {
+    if(util::strieq(buf_.c_str() + fields_[i].name, name)) {
+      return buf_.c_str() + fields_[i].value;
+    }
+  }
+  return 0;
+}
+
+void Headers::add(const char *name, size_t namelen,
+                  const char *value, size_t valuelen)
+{
+  Field f;
+  f.name = buf_.size();
+  f.namelen = namelen;
+  buf_.append(name, namelen);
+  buf_ += '\0';
+  f.value = buf_.size();
+  f.valuelen = valuelen;
+  buf_.append(value, valuelen);
+  buf_ += '\0';
+  fields_.push_back(f);
+}
+
+void Headers::set_last_value(const char *value, size_t valuelen)
+{
+  Field& f = fields_.back();
+  if(f.value + f.valuelen + 1 == buf_.size()) {
+    // The value is at the end of the buffer. Overwrite it.
+    buf_.resize(f.value);
+  } else {
+    f.value = buf_.size();
+  }
+  f.valuelen = valuelen;
+  buf_.append(value, valuelen);
+  buf_ += '\0';
+}
+
+void Headers::clear()
+{
+  buf_.clear();
+  fields_.clear();
+}
+
+size_t Headers::capacity() const
+{
+  return buf_.capacity() + fields_.capacity()*sizeof(Field);
+}
+
 namespace http {
 
 const char* get_status_string(int status_code)
@@ -129,6 +211,332 @@ std::string modify_location_header_value(const std::string& uri)
   return uri;
 }
 
+namespace {
+// Returns true if |s| of length |len| equals to |lower|, which must be
+// in lower case, ignoring case.
+bool lower_eq(const char *lower, const char *s, size_t len)
+{
+  for(size_t i = 0; i < len; ++i) {
+    char c = s[i];
+    if('A' <= c && c <= 'Z') {
+      c += 'a'-'A';
+    }
+    if(c != lower[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+int lookup_token(const char *name, size_t len)
+{
+  // Dispatch on the length first, and then on the last character, so
+  // that at most one comparison is done for each name.
+  switch(len) {
+  case 3:
+    switch(name[2]) {
+    case 'a':
+    case 'A':
+      if(lower_eq("via", name, 2)) {
+        return HD_VIA;
+      }
+      break;
+    case 'e':
+    case 'E':
+      if(lower_eq("age", name, 2)) {
+        return HD_AGE;
+      }
+      break;
+    }
+    break;
+  case 4:
+    if(lower_eq("host", name, 4)) {
+      return HD_HOST;
+    }
+    break;
+  case 6:
+    if(lower_eq("expect", name, 6)) {
+      return HD_EXPECT;
+    }
+    break;
+  case 8:
+    if(lower_eq("location", name, 8)) {
+      return HD_LOCATION;
+    }
+    break;
+  case 10:
+    switch(name[9]) {
+    case 'e':
+    case 'E':
+      if(lower_eq("keep-alive", name, 9)) {
+        return HD_KEEP_ALIVE;
+      }
+      break;
+    case 'n':
+    case 'N':
+      if(lower_eq("connection", name, 9)) {
+        return HD_CONNECTION;
+      }
+      break;
+    }
+    break;
+  case 13:
+    if(lower_eq("cache-control", name, 13)) {
+      return HD_CACHE_CONTROL;
+    }
+    break;
+  case 14:
+    if(lower_eq("content-length", name, 14)) {
+      return HD_CONTENT_LENGTH;
+    }
+    break;
+  case 15:
+    if(lower_eq("x-forwarded-for", name, 15)) {
+      return HD_X_FORWARDED_FOR;
+    }
+    break;
+  case 16:
+    if(lower_eq("proxy-connection", name, 16)) {
+      return HD_PROXY_CONNECTION;
+    }
+    break;
+  case 17:
+    switch(name[16]) {
+    case 'g':
+    case 'G':
+      if(lower_eq("transfer-encoding", name, 16)) {
+        return HD_TRANSFER_ENCODING;
+      }
+      break;
+    case 'o':
+    case 'O':
+      if(lower_eq("x-forwarded-proto", name, 16)) {
+        return HD_X_FORWARDED_PROTO;
+      }
+      break;
+    }
+    break;
+  }
+  return HD_UNKNOWN;
+}
+
+int lookup_token(const std::string& name)
+{
+  return lookup_token(name.c_str(), name.size());
+}
+
+namespace {
+// The number of bytes reserved in evbuffer at once. Large enough for
+// the header block of most requests.
+const size_t WRITER_RESERVE_SIZE = 4096;
+} // namespace
+
+namespace {
+// Writes bytes into the space reserved in evbuffer, reserving more
+// when it is used up. Call commit() to make the written bytes
+// available in the evbuffer.
+class EvbufferWriter {
+public:
+  EvbufferWriter(evbuffer *buf, std::string *copy)
+    : buf_(buf),
+      copy_(copy),
+      pos_(0),
+      end_(0)
+  {
+    vec_.iov_base = 0;
+    vec_.iov_len = 0;
+  }
+  void write(const char *data, size_t len)
+  {
+    while(len > 0) {
+      if(pos_ == end_) {
+        commit();
+        if(!reserve(len)) {
+          // Out of memory. Fall back to evbuffer_add(), which will
+          // most likely fail as well.
+          evbuffer_add(buf_, data, len);
+          return;
+        }
+      }
+      size_t n = std::min(len, static_cast<size_t>(end_-pos_));
+      memcpy(pos_, data, n);
+      pos_ += n;
+      data += n;
+      len -= n;
+    }
+  }
+  void write(const std::string& s)
+  {
+    write(s.data(), s.size());
+  }
+  void write(const char *s)
+  {
+    write(s, strlen(s));
+  }
+  void commit()
+  {
+    if(!vec_.iov_base) {
+      return;
+    }
+    char *base = reinterpret_cast<char*>(vec_.iov_base);
+    vec_.iov_len = pos_-base;
+    if(copy_) {
+      copy_->append(base, vec_.iov_len);
+    }
+    evbuffer_commit_space(buf_, &vec_, 1);
+    vec_.iov_base = 0;
+    pos_ = end_ = 0;
+  }
+private:
+  bool reserve(size_t len)
+  {
+    if(evbuffer_reserve_space(buf_, std::max(len, WRITER_RESERVE_SIZE),
+                              &vec_, 1) != 1) {
+      vec_.iov_base = 0;
+      return false;
+    }
+    pos_ = reinterpret_cast<char*>(vec_.iov_base);
+    end_ = pos_+vec_.iov_len;
+    return true;
+  }
+  evbuffer *buf_;
+  std::string *copy_;
+  evbuffer_iovec vec_;
+  char *pos_;
+  char *end_;
+};
+} // namespace
+
+void write_request_headers(evbuffer *output,
+                           const std::string& method,
+                           const std::string& path,
+                           int major, int minor,
+                           const Headers& headers,
+                           bool connection_close,
+                           const std::string& client_addr,
+                           std::string *copy)
+{
+  EvbufferWriter w(output, copy);
+  w.write(method);
+  w.write(" ", 1);
+  w.write(path);
+  w.write(" HTTP/1.1\r\nHost: ");
+  w.write(get_config()->downstream_hostport);
+  w.write("\r\n", 2);
+  bool xff_found = false;
+  const char *via_value = 0;
+  size_t via_valuelen = 0;
+  for(size_t i = 0; i < headers.size(); ++i) {
+    const char *name = headers.name(i);
+    size_t namelen = headers.namelen(i);
+    switch(lookup_token(name, namelen)) {
+    case HD_X_FORWARDED_PROTO:
+    case HD_HOST:
+    case HD_KEEP_ALIVE:
+    case HD_CONNECTION:
+    case HD_PROXY_CONNECTION:
+      continue;
+    case HD_VIA:
+      via_value = headers.value(i);
+      via_valuelen = headers.valuelen(i);
+      continue;
+    case HD_EXPECT:
+      if(util::strifind(headers.value(i), "100-continue")) {
+        continue;
+      }
+      break;
+    case HD_X_FORWARDED_FOR:
+      if(!xff_found) {
+        xff_found = true;
+        w.write(name, namelen);
+        w.write(": ", 2);
+        w.write(headers.value(i), headers.valuelen(i));
+        w.write(", ", 2);
+        w.write(client_addr);
+        w.write("\r\n", 2);
+        continue;
+      }
+      break;
+    }
+    w.write(name, namelen);
+    w.write(": ", 2);
+    w.write(headers.value(i), headers.valuelen(i));
+    w.write("\r\n", 2);
+  }
+  if(connection_close) {
+    w.write("Connection: close\r\n");
+  }
+  if(!xff_found) {
+    w.write("X-Forwarded-For: ");
+    w.write(client_addr);
+    w.write("\r\n", 2);
+  }
+  w.write("X-Forwarded-Proto: https\r\nVia: ");
+  if(via_valuelen > 0) {
+    w.write(via_value, via_valuelen);
+    w.write(", ", 2);
+  }
+  char via[] = "1.1 shrpx\r\n\r\n";
+  via[0] = major+'0';
+  via[2] = minor+'0';
+  w.write(via, sizeof(via)-1);
+  w.commit();
+}
+
+void write_response_headers(evbuffer *output,
+                            unsigned int status_code,
+                            int major, int minor,
+                            const Headers& headers,
+                            const char *connection,
+                            std::string *copy)
+{
+  EvbufferWriter w(output, copy);
+  w.write("HTTP/1.1 ");
+  w.write(get_status_string(status_code));
+  w.write("\r\n", 2);
+  const char *via_value = 0;
+  size_t via_valuelen = 0;
+  for(size_t i = 0; i < headers.size(); ++i) {
+    const char *name = headers.name(i);
+    size_t namelen = headers.namelen(i);
+    switch(lookup_token(name, namelen)) {
+    case HD_KEEP_ALIVE:
+    case HD_CONNECTION:
+    case HD_PROXY_CONNECTION:
+      continue;
+    case HD_VIA:
+      via_value = headers.value(i);
+      via_valuelen = headers.valuelen(i);
+      continue;
+    case HD_LOCATION:
+      w.write("Location: ");
+      w.write(modify_location_header_value(headers.value(i)));
+      w.write("\r\n", 2);
+      continue;
+    }
+    w.write(name, namelen);
+    w.write(": ", 2);
+    w.write(headers.value(i), headers.valuelen(i));
+    w.write("\r\n", 2);
+  }
+  if(connection) {
+    w.write("Connection: ");
+    w.write(connection);
+    w.write("\r\n", 2);
+  }
+  w.write("Via: ");
+  if(via_valuelen > 0) {
+    w.write(via_value, via_valuelen);
+    w.write(", ", 2);
+  }
+  char via[] = "1.1 shrpx\r\n\r\n";
+  via[0] = major+'0';
+  via[2] = minor+'0';
+  w.write(via, sizeof(via)-1);
+  w.commit();
+}
+
 } // namespace http
 
 } // namespace shrpx
@@ -26,11 +26,74 @@
 #define SHRPX_HTTP_H
 
 #include <string>
+#include <vector>
+
+#include <event2/buffer.h>
 
 namespace shrpx {
 
+// Header fields of a request or response. Names and values are
+// stored back to back in a single buffer, each terminated by NUL, and
+// a field refers to them by offset and length. clear() keeps the
+// allocated storage, so that the recycled Downstream receives the
+// next request without allocating memory for the header fields.
+class Headers {
+public:
+  size_t size() const;
+  bool empty() const;
+  // Returns the NULL-terminated name of the |i|-th field.
+  const char* name(size_t i) const;
+  size_t namelen(size_t i) const;
+  // Returns the NULL-terminated value of the |i|-th field.
+  const char* value(size_t i) const;
+  size_t valuelen(size_t i) const;
+  // Returns the value of the first field whose name is |name|,
+  // compared case-insensitively, or 0 if there is no such field.
+  const char* find(const char *name) const;
+  void add(const char *name, size_t namelen,
+           const char *value, size_t valuelen);
+  // Replaces the value of the last field with |value|.
+  void set_last_value(const char *value, size_t valuelen);
+  void clear();
+  // Returns the number of bytes allocated for the storage.
+  size_t capacity() const;
+private:
+  struct Field {
+    size_t name;
+    size_t namelen;
+    size_t value;
+    size_t valuelen;
+  };
+  std::string buf_;
+  std::vector<Field> fields_;
+};
+
 namespace http {
 
+// Header field names which shrpx handles specially.
+enum {
+  HD_UNKNOWN,
+  HD_AGE,
+  HD_CACHE_CONTROL,
+  HD_CONNECTION,
+  HD_CONTENT_LENGTH,
+  HD_EXPECT,
+  HD_HOST,
+  HD_KEEP_ALIVE,
+  HD_LOCATION,
+  HD_PROXY_CONNECTION,
+  HD_TRANSFER_ENCODING,
+  HD_VIA,
+  HD_X_FORWARDED_FOR,
+  HD_X_FORWARDED_PROTO
+};
+
+// Returns one of HD_* for the header field name |name| of length
+// |len|, compared case-insensitively. Returns HD_UNKNOWN if the name
+// is not the one of them.
+int lookup_token(const char *name, size_t len);
+int lookup_token(const std::string& name);
+
 const char* get_status_string(int status_code);
 
 std::string create_error_html(int status_code);
@@ -39,6 +102,36 @@ std::string create_via_header_value(int major, int minor);
 
 std::string modify_location_header_value(const std::string& uri);
 
+// Writes the HTTP/1.1 request header block sent to the downstream
+// server to |output|. Hop-by-hop header fields in |headers| are
+// removed and X-Forwarded-For, X-Forwarded-Proto and Via are
+// added. The bytes are written into the space reserved in |output|
+// directly. If |copy| is not NULL, the header block is also appended
+// to it.
+void write_request_headers(evbuffer *output,
+                           const std::string& method,
+                           const std::string& path,
+                           int major, int minor,
+                           const Headers& headers,
+                           bool connection_close,
+                           const std::string& client_addr,
+                           std::string *copy);
+
+// Writes the HTTP/1.1 response header block sent to the client to
+// |output|. |major| and |minor| are the version of the downstream
+// response, which is used in Via header field. Hop-by-hop header
+// fields in |headers| except for Transfer-Encoding are removed, and
+// Location is rewritten by modify_location_header_value(). If
+// |connection| is not NULL, Connection header field with that value
+// is added. If |copy| is not NULL, the header block is also appended
+// to it.
+void write_response_headers(evbuffer *output,
+                            unsigned int status_code,
+                            int major, int minor,
+                            const Headers& headers,
+                            const char *connection,
+                            std::string *copy);
+
 } // namespace http
 
 } // namespace shrpx
@@ -0,0 +1,368 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_http_cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "shrpx_http.h"
+#include "util.h"
+
+using namespace spdylay;
+
+namespace shrpx {
+
+HttpCacheEntry::HttpCacheEntry()
+  : status(0),
+    major(1),
+    minor(1),
+    response_time(0),
+    initial_age(0),
+    expires(0)
+{}
+
+size_t HttpCacheEntry::size() const
+{
+  return sizeof(HttpCacheEntry) + key.size() + body.size() +
+    headers.capacity() + vary.capacity();
+}
+
+HttpCache::HttpCache(size_t max_size, size_t max_entry_size)
+  : size_(0),
+    max_size_(max_size),
+    max_entry_size_(max_entry_size)
+{}
+
+HttpCache::~HttpCache()
+{
+  for(EntryList::iterator i = lru_.begin(); i != lru_.end(); ++i) {
+    delete *i;
+  }
+}
+
+namespace {
+struct CacheControl {
+  bool no_store;
+  bool no_cache;
+  bool priv;
+  // -1 if the directive is not present.
+  long int max_age;
+  long int s_maxage;
+  CacheControl()
+    : no_store(false),
+      no_cache(false),
+      priv(false),
+      max_age(-1),
+      s_maxage(-1)
+  {}
+};
+} // namespace
+
+namespace {
+long int parse_delta_seconds(const char *s)
+{
+  if(*s == '"') {
+    ++s;
+  }
+  if(!util::isDigit(*s)) {
+    return -1;
+  }
+  return strtol(s, 0, 10);
+}
+} // namespace
+
+namespace {
+void parse_cache_control(CacheControl *cc, const Headers& headers)
+{
+  for(size_t i = 0; i < headers.size(); ++i) {
+    if(http::lookup_token(headers.name(i), headers.namelen(i)) !=
+       http::HD_CACHE_CONTROL) {
+      continue;
+    }
+    std::vector<std::string> directives;
+    const char *value = headers.value(i);
+    util::split(value, value+headers.valuelen(i),
+                std::back_inserter(directives), ',', true);
+    for(std::vector<std::string>::const_iterator j = directives.begin();
+        j != directives.end(); ++j) {
+      const char *d = (*j).c_str();
+      if(util::strieq(d, "no-store")) {
+        cc->no_store = true;
+      } else if(util::istartsWith(d, "no-cache")) {
+        cc->no_cache = true;
+      } else if(util::istartsWith(d, "private")) {
+        cc->priv = true;
+      } else if(util::istartsWith(d, "max-age=")) {
+        cc->max_age = parse_delta_seconds(d+8);
+      } else if(util::istartsWith(d, "s-maxage=")) {
+        cc->s_maxage = parse_delta_seconds(d+9);
+      }
+    }
+  }
+}
+} // namespace
+
+namespace {
+// Returns true if a response for the request of |downstream| may be
+// stored in or served from the cache at all.
+bool request_cacheable(const Downstream *downstream)
+{
+  return downstream->get_request_method() == "GET" &&
+    !downstream->get_request_headers().find("authorization");
+}
+} // namespace
+
+namespace {
+const time_t HEURISTIC_LIFETIME_MAX = 24*3600;
+} // namespace
+
+namespace {
+// Returns true if the request of |downstream| may be served by the
+// response which is not fetched for it.
+bool request_shareable(const Downstream *downstream)
+{
+  if(!request_cacheable(downstream)) {
+    return false;
+  }
+  const Headers& request_headers = downstream->get_request_headers();
+  CacheControl cc;
+  parse_cache_control(&cc, request_headers);
+  return !cc.no_cache && !cc.no_store &&
+    !util::strifind(request_headers.find("pragma"), "no-cache");
+}
+} // namespace
+
+const HttpCacheEntry* HttpCache::lookup(const Downstream *downstream,
+                                        time_t now)
+{
+  if(!request_shareable(downstream)) {
+    return 0;
+  }
+  const Headers& request_headers = downstream->get_request_headers();
+  std::map<std::string, EntryList::iterator>::iterator i =
+    index_.find(downstream->get_request_path());
+  if(i == index_.end()) {
+    return 0;
+  }
+  HttpCacheEntry *ent = *(*i).second;
+  if(ent->expires <= now) {
+    if(ENABLE_LOG) {
+      LOG(INFO) << "Cache entry " << ent->key << " is stale";
+    }
+    remove((*i).second);
+    return 0;
+  }
+  for(size_t j = 0; j < ent->vary.size(); ++j) {
+    const char *value = request_headers.find(ent->vary.name(j));
+    if(strcmp(ent->vary.value(j), value ? value : "") != 0) {
+      return 0;
+    }
+  }
+  lru_.splice(lru_.begin(), lru_, (*i).second);
+  return ent;
+}
+
+HttpCacheEntry* HttpCache::create_entry(const Downstream *downstream,
+                                        time_t now)
+{
+  if(!request_cacheable(downstream)) {
+    return 0;
+  }
+  const Headers& request_headers = downstream->get_request_headers();
+  CacheControl request_cc;
+  parse_cache_control(&request_cc, request_headers);
+  if(request_cc.no_store) {
+    return 0;
+  }
+  switch(downstream->get_response_http_status()) {
+  case 200:
+  case 203:
+  case 300:
+  case 301:
+  case 410:
+    break;
+  default:
+    return 0;
+  }
+  const Headers& headers = downstream->get_response_headers();
+  if(headers.find("set-cookie")) {
+    return 0;
+  }
+  CacheControl cc;
+  parse_cache_control(&cc, headers);
+  if(cc.no_store || cc.no_cache || cc.priv) {
+    return 0;
+  }
+  const char *vary = headers.find("vary");
+  if(vary && strchr(vary, '*')) {
+    return 0;
+  }
+  const char *content_length = headers.find("content-length");
+  if(content_length &&
+     strtoul(content_length, 0, 10) > max_entry_size_) {
+    return 0;
+  }
+  const char *date_value = headers.find("date");
+  time_t date = date_value ? util::parse_http_date(date_value) : 0;
+  if(date == 0) {
+    date = now;
+  }
+  const char *age_value = headers.find("age");
+  time_t age = age_value ? parse_delta_seconds(age_value) : 0;
+  if(age < 0) {
+    age = 0;
+  }
+  time_t lifetime = -1;
+  const char *expires, *last_modified;
+  if(cc.s_maxage >= 0) {
+    lifetime = cc.s_maxage;
+  } else if(cc.max_age >= 0) {
+    lifetime = cc.max_age;
+  } else if((expires = headers.find("expires"))) {
+    time_t t = util::parse_http_date(expires);
+    if(t != 0) {
+      lifetime = t - date;
+    }
+  } else if((last_modified = headers.find("last-modified"))) {
+    // Heuristic freshness: 10% of the time since the last
+    // modification.
+    time_t t = util::parse_http_date(last_modified);
+    if(t != 0 && t < date) {
+      lifetime = std::min((date - t)/10, HEURISTIC_LIFETIME_MAX);
+    }
+  }
+  if(lifetime <= age) {
+    return 0;
+  }
+  HttpCacheEntry *ent = new HttpCacheEntry();
+  ent->key = downstream->get_request_path();
+  if(vary) {
+    std::vector<std::string> names;
+    util::split(vary, vary+strlen(vary), std::back_inserter(names), ',',
+                true);
+    for(std::vector<std::string>::const_iterator i = names.begin();
+        i != names.end(); ++i) {
+      const char *value = request_headers.find((*i).c_str());
+      ent->vary.add((*i).c_str(), (*i).size(),
+                    value ? value : "", value ? strlen(value) : 0);
+    }
+  }
+  ent->status = downstream->get_response_http_status();
+  ent->major = downstream->get_response_major();
+  ent->minor = downstream->get_response_minor();
+  for(size_t i = 0; i < headers.size(); ++i) {
+    switch(http::lookup_token(headers.name(i), headers.namelen(i))) {
+    case http::HD_TRANSFER_ENCODING:
+    case http::HD_CONTENT_LENGTH:
+    case http::HD_CONNECTION:
+    case http::HD_KEEP_ALIVE:
+    case http::HD_PROXY_CONNECTION:
+    case http::HD_AGE:
+      break;
+    default:
+      ent->headers.add(headers.name(i), headers.namelen(i),
+                       headers.value(i), headers.valuelen(i));
+    }
+  }
+  ent->response_time = now;
+  ent->initial_age = age;
+  ent->expires = now + lifetime - age;
+  return ent;
+}
+
+void HttpCache::store(HttpCacheEntry *ent)
+{
+  size_t entsize = ent->size();
+  if(entsize > max_size_) {
+    delete ent;
+    return;
+  }
+  std::map<std::string, EntryList::iterator>::iterator i =
+    index_.find(ent->key);
+  if(i != index_.end()) {
+    remove((*i).second);
+  }
+  while(size_ + entsize > max_size_ && !lru_.empty()) {
+    remove(--lru_.end());
+  }
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Storing " << ent->key << " in cache, "
+              << entsize << " bytes, expires in "
+              << ent->expires - ent->response_time << " seconds";
+  }
+  lru_.push_front(ent);
+  index_[ent->key] = lru_.begin();
+  size_ += entsize;
+}
+
+void HttpCache::remove(EntryList::iterator i)
+{
+  HttpCacheEntry *ent = *i;
+  size_ -= ent->size();
+  index_.erase(ent->key);
+  lru_.erase(i);
+  delete ent;
+}
+
+size_t HttpCache::get_max_entry_size() const
+{
+  return max_entry_size_;
+}
+
+Downstream* HttpCache::find_in_flight(const Downstream *downstream)
+{
+  if(!request_shareable(downstream)) {
+    return 0;
+  }
+  std::map<std::string, Downstream*>::iterator i =
+    in_flight_.find(downstream->get_request_path());
+  if(i == in_flight_.end()) {
+    return 0;
+  }
+  return (*i).second;
+}
+
+bool HttpCache::add_in_flight(Downstream *downstream)
+{
+  if(!request_shareable(downstream)) {
+    return false;
+  }
+  return in_flight_.insert
+    (std::make_pair(downstream->get_request_path(), downstream)).second;
+}
+
+void HttpCache::remove_in_flight(Downstream *downstream)
+{
+  std::map<std::string, Downstream*>::iterator i =
+    in_flight_.find(downstream->get_request_path());
+  if(i != in_flight_.end() && (*i).second == downstream) {
+    in_flight_.erase(i);
+  }
+}
+
+} // namespace shrpx
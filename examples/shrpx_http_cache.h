@@ -0,0 +1,104 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_HTTP_CACHE_H
+#define SHRPX_HTTP_CACHE_H
+
+#include "shrpx.h"
+
+#include <time.h>
+
+#include <string>
+#include <list>
+#include <map>
+
+#include "shrpx_downstream.h"
+
+namespace shrpx {
+
+struct HttpCacheEntry {
+  std::string key;
+  // Request header fields nominated by Vary response header field and
+  // their values in the request which created this entry.
+  Headers vary;
+  unsigned int status;
+  int major;
+  int minor;
+  // Response headers without hop-by-hop header fields and
+  // Content-Length.
+  Headers headers;
+  std::string body;
+  // The time when the response was received.
+  time_t response_time;
+  // The value of Age header field in the response.
+  time_t initial_age;
+  // The response is fresh until this time.
+  time_t expires;
+  HttpCacheEntry();
+  // Returns the number of bytes accounted for this entry.
+  size_t size() const;
+};
+
+// Response cache with LRU eviction. Each worker thread has its own
+// HttpCache and it is only accessed from that thread.
+class HttpCache {
+public:
+  HttpCache(size_t max_size, size_t max_entry_size);
+  ~HttpCache();
+  // Returns the fresh cached response for the request of
+  // |downstream|, or 0. A stale entry is removed.
+  const HttpCacheEntry* lookup(const Downstream *downstream, time_t now);
+  // Returns new HttpCacheEntry for the response of |downstream|
+  // without body if it can be stored, or 0.
+  HttpCacheEntry* create_entry(const Downstream *downstream, time_t now);
+  // Stores |ent| and takes its ownership. An entry with the same key
+  // is replaced.
+  void store(HttpCacheEntry *ent);
+  size_t get_max_entry_size() const;
+  // Returns the request for the same resource as |downstream| which
+  // is waiting for the response header from downstream server, or
+  // 0.
+  Downstream* find_in_flight(const Downstream *downstream);
+  // Registers |downstream| as the request waiting for the response
+  // for its resource. Returns true if it is registered, or false if
+  // the request is not eligible or the other request has been
+  // registered already.
+  bool add_in_flight(Downstream *downstream);
+  void remove_in_flight(Downstream *downstream);
+private:
+  typedef std::list<HttpCacheEntry*> EntryList;
+  void remove(EntryList::iterator i);
+
+  // Most recently used entry is at front.
+  EntryList lru_;
+  std::map<std::string, EntryList::iterator> index_;
+  std::map<std::string, Downstream*> in_flight_;
+  size_t size_;
+  size_t max_size_;
+  size_t max_entry_size_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_HTTP_CACHE_H
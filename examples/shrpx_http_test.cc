@@ -0,0 +1,146 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_http_test.h"
+
+#include <cstring>
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_http.h"
+
+namespace shrpx {
+
+void test_http_lookup_token(void)
+{
+  CU_ASSERT(http::HD_VIA == http::lookup_token("via", 3));
+  CU_ASSERT(http::HD_HOST == http::lookup_token("host", 4));
+  CU_ASSERT(http::HD_EXPECT == http::lookup_token("expect", 6));
+  CU_ASSERT(http::HD_LOCATION == http::lookup_token("location", 8));
+  CU_ASSERT(http::HD_KEEP_ALIVE == http::lookup_token("keep-alive", 10));
+  CU_ASSERT(http::HD_CONNECTION == http::lookup_token("connection", 10));
+  CU_ASSERT(http::HD_X_FORWARDED_FOR ==
+            http::lookup_token("x-forwarded-for", 15));
+  CU_ASSERT(http::HD_PROXY_CONNECTION ==
+            http::lookup_token("proxy-connection", 16));
+  CU_ASSERT(http::HD_TRANSFER_ENCODING ==
+            http::lookup_token("transfer-encoding", 17));
+  CU_ASSERT(http::HD_X_FORWARDED_PROTO ==
+            http::lookup_token("x-forwarded-proto", 17));
+  CU_ASSERT(http::HD_AGE == http::lookup_token("age", 3));
+  CU_ASSERT(http::HD_CACHE_CONTROL == http::lookup_token("cache-control", 13));
+  CU_ASSERT(http::HD_CONTENT_LENGTH ==
+            http::lookup_token("content-length", 14));
+  CU_ASSERT(http::HD_CONNECTION ==
+            http::lookup_token(std::string("connection")));
+
+  // Case-insensitive, including the last character used to dispatch.
+  CU_ASSERT(http::HD_VIA == http::lookup_token("VIA", 3));
+  CU_ASSERT(http::HD_AGE == http::lookup_token("AgE", 3));
+  CU_ASSERT(http::HD_CONNECTION == http::lookup_token("Connection", 10));
+  CU_ASSERT(http::HD_KEEP_ALIVE == http::lookup_token("Keep-AlivE", 10));
+  CU_ASSERT(http::HD_TRANSFER_ENCODING ==
+            http::lookup_token("TRANSFER-ENCODING", 17));
+  CU_ASSERT(http::HD_X_FORWARDED_PROTO ==
+            http::lookup_token("X-Forwarded-PROTO", 17));
+
+  // Unknown names, including the ones having the same length as a
+  // known name.
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("", 0));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("foo", 3));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("date", 4));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("content-type", 12));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("keep-alivx", 10));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("connectioe", 10));
+  CU_ASSERT(http::HD_UNKNOWN ==
+            http::lookup_token("transfer-encodinx", 17));
+  CU_ASSERT(http::HD_UNKNOWN ==
+            http::lookup_token(std::string("x-forwarded-prot")));
+
+  // Only |len| bytes are looked at, so names which differ only in
+  // length are different.
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("connection", 9));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("connections", 11));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("vias", 4));
+  CU_ASSERT(http::HD_UNKNOWN == http::lookup_token("x-forwarded-fo", 14));
+  CU_ASSERT(http::HD_VIA == http::lookup_token("vias", 3));
+  CU_ASSERT(http::HD_HOST == http::lookup_token("hostname", 4));
+}
+
+void test_http_headers(void)
+{
+  Headers headers;
+  CU_ASSERT(headers.empty());
+  CU_ASSERT(0 == headers.size());
+  CU_ASSERT(0 == headers.find("host"));
+
+  // The name and value given are not NULL-terminated.
+  const char line[] = "Host: example.orgAccept: */*";
+  headers.add(line, 4, line+6, 11);
+  headers.add(line+17, 6, line+25, 3);
+  headers.add("X-Empty", 7, "", 0);
+  CU_ASSERT(!headers.empty());
+  CU_ASSERT(3 == headers.size());
+  CU_ASSERT(strcmp("Host", headers.name(0)) == 0);
+  CU_ASSERT(4 == headers.namelen(0));
+  CU_ASSERT(strcmp("example.org", headers.value(0)) == 0);
+  CU_ASSERT(11 == headers.valuelen(0));
+  CU_ASSERT(strcmp("Accept", headers.name(1)) == 0);
+  CU_ASSERT(strcmp("*/*", headers.value(1)) == 0);
+  CU_ASSERT(strcmp("", headers.value(2)) == 0);
+  CU_ASSERT(0 == headers.valuelen(2));
+
+  // find() ignores case and returns the first one.
+  headers.add("host", 4, "example.com", 11);
+  CU_ASSERT(strcmp("example.org", headers.find("HOST")) == 0);
+  CU_ASSERT(strcmp("", headers.find("x-empty")) == 0);
+  CU_ASSERT(0 == headers.find("Hos"));
+  CU_ASSERT(0 == headers.find("Hosts"));
+
+  // set_last_value() only changes the last field.
+  headers.set_last_value("a.example.com", 13);
+  CU_ASSERT(strcmp("a.example.com", headers.value(3)) == 0);
+  CU_ASSERT(13 == headers.valuelen(3));
+  headers.set_last_value("b", 1);
+  CU_ASSERT(strcmp("b", headers.value(3)) == 0);
+  CU_ASSERT(1 == headers.valuelen(3));
+  CU_ASSERT(strcmp("host", headers.name(3)) == 0);
+  CU_ASSERT(strcmp("example.org", headers.value(0)) == 0);
+  CU_ASSERT(strcmp("*/*", headers.value(1)) == 0);
+
+  // clear() keeps the storage for the next use.
+  size_t capacity = headers.capacity();
+  CU_ASSERT(capacity > 0);
+  headers.clear();
+  CU_ASSERT(headers.empty());
+  CU_ASSERT(0 == headers.find("host"));
+  CU_ASSERT(capacity == headers.capacity());
+  headers.add("Accept", 6, "*/*", 3);
+  CU_ASSERT(1 == headers.size());
+  CU_ASSERT(strcmp("*/*", headers.find("accept")) == 0);
+  CU_ASSERT(capacity == headers.capacity());
+}
+
+} // namespace shrpx
@@ -26,6 +26,7 @@
 
 #include <cassert>
 #include <set>
+#include <algorithm>
 
 #include "shrpx_client_handler.h"
 #include "shrpx_downstream.h"
@@ -48,6 +49,7 @@ HttpsUpstream::HttpsUpstream(ClientHandler *handler)
   : handler_(handler),
     htp_(htparser_new()),
     current_header_length_(0),
+    parse_base_(0),
     ioctrl_(handler->get_bev())
 {
   htparser_init(htp_, htp_type_request);
@@ -68,6 +70,11 @@ void HttpsUpstream::reset_current_header_length()
   current_header_length_ = 0;
 }
 
+void HttpsUpstream::add_body_span(const char *data, size_t len)
+{
+  body_spans_.push_back(std::make_pair(data-parse_base_, len));
+}
+
 namespace {
 int htp_msg_begin(htparser *htp)
 {
@@ -77,7 +84,8 @@ int htp_msg_begin(htparser *htp)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   upstream->reset_current_header_length();
-  Downstream *downstream = new Downstream(upstream, 0, 0);
+  Downstream *downstream = upstream->get_client_handler()->
+    get_downstream_pool()->get(upstream, 0, 0);
   upstream->add_downstream(downstream);
   return 0;
 }
@@ -89,7 +97,7 @@ int htp_methodcb(htparser *htp, const char *data, size_t len)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   Downstream *downstream = upstream->get_last_downstream();
-  downstream->set_request_method(std::string(data, len));
+  downstream->set_request_method(data, len);
   return 0;
 }
 } // namespace
@@ -100,7 +108,7 @@ int htp_uricb(htparser *htp, const char *data, size_t len)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   Downstream *downstream = upstream->get_last_downstream();
-  downstream->set_request_path(std::string(data, len));
+  downstream->set_request_path(data, len);
   return 0;
 }
 } // namespace
@@ -129,7 +137,7 @@ int htp_hdr_keycb(htparser *htp, const char *data, size_t len)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   Downstream *downstream = upstream->get_last_downstream();
-  downstream->add_request_header(std::string(data, len), "");
+  downstream->add_request_header(data, len, "", 0);
   return 0;
 }
 } // namespace
@@ -140,7 +148,7 @@ int htp_hdr_valcb(htparser *htp, const char *data, size_t len)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   Downstream *downstream = upstream->get_last_downstream();
-  downstream->set_last_request_header_value(std::string(data, len));
+  downstream->set_last_request_header_value(data, len);
   return 0;
 }
 } // namespace
@@ -158,6 +166,17 @@ int htp_hdrs_completecb(htparser *htp)
   downstream->set_request_major(htparser_get_major(htp));
   downstream->set_request_minor(htparser_get_minor(htp));
 
+  if(downstream->response_from_cache()) {
+    downstream->set_request_state(Downstream::HEADER_COMPLETE);
+    return 0;
+  }
+
+  if(!upstream->get_client_handler()->admit_request()) {
+    // 503 is sent before the downstream connection is made.
+    downstream->set_request_state(Downstream::CONNECT_FAIL);
+    return 1;
+  }
+
   DownstreamConnection *dconn;
   dconn = upstream->get_client_handler()->get_downstream_connection();
 
@@ -175,6 +194,7 @@ int htp_hdrs_completecb(htparser *htp)
     return 1;
   } else {
     downstream->push_request_headers();
+    downstream->register_in_flight();
     downstream->set_request_state(Downstream::HEADER_COMPLETE);
     return 0;
   }
@@ -186,9 +206,7 @@ int htp_bodycb(htparser *htp, const char *data, size_t len)
 {
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
-  Downstream *downstream = upstream->get_last_downstream();
-  downstream->push_upload_data_chunk(reinterpret_cast<const uint8_t*>(data),
-                                     len);
+  upstream->add_body_span(data, len);
   return 0;
 }
 } // namespace
@@ -202,7 +220,8 @@ int htp_msg_completecb(htparser *htp)
   HttpsUpstream *upstream;
   upstream = reinterpret_cast<HttpsUpstream*>(htparser_get_userdata(htp));
   Downstream *downstream = upstream->get_last_downstream();
-  downstream->end_upload_data();
+  // end_upload_data() is called in on_read() after the request body
+  // in the input buffer is moved.
   downstream->set_request_state(Downstream::MSG_COMPLETE);
   // Stop further processing to complete this request
   return 1;
@@ -231,21 +250,51 @@ htparse_hooks htp_hooks = {
 };
 } // namespace
 
+void HttpsUpstream::consume_input(evbuffer *input, size_t nread)
+{
+  size_t off = 0;
+  if(!body_spans_.empty()) {
+    Downstream *downstream = get_last_downstream();
+    for(size_t i = 0; i < body_spans_.size(); ++i) {
+      evbuffer_drain(input, body_spans_[i].first-off);
+      downstream->push_upload_data_chunk(input, body_spans_[i].second);
+      off = body_spans_[i].first+body_spans_[i].second;
+    }
+    body_spans_.clear();
+  }
+  evbuffer_drain(input, nread-off);
+}
+
 // on_read() does not consume all available data in input buffer if
 // one http request is fully received.
 int HttpsUpstream::on_read()
 {
   bufferevent *bev = handler_->get_bev();
   evbuffer *input = bufferevent_get_input(bev);
-  unsigned char *mem = evbuffer_pullup(input, -1);
-  int nread = htparser_run(htp_, &htp_hooks,
-                           reinterpret_cast<const char*>(mem),
-                           evbuffer_get_length(input));
-  evbuffer_drain(input, nread);
-  // Well, actually header length + some body bytes
-  current_header_length_ += nread;
-  htpparse_error htperr = htparser_get_error(htp_);
-  Downstream *downstream = get_top_downstream();
+  size_t read_chunk = get_config()->upstream_read_chunk_size;
+  htpparse_error htperr = htparse_error_none;
+  Downstream *downstream = 0;
+  // Feed the parser with the head chain of the input buffer in place,
+  // at most read_chunk bytes at a time, so that we can stop as soon as
+  // the downstream output buffer gets full. The request body is not
+  // copied: the parser only tells where it is, and consume_input()
+  // moves it to the downstream output buffer.
+  while(evbuffer_get_length(input) > 0) {
+    evbuffer_iovec vec;
+    evbuffer_peek(input, -1, 0, &vec, 1);
+    size_t len = std::min(vec.iov_len, read_chunk);
+    parse_base_ = reinterpret_cast<const char*>(vec.iov_base);
+    size_t nread = htparser_run(htp_, &htp_hooks, parse_base_, len);
+    consume_input(input, nread);
+    // Well, actually header length + some body bytes
+    current_header_length_ += nread;
+    htperr = htparser_get_error(htp_);
+    downstream = get_top_downstream();
+    if(htperr != htparse_error_none || nread < len ||
+       (downstream && downstream->get_output_buffer_full())) {
+      break;
+    }
+  }
   if(htperr == htparse_error_user) {
     if(downstream->get_request_state() == Downstream::CONNECT_FAIL) {
       get_client_handler()->set_should_close_after_write(true);
@@ -253,11 +302,18 @@ int HttpsUpstream::on_read()
       // Downstream gets deleted after response body is read.
     } else {
       assert(downstream->get_request_state() == Downstream::MSG_COMPLETE);
+      downstream->end_upload_data();
       if(downstream->get_downstream_connection() == 0) {
         // Error response already be sent
         assert(downstream->get_response_state() == Downstream::MSG_COMPLETE);
         pop_downstream();
-        delete downstream;
+        get_client_handler()->get_downstream_pool()->put(downstream);
+        // Process next HTTP request already in the input buffer,
+        // because readcb is not called until new data arrive.
+        if(evbuffer_get_length(input) > 0 &&
+           !handler_->get_should_close_after_write()) {
+          return on_read();
+        }
       } else {
         pause_read(SHRPX_MSG_BLOCK);
       }
@@ -347,7 +403,7 @@ void https_downstream_readcb(bufferevent *bev, void *ptr)
       }
       if(downstream->get_request_state() == Downstream::MSG_COMPLETE) {
         upstream->pop_downstream();
-        delete downstream;
+        upstream->get_client_handler()->get_downstream_pool()->put(downstream);
         // Process next HTTP request
         upstream->resume_read(SHRPX_MSG_BLOCK);
       }
@@ -370,7 +426,7 @@ void https_downstream_readcb(bufferevent *bev, void *ptr)
       upstream->error_reply(502);
       if(downstream->get_request_state() == Downstream::MSG_COMPLETE) {
         upstream->pop_downstream();
-        delete downstream;
+        upstream->get_client_handler()->get_downstream_pool()->put(downstream);
         // Process next HTTP request
         upstream->resume_read(SHRPX_MSG_BLOCK);
       }
@@ -402,6 +458,7 @@ void https_downstream_eventcb(bufferevent *bev, short events, void *ptr)
       LOG(INFO) << "Downstream connection established. downstream "
                 << downstream;
     }
+    dconn->on_connected();
   } else if(events & BEV_EVENT_EOF) {
     if(ENABLE_LOG) {
       LOG(INFO) << "Downstream EOF. stream_id="
@@ -425,7 +482,7 @@ void https_downstream_eventcb(bufferevent *bev, short events, void *ptr)
     }
     if(downstream->get_request_state() == Downstream::MSG_COMPLETE) {
       upstream->pop_downstream();
-      delete downstream;
+      upstream->get_client_handler()->get_downstream_pool()->put(downstream);
       upstream->resume_read(SHRPX_MSG_BLOCK);
     }
   } else if(events & (BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
@@ -443,7 +500,7 @@ void https_downstream_eventcb(bufferevent *bev, short events, void *ptr)
     }
     if(downstream->get_request_state() == Downstream::MSG_COMPLETE) {
       upstream->pop_downstream();
-      delete downstream;
+      upstream->get_client_handler()->get_downstream_pool()->put(downstream);
       upstream->resume_read(SHRPX_MSG_BLOCK);
     }
   }
@@ -468,6 +525,8 @@ void HttpsUpstream::error_reply(int status_code)
   evbuffer_add(output, html.c_str(), html.size());
   Downstream *downstream = get_top_downstream();
   if(downstream) {
+    downstream->set_response_http_status(status_code);
+    downstream->add_response_bodylen(html.size());
     downstream->set_response_state(Downstream::MSG_COMPLETE);
   }
 }
@@ -520,53 +579,26 @@ int HttpsUpstream::on_downstream_header_complete(Downstream *downstream)
   if(ENABLE_LOG) {
     LOG(INFO) << "Downstream on_downstream_header_complete";
   }
-  std::string via_value;
-  std::string location;
-  std::string hdrs = "HTTP/1.1 ";
-  hdrs += http::get_status_string(downstream->get_response_http_status());
-  hdrs += "\r\n";
-  for(Headers::const_iterator i = downstream->get_response_headers().begin();
-      i != downstream->get_response_headers().end(); ++i) {
-    if(util::strieq((*i).first.c_str(), "keep-alive") || // HTTP/1.0?
-       util::strieq((*i).first.c_str(), "connection") ||
-       util:: strieq((*i).first.c_str(), "proxy-connection")) {
-      // These are ignored
-    } else if(util::strieq((*i).first.c_str(), "via")) {
-      via_value = (*i).second;
-    } else if(util::strieq((*i).first.c_str(), "location")) {
-      location = (*i).second;
-    } else {
-      hdrs += (*i).first;
-      hdrs += ": ";
-      hdrs += (*i).second;
-      hdrs += "\r\n";
-    }
-  }
-  if(!location.empty()) {
-    hdrs += "Location: ";
-    hdrs += http::modify_location_header_value(location);
-    hdrs += "\r\n";
-  }
-  if(get_client_handler()->get_should_close_after_write()) {
-    hdrs += "Connection: close\r\n";
+  const char *connection = 0;
+  if(get_client_handler()->get_should_close_after_write() ||
+     downstream->get_request_connection_close()) {
+    connection = "close";
   } else if(downstream->get_request_major() == 1 &&
             downstream->get_request_minor() == 0) {
-    hdrs += "Connection: Keep-Alive\r\n";
-  }
-  hdrs += "Via: ";
-  hdrs += via_value;
-  if(!via_value.empty()) {
-    hdrs += ", ";
+    connection = "Keep-Alive";
   }
-  hdrs += http::create_via_header_value
-    (downstream->get_response_major(), downstream->get_response_minor());
-  hdrs += "\r\n";
-  hdrs += "\r\n";
+  evbuffer *output = bufferevent_get_output(handler_->get_bev());
+  std::string hdrs;
+  http::write_response_headers(output,
+                               downstream->get_response_http_status(),
+                               downstream->get_response_major(),
+                               downstream->get_response_minor(),
+                               downstream->get_response_headers(),
+                               connection,
+                               ENABLE_LOG ? &hdrs : 0);
   if(ENABLE_LOG) {
     LOG(INFO) << "Upstream https response headers\n" << hdrs;
   }
-  evbuffer *output = bufferevent_get_output(handler_->get_bev());
-  evbuffer_add(output, hdrs.c_str(), hdrs.size());
   return 0;
 }
 
@@ -581,10 +613,13 @@ int HttpsUpstream::on_downstream_body(Downstream *downstream,
                   static_cast<unsigned int>(len));
     evbuffer_add(output, chunk_size_hex, rv);
   }
-  evbuffer_add(output, data, len);
+  if(downstream->move_response_body(output, data, len) != 0) {
+    evbuffer_add(output, data, len);
+  }
   if(downstream->get_chunked_response()) {
     evbuffer_add(output, "\r\n", 2);
   }
+  downstream->add_response_bodylen(len);
   return 0;
 }
 
@@ -604,4 +639,24 @@ int HttpsUpstream::on_downstream_body_complete(Downstream *downstream)
   return 0;
 }
 
+int HttpsUpstream::on_downstream_abort(Downstream *downstream)
+{
+  // HttpsUpstream never makes a request follow the other one.
+  assert(0);
+  return 0;
+}
+
+int HttpsUpstream::start_graceful_shutdown()
+{
+  Downstream *downstream = get_top_downstream();
+  if(!downstream) {
+    // Idle keep-alive connection.
+    return -1;
+  }
+  // Close the connection after the response of the current request.
+  // The requests pipelined after it are not processed.
+  downstream->set_request_connection_close(true);
+  return 0;
+}
+
 } // namespace shrpx
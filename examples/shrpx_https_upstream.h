@@ -30,6 +30,7 @@
 #include <stdint.h>
 
 #include <deque>
+#include <vector>
 
 extern "C" {
 #include "htparse/htparse.h"
@@ -67,12 +68,29 @@ public:
   virtual int on_downstream_body(Downstream *downstream,
                                  const uint8_t *data, size_t len);
   virtual int on_downstream_body_complete(Downstream *downstream);
+  virtual int on_downstream_abort(Downstream *downstream);
+  virtual int start_graceful_shutdown();
 
   void reset_current_header_length();
+  // Records the request body bytes |data| of length |len| in the
+  // chunk being parsed. They are moved to the downstream connection
+  // after the parser returns.
+  void add_body_span(const char *data, size_t len);
 private:
+  // Removes |nread| bytes parsed from the head of |input|. The
+  // request body bytes in them are moved to the downstream
+  // connection.
+  void consume_input(evbuffer *input, size_t nread);
+
   ClientHandler *handler_;
   htparser *htp_;
   size_t current_header_length_;
+  // The beginning of the chunk being parsed. It is at the head of
+  // input buffer.
+  const char *parse_base_;
+  // The offset from parse_base_ and the length of each request body
+  // span in the chunk being parsed.
+  std::vector<std::pair<size_t, size_t> > body_spans_;
   std::deque<Downstream*> downstream_queue_;
   IOControl ioctrl_;
 };
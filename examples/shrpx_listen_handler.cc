@@ -28,6 +28,7 @@
 #include <pthread.h>
 
 #include <cerrno>
+#include <algorithm>
 
 #include <event2/bufferevent_ssl.h>
 
@@ -35,19 +36,61 @@
 #include "shrpx_thread_event_receiver.h"
 #include "shrpx_ssl.h"
 #include "shrpx_worker.h"
+#include "shrpx_config.h"
+#include "shrpx_http_cache.h"
+#include "shrpx_downstream.h"
+#include "shrpx_stat.h"
+#include "shrpx_downstream_warm_pool.h"
+#include "shrpx_admission_control.h"
 
 namespace shrpx {
 
-ListenHandler::ListenHandler(event_base *evbase)
+namespace {
+void drained_cb(void *arg)
+{
+  ListenHandler *handler = reinterpret_cast<ListenHandler*>(arg);
+  handler->on_drained();
+}
+} // namespace
+
+namespace {
+void worker_readcb(bufferevent *bev, void *arg)
+{
+  ListenHandler *handler = reinterpret_cast<ListenHandler*>(arg);
+  evbuffer *input = bufferevent_get_input(bev);
+  // Each byte tells that the worker has closed all connections.
+  while(evbuffer_get_length(input) > 0) {
+    evbuffer_drain(input, 1);
+    handler->on_drained();
+  }
+}
+} // namespace
+
+ListenHandler::ListenHandler(event_base *evbase, SSL_CTX *ssl_ctx)
   : evbase_(evbase),
-    ssl_ctx_(ssl::create_ssl_context()),
+    ssl_ctx_(ssl_ctx),
+    downstream_addr_(get_config()->downstream_addr),
+    handler_set_(drained_cb, this),
+    http_cache_(0),
+    downstream_pool_(0),
+    warm_pool_(0),
+    admission_control_(0),
+    stat_(new WorkerStat()),
     worker_round_robin_cnt_(0),
     workers_(0),
-    num_worker_(0)
+    num_worker_(0),
+    num_drained_(0)
 {}
 
 ListenHandler::~ListenHandler()
-{}
+{
+  delete warm_pool_;
+  delete admission_control_;
+  delete downstream_pool_;
+  delete http_cache_;
+  delete stat_;
+  SSL_CTX_free(ssl_ctx_);
+}
 
 void ListenHandler::create_worker_thread(size_t num)
 {
@@ -60,21 +103,31 @@ void ListenHandler::create_worker_thread(size_t num)
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     WorkerInfo *info = &workers_[num_worker_];
+    ssl::ref_ssl_context(ssl_ctx_);
+    info->ssl_ctx = ssl_ctx_;
+    info->downstream_addr = downstream_addr_;
+    info->stat = new WorkerStatSnapshot();
     rv = socketpair(AF_UNIX, SOCK_STREAM, 0, info->sv);
     if(rv == -1) {
       LOG(ERROR) << "socketpair() failed: " << strerror(errno);
+      SSL_CTX_free(info->ssl_ctx);
+      delete info->stat;
       continue;
     }
-    rv = pthread_create(&thread, &attr, start_threaded_worker, &info->sv[1]);
+    rv = pthread_create(&thread, &attr, start_threaded_worker, info);
     if(rv != 0) {
       LOG(ERROR) << "pthread_create() failed: " << strerror(rv);
       for(size_t j = 0; j < 2; ++j) {
         close(info->sv[j]);
       }
+      SSL_CTX_free(info->ssl_ctx);
+      delete info->stat;
       continue;
     }
     bufferevent *bev = bufferevent_socket_new(evbase_, info->sv[0],
                                               BEV_OPT_DEFER_CALLBACKS);
+    bufferevent_setcb(bev, worker_readcb, 0, 0, this);
+    bufferevent_enable(bev, EV_READ);
     info->bev = bev;
     if(ENABLE_LOG) {
       LOG(INFO) << "Created thread#" << num_worker_;
@@ -90,13 +143,47 @@ int ListenHandler::accept_connection(evutil_socket_t fd,
     LOG(INFO) << "<listener> Accepted connection. fd=" << fd;
   }
   if(num_worker_ == 0) {
-    /*ClientHandler* client = */
-    ssl::accept_ssl_connection(evbase_, ssl_ctx_, fd, addr, addrlen);
+    if(!admission_control_) {
+      admission_control_ = new AdmissionControl(evbase_, stat_);
+    }
+    if(!admission_control_->admit_connection(handler_set_.size())) {
+      if(ENABLE_LOG) {
+        LOG(INFO) << "<listener> Connection is shed";
+      }
+      close(fd);
+      return 0;
+    }
+    ClientHandler* client;
+    client = ssl::accept_ssl_connection(evbase_, ssl_ctx_, fd, addr, addrlen);
+    if(client) {
+      if(!downstream_pool_) {
+        downstream_pool_ = new DownstreamPool();
+      }
+      client->set_downstream_pool(downstream_pool_);
+      client->set_worker_stat(stat_);
+      client->set_downstream_addr(&downstream_addr_);
+      if(!warm_pool_ && get_config()->downstream_warm_connections > 0) {
+        warm_pool_ = new DownstreamWarmPool
+          (evbase_, &downstream_addr_,
+           get_config()->downstream_warm_connections);
+      }
+      client->set_downstream_warm_pool(warm_pool_);
+      client->set_admission_control(admission_control_);
+      client->set_handler_set(&handler_set_);
+    }
+    if(client && get_config()->http_cache_size > 0) {
+      if(!http_cache_) {
+        http_cache_ = new HttpCache(get_config()->http_cache_size,
+                                    get_config()->http_cache_max_object_size);
+      }
+      client->set_http_cache(http_cache_);
+    }
   } else {
     size_t idx = worker_round_robin_cnt_ % num_worker_;
     ++worker_round_robin_cnt_;
     WorkerEvent wev;
     memset(&wev, 0, sizeof(wev));
+    wev.type = WORKER_NEW_CONNECTION;
     wev.client_fd = fd;
     memcpy(&wev.client_addr, addr, addrlen);
     wev.client_addrlen = addrlen;
@@ -111,4 +198,70 @@ event_base* ListenHandler::get_evbase() const
   return evbase_;
 }
 
+SSL_CTX* ListenHandler::get_ssl_ctx() const
+{
+  return ssl_ctx_;
+}
+
+void ListenHandler::get_stat(WorkerStat *stat) const
+{
+  *stat = *stat_;
+  for(size_t i = 0; i < num_worker_; ++i) {
+    workers_[i].stat->merge_to(stat);
+  }
+}
+
+void ListenHandler::reload(SSL_CTX *ssl_ctx,
+                           const DownstreamAddr& downstream_addr)
+{
+  for(size_t i = 0; i < num_worker_; ++i) {
+    WorkerEvent wev;
+    memset(&wev, 0, sizeof(wev));
+    wev.type = WORKER_RELOAD;
+    ssl::ref_ssl_context(ssl_ctx);
+    wev.ssl_ctx = ssl_ctx;
+    wev.downstream_addr = downstream_addr;
+    evbuffer *output = bufferevent_get_output(workers_[i].bev);
+    evbuffer_add(output, &wev, sizeof(wev));
+  }
+  SSL_CTX_free(ssl_ctx_);
+  ssl_ctx_ = ssl_ctx;
+  if(downstream_addr_.addrlen != downstream_addr.addrlen ||
+     memcmp(&downstream_addr_.addr, &downstream_addr.addr,
+            downstream_addr.addrlen) != 0) {
+    downstream_addr_ = downstream_addr;
+    handler_set_.clear_downstream_connection_pools();
+    if(warm_pool_) {
+      warm_pool_->reset();
+    }
+  }
+}
+
+void ListenHandler::graceful_shutdown()
+{
+  if(num_worker_ == 0) {
+    if(warm_pool_) {
+      warm_pool_->shutdown();
+    }
+    handler_set_.start_graceful_shutdown();
+    return;
+  }
+  for(size_t i = 0; i < num_worker_; ++i) {
+    WorkerEvent wev;
+    memset(&wev, 0, sizeof(wev));
+    wev.type = WORKER_GRACEFUL_SHUTDOWN;
+    evbuffer *output = bufferevent_get_output(workers_[i].bev);
+    evbuffer_add(output, &wev, sizeof(wev));
+  }
+}
+
+void ListenHandler::on_drained()
+{
+  ++num_drained_;
+  if(num_drained_ >= std::max(num_worker_, static_cast<size_t>(1))) {
+    LOG(INFO) << "All connections are closed. Exiting";
+    event_base_loopexit(evbase_, 0);
+  }
+}
+
 } // namespace shrpx
@@ -34,26 +34,76 @@
 
 #include <event.h>
 
+#include "shrpx_config.h"
+#include "shrpx_client_handler.h"
+
 namespace shrpx {
 
+class HttpCache;
+class DownstreamPool;
+class DownstreamWarmPool;
+class AdmissionControl;
+struct WorkerStat;
+class WorkerStatSnapshot;
+
 struct WorkerInfo {
   int sv[2];
   bufferevent *bev;
+  // The SSL_CTX shared with the main thread. The worker owns this
+  // reference.
+  SSL_CTX *ssl_ctx;
+  DownstreamAddr downstream_addr;
+  // Published by the worker thread and read by the main thread.
+  WorkerStatSnapshot *stat;
 };
 
 class ListenHandler {
 public:
-  ListenHandler(event_base *evbase);
+  // The reference of |ssl_ctx| is passed to this object.
+  ListenHandler(event_base *evbase, SSL_CTX *ssl_ctx);
   ~ListenHandler();
   int accept_connection(evutil_socket_t fd, sockaddr *addr, int addrlen);
   void create_worker_thread(size_t num);
   event_base* get_evbase() const;
+  SSL_CTX* get_ssl_ctx() const;
+  // Aggregates the statistics of all worker threads into |stat|. The
+  // statistics of the worker threads are the ones they published
+  // last, which are at most STAT_PUBLISH_INTERVAL seconds old.
+  void get_stat(WorkerStat *stat) const;
+  // Makes all threads use |ssl_ctx| and |downstream_addr| for the new
+  // connections and downstream connections. The reference of
+  // |ssl_ctx| is passed to this object.
+  void reload(SSL_CTX *ssl_ctx, const DownstreamAddr& downstream_addr);
+  // Shuts down the connections of all threads gracefully. The event
+  // loop exits when all connections are closed. Stop accepting
+  // connections before calling this function.
+  void graceful_shutdown();
+  // Called when all connections of one thread are closed.
+  void on_drained();
 private:
   event_base *evbase_;
   SSL_CTX *ssl_ctx_;
+  // Downstream address used when no worker thread is created.
+  DownstreamAddr downstream_addr_;
+  // Connections handled when no worker thread is created.
+  ClientHandlerSet handler_set_;
+  // Response cache used when no worker thread is created.
+  HttpCache *http_cache_;
+  // Downstream free list used when no worker thread is created.
+  DownstreamPool *downstream_pool_;
+  // Warm downstream connections used when no worker thread is
+  // created.
+  DownstreamWarmPool *warm_pool_;
+  // Admission control used when no worker thread is created.
+  AdmissionControl *admission_control_;
+  // Statistics used when no worker thread is created.
+  WorkerStat *stat_;
   unsigned int worker_round_robin_cnt_;
   WorkerInfo *workers_;
   size_t num_worker_;
+  // The number of threads which have closed all connections after
+  // graceful_shutdown().
+  size_t num_drained_;
 };
 
 } // namespace shrpx
@@ -24,8 +24,16 @@
  */
 #include "shrpx_log.h"
 
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
 
 namespace shrpx {
 
@@ -51,6 +59,306 @@ int Log::set_severity_level_by_name(const char *name)
   return -1;
 }
 
+namespace {
+enum LogChannel {
+  CHANNEL_ERROR,
+  CHANNEL_ACCESS
+};
+} // namespace
+
+namespace {
+struct LogRecordHeader {
+  uint32_t len;
+  uint32_t channel;
+};
+} // namespace
+
+namespace {
+const size_t LOG_RING_SIZE = 256*1024;
+} // namespace
+
+namespace {
+// Single producer, single consumer ring buffer of log records. The
+// producer is the thread which owns it and the consumer is the
+// writer thread. The records are dropped if the buffer is full, so
+// that the producer never blocks.
+class LogRing {
+public:
+  LogRing()
+    : head_(0),
+      tail_(0),
+      dropped_(0)
+  {}
+  bool push(LogChannel channel, const char *data, size_t len)
+  {
+    LogRecordHeader hd;
+    hd.len = len;
+    hd.channel = channel;
+    size_t head = head_;
+    __sync_synchronize();
+    if(LOG_RING_SIZE - (tail_ - head) < sizeof(hd) + len) {
+      __sync_fetch_and_add(&dropped_, 1);
+      return false;
+    }
+    size_t tail = tail_;
+    tail = copy_in(tail, reinterpret_cast<const char*>(&hd), sizeof(hd));
+    tail = copy_in(tail, data, len);
+    __sync_synchronize();
+    tail_ = tail;
+    return true;
+  }
+  // Appends all records in this buffer to |out| per channel.
+  void pop_all(std::string *out)
+  {
+    size_t tail = tail_;
+    __sync_synchronize();
+    size_t head = head_;
+    while(head != tail) {
+      LogRecordHeader hd;
+      head = copy_out(reinterpret_cast<char*>(&hd), head, sizeof(hd));
+      std::string& dest = out[hd.channel];
+      size_t off = dest.size();
+      dest.resize(off + hd.len);
+      head = copy_out(&dest[off], head, hd.len);
+    }
+    __sync_synchronize();
+    head_ = head;
+  }
+  bool empty()
+  {
+    __sync_synchronize();
+    return head_ == tail_;
+  }
+  size_t get_dropped()
+  {
+    return __sync_lock_test_and_set(&dropped_, 0);
+  }
+private:
+  size_t copy_in(size_t pos, const char *data, size_t len)
+  {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t n = std::min(len, LOG_RING_SIZE - off);
+    memcpy(buf_ + off, data, n);
+    memcpy(buf_, data + n, len - n);
+    return pos + len;
+  }
+  size_t copy_out(char *data, size_t pos, size_t len)
+  {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t n = std::min(len, LOG_RING_SIZE - off);
+    memcpy(data, buf_ + off, n);
+    memcpy(data + n, buf_, len - n);
+    return pos + len;
+  }
+  // head_ and tail_ are monotonically increasing byte offsets.
+  volatile size_t head_;
+  volatile size_t tail_;
+  size_t dropped_;
+  char buf_[LOG_RING_SIZE];
+};
+} // namespace
+
+namespace {
+volatile bool writer_started = false;
+volatile bool writer_stopping = false;
+pthread_t writer;
+// The writer thread waits on this pipe while it has nothing to
+// write. writer_sleeping is 1 while it waits, and the thread which
+// resets it to 0 writes a byte to wake it up.
+int wakeup_fd[2] = { -1, -1 };
+int writer_sleeping = 0;
+int access_log_fd = -1;
+pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<LogRing*> rings;
+__thread LogRing *thread_ring = 0;
+} // namespace
+
+namespace {
+void write_fully(int fd, const char *data, size_t len)
+{
+  while(len > 0) {
+    ssize_t rv;
+    while((rv = write(fd, data, len)) == -1 && errno == EINTR);
+    if(rv == -1) {
+      return;
+    }
+    data += rv;
+    len -= rv;
+  }
+}
+} // namespace
+
+namespace {
+int channel_fd(int channel)
+{
+  return channel == CHANNEL_ACCESS ? access_log_fd : STDERR_FILENO;
+}
+} // namespace
+
+namespace {
+void wake_up_writer()
+{
+  char c = 0;
+  while(write(wakeup_fd[1], &c, 1) == -1 && errno == EINTR);
+}
+} // namespace
+
+namespace {
+void write_log(LogChannel channel, const char *data, size_t len,
+               bool sync)
+{
+  if(!sync && thread_ring && writer_started) {
+    if(thread_ring->push(channel, data, len)) {
+      __sync_synchronize();
+      if(writer_sleeping &&
+         __sync_bool_compare_and_swap(&writer_sleeping, 1, 0)) {
+        wake_up_writer();
+      }
+    }
+  } else {
+    write_fully(channel_fd(channel), data, len);
+  }
+}
+} // namespace
+
+namespace {
+void* writer_thread(void *arg)
+{
+  std::vector<LogRing*> local_rings;
+  std::string out[2];
+  char buf[64];
+  for(;;) {
+    // The records pushed before stop_writer() are written before
+    // this thread exits.
+    bool stopping = writer_stopping;
+    __sync_synchronize();
+    pthread_mutex_lock(&rings_mutex);
+    local_rings = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    size_t dropped = 0;
+    for(size_t i = 0; i < local_rings.size(); ++i) {
+      local_rings[i]->pop_all(out);
+      dropped += local_rings[i]->get_dropped();
+    }
+    if(dropped) {
+      int rv = snprintf(buf, sizeof(buf),
+                        "[WARN] %zu log messages were dropped\n", dropped);
+      out[CHANNEL_ERROR].append(buf, rv);
+    }
+    if(out[CHANNEL_ERROR].empty() && out[CHANNEL_ACCESS].empty()) {
+      if(stopping) {
+        break;
+      }
+      writer_sleeping = 1;
+      __sync_synchronize();
+      // The records pushed before writer_sleeping was set do not wake
+      // this thread up. Look at the buffers again before sleeping.
+      bool empty = !writer_stopping;
+      pthread_mutex_lock(&rings_mutex);
+      for(size_t i = 0; empty && i < rings.size(); ++i) {
+        empty = rings[i]->empty();
+      }
+      pthread_mutex_unlock(&rings_mutex);
+      if(empty) {
+        while(read(wakeup_fd[0], buf, sizeof(buf)) == -1 && errno == EINTR);
+      } else {
+        // If a producer has reset the flag, its byte is read in the
+        // next sleep, which just ends early.
+        __sync_bool_compare_and_swap(&writer_sleeping, 1, 0);
+      }
+      continue;
+    }
+    for(int i = 0; i < 2; ++i) {
+      write_fully(channel_fd(i), out[i].data(), out[i].size());
+      out[i].clear();
+    }
+  }
+  return 0;
+}
+} // namespace
+
+void Log::start_writer()
+{
+  if(pipe(wakeup_fd) == -1) {
+    LOG(ERROR) << "pipe() failed: " << strerror(errno);
+    return;
+  }
+  for(int i = 0; i < 2; ++i) {
+    fcntl(wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  // The logging threads must not block on the pipe.
+  fcntl(wakeup_fd[1], F_SETFL, fcntl(wakeup_fd[1], F_GETFL) | O_NONBLOCK);
+  int rv = pthread_create(&writer, 0, writer_thread, 0);
+  if(rv != 0) {
+    LOG(ERROR) << "pthread_create() failed: " << strerror(rv);
+    close(wakeup_fd[0]);
+    close(wakeup_fd[1]);
+    return;
+  }
+  writer_started = true;
+}
+
+void Log::stop_writer()
+{
+  if(!writer_started) {
+    return;
+  }
+  __sync_synchronize();
+  writer_stopping = true;
+  __sync_synchronize();
+  wake_up_writer();
+  pthread_join(writer, 0);
+  // The messages logged from now on are written directly.
+  writer_started = false;
+  __sync_synchronize();
+  // Write the records pushed while the writer thread was finishing.
+  std::string out[2];
+  pthread_mutex_lock(&rings_mutex);
+  for(size_t i = 0; i < rings.size(); ++i) {
+    rings[i]->pop_all(out);
+  }
+  pthread_mutex_unlock(&rings_mutex);
+  for(int i = 0; i < 2; ++i) {
+    write_fully(channel_fd(i), out[i].data(), out[i].size());
+  }
+  close(wakeup_fd[0]);
+  close(wakeup_fd[1]);
+}
+
+void Log::register_thread()
+{
+  if(!writer_started || thread_ring) {
+    return;
+  }
+  LogRing *ring = new LogRing();
+  pthread_mutex_lock(&rings_mutex);
+  rings.push_back(ring);
+  pthread_mutex_unlock(&rings_mutex);
+  thread_ring = ring;
+}
+
+int Log::open_access_log(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd == -1) {
+    return -1;
+  }
+  access_log_fd = fd;
+  return 0;
+}
+
+bool Log::access_log_enabled()
+{
+  return access_log_fd != -1;
+}
+
+void Log::access_log(const std::string& record)
+{
+  std::string line = record;
+  line += "\n";
+  write_log(CHANNEL_ACCESS, line.data(), line.size(), false);
+}
+
 Log::Log(int severity, const char *filename, int linenum)
   : severity_(severity),
     filename_(filename),
@@ -60,11 +368,95 @@ Log::Log(int severity, const char *filename, int linenum)
 Log::~Log()
 {
   if(severity_ >= severity_thres_) {
-    fprintf(stderr, "[%s] %s\n       (%s, line %d)\n",
-            SEVERITY_STR[severity_], stream_.str().c_str(),
-            filename_, linenum_);
-    fflush(stderr);
+    char buf[64];
+    std::string rec = "[";
+    rec += SEVERITY_STR[severity_];
+    rec += "] ";
+    rec += msg_;
+    rec += "\n       (";
+    rec += filename_;
+    int rv = snprintf(buf, sizeof(buf), ", line %d)\n", linenum_);
+    rec.append(buf, rv);
+    // FATAL message is written immediately because the process may
+    // be about to abort.
+    write_log(CHANNEL_ERROR, rec.data(), rec.size(), severity_ == FATAL);
   }
 }
 
+Log& Log::operator<<(const std::string& s)
+{
+  msg_ += s;
+  return *this;
+}
+
+Log& Log::operator<<(const char *s)
+{
+  msg_ += s ? s : "(null)";
+  return *this;
+}
+
+Log& Log::operator<<(char c)
+{
+  msg_ += c;
+  return *this;
+}
+
+namespace {
+template<typename T>
+void append_format(std::string& msg, const char *fmt, T value)
+{
+  char buf[32];
+  int rv = snprintf(buf, sizeof(buf), fmt, value);
+  msg.append(buf, rv);
+}
+} // namespace
+
+Log& Log::operator<<(int n)
+{
+  append_format(msg_, "%d", n);
+  return *this;
+}
+
+Log& Log::operator<<(unsigned int n)
+{
+  append_format(msg_, "%u", n);
+  return *this;
+}
+
+Log& Log::operator<<(long int n)
+{
+  append_format(msg_, "%ld", n);
+  return *this;
+}
+
+Log& Log::operator<<(unsigned long int n)
+{
+  append_format(msg_, "%lu", n);
+  return *this;
+}
+
+Log& Log::operator<<(long long int n)
+{
+  append_format(msg_, "%lld", n);
+  return *this;
+}
+
+Log& Log::operator<<(unsigned long long int n)
+{
+  append_format(msg_, "%llu", n);
+  return *this;
+}
+
+Log& Log::operator<<(double n)
+{
+  append_format(msg_, "%g", n);
+  return *this;
+}
+
+Log& Log::operator<<(const void *p)
+{
+  append_format(msg_, "%p", p);
+  return *this;
+}
+
 } // namespace shrpx
@@ -27,13 +27,26 @@
 
 #include "shrpx.h"
 
-#include <sstream>
+#include <string>
 
 namespace shrpx {
 
-#define ENABLE_LOG 1
+// ENABLE_LOG guards INFO level logging. It is evaluated at run time
+// so that the message is not even formatted unless INFO level is
+// enabled. Define SHRPX_NO_INFO_LOG to compile it out entirely.
+#ifdef SHRPX_NO_INFO_LOG
+#  define ENABLE_LOG 0
+#else // !SHRPX_NO_INFO_LOG
+#  define ENABLE_LOG (LOG_ENABLED(INFO))
+#endif // !SHRPX_NO_INFO_LOG
 
-#define LOG(SEVERITY) Log(SEVERITY, __FILE__, __LINE__)
+#define LOG_ENABLED(SEVERITY) (Log::get_severity_level() <= (SEVERITY))
+
+// The arguments of operator<< are not evaluated if SEVERITY is
+// below the threshold.
+#define LOG(SEVERITY)                                   \
+  if(!LOG_ENABLED(SEVERITY)) {} else                    \
+    Log(SEVERITY, __FILE__, __LINE__)
 
 enum SeverityLevel {
   INFO, WARNING, ERROR, FATAL
@@ -43,18 +56,46 @@ class Log {
 public:
   Log(int severity, const char *filename, int linenum);
   ~Log();
-  template<typename Type> Log& operator<<(Type s)
-  {
-    stream_ << s;
-    return *this;
-  }
+  Log& operator<<(const std::string& s);
+  Log& operator<<(const char *s);
+  Log& operator<<(char c);
+  Log& operator<<(int n);
+  Log& operator<<(unsigned int n);
+  Log& operator<<(long int n);
+  Log& operator<<(unsigned long int n);
+  Log& operator<<(long long int n);
+  Log& operator<<(unsigned long long int n);
+  Log& operator<<(double n);
+  Log& operator<<(const void *p);
   static void set_severity_level(int severity);
   static int set_severity_level_by_name(const char *name);
+  static int get_severity_level()
+  {
+    return severity_thres_;
+  }
+  // Opens |path| to write access log. Returns 0 if it succeeds, or
+  // -1.
+  static int open_access_log(const char *path);
+  static bool access_log_enabled();
+  // Writes |record| to access log. A newline is appended.
+  static void access_log(const std::string& record);
+  // Starts the thread which writes log messages. The threads
+  // registered by register_thread() hand over their messages to the
+  // writer thread through lock-free buffers instead of writing them
+  // by themselves. Call this function before creating any thread.
+  static void start_writer();
+  // Stops the writer thread after it writes the pending messages.
+  // The messages logged after this call are written directly. Call
+  // this function before the process exits.
+  static void stop_writer();
+  // Registers the calling thread to the writer thread. This function
+  // does nothing if the writer thread has not been started.
+  static void register_thread();
 private:
   int severity_;
   const char *filename_;
   int linenum_;
-  std::stringstream stream_;
+  std::string msg_;
   static int severity_thres_;
 };
 
@@ -26,12 +26,14 @@
 
 #include <assert.h>
 #include <sstream>
+#include <algorithm>
 
 #include "shrpx_client_handler.h"
 #include "shrpx_downstream.h"
 #include "shrpx_downstream_connection.h"
 #include "shrpx_config.h"
 #include "shrpx_http.h"
+#include "shrpx_stat.h"
 #include "util.h"
 
 using namespace spdylay;
@@ -42,6 +44,11 @@ namespace {
 const size_t SHRPX_SPDY_UPSTREAM_OUTPUT_UPPER_THRES = 64*1024;
 } // namespace
 
+namespace {
+// The minimum length of DATA frame sent by a rate limited stream.
+const size_t SHRPX_SPDY_RATE_LIMIT_MIN_DATA_LEN = 4096;
+} // namespace
+
 namespace {
 ssize_t send_callback(spdylay_session *session,
                       const uint8_t *data, size_t len, int flags,
@@ -66,25 +73,6 @@ ssize_t send_callback(spdylay_session *session,
 }
 } // namespace
 
-namespace {
-ssize_t recv_callback(spdylay_session *session,
-                      uint8_t *data, size_t len, int flags, void *user_data)
-{
-  SpdyUpstream *upstream = reinterpret_cast<SpdyUpstream*>(user_data);
-  ClientHandler *handler = upstream->get_client_handler();
-  bufferevent *bev = handler->get_bev();
-  evbuffer *input = bufferevent_get_input(bev);
-  int nread = evbuffer_remove(input, data, len);
-  if(nread == -1) {
-    return SPDYLAY_ERR_CALLBACK_FAILURE;
-  } else if(nread == 0) {
-    return SPDYLAY_ERR_WOULDBLOCK;
-  } else {
-    return nread;
-  }
-}
-} // namespace
-
 namespace {
 void on_stream_close_callback
 (spdylay_session *session, int32_t stream_id, spdylay_status_code status_code,
@@ -98,7 +86,7 @@ void on_stream_close_callback
   if(downstream) {
     if(downstream->get_request_state() == Downstream::CONNECT_FAIL) {
       upstream->remove_downstream(downstream);
-      delete downstream;
+      upstream->get_client_handler()->get_downstream_pool()->put(downstream);
     } else {
       downstream->set_request_state(Downstream::STREAM_CLOSED);
       if(downstream->get_response_state() == Downstream::MSG_COMPLETE) {
@@ -112,11 +100,11 @@ void on_stream_close_callback
           }
         }
         upstream->remove_downstream(downstream);
-        delete downstream;
+        upstream->get_client_handler()->get_downstream_pool()->put(downstream);
       } else {
         // At this point, downstream read may be paused.
         upstream->remove_downstream(downstream);
-        delete downstream;
+        upstream->get_client_handler()->get_downstream_pool()->put(downstream);
         // How to test this case? Request sufficient large download
         // and make client send RST_STREAM after it gets first DATA
         // frame chunk.
@@ -139,23 +127,27 @@ void on_ctrl_recv_callback
                 << frame->syn_stream.stream_id;
     }
     Downstream *downstream;
-    downstream = new Downstream(upstream,
-                                frame->syn_stream.stream_id,
-                                frame->syn_stream.pri);
+    downstream = upstream->get_client_handler()->get_downstream_pool()->get
+      (upstream, frame->syn_stream.stream_id, frame->syn_stream.pri);
     upstream->add_downstream(downstream);
     downstream->init_response_body_buf();
+    WorkerStat *stat = upstream->get_client_handler()->get_worker_stat();
+    if(stat) {
+      ++stat->spdy_streams;
+    }
 
     char **nv = frame->syn_stream.nv;
     for(size_t i = 0; nv[i]; i += 2) {
       if(strcmp(nv[i], ":path") == 0) {
-        downstream->set_request_path(nv[i+1]);
+        downstream->set_request_path(nv[i+1], strlen(nv[i+1]));
       } else if(strcmp(nv[i], ":method") == 0) {
-        downstream->set_request_method(nv[i+1]);
+        downstream->set_request_method(nv[i+1], strlen(nv[i+1]));
       } else if(nv[i][0] != ':') {
-        downstream->add_request_header(nv[i], nv[i+1]);
+        downstream->add_request_header(nv[i], strlen(nv[i]),
+                                       nv[i+1], strlen(nv[i+1]));
       }
     }
-    downstream->add_request_header("X-Forwarded-Spdy", "true");
+    downstream->add_request_header("X-Forwarded-Spdy", 16, "true", 4);
 
     if(ENABLE_LOG) {
       std::stringstream ss;
@@ -165,16 +157,17 @@ void on_ctrl_recv_callback
       LOG(INFO) << "Upstream spdy request headers:\n" << ss.str();
     }
 
-    DownstreamConnection *dconn;
-    dconn = upstream->get_client_handler()->get_downstream_connection();
-    int rv = dconn->attach_downstream(downstream);
-    if(rv != 0) {
-      // If downstream connection fails, issue RST_STREAM.
-      upstream->rst_stream(downstream, SPDYLAY_INTERNAL_ERROR);
-      downstream->set_request_state(Downstream::CONNECT_FAIL);
-      return;
+    // Only the request without body can follow the other one. It
+    // can also wait for a downstream connection, because no request
+    // body has to be forwarded in the meantime.
+    bool fin = frame->syn_stream.hd.flags & SPDYLAY_CTRL_FLAG_FIN;
+    if(!downstream->response_from_cache() &&
+       !(fin && downstream->follow_in_flight_request())) {
+      if(upstream->start_downstream(downstream, fin) != 0) {
+        return;
+      }
+      downstream->register_in_flight();
     }
-    downstream->push_request_headers();
     downstream->set_request_state(Downstream::HEADER_COMPLETE);
     if(frame->syn_stream.hd.flags & SPDYLAY_CTRL_FLAG_FIN) {
       if(ENABLE_LOG) {
@@ -228,9 +221,33 @@ void on_data_chunk_recv_callback(spdylay_session *session,
 }
 } // namespace
 
+namespace {
+void send_evcb(evutil_socket_t fd, short what, void *arg)
+{
+  SpdyUpstream *upstream = reinterpret_cast<SpdyUpstream*>(arg);
+  // Same as upstream_writecb(): the session may have finished.
+  if(upstream->on_write() != 0) {
+    delete upstream->get_client_handler();
+  }
+}
+} // namespace
+
+namespace {
+void rate_limit_evcb(evutil_socket_t fd, short what, void *arg)
+{
+  SpdyUpstream *upstream = reinterpret_cast<SpdyUpstream*>(arg);
+  upstream->resume_rate_limited_streams();
+  if(upstream->on_write() != 0) {
+    delete upstream->get_client_handler();
+  }
+}
+} // namespace
+
 SpdyUpstream::SpdyUpstream(uint16_t version, ClientHandler *handler)
   : handler_(handler),
-    session_(0)
+    session_(0),
+    send_ev_(evtimer_new(handler->get_evbase(), send_evcb, this)),
+    rate_limit_ev_(evtimer_new(handler->get_evbase(), rate_limit_evcb, this))
 {
   //handler->set_bev_cb(spdy_readcb, 0, spdy_eventcb);
   handler->set_upstream_timeouts(&get_config()->spdy_upstream_read_timeout,
@@ -239,7 +256,6 @@ SpdyUpstream::SpdyUpstream(uint16_t version, ClientHandler *handler)
   spdylay_session_callbacks callbacks;
   memset(&callbacks, 0, sizeof(callbacks));
   callbacks.send_callback = send_callback;
-  callbacks.recv_callback = recv_callback;
   callbacks.on_stream_close_callback = on_stream_close_callback;
   callbacks.on_ctrl_recv_callback = on_ctrl_recv_callback;
   callbacks.on_data_chunk_recv_callback = on_data_chunk_recv_callback;
@@ -274,32 +290,78 @@ SpdyUpstream::SpdyUpstream(uint16_t version, ClientHandler *handler)
     (session_, SPDYLAY_FLAG_SETTINGS_NONE,
      entry, sizeof(entry)/sizeof(spdylay_settings_entry));
   assert(rv == 0);
+  WorkerStat *stat = handler->get_worker_stat();
+  if(stat) {
+    ++stat->active_spdy_sessions;
+  }
   // TODO Maybe call from outside?
   send();
 }
 
 SpdyUpstream::~SpdyUpstream()
 {
+  WorkerStat *stat = handler_->get_worker_stat();
+  if(stat) {
+    --stat->active_spdy_sessions;
+  }
+  event_free(send_ev_);
+  event_free(rate_limit_ev_);
   spdylay_session_del(session_);
+  // Downstreams are deleted after this. Tell on_downstream_abort()
+  // that the session is gone.
+  session_ = 0;
 }
 
+namespace {
+const int MAX_INPUT_IOVCNT = 16;
+} // namespace
+
 int SpdyUpstream::on_read()
 {
-  int rv;
-  if((rv = spdylay_session_recv(session_)) ||
-     (rv = spdylay_session_send(session_))) {
+  int rv = 0;
+  evbuffer *input = bufferevent_get_input(handler_->get_bev());
+  // Pass the chunks in the input buffer to spdylay directly, so that
+  // the data is not copied before it is parsed. Spdylay consumes all
+  // given data unless a fatal error occurs.
+  evbuffer_iovec iov[MAX_INPUT_IOVCNT];
+  while(rv == 0 && evbuffer_get_length(input) > 0) {
+    int iovcnt = std::min(evbuffer_peek(input, -1, 0, iov, MAX_INPUT_IOVCNT),
+                          MAX_INPUT_IOVCNT);
+    size_t nproc = 0;
+    for(int i = 0; i < iovcnt; ++i) {
+      ssize_t r = spdylay_session_mem_recv
+        (session_, reinterpret_cast<const uint8_t*>(iov[i].iov_base),
+         iov[i].iov_len);
+      if(r < 0) {
+        rv = r;
+        break;
+      }
+      nproc += r;
+    }
+    evbuffer_drain(input, nproc);
+  }
+  if(rv || (rv = spdylay_session_send(session_))) {
     if(rv != SPDYLAY_ERR_EOF) {
       LOG(ERROR) << "spdylay error: " << spdylay_strerror(rv);
       DIE();
     }
   }
-  return 0;
+  return can_close() ? -1 : 0;
 }
 
 int SpdyUpstream::on_write()
 {
-  send();
-  return 0;
+  if(send() != 0) {
+    return -1;
+  }
+  return can_close() ? -1 : 0;
+}
+
+bool SpdyUpstream::can_close()
+{
+  return spdylay_session_want_read(session_) == 0 &&
+    spdylay_session_want_write(session_) == 0 &&
+    evbuffer_get_length(bufferevent_get_output(handler_->get_bev())) == 0;
 }
 
 // After this function call, downstream may be deleted.
@@ -313,6 +375,12 @@ int SpdyUpstream::send()
   return 0;
 }
 
+void SpdyUpstream::schedule_send()
+{
+  timeval tv = { 0, 0 };
+  evtimer_add(send_ev_, &tv);
+}
+
 int SpdyUpstream::on_event()
 {
   return 0;
@@ -338,7 +406,7 @@ void spdy_downstream_readcb(bufferevent *bev, void *ptr)
     // because there is no consumer now. Downstream connection is also
     // closed in this case.
     upstream->remove_downstream(downstream);
-    delete downstream;
+    upstream->get_client_handler()->get_downstream_pool()->put(downstream);
     return;
   }
   int rv = downstream->parse_http_response();
@@ -391,6 +459,7 @@ void spdy_downstream_eventcb(bufferevent *bev, short events, void *ptr)
       LOG(INFO) << "Downstream connection established. Downstream "
                 << downstream;
     }
+    dconn->on_connected();
   } else if(events & BEV_EVENT_EOF) {
     if(ENABLE_LOG) {
       LOG(INFO) << "Downstream EOF stream_id="
@@ -400,7 +469,7 @@ void spdy_downstream_eventcb(bufferevent *bev, short events, void *ptr)
       // If stream was closed already, we don't need to send reply at
       // the first place. We can delete downstream.
       upstream->remove_downstream(downstream);
-      delete downstream;
+      upstream->get_client_handler()->get_downstream_pool()->put(downstream);
     } else {
       // Delete downstream connection. If we don't delete it here, it
       // will be pooled in on_stream_close_callback.
@@ -430,7 +499,7 @@ void spdy_downstream_eventcb(bufferevent *bev, short events, void *ptr)
     }
     if(downstream->get_request_state() == Downstream::STREAM_CLOSED) {
       upstream->remove_downstream(downstream);
-      delete downstream;
+      upstream->get_client_handler()->get_downstream_pool()->put(downstream);
     } else {
       // Delete downstream connection. If we don't delete it here, it
       // will be pooled in on_stream_close_callback.
@@ -495,10 +564,28 @@ ssize_t spdy_data_read_callback(spdylay_session *session,
                                 spdylay_data_source *source,
                                 void *user_data)
 {
+  SpdyUpstream *upstream = reinterpret_cast<SpdyUpstream*>(user_data);
   Downstream *downstream = reinterpret_cast<Downstream*>(source->ptr);
   evbuffer *body = downstream->get_response_body_buf();
   assert(body);
+  size_t bodylen = evbuffer_get_length(body);
+  TokenBucket *bucket = downstream->get_response_bucket();
+  if(bodylen > 0 && bucket->get_burst() > 0) {
+    timeval now;
+    gettimeofday(&now, 0);
+    size_t avail = bucket->get_available(&now);
+    // Small DATA frames are avoided unless the rate is very low.
+    size_t min_len = std::min(std::min(length, bodylen),
+                              std::min(bucket->get_burst(),
+                                       SHRPX_SPDY_RATE_LIMIT_MIN_DATA_LEN));
+    if(avail < min_len) {
+      upstream->defer_by_rate_limit(downstream, min_len);
+      return SPDYLAY_ERR_DEFERRED;
+    }
+    length = std::min(length, avail);
+  }
   int nread = evbuffer_remove(body, buf, length);
+  bucket->consume(nread);
   if(nread == 0 &&
      downstream->get_response_state() == Downstream::MSG_COMPLETE) {
     *eof = 1;
@@ -520,6 +607,8 @@ int SpdyUpstream::error_reply(Downstream *downstream, int status_code)
   if(rv == -1) {
     DIE();
   }
+  downstream->set_response_http_status(status_code);
+  downstream->add_response_bodylen(html.size());
   downstream->set_response_state(Downstream::MSG_COMPLETE);
   
   spdylay_data_provider data_prd;
@@ -566,6 +655,20 @@ void SpdyUpstream::add_downstream(Downstream *downstream)
 void SpdyUpstream::remove_downstream(Downstream *downstream)
 {
   downstream_queue_.remove(downstream);
+  if(active_downstreams_.erase(downstream)) {
+    start_pending_downstreams();
+    return;
+  }
+  std::pair<std::multimap<int, Downstream*>::iterator,
+            std::multimap<int, Downstream*>::iterator> range;
+  range = pending_downstreams_.equal_range(downstream->get_priority());
+  for(std::multimap<int, Downstream*>::iterator i = range.first;
+      i != range.second; ++i) {
+    if((*i).second == downstream) {
+      pending_downstreams_.erase(i);
+      break;
+    }
+  }
 }
 
 Downstream* SpdyUpstream::find_downstream(int32_t stream_id)
@@ -579,15 +682,18 @@ spdylay_session* SpdyUpstream::get_spdy_session()
 }
 
 // WARNING: Never call directly or indirectly spdylay_session_send or
-// spdylay_session_recv. These calls may delete downstream.
+// spdylay_session_mem_recv. These calls may delete downstream.
 int SpdyUpstream::on_downstream_header_complete(Downstream *downstream)
 {
   if(ENABLE_LOG) {
     LOG(INFO) << "Downstream on_downstream_header_complete";
   }
-  size_t nheader = downstream->get_response_headers().size();
-  // 6 means :status, :version and possible via header field.
-  const char **nv = new const char*[nheader * 2 + 6 + 1];
+  const Headers& headers = downstream->get_response_headers();
+  size_t nheader = headers.size();
+  // 6 means :status, :version and possible via header field. nv_ is
+  // reused so that it is not allocated for each response.
+  nv_.resize(nheader * 2 + 6 + 1);
+  const char **nv = &nv_[0];
   size_t hdidx = 0;
   std::string via_value;
   std::string location;
@@ -595,20 +701,23 @@ int SpdyUpstream::on_downstream_header_complete(Downstream *downstream)
   nv[hdidx++] = http::get_status_string(downstream->get_response_http_status());
   nv[hdidx++] = ":version";
   nv[hdidx++] = "HTTP/1.1";
-  for(Headers::const_iterator i = downstream->get_response_headers().begin();
-      i != downstream->get_response_headers().end(); ++i) {
-    if(util::strieq((*i).first.c_str(), "transfer-encoding") ||
-       util::strieq((*i).first.c_str(), "keep-alive") || // HTTP/1.0?
-       util::strieq((*i).first.c_str(), "connection") ||
-       util:: strieq((*i).first.c_str(), "proxy-connection")) {
+  for(size_t i = 0; i < nheader; ++i) {
+    switch(http::lookup_token(headers.name(i), headers.namelen(i))) {
+    case http::HD_TRANSFER_ENCODING:
+    case http::HD_KEEP_ALIVE: // HTTP/1.0?
+    case http::HD_CONNECTION:
+    case http::HD_PROXY_CONNECTION:
       // These are ignored
-    } else if(util::strieq((*i).first.c_str(), "via")) {
-      via_value = (*i).second;
-    } else if(util::strieq((*i).first.c_str(), "location")) {
-      location = (*i).second;
-    } else {
-      nv[hdidx++] = (*i).first.c_str();
-      nv[hdidx++] = (*i).second.c_str();
+      break;
+    case http::HD_VIA:
+      via_value = headers.value(i);
+      break;
+    case http::HD_LOCATION:
+      location = headers.value(i);
+      break;
+    default:
+      nv[hdidx++] = headers.name(i);
+      nv[hdidx++] = headers.value(i);
     }
   }
   if(!location.empty()) {
@@ -639,12 +748,16 @@ int SpdyUpstream::on_downstream_header_complete(Downstream *downstream)
 
   spdylay_submit_response(session_, downstream->get_stream_id(), nv,
                           &data_prd);
-  delete [] nv;
+  if(downstream->get_leader()) {
+    // The response is relayed from the other request. Nobody calls
+    // send() for this session.
+    schedule_send();
+  }
   return 0;
 }
 
 // WARNING: Never call directly or indirectly spdylay_session_send or
-// spdylay_session_recv. These calls may delete downstream.
+// spdylay_session_mem_recv. These calls may delete downstream.
 int SpdyUpstream::on_downstream_body(Downstream *downstream,
                                      const uint8_t *data, size_t len)
 {
@@ -652,28 +765,150 @@ int SpdyUpstream::on_downstream_body(Downstream *downstream,
     LOG(INFO) << "Downstream on_downstream_body";
   }
   evbuffer *body = downstream->get_response_body_buf();
-  evbuffer_add(body, data, len);
+  if(downstream->move_response_body(body, data, len) != 0) {
+    evbuffer_add(body, data, len);
+  }
+  downstream->add_response_bodylen(len);
   spdylay_session_resume_data(session_, downstream->get_stream_id());
 
   size_t bodylen = evbuffer_get_length(body);
   if(bodylen > SHRPX_SPDY_UPSTREAM_OUTPUT_UPPER_THRES) {
     downstream->pause_read(SHRPX_NO_BUFFER);
   }
+  if(downstream->get_leader()) {
+    schedule_send();
+  }
 
   return 0;
 }
 
 // WARNING: Never call directly or indirectly spdylay_session_send or
-// spdylay_session_recv. These calls may delete downstream.
+// spdylay_session_mem_recv. These calls may delete downstream.
 int SpdyUpstream::on_downstream_body_complete(Downstream *downstream)
 {
   if(ENABLE_LOG) {
     LOG(INFO) << "Downstream on_downstream_body_complete";
   }
   spdylay_session_resume_data(session_, downstream->get_stream_id());
+  if(downstream->get_leader()) {
+    schedule_send();
+  }
+  return 0;
+}
+
+// WARNING: Never call directly or indirectly spdylay_session_send or
+// spdylay_session_mem_recv. These calls may delete downstream.
+int SpdyUpstream::on_downstream_abort(Downstream *downstream)
+{
+  if(!session_) {
+    // This object is being deleted.
+    return 0;
+  }
+  if(downstream->get_response_state() == Downstream::INITIAL) {
+    start_downstream(downstream, true);
+  } else {
+    rst_stream(downstream, SPDYLAY_INTERNAL_ERROR);
+    downstream->set_response_state(Downstream::MSG_COMPLETE);
+  }
+  schedule_send();
+  return 0;
+}
+
+int SpdyUpstream::start_graceful_shutdown()
+{
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Sending GOAWAY to " << handler_->get_ipaddr();
+  }
+  // The streams opened so far are processed. The client sends new
+  // requests over another connection.
+  if(spdylay_submit_goaway(session_, SPDYLAY_GOAWAY_OK) != 0) {
+    return -1;
+  }
+  send();
   return 0;
 }
 
+int SpdyUpstream::start_downstream(Downstream *downstream, bool can_wait)
+{
+  if(!handler_->admit_request()) {
+    if(ENABLE_LOG) {
+      LOG(INFO) << "Downstream " << downstream << " is refused";
+    }
+    rst_stream(downstream, SPDYLAY_REFUSED_STREAM);
+    downstream->set_request_state(Downstream::CONNECT_FAIL);
+    return -1;
+  }
+  size_t max = get_config()->spdy_max_downstream_connections;
+  if(can_wait && max > 0 && active_downstreams_.size() >= max) {
+    if(ENABLE_LOG) {
+      LOG(INFO) << "Downstream " << downstream << " with priority "
+                << downstream->get_priority()
+                << " waits for downstream connection";
+    }
+    pending_downstreams_.insert(std::make_pair(downstream->get_priority(),
+                                               downstream));
+    return 0;
+  }
+  return connect_downstream(downstream);
+}
+
+int SpdyUpstream::connect_downstream(Downstream *downstream)
+{
+  DownstreamConnection *dconn;
+  dconn = handler_->get_downstream_connection();
+  int rv = dconn->attach_downstream(downstream);
+  if(rv != 0) {
+    // If downstream connection fails, issue RST_STREAM.
+    rst_stream(downstream, SPDYLAY_INTERNAL_ERROR);
+    downstream->set_request_state(Downstream::CONNECT_FAIL);
+    return -1;
+  }
+  active_downstreams_.insert(downstream);
+  downstream->push_request_headers();
+  return 0;
+}
+
+void SpdyUpstream::start_pending_downstreams()
+{
+  size_t max = get_config()->spdy_max_downstream_connections;
+  bool failed = false;
+  while(!pending_downstreams_.empty() &&
+        (max == 0 || active_downstreams_.size() < max)) {
+    Downstream *downstream = (*pending_downstreams_.begin()).second;
+    pending_downstreams_.erase(pending_downstreams_.begin());
+    if(connect_downstream(downstream) != 0) {
+      failed = true;
+    }
+  }
+  if(failed) {
+    // RST_STREAM was submitted.
+    schedule_send();
+  }
+}
+
+void SpdyUpstream::defer_by_rate_limit(Downstream *downstream, size_t len)
+{
+  rate_limited_streams_.insert(downstream->get_stream_id());
+  // All streams have the same rate, so the timer set by the first
+  // deferred stream is not moved.
+  if(!evtimer_pending(rate_limit_ev_, 0)) {
+    timeval tv;
+    downstream->get_response_bucket()->get_wait_time(&tv, len);
+    evtimer_add(rate_limit_ev_, &tv);
+  }
+}
+
+void SpdyUpstream::resume_rate_limited_streams()
+{
+  for(std::set<int32_t>::iterator i = rate_limited_streams_.begin();
+      i != rate_limited_streams_.end(); ++i) {
+    // The stream may have been closed in the meantime, in which case
+    // this call fails harmlessly.
+    spdylay_session_resume_data(session_, *i);
+  }
+  rate_limited_streams_.clear();
+}
+
 bool SpdyUpstream::get_flow_control() const
 {
   return flow_control_;
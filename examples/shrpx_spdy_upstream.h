@@ -27,6 +27,12 @@
 
 #include "shrpx.h"
 
+#include <vector>
+#include <map>
+#include <set>
+
+#include <event.h>
+
 #include <spdylay/spdylay.h>
 
 #include "shrpx_upstream.h"
@@ -44,6 +50,9 @@ public:
   virtual int on_write();
   virtual int on_event();
   int send();
+  // Calls send() from the event loop. Use this function when the
+  // frames are submitted outside the callbacks of this object.
+  void schedule_send();
   virtual ClientHandler* get_client_handler() const;
   virtual bufferevent_data_cb get_downstream_readcb();
   virtual bufferevent_data_cb get_downstream_writecb();
@@ -62,15 +71,50 @@ public:
   virtual int on_downstream_body(Downstream *downstream,
                                  const uint8_t *data, size_t len);
   virtual int on_downstream_body_complete(Downstream *downstream);
+  virtual int on_downstream_abort(Downstream *downstream);
+  virtual int start_graceful_shutdown();
 
   bool get_flow_control() const;
   int32_t get_initial_window_size() const;
+  // Sends the request of |downstream| to the downstream server. If
+  // |can_wait| is true and this session uses the maximum number of
+  // downstream connections, the request waits until one of them is
+  // released. The waiting requests are sent in the order of SPDY
+  // priority. Returns -1 if connecting to the downstream server
+  // fails, in which case the stream is reset.
+  int start_downstream(Downstream *downstream, bool can_wait);
+  // Defers the response body of |downstream| until its rate limit
+  // allows |len| bytes, and then resumes it.
+  void defer_by_rate_limit(Downstream *downstream, size_t len);
+  // Resumes the streams deferred by rate limit.
+  void resume_rate_limited_streams();
 private:
+  int connect_downstream(Downstream *downstream);
+  // Sends the waiting requests while the downstream connections are
+  // available.
+  void start_pending_downstreams();
+
+  // Returns true if the session has finished after GOAWAY and all
+  // frames have been written to the client.
+  bool can_close();
+
   ClientHandler *handler_;
   spdylay_session *session_;
+  event *send_ev_;
+  // Fires when the streams deferred by rate limit can send again.
+  event *rate_limit_ev_;
+  std::set<int32_t> rate_limited_streams_;
   bool flow_control_;
   int32_t initial_window_size_;
   DownstreamQueue downstream_queue_;
+  // The requests waiting for a downstream connection, keyed by
+  // priority. The requests of the same priority are kept in arrival
+  // order.
+  std::multimap<int, Downstream*> pending_downstreams_;
+  // The requests which have a downstream connection.
+  std::set<Downstream*> active_downstreams_;
+  // Name/value array of response headers passed to spdylay.
+  std::vector<const char*> nv_;
 };
 
 } // namespace shrpx
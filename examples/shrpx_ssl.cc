@@ -28,8 +28,23 @@
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <list>
+#include <map>
 
 #include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#  include <openssl/params.h>
+#endif // OPENSSL_VERSION_NUMBER >= 0x30000000L
 
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
@@ -68,13 +83,370 @@ int verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
 }
 } // namespace
 
+namespace {
+TLSStats stats;
+} // namespace
+
+namespace {
+void info_callback(const SSL *ssl, int where, int ret)
+{
+  if(where & SSL_CB_HANDSHAKE_DONE) {
+    __sync_add_and_fetch(&stats.handshakes, 1);
+    if(SSL_session_reused(const_cast<SSL*>(ssl))) {
+      __sync_add_and_fetch(&stats.resumed_handshakes, 1);
+    }
+  }
+}
+} // namespace
+
+namespace {
+// The key to encrypt and decrypt session tickets. The format is the
+// same as the content of the ticket key file.
+struct TicketKey {
+  unsigned char name[16];
+  unsigned char aes_key[16];
+  unsigned char hmac_key[16];
+};
+} // namespace
+
+namespace {
+// The first key is used to encrypt new tickets. The rest are only
+// used to decrypt tickets issued before the rotation.
+std::vector<TicketKey> ticket_keys;
+pthread_rwlock_t ticket_keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+// The number of keys kept when they are generated by ourselves.
+const size_t MAX_GENERATED_TICKET_KEYS = 2;
+// The interval of the rotation of the generated keys.
+const time_t TICKET_KEY_ROTATION_INTERVAL = 3600;
+} // namespace
+
+namespace {
+// Selects the key for the session ticket callback. If |enc| is
+// nonzero, the name of the current key and random IV are written to
+// |key_name| and |iv|. Otherwise the key named |key_name| is looked
+// up. Returns the value the callback returns; |key| is filled if it
+// is positive.
+int select_ticket_key(TicketKey *key, unsigned char *key_name,
+                      unsigned char *iv, int enc)
+{
+  size_t idx = 0;
+  pthread_rwlock_rdlock(&ticket_keys_lock);
+  if(enc) {
+    if(!ticket_keys.empty()) {
+      *key = ticket_keys[0];
+    }
+  } else {
+    for(; idx < ticket_keys.size(); ++idx) {
+      if(memcmp(ticket_keys[idx].name, key_name, sizeof(key->name)) == 0) {
+        *key = ticket_keys[idx];
+        break;
+      }
+    }
+  }
+  size_t num_keys = ticket_keys.size();
+  pthread_rwlock_unlock(&ticket_keys_lock);
+  if(enc) {
+    if(num_keys == 0 || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+      return -1;
+    }
+    memcpy(key_name, key->name, sizeof(key->name));
+    return 1;
+  }
+  if(idx == num_keys) {
+    __sync_add_and_fetch(&stats.ticket_misses, 1);
+    // Unknown key. Fall back to the full handshake.
+    return 0;
+  }
+  __sync_add_and_fetch(&stats.ticket_hits, 1);
+  // Ask the client to renew the ticket if it was encrypted by the old
+  // key.
+  return idx == 0 ? 1 : 2;
+}
+} // namespace
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+namespace {
+int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                  EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+  TicketKey key;
+  int rv = select_ticket_key(&key, key_name, iv, enc);
+  if(rv <= 0) {
+    return rv;
+  }
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key,
+                                      sizeof(key.hmac_key)),
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                     const_cast<char*>("SHA256"), 0),
+    OSSL_PARAM_construct_end()
+  };
+  if(EVP_MAC_CTX_set_params(hctx, params) != 1) {
+    return -1;
+  }
+  if(enc) {
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), 0, key.aes_key, iv);
+  } else {
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), 0, key.aes_key, iv);
+  }
+  return rv;
+}
+} // namespace
+#else // OPENSSL_VERSION_NUMBER < 0x30000000L
+namespace {
+int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                  EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+  TicketKey key;
+  int rv = select_ticket_key(&key, key_name, iv, enc);
+  if(rv <= 0) {
+    return rv;
+  }
+  HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), 0);
+  if(enc) {
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), 0, key.aes_key, iv);
+  } else {
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), 0, key.aes_key, iv);
+  }
+  return rv;
+}
+} // namespace
+#endif // OPENSSL_VERSION_NUMBER < 0x30000000L
+
+namespace {
+int read_ticket_key(TicketKey *key, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    LOG(ERROR) << "Could not open ticket key file " << path << ": "
+               << strerror(errno);
+    return -1;
+  }
+  unsigned char buf[sizeof(TicketKey)+1];
+  size_t len = 0;
+  ssize_t r;
+  while(len < sizeof(buf) &&
+        ((r = read(fd, buf+len, sizeof(buf)-len)) > 0 ||
+         (r == -1 && errno == EINTR))) {
+    if(r > 0) {
+      len += r;
+    }
+  }
+  close(fd);
+  if(len != sizeof(TicketKey)) {
+    LOG(ERROR) << "Ticket key file " << path << " must be exactly "
+               << sizeof(TicketKey) << " bytes";
+    return -1;
+  }
+  memcpy(key->name, buf, sizeof(key->name));
+  memcpy(key->aes_key, buf+16, sizeof(key->aes_key));
+  memcpy(key->hmac_key, buf+32, sizeof(key->hmac_key));
+  return 0;
+}
+} // namespace
+
+namespace {
+void rotate_ticket_key()
+{
+  TicketKey key;
+  if(RAND_bytes(reinterpret_cast<unsigned char*>(&key), sizeof(key)) != 1) {
+    LOG(ERROR) << "Generating ticket key failed";
+    return;
+  }
+  pthread_rwlock_wrlock(&ticket_keys_lock);
+  ticket_keys.insert(ticket_keys.begin(), key);
+  if(ticket_keys.size() > MAX_GENERATED_TICKET_KEYS) {
+    ticket_keys.resize(MAX_GENERATED_TICKET_KEYS);
+  }
+  pthread_rwlock_unlock(&ticket_keys_lock);
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Session ticket key rotated";
+  }
+}
+} // namespace
+
+namespace {
+void rotate_ticket_key_cb(evutil_socket_t fd, short what, void *arg)
+{
+  rotate_ticket_key();
+}
+} // namespace
+
+namespace {
+int read_ticket_key_files()
+{
+  const std::vector<std::string>& files = get_config()->tls_ticket_key_files;
+  std::vector<TicketKey> keys(files.size());
+  for(size_t i = 0; i < files.size(); ++i) {
+    if(read_ticket_key(&keys[i], files[i].c_str()) == -1) {
+      return -1;
+    }
+  }
+  pthread_rwlock_wrlock(&ticket_keys_lock);
+  ticket_keys.swap(keys);
+  pthread_rwlock_unlock(&ticket_keys_lock);
+  return 0;
+}
+} // namespace
+
+int init_ticket_keys(event_base *evbase)
+{
+  if(!get_config()->tls_ticket_key_files.empty()) {
+    return read_ticket_key_files();
+  }
+  rotate_ticket_key();
+  event *ev = event_new(evbase, -1, EV_PERSIST, rotate_ticket_key_cb, 0);
+  timeval tv = { TICKET_KEY_ROTATION_INTERVAL, 0 };
+  event_add(ev, &tv);
+  return 0;
+}
+
+int reload_ticket_keys()
+{
+  if(get_config()->tls_ticket_key_files.empty()) {
+    return 0;
+  }
+  return read_ticket_key_files();
+}
+
+namespace {
+struct SessionCacheEntry {
+  // DER encoded session
+  std::string der;
+  time_t expiry;
+  std::list<std::string>::iterator order_pos;
+};
+} // namespace
+
+namespace {
+// The server side session cache. It is kept outside SSL_CTX, so that
+// it is shared by the worker threads and survives the reload of the
+// certificate, which creates new SSL_CTX.
+std::map<std::string, SessionCacheEntry> session_cache;
+// The session IDs in the order of insertion. The oldest one is
+// evicted first when the cache is full.
+std::list<std::string> session_cache_order;
+pthread_mutex_t session_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+} // namespace
+
+namespace {
+// Removes the entry pointed by |i|. session_cache_lock must be held.
+void erase_session(std::map<std::string, SessionCacheEntry>::iterator i)
+{
+  session_cache_order.erase((*i).second.order_pos);
+  session_cache.erase(i);
+}
+} // namespace
+
+namespace {
+int new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+  unsigned int idlen;
+  const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+  int len = i2d_SSL_SESSION(session, 0);
+  if(len <= 0) {
+    return 0;
+  }
+  std::string key(reinterpret_cast<const char*>(id), idlen);
+  SessionCacheEntry entry;
+  entry.der.resize(len);
+  unsigned char *p = reinterpret_cast<unsigned char*>(&entry.der[0]);
+  i2d_SSL_SESSION(session, &p);
+  entry.expiry = SSL_SESSION_get_time(session) +
+    SSL_SESSION_get_timeout(session);
+  pthread_mutex_lock(&session_cache_lock);
+  std::map<std::string, SessionCacheEntry>::iterator i =
+    session_cache.find(key);
+  if(i != session_cache.end()) {
+    erase_session(i);
+  }
+  while(!session_cache.empty() &&
+        session_cache.size() >= get_config()->tls_session_cache_size) {
+    erase_session(session_cache.find(session_cache_order.front()));
+  }
+  entry.order_pos = session_cache_order.insert(session_cache_order.end(),
+                                               key);
+  session_cache[key] = entry;
+  pthread_mutex_unlock(&session_cache_lock);
+  // We did not keep the reference to |session|.
+  return 0;
+}
+} // namespace
+
+namespace {
+SSL_SESSION* get_session_cb(SSL *ssl,
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                            const unsigned char *id,
+#else // OPENSSL_VERSION_NUMBER < 0x10100000L
+                            unsigned char *id,
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+                            int idlen, int *copy)
+{
+  *copy = 0;
+  std::string key(reinterpret_cast<const char*>(id), idlen);
+  std::string der;
+  pthread_mutex_lock(&session_cache_lock);
+  std::map<std::string, SessionCacheEntry>::iterator i =
+    session_cache.find(key);
+  if(i != session_cache.end()) {
+    if((*i).second.expiry <= time(0)) {
+      erase_session(i);
+      __sync_add_and_fetch(&stats.session_cache_timeouts, 1);
+    } else {
+      der = (*i).second.der;
+    }
+  }
+  pthread_mutex_unlock(&session_cache_lock);
+  SSL_SESSION *session = 0;
+  if(!der.empty()) {
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(der.data());
+    session = d2i_SSL_SESSION(0, &p, der.size());
+  }
+  if(session) {
+    __sync_add_and_fetch(&stats.session_cache_hits, 1);
+  } else {
+    __sync_add_and_fetch(&stats.session_cache_misses, 1);
+  }
+  return session;
+}
+} // namespace
+
+namespace {
+void remove_session_cb(SSL_CTX *ssl_ctx, SSL_SESSION *session)
+{
+  unsigned int idlen;
+  const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+  std::string key(reinterpret_cast<const char*>(id), idlen);
+  pthread_mutex_lock(&session_cache_lock);
+  std::map<std::string, SessionCacheEntry>::iterator i =
+    session_cache.find(key);
+  if(i != session_cache.end()) {
+    erase_session(i);
+  }
+  pthread_mutex_unlock(&session_cache_lock);
+}
+} // namespace
+
+size_t get_session_cache_entries()
+{
+  pthread_mutex_lock(&session_cache_lock);
+  size_t n = session_cache.size();
+  pthread_mutex_unlock(&session_cache_lock);
+  return n;
+}
+
+const TLSStats& get_stats()
+{
+  return stats;
+}
+
 SSL_CTX* create_ssl_context()
 {
   SSL_CTX *ssl_ctx;
   ssl_ctx = SSL_CTX_new(SSLv23_server_method());
   if(!ssl_ctx) {
-    LOG(FATAL) << ERR_error_string(ERR_get_error(), 0);
-    DIE();
+    LOG(ERROR) << ERR_error_string(ERR_get_error(), 0);
+    return 0;
   }
   SSL_CTX_set_options(ssl_ctx,
                       SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_COMPRESSION |
@@ -83,20 +455,45 @@ SSL_CTX* create_ssl_context()
   SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
   SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
   SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+  // The session cache is kept outside SSL_CTX, so that the sessions
+  // are not lost when SSL_CTX is recreated on reload. The key to
+  // encrypt session tickets is shared too.
+  if(get_config()->tls_session_cache_size > 0) {
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER |
+                                   SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_cb);
+    SSL_CTX_sess_set_get_cb(ssl_ctx, get_session_cb);
+    SSL_CTX_sess_set_remove_cb(ssl_ctx, remove_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+  }
+  SSL_CTX_set_session_id_context
+    (ssl_ctx, reinterpret_cast<const unsigned char*>("shrpx"), 5);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, ticket_key_cb);
+#else // OPENSSL_VERSION_NUMBER < 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, ticket_key_cb);
+#endif // OPENSSL_VERSION_NUMBER < 0x30000000L
+  SSL_CTX_set_info_callback(ssl_ctx, info_callback);
+
   if(SSL_CTX_use_PrivateKey_file(ssl_ctx,
                                  get_config()->private_key_file,
                                  SSL_FILETYPE_PEM) != 1) {
-    LOG(FATAL) << "SSL_CTX_use_PrivateKey_file failed.";
-    DIE();
+    LOG(ERROR) << "SSL_CTX_use_PrivateKey_file failed.";
+    SSL_CTX_free(ssl_ctx);
+    return 0;
   }
   if(SSL_CTX_use_certificate_file(ssl_ctx, get_config()->cert_file,
                                   SSL_FILETYPE_PEM) != 1) {
-    LOG(FATAL) << "SSL_CTX_use_certificate_file failed.";
-    DIE();
+    LOG(ERROR) << "SSL_CTX_use_certificate_file failed.";
+    SSL_CTX_free(ssl_ctx);
+    return 0;
   }
   if(SSL_CTX_check_private_key(ssl_ctx) != 1) {
-    LOG(FATAL) << "SSL_CTX_check_private_key failed.";
-    DIE();
+    LOG(ERROR) << "SSL_CTX_check_private_key failed.";
+    SSL_CTX_free(ssl_ctx);
+    return 0;
   }
   if(get_config()->verify_client) {
     SSL_CTX_set_verify(ssl_ctx,
@@ -118,6 +515,15 @@ SSL_CTX* create_ssl_context()
   return ssl_ctx;
 }
 
+void ref_ssl_context(SSL_CTX *ssl_ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  SSL_CTX_up_ref(ssl_ctx);
+#else // OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&ssl_ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+}
+
 ClientHandler* accept_ssl_connection(event_base *evbase, SSL_CTX *ssl_ctx,
                                      evutil_socket_t fd,
                                      sockaddr *addr, int addrlen)
@@ -149,6 +555,8 @@ ClientHandler* accept_ssl_connection(event_base *evbase, SSL_CTX *ssl_ctx,
   }
 }
 
+// OpenSSL 1.1.0 and later do the locking by themselves.
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 namespace {
 pthread_mutex_t *ssl_locks;
 } // namespace
@@ -185,6 +593,7 @@ void teardown_ssl_lock()
   }
   delete [] ssl_locks;
 }
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
 
 } // namespace ssl
 
@@ -27,6 +27,8 @@
 
 #include "shrpx.h"
 
+#include <stdint.h>
+
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
@@ -38,15 +40,56 @@ class ClientHandler;
 
 namespace ssl {
 
+struct TLSStats {
+  // The number of completed handshakes, including resumed ones.
+  uint64_t handshakes;
+  uint64_t resumed_handshakes;
+  // The number of session tickets decrypted successfully.
+  uint64_t ticket_hits;
+  // The number of session tickets encrypted by unknown key.
+  uint64_t ticket_misses;
+  // The number of sessions found in the session cache.
+  uint64_t session_cache_hits;
+  // The number of session IDs not found in the session cache,
+  // including expired ones.
+  uint64_t session_cache_misses;
+  // The number of expired sessions looked up in the session cache.
+  uint64_t session_cache_timeouts;
+};
+
+// Loads the session ticket keys from the files in configuration. If
+// no file is given, generates the key and rotates it periodically
+// using |evbase|. Returns 0 if it succeeds, or -1.
+int init_ticket_keys(event_base *evbase);
+
+// Reads the session ticket key files again. The keys are not changed
+// if an error occurs. Returns 0 if it succeeds or no file is given,
+// or -1.
+int reload_ticket_keys();
+
+const TLSStats& get_stats();
+
+// Returns the number of sessions in the session cache.
+size_t get_session_cache_entries();
+
+// Creates SSL_CTX from the private key and certificate files in
+// configuration. Returns NULL if it fails.
 SSL_CTX* create_ssl_context();
 
+// Increments the reference count of |ssl_ctx|. Each reference is
+// released by SSL_CTX_free().
+void ref_ssl_context(SSL_CTX *ssl_ctx);
+
 ClientHandler* accept_ssl_connection(event_base *evbase, SSL_CTX *ssl_ctx,
                                      evutil_socket_t fd,
                                      sockaddr *addr, int addrlen);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL 1.1.0 and later do not need the locking callbacks.
 void setup_ssl_lock();
 
 void teardown_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
 
 } // namespace ssl
 
@@ -0,0 +1,313 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_stat.h"
+
+#include <cstring>
+
+#include "shrpx_ssl.h"
+
+namespace shrpx {
+
+const int64_t LatencyHistogram::BOUNDS[] = {
+  100, 250, 500,
+  1000, 2500, 5000,
+  10000, 25000, 50000,
+  100000, 250000, 500000,
+  1000000, 2500000, 5000000,
+  10000000
+};
+
+LatencyHistogram::LatencyHistogram()
+  : sum(0)
+{
+  memset(counts, 0, sizeof(counts));
+}
+
+void LatencyHistogram::record(int64_t usec)
+{
+  if(usec < 0) {
+    usec = 0;
+  }
+  size_t i;
+  for(i = 0; i < NUM_BUCKETS && usec > BOUNDS[i]; ++i);
+  ++counts[i];
+  sum += usec;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+  for(size_t i = 0; i <= NUM_BUCKETS; ++i) {
+    counts[i] += other.counts[i];
+  }
+  sum += other.sum;
+}
+
+WorkerStat::WorkerStat()
+  : accepted_connections(0),
+    active_connections(0),
+    npn_spdy2(0),
+    npn_spdy3(0),
+    npn_other(0),
+    npn_none(0),
+    active_spdy_sessions(0),
+    spdy_streams(0),
+    requests(0),
+    active_requests(0),
+    request_body_bytes(0),
+    response_body_bytes(0),
+    downstream_connection_reused(0),
+    downstream_connection_warm(0),
+    downstream_connection_created(0),
+    cache_hits(0),
+    cache_misses(0),
+    coalesced_requests(0),
+    shed_connections_limit(0),
+    shed_connections_overload(0),
+    shed_requests_limit(0),
+    shed_requests_overload(0)
+{}
+
+void WorkerStat::merge(const WorkerStat& other)
+{
+  accepted_connections += other.accepted_connections;
+  active_connections += other.active_connections;
+  npn_spdy2 += other.npn_spdy2;
+  npn_spdy3 += other.npn_spdy3;
+  npn_other += other.npn_other;
+  npn_none += other.npn_none;
+  active_spdy_sessions += other.active_spdy_sessions;
+  spdy_streams += other.spdy_streams;
+  requests += other.requests;
+  active_requests += other.active_requests;
+  request_body_bytes += other.request_body_bytes;
+  response_body_bytes += other.response_body_bytes;
+  downstream_connection_reused += other.downstream_connection_reused;
+  downstream_connection_warm += other.downstream_connection_warm;
+  downstream_connection_created += other.downstream_connection_created;
+  cache_hits += other.cache_hits;
+  cache_misses += other.cache_misses;
+  coalesced_requests += other.coalesced_requests;
+  shed_connections_limit += other.shed_connections_limit;
+  shed_connections_overload += other.shed_connections_overload;
+  shed_requests_limit += other.shed_requests_limit;
+  shed_requests_overload += other.shed_requests_overload;
+  tls_handshake_time.merge(other.tls_handshake_time);
+  request_time.merge(other.request_time);
+  downstream_connect_time.merge(other.downstream_connect_time);
+  downstream_connect_wait_time.merge(other.downstream_connect_wait_time);
+  downstream_response_time.merge(other.downstream_response_time);
+  event_loop_lag.merge(other.event_loop_lag);
+}
+
+WorkerStatSnapshot::WorkerStatSnapshot()
+{
+  pthread_mutex_init(&mutex_, 0);
+}
+
+WorkerStatSnapshot::~WorkerStatSnapshot()
+{
+  pthread_mutex_destroy(&mutex_);
+}
+
+void WorkerStatSnapshot::update(const WorkerStat& stat)
+{
+  pthread_mutex_lock(&mutex_);
+  stat_ = stat;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void WorkerStatSnapshot::merge_to(WorkerStat *stat)
+{
+  pthread_mutex_lock(&mutex_);
+  stat->merge(stat_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+int64_t elapsed_usec(const timeval& start)
+{
+  timeval now;
+  gettimeofday(&now, 0);
+  return static_cast<int64_t>(now.tv_sec - start.tv_sec)*1000000 +
+    now.tv_usec - start.tv_usec;
+}
+
+namespace {
+void write_header(evbuffer *buf, const char *name, const char *type,
+                  const char *help)
+{
+  evbuffer_add_printf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+                      name, help, name, type);
+}
+} // namespace
+
+namespace {
+void write_metric(evbuffer *buf, const char *name, const char *type,
+                  const char *help, long long int value)
+{
+  write_header(buf, name, type, help);
+  evbuffer_add_printf(buf, "%s %lld\n", name, value);
+}
+} // namespace
+
+namespace {
+void write_histogram(evbuffer *buf, const char *name, const char *help,
+                     const LatencyHistogram& hist)
+{
+  write_header(buf, name, "histogram", help);
+  unsigned long long int count = 0;
+  for(size_t i = 0; i < LatencyHistogram::NUM_BUCKETS; ++i) {
+    count += hist.counts[i];
+    evbuffer_add_printf(buf, "%s_bucket{le=\"%g\"} %llu\n", name,
+                        LatencyHistogram::BOUNDS[i]/1000000.0, count);
+  }
+  count += hist.counts[LatencyHistogram::NUM_BUCKETS];
+  evbuffer_add_printf(buf, "%s_bucket{le=\"+Inf\"} %llu\n", name, count);
+  evbuffer_add_printf(buf, "%s_sum %.6f\n", name, hist.sum/1000000.0);
+  evbuffer_add_printf(buf, "%s_count %llu\n", name, count);
+}
+} // namespace
+
+void write_metrics(evbuffer *buf, const WorkerStat& stat)
+{
+  write_metric(buf, "shrpx_connections_accepted_total", "counter",
+               "Number of accepted client connections.",
+               stat.accepted_connections);
+  write_metric(buf, "shrpx_connections_active", "gauge",
+               "Number of open client connections.",
+               stat.active_connections);
+  write_header(buf, "shrpx_npn_negotiated_total", "counter",
+               "Number of completed SSL/TLS handshakes by NPN result.");
+  evbuffer_add_printf(buf,
+                      "shrpx_npn_negotiated_total{protocol=\"spdy/3\"} %llu\n"
+                      "shrpx_npn_negotiated_total{protocol=\"spdy/2\"} %llu\n"
+                      "shrpx_npn_negotiated_total{protocol=\"other\"} %llu\n"
+                      "shrpx_npn_negotiated_total{protocol=\"none\"} %llu\n",
+                      static_cast<unsigned long long int>(stat.npn_spdy3),
+                      static_cast<unsigned long long int>(stat.npn_spdy2),
+                      static_cast<unsigned long long int>(stat.npn_other),
+                      static_cast<unsigned long long int>(stat.npn_none));
+  write_metric(buf, "shrpx_spdy_sessions_active", "gauge",
+               "Number of open SPDY sessions.", stat.active_spdy_sessions);
+  write_metric(buf, "shrpx_spdy_streams_total", "counter",
+               "Number of SPDY streams opened by clients.",
+               stat.spdy_streams);
+  write_metric(buf, "shrpx_requests_total", "counter",
+               "Number of requests received from clients.", stat.requests);
+  write_metric(buf, "shrpx_requests_active", "gauge",
+               "Number of requests in progress.", stat.active_requests);
+  write_metric(buf, "shrpx_request_body_bytes_total", "counter",
+               "Bytes of request bodies forwarded to downstream.",
+               stat.request_body_bytes);
+  write_metric(buf, "shrpx_response_body_bytes_total", "counter",
+               "Bytes of response bodies sent to clients.",
+               stat.response_body_bytes);
+  write_header(buf, "shrpx_downstream_connections_total", "counter",
+               "Number of downstream connections assigned to requests.");
+  evbuffer_add_printf(buf,
+                      "shrpx_downstream_connections_total{pool=\"hit\"} %llu\n"
+                      "shrpx_downstream_connections_total{pool=\"warm\"} "
+                      "%llu\n"
+                      "shrpx_downstream_connections_total{pool=\"miss\"} "
+                      "%llu\n",
+                      static_cast<unsigned long long int>
+                      (stat.downstream_connection_reused),
+                      static_cast<unsigned long long int>
+                      (stat.downstream_connection_warm),
+                      static_cast<unsigned long long int>
+                      (stat.downstream_connection_created));
+  write_header(buf, "shrpx_cache_lookups_total", "counter",
+               "Number of response cache lookups.");
+  evbuffer_add_printf(buf,
+                      "shrpx_cache_lookups_total{result=\"hit\"} %llu\n"
+                      "shrpx_cache_lookups_total{result=\"miss\"} %llu\n",
+                      static_cast<unsigned long long int>(stat.cache_hits),
+                      static_cast<unsigned long long int>(stat.cache_misses));
+  write_metric(buf, "shrpx_coalesced_requests_total", "counter",
+               "Number of requests served by the response of the other "
+               "request.", stat.coalesced_requests);
+  write_header(buf, "shrpx_shed_connections_total", "counter",
+               "Number of connections closed without being served.");
+  evbuffer_add_printf(buf,
+                      "shrpx_shed_connections_total{reason=\"limit\"} "
+                      "%llu\n"
+                      "shrpx_shed_connections_total{reason=\"overload\"} "
+                      "%llu\n",
+                      static_cast<unsigned long long int>
+                      (stat.shed_connections_limit),
+                      static_cast<unsigned long long int>
+                      (stat.shed_connections_overload));
+  write_header(buf, "shrpx_shed_requests_total", "counter",
+               "Number of requests refused before sent to downstream.");
+  evbuffer_add_printf(buf,
+                      "shrpx_shed_requests_total{reason=\"limit\"} %llu\n"
+                      "shrpx_shed_requests_total{reason=\"overload\"} "
+                      "%llu\n",
+                      static_cast<unsigned long long int>
+                      (stat.shed_requests_limit),
+                      static_cast<unsigned long long int>
+                      (stat.shed_requests_overload));
+  write_histogram(buf, "shrpx_tls_handshake_duration_seconds",
+                  "Time to complete SSL/TLS handshake.",
+                  stat.tls_handshake_time);
+  write_histogram(buf, "shrpx_request_duration_seconds",
+                  "Lifetime of requests and SPDY streams.",
+                  stat.request_time);
+  write_histogram(buf, "shrpx_downstream_connect_duration_seconds",
+                  "Time to connect to downstream server.",
+                  stat.downstream_connect_time);
+  write_histogram(buf, "shrpx_downstream_connect_wait_duration_seconds",
+                  "Time each request waits for its downstream connection "
+                  "to be established.",
+                  stat.downstream_connect_wait_time);
+  write_histogram(buf, "shrpx_downstream_response_duration_seconds",
+                  "Time from sending the request headers to receiving "
+                  "the response headers from downstream server.",
+                  stat.downstream_response_time);
+  write_histogram(buf, "shrpx_event_loop_lag_seconds",
+                  "Delay of the periodic timer in the event loop.",
+                  stat.event_loop_lag);
+
+  const ssl::TLSStats& tls_stats = ssl::get_stats();
+  write_metric(buf, "shrpx_tls_handshakes_total", "counter",
+               "Number of completed SSL/TLS handshakes.",
+               tls_stats.handshakes);
+  write_metric(buf, "shrpx_tls_resumed_handshakes_total", "counter",
+               "Number of abbreviated SSL/TLS handshakes.",
+               tls_stats.resumed_handshakes);
+  write_metric(buf, "shrpx_tls_session_cache_hits_total", "counter",
+               "Number of sessions resumed from the session cache.",
+               tls_stats.session_cache_hits);
+  write_metric(buf, "shrpx_tls_session_cache_misses_total", "counter",
+               "Number of sessions not found in the session cache.",
+               tls_stats.session_cache_misses);
+  write_metric(buf, "shrpx_tls_ticket_hits_total", "counter",
+               "Number of sessions resumed from tickets.",
+               tls_stats.ticket_hits);
+  write_metric(buf, "shrpx_tls_ticket_misses_total", "counter",
+               "Number of tickets which could not be decrypted.",
+               tls_stats.ticket_misses);
+}
+
+} // namespace shrpx
@@ -0,0 +1,137 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_STAT_H
+#define SHRPX_STAT_H
+
+#include "shrpx.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+namespace shrpx {
+
+// Histogram of durations with the fixed buckets, which are exported
+// as Prometheus histogram.
+struct LatencyHistogram {
+  enum { NUM_BUCKETS = 16 };
+  // The upper bounds of the buckets in microseconds.
+  static const int64_t BOUNDS[NUM_BUCKETS];
+  // counts[i] is the number of the durations in the range
+  // (BOUNDS[i-1], BOUNDS[i]]. counts[NUM_BUCKETS] is the number of
+  // the durations larger than the last bound.
+  uint64_t counts[NUM_BUCKETS+1];
+  // The sum of the durations in microseconds.
+  uint64_t sum;
+  LatencyHistogram();
+  void record(int64_t usec);
+  void merge(const LatencyHistogram& other);
+};
+
+// Statistics of one worker thread. The fields are only updated by the
+// thread which owns this object, so no locking is needed. The worker
+// threads publish them to the main thread through
+// WorkerStatSnapshot.
+struct WorkerStat {
+  uint64_t accepted_connections;
+  int64_t active_connections;
+  // The result of NPN in ClientHandler::validate_next_proto().
+  uint64_t npn_spdy2;
+  uint64_t npn_spdy3;
+  // The other protocol was negotiated. HTTP/1.1 is used.
+  uint64_t npn_other;
+  // NPN was not used. HTTP/1.1 is used.
+  uint64_t npn_none;
+  int64_t active_spdy_sessions;
+  uint64_t spdy_streams;
+  uint64_t requests;
+  int64_t active_requests;
+  uint64_t request_body_bytes;
+  uint64_t response_body_bytes;
+  // Downstream connections reused from the pool of ClientHandler,
+  // taken from DownstreamWarmPool, and the ones newly created.
+  uint64_t downstream_connection_reused;
+  uint64_t downstream_connection_warm;
+  uint64_t downstream_connection_created;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t coalesced_requests;
+  // Connections and requests shed by AdmissionControl because of the
+  // limits, and because the event loop lags.
+  uint64_t shed_connections_limit;
+  uint64_t shed_connections_overload;
+  uint64_t shed_requests_limit;
+  uint64_t shed_requests_overload;
+  // From the creation of ClientHandler to the completion of SSL/TLS
+  // handshake.
+  LatencyHistogram tls_handshake_time;
+  // From the creation of Downstream to its release.
+  LatencyHistogram request_time;
+  LatencyHistogram downstream_connect_time;
+  // The time each request waits for its downstream connection to be
+  // established. It is 0 if the connection is reused or warm.
+  LatencyHistogram downstream_connect_wait_time;
+  // From sending the request headers to receiving the response
+  // headers from the downstream server.
+  LatencyHistogram downstream_response_time;
+  // Delay of the periodic timer of AdmissionControl. Only recorded
+  // if max_event_loop_lag is set.
+  LatencyHistogram event_loop_lag;
+  WorkerStat();
+  void merge(const WorkerStat& other);
+};
+
+// The copy of WorkerStat which a worker thread publishes to the main
+// thread. The worker thread calls update() periodically from its
+// event loop, and the main thread reads the last published values by
+// merge_to(), so that it never reads the fields being updated.
+class WorkerStatSnapshot {
+public:
+  WorkerStatSnapshot();
+  ~WorkerStatSnapshot();
+  void update(const WorkerStat& stat);
+  // Merges the last published values into |stat|.
+  void merge_to(WorkerStat *stat);
+private:
+  pthread_mutex_t mutex_;
+  WorkerStat stat_;
+};
+
+// The interval at which the worker threads publish their
+// statistics.
+const time_t STAT_PUBLISH_INTERVAL = 1;
+
+// Returns the number of microseconds elapsed since |start|.
+int64_t elapsed_usec(const timeval& start);
+
+// Appends |stat| and the TLS statistics to |buf| in Prometheus text
+// exposition format.
+void write_metrics(evbuffer *buf, const WorkerStat& stat);
+
+} // namespace shrpx
+
+#endif // SHRPX_STAT_H
@@ -28,16 +28,48 @@
 
 #include "shrpx_ssl.h"
 #include "shrpx_log.h"
-#include "shrpx_client_handler.h"
+#include "shrpx_downstream_warm_pool.h"
+#include "shrpx_admission_control.h"
 
 namespace shrpx {
 
-ThreadEventReceiver::ThreadEventReceiver(SSL_CTX *ssl_ctx)
-  : ssl_ctx_(ssl_ctx)
-{}
+namespace {
+void drained_cb(void *arg)
+{
+  ThreadEventReceiver *receiver = reinterpret_cast<ThreadEventReceiver*>(arg);
+  receiver->on_drained();
+}
+} // namespace
+
+ThreadEventReceiver::ThreadEventReceiver(bufferevent *bev,
+                                         SSL_CTX *ssl_ctx,
+                                         const DownstreamAddr& downstream_addr,
+                                         HttpCache *http_cache,
+                                         DownstreamPool *downstream_pool,
+                                         WorkerStat *stat)
+  : bev_(bev),
+    ssl_ctx_(ssl_ctx),
+    downstream_addr_(downstream_addr),
+    warm_pool_(0),
+    admission_control_(new AdmissionControl(bufferevent_get_base(bev), stat)),
+    http_cache_(http_cache),
+    downstream_pool_(downstream_pool),
+    stat_(stat),
+    handler_set_(drained_cb, this)
+{
+  if(get_config()->downstream_warm_connections > 0) {
+    warm_pool_ = new DownstreamWarmPool
+      (bufferevent_get_base(bev_), &downstream_addr_,
+       get_config()->downstream_warm_connections);
+  }
+}
 
 ThreadEventReceiver::~ThreadEventReceiver()
-{}
+{
+  delete warm_pool_;
+  delete admission_control_;
+  SSL_CTX_free(ssl_ctx_);
+}
 
 void ThreadEventReceiver::on_read(bufferevent *bev)
 {
@@ -45,27 +77,88 @@ void ThreadEventReceiver::on_read(bufferevent *bev)
   while(evbuffer_get_length(input) >= sizeof(WorkerEvent)) {
     WorkerEvent wev;
     evbuffer_remove(input, &wev, sizeof(WorkerEvent));
-    if(ENABLE_LOG) {
-      LOG(INFO) << "WorkerEvent: client_fd=" << wev.client_fd
-                << ", addrlen=" << wev.client_addrlen;
-    }
-    event_base *evbase = bufferevent_get_base(bev);
-    ClientHandler *client_handler;
-    client_handler = ssl::accept_ssl_connection(evbase, ssl_ctx_,
-                                                wev.client_fd,
-                                                &wev.client_addr.sa,
-                                                wev.client_addrlen);
-    if(client_handler) {
+    switch(wev.type) {
+    case WORKER_NEW_CONNECTION:
+      accept_connection(wev);
+      break;
+    case WORKER_RELOAD:
+      reload(wev);
+      break;
+    case WORKER_GRACEFUL_SHUTDOWN:
       if(ENABLE_LOG) {
-        LOG(INFO) << "ClientHandler " << client_handler << " created";
+        LOG(INFO) << "Starting graceful shutdown";
       }
-    } else {
-      if(ENABLE_LOG) {
-        LOG(ERROR) << "ClientHandler creation failed";
+      if(warm_pool_) {
+        warm_pool_->shutdown();
       }
-      close(wev.client_fd);
+      handler_set_.start_graceful_shutdown();
+      break;
+    }
+  }
+}
+
+void ThreadEventReceiver::accept_connection(const WorkerEvent& wev)
+{
+  if(ENABLE_LOG) {
+    LOG(INFO) << "WorkerEvent: client_fd=" << wev.client_fd
+              << ", addrlen=" << wev.client_addrlen;
+  }
+  if(!admission_control_->admit_connection(handler_set_.size())) {
+    if(ENABLE_LOG) {
+      LOG(INFO) << "Connection is shed";
+    }
+    close(wev.client_fd);
+    return;
+  }
+  event_base *evbase = bufferevent_get_base(bev_);
+  ClientHandler *client_handler;
+  client_handler = ssl::accept_ssl_connection
+    (evbase, ssl_ctx_, wev.client_fd,
+     const_cast<sockaddr*>(&wev.client_addr.sa), wev.client_addrlen);
+  if(client_handler) {
+    client_handler->set_http_cache(http_cache_);
+    client_handler->set_downstream_pool(downstream_pool_);
+    client_handler->set_worker_stat(stat_);
+    client_handler->set_downstream_addr(&downstream_addr_);
+    client_handler->set_downstream_warm_pool(warm_pool_);
+    client_handler->set_admission_control(admission_control_);
+    client_handler->set_handler_set(&handler_set_);
+    if(ENABLE_LOG) {
+      LOG(INFO) << "ClientHandler " << client_handler << " created";
+    }
+  } else {
+    if(ENABLE_LOG) {
+      LOG(ERROR) << "ClientHandler creation failed";
+    }
+    close(wev.client_fd);
+  }
+}
+
+void ThreadEventReceiver::reload(const WorkerEvent& wev)
+{
+  if(ENABLE_LOG) {
+    LOG(INFO) << "Reloading SSL_CTX and downstream address";
+  }
+  // The connections established so far keep the old SSL_CTX through
+  // their SSL objects.
+  SSL_CTX_free(ssl_ctx_);
+  ssl_ctx_ = wev.ssl_ctx;
+  if(downstream_addr_.addrlen != wev.downstream_addr.addrlen ||
+     memcmp(&downstream_addr_.addr, &wev.downstream_addr.addr,
+            wev.downstream_addr.addrlen) != 0) {
+    downstream_addr_ = wev.downstream_addr;
+    // The idle connections to the old address are not reused.
+    handler_set_.clear_downstream_connection_pools();
+    if(warm_pool_) {
+      warm_pool_->reset();
     }
   }
 }
 
+void ThreadEventReceiver::on_drained()
+{
+  // Tell the main thread that this worker has no connection.
+  bufferevent_write(bev_, "", 1);
+}
+
 } // namespace shrpx
@@ -32,22 +32,64 @@
 #include <event2/bufferevent.h>
 
 #include "shrpx_config.h"
+#include "shrpx_client_handler.h"
 
 namespace shrpx {
 
+class HttpCache;
+class DownstreamPool;
+class DownstreamWarmPool;
+class AdmissionControl;
+struct WorkerStat;
+
+enum WorkerEventType {
+  // Accept the connection of client_fd.
+  WORKER_NEW_CONNECTION,
+  // Use ssl_ctx and downstream_addr for the new connections.
+  WORKER_RELOAD,
+  // Shut down the connections gracefully. The worker writes 1 byte
+  // to the main thread when all connections are closed.
+  WORKER_GRACEFUL_SHUTDOWN
+};
+
 struct WorkerEvent {
+  WorkerEventType type;
   evutil_socket_t client_fd;
   sockaddr_union client_addr;
   size_t client_addrlen;
+  // The reference of ssl_ctx is passed to the worker.
+  SSL_CTX *ssl_ctx;
+  DownstreamAddr downstream_addr;
 };
-  
+
 class ThreadEventReceiver {
 public:
-  ThreadEventReceiver(SSL_CTX *ssl_ctx);
+  // |bev| is the channel to the main thread. The reference of
+  // |ssl_ctx| is passed to this object.
+  ThreadEventReceiver(bufferevent *bev,
+                      SSL_CTX *ssl_ctx, const DownstreamAddr& downstream_addr,
+                      HttpCache *http_cache,
+                      DownstreamPool *downstream_pool, WorkerStat *stat);
   ~ThreadEventReceiver();
   void on_read(bufferevent *bev);
+  // Called when all connections are closed after the graceful
+  // shutdown.
+  void on_drained();
 private:
+  void accept_connection(const WorkerEvent& wev);
+  void reload(const WorkerEvent& wev);
+
+  bufferevent *bev_;
   SSL_CTX *ssl_ctx_;
+  DownstreamAddr downstream_addr_;
+  // Connections to downstream_addr_ established in advance, or 0 if
+  // disabled.
+  DownstreamWarmPool *warm_pool_;
+  AdmissionControl *admission_control_;
+  HttpCache *http_cache_;
+  DownstreamPool *downstream_pool_;
+  WorkerStat *stat_;
+  ClientHandlerSet handler_set_;
 };
 
 } // namespace shrpx
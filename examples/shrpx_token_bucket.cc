@@ -0,0 +1,97 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_token_bucket.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace shrpx {
+
+TokenBucket::TokenBucket()
+  : rate_(0),
+    burst_(0),
+    tokens_(0),
+    frac_(0)
+{
+  last_.tv_sec = 0;
+  last_.tv_usec = 0;
+}
+
+void TokenBucket::init(size_t rate, size_t burst, const timeval *now)
+{
+  rate_ = rate;
+  burst_ = burst;
+  tokens_ = burst;
+  frac_ = 0;
+  last_ = *now;
+}
+
+size_t TokenBucket::get_available(const timeval *now)
+{
+  int64_t usec = (now->tv_sec - last_.tv_sec) * 1000000LL +
+    now->tv_usec - last_.tv_usec;
+  if(usec < 0) {
+    // The clock went backwards.
+    last_ = *now;
+    return tokens_;
+  }
+  last_ = *now;
+  // The fraction of a token is carried over to the next call, so that
+  // frequent calls do not lose it.
+  uint64_t add = static_cast<uint64_t>(rate_) * usec + frac_;
+  frac_ = add % 1000000;
+  add /= 1000000;
+  if(tokens_ + add >= burst_) {
+    tokens_ = burst_;
+    frac_ = 0;
+  } else {
+    tokens_ += add;
+  }
+  return tokens_;
+}
+
+void TokenBucket::consume(size_t n)
+{
+  tokens_ -= std::min(n, tokens_);
+}
+
+void TokenBucket::get_wait_time(timeval *tv, size_t n) const
+{
+  uint64_t usec = 0;
+  if(n > tokens_ && rate_ > 0) {
+    usec = (static_cast<uint64_t>(n - tokens_) * 1000000 - frac_ + rate_ - 1) /
+      rate_;
+  }
+  tv->tv_sec = usec / 1000000;
+  tv->tv_usec = usec % 1000000;
+}
+
+size_t TokenBucket::get_burst() const
+{
+  return burst_;
+}
+
+} // namespace shrpx
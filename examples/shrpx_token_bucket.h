@@ -0,0 +1,60 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_TOKEN_BUCKET_H
+#define SHRPX_TOKEN_BUCKET_H
+
+#include "shrpx.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+
+namespace shrpx {
+
+// Token bucket which allows |rate| bytes per second on average and
+// bursts of up to |burst| bytes. The bucket is full when it is
+// initialized.
+class TokenBucket {
+public:
+  TokenBucket();
+  void init(size_t rate, size_t burst, const timeval *now);
+  // Returns the number of bytes which can be sent at |now|.
+  size_t get_available(const timeval *now);
+  void consume(size_t n);
+  // Stores in |tv| the time until |n| bytes become available.
+  void get_wait_time(timeval *tv, size_t n) const;
+  size_t get_burst() const;
+private:
+  size_t rate_;
+  size_t burst_;
+  size_t tokens_;
+  // The fraction of a token in 1/1000000 token.
+  uint64_t frac_;
+  // The time when the tokens were last added.
+  timeval last_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_TOKEN_BUCKET_H
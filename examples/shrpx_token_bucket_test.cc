@@ -0,0 +1,138 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_token_bucket_test.h"
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_token_bucket.h"
+
+namespace shrpx {
+
+namespace {
+timeval msec(int64_t t)
+{
+  timeval tv;
+  tv.tv_sec = t / 1000;
+  tv.tv_usec = (t % 1000) * 1000;
+  return tv;
+}
+} // namespace
+
+void test_token_bucket(void)
+{
+  TokenBucket bucket;
+  timeval now = msec(1000);
+  bucket.init(1000, 100, &now);
+  CU_ASSERT(100 == bucket.get_burst());
+  // The bucket is full when it is initialized.
+  CU_ASSERT(100 == bucket.get_available(&now));
+  bucket.consume(30);
+  CU_ASSERT(70 == bucket.get_available(&now));
+  // Consuming more than available empties the bucket.
+  bucket.consume(1000);
+  CU_ASSERT(0 == bucket.get_available(&now));
+
+  now = msec(1010);
+  CU_ASSERT(10 == bucket.get_available(&now));
+  now = msec(1050);
+  CU_ASSERT(50 == bucket.get_available(&now));
+  // The tokens never exceed the burst.
+  now = msec(5000);
+  CU_ASSERT(100 == bucket.get_available(&now));
+  now = msec(6000);
+  CU_ASSERT(100 == bucket.get_available(&now));
+
+  // The clock going backwards adds nothing.
+  bucket.consume(100);
+  now = msec(5500);
+  CU_ASSERT(0 == bucket.get_available(&now));
+  now = msec(5520);
+  CU_ASSERT(20 == bucket.get_available(&now));
+}
+
+void test_token_bucket_fraction(void)
+{
+  TokenBucket bucket;
+  timeval now = msec(0);
+  bucket.init(10, 10, &now);
+  bucket.consume(10);
+  // 1.5 tokens, and then another 0.5 token.
+  now = msec(150);
+  CU_ASSERT(1 == bucket.get_available(&now));
+  now = msec(200);
+  CU_ASSERT(2 == bucket.get_available(&now));
+
+  // 3 tokens per second polled every millisecond give exactly 3
+  // tokens in a second.
+  now = msec(0);
+  bucket.init(3, 10, &now);
+  bucket.consume(10);
+  for(int64_t t = 1; t < 1000; ++t) {
+    now = msec(t);
+    bucket.get_available(&now);
+  }
+  now = msec(999);
+  CU_ASSERT(2 == bucket.get_available(&now));
+  now = msec(1000);
+  CU_ASSERT(3 == bucket.get_available(&now));
+
+  // The fraction is not kept when the bucket is full, so that it
+  // never exceeds the burst.
+  now = msec(0);
+  bucket.init(10, 2, &now);
+  now = msec(50);
+  CU_ASSERT(2 == bucket.get_available(&now));
+  bucket.consume(2);
+  now = msec(100);
+  CU_ASSERT(0 == bucket.get_available(&now));
+  now = msec(150);
+  CU_ASSERT(1 == bucket.get_available(&now));
+}
+
+void test_token_bucket_wait_time(void)
+{
+  TokenBucket bucket;
+  timeval now = msec(0);
+  timeval tv;
+  bucket.init(1000, 100, &now);
+  bucket.get_wait_time(&tv, 100);
+  CU_ASSERT(0 == tv.tv_sec && 0 == tv.tv_usec);
+  bucket.consume(100);
+  bucket.get_wait_time(&tv, 10);
+  CU_ASSERT(0 == tv.tv_sec && 10000 == tv.tv_usec);
+
+  // The fraction already accumulated shortens the wait.
+  now = msec(0);
+  bucket.init(3, 10, &now);
+  bucket.consume(10);
+  now = msec(500);
+  CU_ASSERT(1 == bucket.get_available(&now));
+  bucket.get_wait_time(&tv, 2);
+  CU_ASSERT(0 == tv.tv_sec && 166667 == tv.tv_usec);
+  bucket.get_wait_time(&tv, 5);
+  CU_ASSERT(1 == tv.tv_sec && 166667 == tv.tv_usec);
+}
+
+} // namespace shrpx
@@ -49,6 +49,14 @@ public:
   virtual int on_downstream_body(Downstream *downstream,
                                  const uint8_t *data, size_t len) = 0;
   virtual int on_downstream_body_complete(Downstream *downstream) = 0;
+  // Called when |downstream| following the other request loses its
+  // leader. If no response header has been sent yet, |downstream|
+  // has to issue its request to downstream server by itself.
+  virtual int on_downstream_abort(Downstream *downstream) = 0;
+  // Stops taking new requests and lets the requests in progress
+  // finish. The connection is closed after that. Returns -1 if the
+  // connection can be closed immediately.
+  virtual int start_graceful_shutdown() = 0;
 };
 
 } // namespace shrpx
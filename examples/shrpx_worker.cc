@@ -31,19 +31,38 @@
 #include <event2/bufferevent.h>
 
 #include "shrpx_ssl.h"
+#include "shrpx_listen_handler.h"
 #include "shrpx_thread_event_receiver.h"
 #include "shrpx_log.h"
+#include "shrpx_config.h"
+#include "shrpx_http_cache.h"
+#include "shrpx_downstream.h"
+#include "shrpx_stat.h"
 
 namespace shrpx {
 
-Worker::Worker(int fd)
+Worker::Worker(int fd, SSL_CTX *ssl_ctx,
+               const DownstreamAddr& downstream_addr,
+               WorkerStatSnapshot *snapshot)
   : fd_(fd),
-    ssl_ctx_(ssl::create_ssl_context())
-{}
+    ssl_ctx_(ssl_ctx),
+    downstream_addr_(downstream_addr),
+    http_cache_(0),
+    downstream_pool_(new DownstreamPool()),
+    stat_(new WorkerStat()),
+    snapshot_(snapshot)
+{
+  if(get_config()->http_cache_size > 0) {
+    http_cache_ = new HttpCache(get_config()->http_cache_size,
+                                get_config()->http_cache_max_object_size);
+  }
+}
   
 Worker::~Worker()
 {
-  SSL_CTX_free(ssl_ctx_);
+  delete downstream_pool_;
+  delete http_cache_;
+  delete stat_;
   shutdown(fd_, SHUT_WR);
   close(fd_);
 }
@@ -68,24 +87,51 @@ void eventcb(bufferevent *bev, short events, void *arg)
 }
 } // namespace
 
+namespace {
+void publish_stat_cb(evutil_socket_t fd, short what, void *arg)
+{
+  Worker *worker = reinterpret_cast<Worker*>(arg);
+  worker->publish_stat();
+}
+} // namespace
+
+void Worker::publish_stat()
+{
+  snapshot_->update(*stat_);
+}
+
 void Worker::run()
 {
+  Log::register_thread();
   event_base *evbase = event_base_new();
   bufferevent *bev = bufferevent_socket_new(evbase, fd_,
                                             BEV_OPT_DEFER_CALLBACKS);
-  ThreadEventReceiver *receiver = new ThreadEventReceiver(ssl_ctx_);
+  ThreadEventReceiver *receiver = new ThreadEventReceiver(bev,
+                                                          ssl_ctx_,
+                                                          downstream_addr_,
+                                                          http_cache_,
+                                                          downstream_pool_,
+                                                          stat_);
   bufferevent_enable(bev, EV_READ);
   bufferevent_setcb(bev, readcb, 0, eventcb, receiver);
 
+  event *publish_ev = event_new(evbase, -1, EV_PERSIST, publish_stat_cb,
+                                this);
+  timeval tv = { STAT_PUBLISH_INTERVAL, 0 };
+  event_add(publish_ev, &tv);
+
   event_base_loop(evbase, 0);
 
+  event_free(publish_ev);
   delete receiver;
+  publish_stat();
 }
 
 void* start_threaded_worker(void *arg)
 {
-  int fd = *reinterpret_cast<int*>(arg);
-  Worker worker(fd);
+  WorkerInfo *info = reinterpret_cast<WorkerInfo*>(arg);
+  Worker worker(info->sv[1], info->ssl_ctx, info->downstream_addr,
+                info->stat);
   worker.run();
   return 0;
 }
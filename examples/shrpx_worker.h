@@ -30,17 +30,34 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "shrpx_config.h"
+
 namespace shrpx {
 
+class HttpCache;
+class DownstreamPool;
+struct WorkerStat;
+class WorkerStatSnapshot;
+
 class Worker {
 public:
-  Worker(int fd);
+  // |snapshot| is owned by the caller. The statistics of this thread
+  // are published to it. The reference of |ssl_ctx| is passed to this
+  // object.
+  Worker(int fd, SSL_CTX *ssl_ctx, const DownstreamAddr& downstream_addr,
+         WorkerStatSnapshot *snapshot);
   ~Worker();
   void run();
+  void publish_stat();
 private:
   // Channel to the main thread
   int fd_;
   SSL_CTX *ssl_ctx_;
+  DownstreamAddr downstream_addr_;
+  HttpCache *http_cache_;
+  DownstreamPool *downstream_pool_;
+  WorkerStat *stat_;
+  WorkerStatSnapshot *snapshot_;
 };
 
 void* start_threaded_worker(void *arg);
@@ -0,0 +1,571 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+// Micro benchmarks of the header and body processing of shrpx.
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <event2/buffer.h>
+
+extern "C" {
+#include "htparse/htparse.h"
+}
+
+#include "shrpx_config.h"
+#include "shrpx_http.h"
+#include "util.h"
+
+using namespace spdylay;
+
+namespace shrpx {
+
+namespace {
+// The request headers Chrome sends for a subresource, plus those
+// added by the load balancer in front of shrpx.
+void fill_browser_request_headers(Headers *headers)
+{
+  const char *nv[] = {
+    "Accept", "text/css,*/*;q=0.1",
+    "Accept-Encoding", "gzip,deflate,sdch",
+    "Accept-Language", "en-US,en;q=0.8,ja;q=0.6",
+    "Accept-Charset", "ISO-8859-1,utf-8;q=0.7,*;q=0.3",
+    "Cache-Control", "max-age=0",
+    "Connection", "keep-alive",
+    "Cookie", "__utma=111872281.1437428227.1343890321.1346248385.1346304321"
+    ".12; __utmz=111872281.1343890321.1.1.utmcsr=(direct)|utmccn=(direct)"
+    "|utmcmd=(none); sid=8c6bd8b0a3e54bb7a1f2c7b5c6a6e2f1",
+    "Host", "www.example.com",
+    "If-Modified-Since", "Thu, 30 Aug 2012 05:42:11 GMT",
+    "If-None-Match", "\"4cbd2c-2b5e-4c8759a1e4ec0\"",
+    "Referer", "https://www.example.com/index.html",
+    "User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.1 "
+    "(KHTML, like Gecko) Chrome/21.0.1180.89 Safari/537.1",
+    "DNT", "1",
+    "Keep-Alive", "300",
+    "Pragma", "no-cache",
+    "Origin", "https://www.example.com",
+    "X-Requested-With", "XMLHttpRequest",
+    "X-Forwarded-For", "192.0.2.1",
+    "X-Forwarded-Proto", "https",
+    "X-Real-IP", "192.0.2.1",
+    "X-Request-Id", "f6a3c2b9-4d1e-4c1a-9e2b-0d5a7c3e8b41",
+    "X-Forwarded-Spdy", "true",
+    "Via", "1.1 lb1",
+    "Proxy-Connection", "keep-alive",
+    "Expect", "100-continue",
+    "Content-Type", "application/x-www-form-urlencoded",
+    "Content-Length", "0",
+    "Range", "bytes=0-",
+    "If-Range", "\"4cbd2c-2b5e-4c8759a1e4ec0\"",
+    "TE", "trailers",
+    0
+  };
+  for(size_t i = 0; nv[i]; i += 2) {
+    headers->add(nv[i], strlen(nv[i]), nv[i+1], strlen(nv[i+1]));
+  }
+}
+} // namespace
+
+namespace {
+// The header serialization before http::write_request_headers() was
+// introduced. It is kept here for comparison.
+void build_request_headers_by_string(evbuffer *output,
+                                     const std::string& method,
+                                     const std::string& path,
+                                     int major, int minor,
+                                     const Headers& headers,
+                                     bool connection_close,
+                                     const std::string& client_addr)
+{
+  bool xff_found = false;
+  std::string hdrs = method;
+  hdrs += " ";
+  hdrs += path;
+  hdrs += " ";
+  hdrs += "HTTP/1.1\r\n";
+  hdrs += "Host: ";
+  hdrs += get_config()->downstream_hostport;
+  hdrs += "\r\n";
+  std::string via_value;
+  for(size_t i = 0; i < headers.size(); ++i) {
+    if(util::strieq(headers.name(i), "X-Forwarded-Proto") ||
+       util::strieq(headers.name(i), "host") ||
+       util::strieq(headers.name(i), "keep-alive") ||
+       util::strieq(headers.name(i), "connection") ||
+       util::strieq(headers.name(i), "proxy-connection")) {
+      continue;
+    }
+    if(util::strieq(headers.name(i), "via")) {
+      via_value = headers.value(i);
+      continue;
+    }
+    if(util::strieq(headers.name(i), "expect") &&
+       util::strifind(headers.value(i), "100-continue")) {
+      continue;
+    }
+    hdrs += headers.name(i);
+    hdrs += ": ";
+    hdrs += headers.value(i);
+    if(!xff_found && util::strieq(headers.name(i), "X-Forwarded-For")) {
+      xff_found = true;
+      hdrs += ", ";
+      hdrs += client_addr;
+    }
+    hdrs += "\r\n";
+  }
+  if(connection_close) {
+    hdrs += "Connection: close\r\n";
+  }
+  if(!xff_found) {
+    hdrs += "X-Forwarded-For: ";
+    hdrs += client_addr;
+    hdrs += "\r\n";
+  }
+  hdrs += "X-Forwarded-Proto: https\r\n";
+  hdrs += "Via: ";
+  hdrs += via_value;
+  if(!via_value.empty()) {
+    hdrs += ", ";
+  }
+  hdrs += http::create_via_header_value(major, minor);
+  hdrs += "\r\n";
+  hdrs += "\r\n";
+  evbuffer_add(output, hdrs.c_str(), hdrs.size());
+}
+} // namespace
+
+namespace {
+double now()
+{
+  timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+} // namespace
+
+namespace {
+void print_result(const char *name, size_t n, double elapsed)
+{
+  std::cout << std::left << std::setw(32) << name << std::right
+            << std::fixed << std::setprecision(1)
+            << std::setw(10) << elapsed*1000000000.0/n << " ns/op"
+            << std::endl;
+}
+} // namespace
+
+namespace {
+int bench_request_headers(size_t n)
+{
+  Headers headers;
+  fill_browser_request_headers(&headers);
+  std::string method = "GET", path = "/static/css/main.css?v=20120830";
+  std::string client_addr = "203.0.113.17";
+  evbuffer *output = evbuffer_new();
+
+  // Both must produce the same header block.
+  build_request_headers_by_string(output, method, path, 1, 1, headers,
+                                  false, client_addr);
+  size_t len = evbuffer_get_length(output);
+  std::string expected(reinterpret_cast<char*>(evbuffer_pullup(output, -1)),
+                       len);
+  evbuffer_drain(output, len);
+  http::write_request_headers(output, method, path, 1, 1, headers, false,
+                              client_addr, 0);
+  len = evbuffer_get_length(output);
+  std::string actual(reinterpret_cast<char*>(evbuffer_pullup(output, -1)),
+                     len);
+  evbuffer_drain(output, len);
+  if(expected != actual) {
+    std::cerr << "Header block mismatch\nexpected:\n" << expected
+              << "actual:\n" << actual << std::endl;
+    evbuffer_free(output);
+    return -1;
+  }
+  std::cout << headers.size() << " request headers, " << len
+            << " bytes header block" << std::endl;
+
+  double t = now();
+  for(size_t i = 0; i < n; ++i) {
+    build_request_headers_by_string(output, method, path, 1, 1, headers,
+                                    false, client_addr);
+    evbuffer_drain(output, evbuffer_get_length(output));
+  }
+  print_result("string concatenation", n, now()-t);
+
+  t = now();
+  for(size_t i = 0; i < n; ++i) {
+    http::write_request_headers(output, method, path, 1, 1, headers, false,
+                                client_addr, 0);
+    evbuffer_drain(output, evbuffer_get_length(output));
+  }
+  print_result("http::write_request_headers", n, now()-t);
+  evbuffer_free(output);
+  return 0;
+}
+} // namespace
+
+namespace {
+void fill_response_headers(Headers *headers)
+{
+  const char *nv[] = {
+    "Date", "Thu, 30 Aug 2012 05:42:11 GMT",
+    "Server", "Apache/2.2.22 (Ubuntu)",
+    "Last-Modified", "Wed, 29 Aug 2012 11:02:31 GMT",
+    "ETag", "\"4cbd2c-2b5e-4c8759a1e4ec0\"",
+    "Accept-Ranges", "bytes",
+    "Cache-Control", "max-age=3600, public",
+    "Expires", "Thu, 30 Aug 2012 06:42:11 GMT",
+    "Vary", "Accept-Encoding",
+    "Content-Encoding", "gzip",
+    "Content-Length", "3406",
+    "Keep-Alive", "timeout=5, max=100",
+    "Connection", "Keep-Alive",
+    "Content-Type", "text/css",
+    "X-Content-Type-Options", "nosniff",
+    "Via", "1.1 cache1",
+    0
+  };
+  for(size_t i = 0; nv[i]; i += 2) {
+    headers->add(nv[i], strlen(nv[i]), nv[i+1], strlen(nv[i+1]));
+  }
+}
+} // namespace
+
+namespace {
+// The classification of response header fields before
+// http::lookup_token() was introduced.
+size_t count_hop_by_hop_by_strieq(const Headers& headers)
+{
+  size_t n = 0;
+  for(size_t i = 0; i < headers.size(); ++i) {
+    if(util::strieq(headers.name(i), "transfer-encoding") ||
+       util::strieq(headers.name(i), "keep-alive") ||
+       util::strieq(headers.name(i), "connection") ||
+       util::strieq(headers.name(i), "proxy-connection")) {
+      ++n;
+    } else if(util::strieq(headers.name(i), "via")) {
+      ++n;
+    } else if(util::strieq(headers.name(i), "location")) {
+      ++n;
+    }
+  }
+  return n;
+}
+} // namespace
+
+namespace {
+size_t count_hop_by_hop_by_token(const Headers& headers)
+{
+  size_t n = 0;
+  for(size_t i = 0; i < headers.size(); ++i) {
+    switch(http::lookup_token(headers.name(i), headers.namelen(i))) {
+    case http::HD_TRANSFER_ENCODING:
+    case http::HD_KEEP_ALIVE:
+    case http::HD_CONNECTION:
+    case http::HD_PROXY_CONNECTION:
+    case http::HD_VIA:
+    case http::HD_LOCATION:
+      ++n;
+      break;
+    }
+  }
+  return n;
+}
+} // namespace
+
+namespace {
+int bench_response_headers(size_t n)
+{
+  Headers headers;
+  fill_response_headers(&headers);
+  if(count_hop_by_hop_by_strieq(headers) !=
+     count_hop_by_hop_by_token(headers)) {
+    std::cerr << "Classification mismatch" << std::endl;
+    return -1;
+  }
+  std::cout << headers.size() << " response headers" << std::endl;
+  // Accumulate the result so that the loop is not optimized out.
+  size_t sum = 0;
+  double t = now();
+  for(size_t i = 0; i < n; ++i) {
+    sum += count_hop_by_hop_by_strieq(headers);
+  }
+  print_result("util::strieq chain", n, now()-t);
+  t = now();
+  for(size_t i = 0; i < n; ++i) {
+    sum += count_hop_by_hop_by_token(headers);
+  }
+  print_result("http::lookup_token", n, now()-t);
+
+  evbuffer *output = evbuffer_new();
+  t = now();
+  for(size_t i = 0; i < n; ++i) {
+    http::write_response_headers(output, 200, 1, 1, headers, 0, 0);
+    evbuffer_drain(output, evbuffer_get_length(output));
+  }
+  print_result("http::write_response_headers", n, now()-t);
+  evbuffer_free(output);
+  return sum == 0 ? -1 : 0;
+}
+} // namespace
+
+namespace {
+// Stores the request header fields in the way add_request_header()
+// and set_last_request_header_value() receive them from htparse.
+int bench_header_storage(size_t n)
+{
+  Headers src;
+  fill_browser_request_headers(&src);
+  std::cout << src.size() << " header fields stored" << std::endl;
+  size_t sum = 0;
+  double t = now();
+  for(size_t i = 0; i < n; ++i) {
+    // The storage before Headers was introduced: a pair of strings
+    // for each field in the vector created for each request.
+    std::vector<std::pair<std::string, std::string> > headers;
+    for(size_t j = 0; j < src.size(); ++j) {
+      headers.push_back(std::make_pair(std::string(src.name(j),
+                                                   src.namelen(j)), ""));
+      headers.back().second = std::string(src.value(j), src.valuelen(j));
+    }
+    sum += headers.size();
+  }
+  print_result("vector of string pairs", n, now()-t);
+  // The recycled Downstream keeps its Headers storage.
+  Headers headers;
+  t = now();
+  for(size_t i = 0; i < n; ++i) {
+    headers.clear();
+    for(size_t j = 0; j < src.size(); ++j) {
+      headers.add(src.name(j), src.namelen(j), "", 0);
+      headers.set_last_value(src.value(j), src.valuelen(j));
+    }
+    sum += headers.size();
+  }
+  print_result("Headers reused", n, now()-t);
+  return sum == 0 ? -1 : 0;
+}
+} // namespace
+
+namespace {
+// The ways of taking the response body out of the input buffer of
+// the downstream connection.
+enum {
+  // The input buffer is linearized by evbuffer_pullup() and the body
+  // is copied by evbuffer_add().
+  BODY_PULLUP_ADD,
+  // The chains are parsed in place and the body is copied by
+  // evbuffer_add().
+  BODY_PEEK_ADD,
+  // The chains are parsed in place and the body is moved by
+  // evbuffer_remove_buffer() as Downstream::move_response_body()
+  // does.
+  BODY_PEEK_MOVE
+};
+} // namespace
+
+namespace {
+struct BodyBench {
+  int mode;
+  evbuffer *input;
+  evbuffer *body;
+  const uint8_t *base;
+  size_t offset;
+  size_t removed;
+  // The number of bytes copied, not including the read from socket.
+  size_t copied;
+};
+} // namespace
+
+namespace {
+// Returns the number of bytes of |len| bytes appended to |body| at
+// |oldlen| which are not the memory of |data|, that is, which were
+// copied rather than moved.
+size_t count_copied(evbuffer *body, size_t oldlen, const uint8_t *data,
+                    size_t len)
+{
+  evbuffer_ptr pos;
+  evbuffer_ptr_set(body, &pos, oldlen, EVBUFFER_PTR_SET);
+  int nvec = evbuffer_peek(body, len, &pos, 0, 0);
+  std::vector<evbuffer_iovec> vec(nvec);
+  evbuffer_peek(body, len, &pos, &vec[0], nvec);
+  size_t copied = 0;
+  size_t off = 0;
+  for(int i = 0; i < nvec && off < len; ++i) {
+    size_t n = std::min(vec[i].iov_len, len - off);
+    if(vec[i].iov_base != data + off) {
+      copied += n;
+    }
+    off += n;
+  }
+  return copied;
+}
+} // namespace
+
+namespace {
+int body_bench_bodycb(htparser *htp, const char *data, size_t len)
+{
+  BodyBench *bb = reinterpret_cast<BodyBench*>(htparser_get_userdata(htp));
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(data);
+  if(bb->mode == BODY_PEEK_MOVE) {
+    size_t off = bb->offset + (p - bb->base);
+    evbuffer_drain(bb->input, off - bb->removed);
+    size_t oldlen = evbuffer_get_length(bb->body);
+    evbuffer_remove_buffer(bb->input, bb->body, len);
+    bb->removed = off + len;
+    bb->copied += count_copied(bb->body, oldlen, p, len);
+  } else {
+    evbuffer_add(bb->body, data, len);
+    bb->copied += len;
+  }
+  return 0;
+}
+} // namespace
+
+namespace {
+htparse_hooks body_bench_hooks = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  body_bench_bodycb, /* htparse_data_hook body; */
+  0
+};
+} // namespace
+
+namespace {
+void parse_body_bench(BodyBench *bb, htparser *htp)
+{
+  evbuffer *input = bb->input;
+  if(bb->mode == BODY_PULLUP_ADD) {
+    size_t len = evbuffer_get_length(input);
+    evbuffer_iovec head;
+    evbuffer_peek(input, -1, 0, &head, 1);
+    unsigned char *mem = evbuffer_pullup(input, -1);
+    // evbuffer_pullup() copies the following chains into the first
+    // one if it has room, otherwise everything into a new chain.
+    bb->copied += mem == head.iov_base ? len - head.iov_len : len;
+    size_t nread = htparser_run(htp, &body_bench_hooks,
+                                reinterpret_cast<const char*>(mem), len);
+    evbuffer_drain(input, nread);
+    return;
+  }
+  while(evbuffer_get_length(input) > 0) {
+    evbuffer_iovec vec[16];
+    int nvec = std::min(evbuffer_peek(input, -1, 0, vec, 16), 16);
+    size_t nread = 0;
+    bb->removed = 0;
+    for(int i = 0; i < nvec; ++i) {
+      bb->base = reinterpret_cast<const uint8_t*>(vec[i].iov_base);
+      bb->offset = nread;
+      nread += htparser_run(htp, &body_bench_hooks,
+                            reinterpret_cast<const char*>(vec[i].iov_base),
+                            vec[i].iov_len);
+    }
+    evbuffer_drain(input, nread - bb->removed);
+  }
+}
+} // namespace
+
+namespace {
+// Feeds the response with 1MiB body to htparser in 16KiB reads as
+// Downstream::parse_http_response() sees it, and counts the body
+// bytes copied on the way to the response body buffer.
+int bench_response_body(size_t n)
+{
+  const size_t bodylen = 1024*1024;
+  const size_t readlen = 16*1024;
+  const char hdr[] = "HTTP/1.1 200 OK\r\nContent-Length: 1048576\r\n\r\n";
+  std::vector<char> data(readlen, 'a');
+  const char *names[] = {
+    "evbuffer_pullup+evbuffer_add",
+    "evbuffer_peek+evbuffer_add",
+    "evbuffer_peek+remove_buffer"
+  };
+  htparser *htp = htparser_new();
+  for(int mode = BODY_PULLUP_ADD; mode <= BODY_PEEK_MOVE; ++mode) {
+    BodyBench bb;
+    memset(&bb, 0, sizeof(bb));
+    bb.mode = mode;
+    bb.input = evbuffer_new();
+    bb.body = evbuffer_new();
+    size_t total = 0;
+    double t = now();
+    for(size_t i = 0; i < n; ++i) {
+      htparser_init(htp, htp_type_response);
+      htparser_set_userdata(htp, &bb);
+      evbuffer_add(bb.input, hdr, sizeof(hdr)-1);
+      for(size_t len = 0; len < bodylen; len += readlen) {
+        evbuffer_add(bb.input, &data[0], readlen);
+        parse_body_bench(&bb, htp);
+        // Spdylay reads the body buffer in the data read callback.
+        total += evbuffer_get_length(bb.body);
+        evbuffer_drain(bb.body, evbuffer_get_length(bb.body));
+      }
+    }
+    double elapsed = now()-t;
+    evbuffer_free(bb.input);
+    evbuffer_free(bb.body);
+    if(total != bodylen*n) {
+      std::cerr << names[mode] << ": body length mismatch" << std::endl;
+      free(htp);
+      return -1;
+    }
+    print_result(names[mode], n, elapsed);
+    std::cout << std::left << std::setw(32) << "" << std::right
+              << std::setw(10) << bb.copied/n << " bytes copied/MiB"
+              << std::endl;
+  }
+  free(htp);
+  return 0;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul(argv[1], 0, 10) : 1000000;
+  create_config();
+  mod_config()->downstream_hostport = "127.0.0.1:8080";
+  mod_config()->server_name = "shrpx";
+  mod_config()->downstream_host = "127.0.0.1";
+  mod_config()->downstream_port = 8080;
+  mod_config()->host = "localhost";
+  mod_config()->port = 3000;
+  if(bench_request_headers(n) != 0 || bench_response_headers(n) != 0 ||
+     bench_header_storage(n) != 0 || bench_response_body(n/10000+1) != 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace shrpx
+
+int main(int argc, char **argv)
+{
+  return shrpx::main(argc, argv);
+}
@@ -50,6 +50,7 @@
 #include <fstream>
 #include <map>
 #include <vector>
+#include <deque>
 #include <sstream>
 
 #include <openssl/ssl.h>
@@ -80,6 +81,9 @@ struct Config {
   {}
 };
 
+Config config;
+extern bool ssl_debug;
+
 struct RequestStat {
   timeval on_syn_stream_time;
   timeval on_syn_reply_time;
@@ -166,6 +170,8 @@ struct SessionStat {
   }
 };
 
+struct SessionPool;
+
 struct SpdySession {
   std::vector<Request*> reqvec;
   // Map from stream ID to Request object.
@@ -173,14 +179,58 @@ struct SpdySession {
   // Insert path already added in reqvec to prevent multiple request
   // for 1 resource.
   std::set<std::string> path_cache;
+  // The requests which are not submitted yet.
+  std::deque<Request*> pending;
+  // The number of submitted requests.
+  size_t submitted;
   // The number of completed requests, including failed ones.
   size_t complete;
+  // The maximum number of concurrent streams advertised by the
+  // server in SETTINGS.
+  uint32_t max_concurrent_streams;
+  std::string host;
+  uint16_t port;
   std::string hostport;
+  std::string next_proto;
+  SSL_CTX *ssl_ctx;
+  SSL *ssl;
+  int fd;
   Spdylay *sc;
+  SessionPool *pool;
+  enum {
+    // The connection is not initiated yet.
+    IDLE,
+    // Connecting to the host and performing SSL/TLS handshake.
+    CONNECTING,
+    CONNECTED,
+    // The connection was closed or could not be established.
+    DONE
+  };
+  int state;
+  // The events to poll for while the handshake is in progress.
+  short handshake_events;
+  bool goaway_submitted;
   SessionStat stat;
-  SpdySession():complete(0) {}
+  SpdySession(const uri::UriStruct& us, SessionPool *pool)
+    : submitted(0), complete(0),
+      max_concurrent_streams(SPDYLAY_INITIAL_MAX_CONCURRENT_STREAMS),
+      host(us.host), port(us.port), ssl_ctx(0), ssl(0), fd(-1), sc(0),
+      pool(pool), state(IDLE), handshake_events(0), goaway_submitted(false)
+  {
+    std::stringstream ss;
+    if(us.ipv6LiteralAddress) {
+      ss << "[" << us.host << "]";
+    } else {
+      ss << us.host;
+    }
+    if(us.port != 443) {
+      ss << ":" << us.port;
+    }
+    hostport = ss.str();
+  }
   ~SpdySession()
   {
+    disconnect();
     for(size_t i = 0; i < reqvec.size(); ++i) {
       delete reqvec[i];
     }
@@ -189,21 +239,9 @@ struct SpdySession {
   {
     return complete == reqvec.size();
   }
-  void update_hostport()
+  bool connected() const
   {
-    if(reqvec.empty()) {
-      return;
-    }
-    std::stringstream ss;
-    if(reqvec[0]->us.ipv6LiteralAddress) {
-      ss << "[" << reqvec[0]->us.host << "]";
-    } else {
-      ss << reqvec[0]->us.host;
-    }
-    if(reqvec[0]->us.port != 443) {
-      ss << ":" << reqvec[0]->us.port;
-    }
-    hostport = ss.str();
+    return state == CONNECTED;
   }
   bool add_request(const uri::UriStruct& us, int level = 0)
   {
@@ -213,6 +251,7 @@ struct SpdySession {
     } else {
       path_cache.insert(key);
       reqvec.push_back(new Request(us, level));
+      pending.push_back(reqvec.back());
       return true;
     }
   }
@@ -220,10 +259,112 @@ struct SpdySession {
   {
     record_time(&stat.on_handshake_time);
   }
+  // Initiates the connection to the host. The handshake is continued
+  // by handshake() when the socket gets ready.
+  int connect();
+  // Performs SSL/TLS handshake. Returns 0 if the handshake is
+  // completed or still in progress, or -1 on error.
+  int handshake(const spdylay_session_callbacks *callbacks);
+  void disconnect();
+  // Submits the pending requests as long as the number of streams in
+  // flight is less than the limit advertised by the server.
+  void submit_pending();
 };
 
-Config config;
-extern bool ssl_debug;
+// The connections to the servers, one per host and port. All
+// connections are processed at the same time, so that the assets on
+// the different hosts are fetched in parallel.
+struct SessionPool {
+  std::vector<SpdySession*> sessions;
+  // The number of requests which may still discover assets, that is,
+  // the requests of level 0 not completed yet if -a is given.
+  size_t pages_in_progress;
+  // The time when the first connection was initiated.
+  timeval start_time;
+  // The time when the last request was completed.
+  timeval end_time;
+  SessionPool():pages_in_progress(0)
+  {
+    start_time.tv_sec = -1;
+    start_time.tv_usec = -1;
+    end_time.tv_sec = -1;
+    end_time.tv_usec = -1;
+  }
+  ~SessionPool()
+  {
+    for(size_t i = 0; i < sessions.size(); ++i) {
+      delete sessions[i];
+    }
+  }
+  // Returns the session for the host and port of |us|. The new session
+  // is created if there is none.
+  SpdySession* get_session(const uri::UriStruct& us)
+  {
+    for(size_t i = 0; i < sessions.size(); ++i) {
+      if(sessions[i]->host == us.host && sessions[i]->port == us.port) {
+        return sessions[i];
+      }
+    }
+    sessions.push_back(new SpdySession(us, this));
+    return sessions.back();
+  }
+  // Adds the request for |us| to the session for its host and
+  // port. The request is submitted if the session is connected.
+  void add_request(const uri::UriStruct& us, int level = 0);
+  // Called when the connection of |spdySession| is closed or could
+  // not be established. The requests of |spdySession| are given up.
+  void on_session_done(SpdySession *spdySession);
+  // Submits GOAWAY to the sessions whose requests have been
+  // processed, unless a page in progress may still add requests to
+  // them.
+  void submit_goaway();
+};
+
+void SessionPool::add_request(const uri::UriStruct& us, int level)
+{
+  SpdySession *spdySession = get_session(us);
+  if(spdySession->state == SpdySession::DONE) {
+    return;
+  }
+  if(spdySession->add_request(us, level)) {
+    if(config.get_assets && level == 0) {
+      ++pages_in_progress;
+    }
+    if(spdySession->connected()) {
+      spdySession->submit_pending();
+    }
+  }
+}
+
+void SessionPool::on_session_done(SpdySession *spdySession)
+{
+  spdySession->state = SpdySession::DONE;
+  spdySession->disconnect();
+  if(config.get_assets) {
+    for(size_t i = 0; i < spdySession->reqvec.size(); ++i) {
+      Request *req = spdySession->reqvec[i];
+      if(req->level == 0 && req->stat.on_complete_time.tv_sec < 0) {
+        --pages_in_progress;
+      }
+    }
+  }
+  submit_goaway();
+}
+
+void SessionPool::submit_goaway()
+{
+  if(pages_in_progress > 0) {
+    return;
+  }
+  for(size_t i = 0; i < sessions.size(); ++i) {
+    SpdySession *spdySession = sessions[i];
+    if(spdySession->connected() && !spdySession->goaway_submitted &&
+       spdySession->all_requests_processed()) {
+      spdySession->sc->submit_goaway(SPDYLAY_GOAWAY_OK);
+      spdySession->goaway_submitted = true;
+    }
+  }
+}
 
 void submit_request(Spdylay& sc, const std::string& hostport, Request* req)
 {
@@ -233,6 +374,132 @@ void submit_request(Spdylay& sc, const std::string& hostport, Request* req)
   assert(r == 0);
 }
 
+void SpdySession::submit_pending()
+{
+  while(!pending.empty() && submitted-complete < max_concurrent_streams) {
+    submit_request(*sc, hostport, pending.front());
+    pending.pop_front();
+    ++submitted;
+  }
+}
+
+int SpdySession::connect()
+{
+  fd = nonblock_connect_to(host, port);
+  if(fd == -1) {
+    std::cerr << "Could not connect to the host" << std::endl;
+    return -1;
+  }
+  ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if(!ssl_ctx) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  switch(config.spdy_version) {
+  case SPDYLAY_PROTO_SPDY2:
+    next_proto = "spdy/2";
+    break;
+  case SPDYLAY_PROTO_SPDY3:
+    next_proto = "spdy/3";
+    break;
+  }
+  setup_ssl_ctx(ssl_ctx, &next_proto);
+  if(!config.keyfile.empty()) {
+    if(SSL_CTX_use_PrivateKey_file(ssl_ctx, config.keyfile.c_str(),
+                                   SSL_FILETYPE_PEM) != 1) {
+      std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+      return -1;
+    }
+  }
+  if(!config.certfile.empty()) {
+    if(SSL_CTX_use_certificate_chain_file(ssl_ctx,
+                                          config.certfile.c_str()) != 1) {
+      std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+      return -1;
+    }
+  }
+  ssl = SSL_new(ssl_ctx);
+  if(!ssl) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  if (!SSL_set_tlsext_host_name(ssl, host.c_str())) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  if(SSL_set_fd(ssl, fd) == 0) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  state = CONNECTING;
+  // Wait for the completion of connect().
+  handshake_events = POLLOUT;
+  return 0;
+}
+
+int SpdySession::handshake(const spdylay_session_callbacks *callbacks)
+{
+  ERR_clear_error();
+  int r = SSL_connect(ssl);
+  if(r <= 0) {
+    switch(SSL_get_error(ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+      handshake_events = POLLIN;
+      return 0;
+    case SSL_ERROR_WANT_WRITE:
+      handshake_events = POLLOUT;
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      std::cerr << "Could not connect to the host: "
+                << (errno ? strerror(errno) : "EOF") << std::endl;
+      return -1;
+    default:
+      std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+      return -1;
+    }
+  }
+  record_handshake_time();
+  set_tcp_nodelay(fd);
+  int spdy_version = spdylay_npn_get_version(
+      reinterpret_cast<const unsigned char*>(next_proto.c_str()),
+      next_proto.size());
+  if (spdy_version <= 0) {
+    return -1;
+  }
+  sc = new Spdylay(fd, ssl, spdy_version, callbacks, this);
+  state = CONNECTED;
+  if(spdy_version >= SPDYLAY_PROTO_SPDY3 && config.window_bits != -1) {
+    spdylay_settings_entry iv[1];
+    iv[0].settings_id = SPDYLAY_SETTINGS_INITIAL_WINDOW_SIZE;
+    iv[0].flags = SPDYLAY_ID_FLAG_SETTINGS_NONE;
+    iv[0].value = 1 << config.window_bits;
+    int rv = sc->submit_settings(SPDYLAY_FLAG_SETTINGS_NONE, iv, 1);
+    assert(rv == 0);
+  }
+  submit_pending();
+  return 0;
+}
+
+void SpdySession::disconnect()
+{
+  delete sc;
+  sc = 0;
+  if(ssl) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ssl = 0;
+  }
+  if(ssl_ctx) {
+    SSL_CTX_free(ssl_ctx);
+    ssl_ctx = 0;
+  }
+  if(fd != -1) {
+    shutdown(fd, SHUT_WR);
+    close(fd);
+    fd = -1;
+  }
+}
+
 void update_html_parser(SpdySession *spdySession, Request *req,
                         const uint8_t *data, size_t len, int fin)
 {
@@ -244,12 +511,8 @@ void update_html_parser(SpdySession *spdySession, Request *req,
   for(size_t i = 0; i < req->html_parser->get_links().size(); ++i) {
     const std::string& uri = req->html_parser->get_links()[i];
     uri::UriStruct us;
-    if(uri::parse(us, uri) &&
-       req->us.protocol == us.protocol && req->us.host == us.host &&
-       req->us.port == us.port) {
-      spdySession->add_request(us, req->level+1);
-      submit_request(*spdySession->sc, spdySession->hostport,
-                     spdySession->reqvec.back());
+    if(uri::parse(us, uri) && req->us.protocol == us.protocol) {
+      spdySession->pool->add_request(us, req->level+1);
     }
   }
   req->html_parser->clear_links();
@@ -368,6 +631,15 @@ void on_ctrl_recv_callback2
       (session, frame->syn_reply.stream_id);
     assert(req);
     req->record_syn_reply_time();
+  } else if(type == SPDYLAY_SETTINGS) {
+    SpdySession *spdySession = get_session(user_data);
+    for(size_t i = 0; i < frame->settings.niv; ++i) {
+      if(frame->settings.iv[i].settings_id ==
+         SPDYLAY_SETTINGS_MAX_CONCURRENT_STREAMS) {
+        spdySession->max_concurrent_streams = frame->settings.iv[i].value;
+      }
+    }
+    spdySession->submit_pending();
   }
   check_response_header(session, type, frame, user_data);
   if(config.verbose) {
@@ -383,12 +655,17 @@ void on_stream_close_callback
   std::map<int32_t, Request*>::iterator itr =
     spdySession->streams.find(stream_id);
   if(itr != spdySession->streams.end()) {
-    update_html_parser(spdySession, (*itr).second, 0, 0, 1);
-    (*itr).second->record_complete_time();
+    Request *req = (*itr).second;
+    update_html_parser(spdySession, req, 0, 0, 1);
+    req->record_complete_time();
     ++spdySession->complete;
-    if(spdySession->all_requests_processed()) {
-      spdylay_submit_goaway(session, SPDYLAY_GOAWAY_OK);
+    SessionPool *pool = spdySession->pool;
+    pool->end_time = req->stat.on_complete_time;
+    if(config.get_assets && req->level == 0) {
+      --pool->pages_in_progress;
     }
+    spdySession->submit_pending();
+    pool->submit_goaway();
   }
 }
 
@@ -438,135 +715,131 @@ void print_stats(const SpdySession& spdySession)
   }
 }
 
-int communicate(const std::string& host, uint16_t port,
-                SpdySession& spdySession,
-                const spdylay_session_callbacks *callbacks)
+void print_page_load_time(const SessionPool& pool)
 {
-  int fd = connect_to(host, port);
-  if(fd == -1) {
-    std::cerr << "Could not connect to the host" << std::endl;
-    return -1;
-  }
-  SSL_CTX *ssl_ctx;
-  ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-  if(!ssl_ctx) {
-    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
-    return -1;
-  }
-  std::string next_proto;
-  switch(config.spdy_version) {
-  case SPDYLAY_PROTO_SPDY2:
-    next_proto = "spdy/2";
-    break;
-  case SPDYLAY_PROTO_SPDY3:
-    next_proto = "spdy/3";
-    break;
+  if(pool.end_time.tv_sec >= 0) {
+    std::cout << "Page load time (ms): "
+              << time_delta(pool.end_time, pool.start_time) << "\n"
+              << std::endl;
   }
-  setup_ssl_ctx(ssl_ctx, &next_proto);
-  if(!config.keyfile.empty()) {
-    if(SSL_CTX_use_PrivateKey_file(ssl_ctx, config.keyfile.c_str(),
-                                   SSL_FILETYPE_PEM) != 1) {
-      std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
-      return -1;
+}
+
+// Processes the I/O of |spdySession|. Returns 0 if the connection is
+// still in use, 1 if it has been finished normally, or -1 on error.
+int on_session_event(SpdySession *spdySession, const pollfd& pfd,
+                     const spdylay_session_callbacks *callbacks)
+{
+  if(spdySession->state == SpdySession::CONNECTING) {
+    if(pfd.revents == 0) {
+      return 0;
     }
+    // The error of connect() is reported by SSL_connect().
+    return spdySession->handshake(callbacks);
   }
-  if(!config.certfile.empty()) {
-    if(SSL_CTX_use_certificate_chain_file(ssl_ctx,
-                                          config.certfile.c_str()) != 1) {
-      std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+  Spdylay *sc = spdySession->sc;
+  if(pfd.revents & (POLLIN | POLLOUT)) {
+    int rv;
+    if((rv = sc->recv()) != 0 || (rv = sc->send()) != 0) {
+      if(rv != SPDYLAY_ERR_EOF || !spdySession->all_requests_processed()) {
+        std::cout << "Fatal: " << spdylay_strerror(rv) << std::endl;
+        std::cout << "reqnum=" << spdySession->reqvec.size()
+                  << ", completed=" << spdySession->complete << std::endl;
+      }
       return -1;
     }
   }
-  SSL *ssl = SSL_new(ssl_ctx);
-  if(!ssl) {
-    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
-    return -1;
-  }
-  if (!SSL_set_tlsext_host_name(ssl, host.c_str())) {
-    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
-    return -1;
-  }
-  if(ssl_handshake(ssl, fd) == -1) {
-    return -1;
-  }
-  spdySession.record_handshake_time();
-  make_non_block(fd);
-  set_tcp_nodelay(fd);
-  int spdy_version = spdylay_npn_get_version(
-      reinterpret_cast<const unsigned char*>(next_proto.c_str()),
-      next_proto.size());
-  if (spdy_version <= 0) {
+  if((pfd.revents & POLLHUP) || (pfd.revents & POLLERR)) {
+    std::cout << "HUP" << std::endl;
     return -1;
   }
-  Spdylay sc(fd, ssl, spdy_version, callbacks, &spdySession);
-  spdySession.sc = &sc;
-
-  nfds_t npollfds = 1;
-  pollfd pollfds[1];
+  return sc->finish() ? 1 : 0;
+}
 
-  if(spdy_version >= SPDYLAY_PROTO_SPDY3 && config.window_bits != -1) {
-    spdylay_settings_entry iv[1];
-    iv[0].settings_id = SPDYLAY_SETTINGS_INITIAL_WINDOW_SIZE;
-    iv[0].flags = SPDYLAY_ID_FLAG_SETTINGS_NONE;
-    iv[0].value = 1 << config.window_bits;
-    int rv = sc.submit_settings(SPDYLAY_FLAG_SETTINGS_NONE, iv, 1);
-    assert(rv == 0);
-  }
-  for(int i = 0, n = spdySession.reqvec.size(); i < n; ++i) {
-    submit_request(sc, spdySession.hostport, spdySession.reqvec[i]);
-  }
-  pollfds[0].fd = fd;
-  ctl_poll(pollfds, &sc);
+int communicate(SessionPool& pool,
+                const spdylay_session_callbacks *callbacks)
+{
+  int failures = 0;
   int end_time = time(NULL) + config.timeout;
   int timeout = config.timeout;
-
-  bool ok = true;
-  while(!sc.finish()) {
-    int nfds = poll(pollfds, npollfds, timeout);
+  record_time(&pool.start_time);
+  std::vector<pollfd> pollfds;
+  std::vector<SpdySession*> polled;
+  while(1) {
+    // Connect to the hosts which are discovered during the previous
+    // iteration. The connections are established in parallel.
+    for(size_t i = 0; i < pool.sessions.size(); ++i) {
+      SpdySession *spdySession = pool.sessions[i];
+      if(spdySession->state == SpdySession::IDLE) {
+        if(spdySession->connect() != 0) {
+          ++failures;
+          pool.on_session_done(spdySession);
+        }
+      }
+    }
+    pollfds.clear();
+    polled.clear();
+    for(size_t i = 0; i < pool.sessions.size(); ++i) {
+      SpdySession *spdySession = pool.sessions[i];
+      pollfd pfd;
+      pfd.fd = spdySession->fd;
+      if(spdySession->state == SpdySession::CONNECTING) {
+        pfd.events = spdySession->handshake_events;
+      } else if(spdySession->connected()) {
+        ctl_poll(&pfd, spdySession->sc);
+      } else {
+        continue;
+      }
+      pollfds.push_back(pfd);
+      polled.push_back(spdySession);
+    }
+    if(pollfds.empty()) {
+      break;
+    }
+    int nfds = poll(&pollfds[0], pollfds.size(), timeout);
     if(nfds == -1) {
       perror("poll");
       return -1;
     }
-    if(pollfds[0].revents & (POLLIN | POLLOUT)) {
-      int rv;
-      if((rv = sc.recv()) != 0 || (rv = sc.send()) != 0) {
-        if(rv != SPDYLAY_ERR_EOF || !spdySession.all_requests_processed()) {
-          std::cout << "Fatal: " << spdylay_strerror(rv) << std::endl;
-          std::cout << "reqnum=" << spdySession.reqvec.size()
-                    << ", completed=" << spdySession.complete << std::endl;
+    for(size_t i = 0; i < polled.size(); ++i) {
+      int rv = on_session_event(polled[i], pollfds[i], callbacks);
+      if(rv != 0) {
+        if(rv == -1) {
+          ++failures;
         }
-        ok = false;
-        break;
+        pool.on_session_done(polled[i]);
       }
     }
-    if((pollfds[0].revents & POLLHUP) || (pollfds[0].revents & POLLERR)) {
-      std::cout << "HUP" << std::endl;
-      ok = false;
-      break;
-    }
     timeout = timeout == -1 ? timeout : end_time - time(NULL);
     if (config.timeout != -1 && timeout <= 0) {
-      std::cout << "Requests to " << spdySession.hostport << "timed out.";
-      ok = false;
+      for(size_t i = 0; i < pool.sessions.size(); ++i) {
+        SpdySession *spdySession = pool.sessions[i];
+        if(spdySession->state == SpdySession::CONNECTING ||
+           spdySession->connected()) {
+          std::cout << "Requests to " << spdySession->hostport
+                    << " timed out." << std::endl;
+          ++failures;
+          pool.on_session_done(spdySession);
+        }
+      }
       break;
     }
-    assert(ok);
-    ctl_poll(pollfds, &sc);
   }
-  if(!spdySession.all_requests_processed()) {
-    std::cout << "Some requests were not processed. total="
-              << spdySession.reqvec.size()
-              << ", processed=" << spdySession.complete << std::endl;
+  for(size_t i = 0; i < pool.sessions.size(); ++i) {
+    SpdySession *spdySession = pool.sessions[i];
+    if(!spdySession->all_requests_processed()) {
+      std::cout << "Some requests to " << spdySession->hostport
+                << " were not processed. total="
+                << spdySession->reqvec.size()
+                << ", processed=" << spdySession->complete << std::endl;
+    }
   }
-  SSL_shutdown(ssl);
-  SSL_free(ssl);
-  SSL_CTX_free(ssl_ctx);
-  shutdown(fd, SHUT_WR);
-  close(fd);
   if(config.stat) {
-    print_stats(spdySession);
+    for(size_t i = 0; i < pool.sessions.size(); ++i) {
+      print_stats(*pool.sessions[i]);
+    }
+    print_page_load_time(pool);
   }
-  return ok ? 0 : -1;
+  return failures;
 }
 
 int run(char **uris, int n)
@@ -587,34 +860,14 @@ int run(char **uris, int n)
   }
   callbacks.on_data_chunk_recv_callback = on_data_chunk_recv_callback;
   ssl_debug = config.verbose;
-  std::string prev_host;
-  uint16_t prev_port = 0;
-  int failures = 0;
-  SpdySession spdySession;
+  SessionPool pool;
   for(int i = 0; i < n; ++i) {
     uri::UriStruct us;
     if(uri::parse(us, uris[i])) {
-      if(prev_host != us.host || prev_port != us.port) {
-        if(!spdySession.reqvec.empty()) {
-          spdySession.update_hostport();
-          if (communicate(prev_host, prev_port, spdySession, &callbacks) != 0) {
-            ++failures;
-          }
-          spdySession = SpdySession();
-        }
-        prev_host = us.host;
-        prev_port = us.port;
-      }
-      spdySession.add_request(us);
-    }
-  }
-  if(!spdySession.reqvec.empty()) {
-    spdySession.update_hostport();
-    if (communicate(prev_host, prev_port, spdySession, &callbacks) != 0) {
-      ++failures;
+      pool.add_request(us);
     }
   }
-  return failures;
+  return communicate(pool, &callbacks);
 }
 
 void print_usage(std::ostream& out)
@@ -643,9 +896,11 @@ void print_help(std::ostream& out)
       << "                       Sets the initial window size to 2**<N>.\n"
       << "    -a, --get-assets   Download assets such as stylesheets, images\n"
       << "                       and script files linked from the downloaded\n"
-      << "                       resource. Only links whose origins are the\n"
+      << "                       resource. Only links whose schemes are the\n"
       << "                       same with the linking resource will be\n"
-      << "                       downloaded.\n"
+      << "                       downloaded. The assets on the other hosts\n"
+      << "                       are downloaded over the new connections in\n"
+      << "                       parallel.\n"
       << "    -s, --stat         Print statistics.\n"
       << "    --cert=<CERT>      Use the specified client certificate file.\n"
       << "                       The file must be in PEM format.\n"
@@ -714,13 +969,7 @@ int main(int argc, char **argv)
       break;
     }
     case 'a':
-#ifdef HAVE_LIBXML2
       config.get_assets = true;
-#else // !HAVE_LIBXML2
-      std::cerr << "Warning: -a, --get-assets option cannot be used because\n"
-                << "the binary was not compiled with libxml2."
-                << std::endl;
-#endif // !HAVE_LIBXML2
       break;
     case 's':
       config.stat = true;
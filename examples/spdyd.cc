@@ -47,7 +47,7 @@ extern bool ssl_debug;
 namespace {
 void print_usage(std::ostream& out)
 {
-  out << "Usage: spdyd [-3DVhv] [-d <PATH>] <PORT> <PRIVATE_KEY> <CERT>"
+  out << "Usage: spdyd [-3DVhv] [-d <PATH>] [-n <CORES>] <PORT> <PRIVATE_KEY> <CERT>"
       << std::endl;
 }
 } // namespace
@@ -75,6 +75,19 @@ void print_help(std::ostream& out)
       << "    -v, --verbose      Print debug information such as reception/\n"
       << "                       transmission of frames and name/value pairs.\n"
       << "    -3, --spdy3        Only use SPDY/3.\n"
+      << "    -n, --workers=<CORES>\n"
+      << "                       Set the number of worker threads. Each\n"
+      << "                       worker has its own event loop and file\n"
+      << "                       cache.\n"
+      << "                       Default: 1\n"
+      << "    --cache-size=<SIZE>\n"
+      << "                       Set the maximum number of bytes of small\n"
+      << "                       files kept in memory. 0 disables the\n"
+      << "                       cache.\n"
+      << "                       Default: 16777216\n"
+      << "    --edge-triggered   Watch the sockets in edge-triggered mode.\n"
+      << "                       The readiness of a socket is not reported\n"
+      << "                       again until the connection drains it.\n"
       << "    -h, --help         Print this help.\n"
       << std::endl;
 }
@@ -84,6 +97,7 @@ int main(int argc, char **argv)
 {
   Config config;
   while(1) {
+    int flag;
     static option long_options[] = {
       {"daemon", no_argument, 0, 'D' },
       {"htdocs", required_argument, 0, 'd' },
@@ -91,10 +105,13 @@ int main(int argc, char **argv)
       {"verbose", no_argument, 0, 'v' },
       {"spdy3", no_argument, 0, '3' },
       {"verify-client", no_argument, 0, 'V' },
+      {"workers", required_argument, 0, 'n' },
+      {"cache-size", required_argument, &flag, 1 },
+      {"edge-triggered", no_argument, &flag, 2 },
       {0, 0, 0, 0 }
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "DVd:hv3", long_options, &option_index);
+    int c = getopt_long(argc, argv, "DVd:hn:v3", long_options, &option_index);
     if(c == -1) {
       break;
     }
@@ -117,8 +134,27 @@ int main(int argc, char **argv)
     case '3':
       config.spdy3_only = true;
       break;
+    case 'n':
+      config.num_worker = strtoul(optarg, 0, 10);
+      if(config.num_worker == 0) {
+        std::cerr << "-n: specify the number of workers > 0" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
     case '?':
       exit(EXIT_FAILURE);
+    case 0:
+      switch(flag) {
+      case 1:
+        // --cache-size
+        config.cache_size = strtoul(optarg, 0, 10);
+        break;
+      case 2:
+        // --edge-triggered
+        config.edge_triggered = true;
+        break;
+      }
+      break;
     default:
       break;
     }
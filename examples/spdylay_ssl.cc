@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 
 #include <cassert>
 #include <cstdio>
@@ -143,6 +144,11 @@ int Spdylay::submit_settings(int flags, spdylay_settings_entry *iv, size_t niv)
   return spdylay_submit_settings(session_, flags, iv, niv);
 }
 
+int Spdylay::submit_goaway(uint32_t status_code)
+{
+  return spdylay_submit_goaway(session_, status_code);
+}
+
 bool Spdylay::would_block(int r)
 {
   int e = SSL_get_error(ssl_, r);
@@ -182,7 +188,42 @@ int connect_to(const std::string& host, uint16_t port)
   return fd;
 }
 
-int make_listen_socket(const std::string& host, uint16_t port, int family)
+int nonblock_connect_to(const std::string& host, uint16_t port)
+{
+  struct addrinfo hints;
+  int fd = -1;
+  int r;
+  char service[10];
+  snprintf(service, sizeof(service), "%u", port);
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *res;
+  r = getaddrinfo(host.c_str(), service, &hints, &res);
+  if(r != 0) {
+    std::cerr << "getaddrinfo: " << gai_strerror(r) << std::endl;
+    return -1;
+  }
+  fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if(fd != -1) {
+    if(make_non_block(fd) == -1) {
+      close(fd);
+      fd = -1;
+    } else {
+      while((r = connect(fd, res->ai_addr, res->ai_addrlen)) == -1 &&
+            errno == EINTR);
+      if(r == -1 && errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int make_listen_socket(const std::string& host, uint16_t port, int family,
+                       bool reuseport)
 {
   addrinfo hints;
   int fd = -1;
@@ -219,6 +260,14 @@ int make_listen_socket(const std::string& host, uint16_t port, int family)
       close(fd);
       continue;
     }
+#ifdef SO_REUSEPORT
+    if(reuseport &&
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val,
+                  static_cast<socklen_t>(sizeof(val))) == -1) {
+      close(fd);
+      continue;
+    }
+#endif // SO_REUSEPORT
 #ifdef IPV6_V6ONLY
     if(family == AF_INET6) {
       if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val,
@@ -612,6 +661,43 @@ int ssl_handshake(SSL *ssl, int fd)
   return 0;
 }
 
+// OpenSSL 1.1.0 and later do the locking by themselves.
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+namespace {
+pthread_mutex_t *ssl_locks;
+} // namespace
+
+namespace {
+void ssl_locking_cb(int mode, int type, const char *file, int line)
+{
+  if(mode & CRYPTO_LOCK) {
+    pthread_mutex_lock(&(ssl_locks[type]));
+  } else {
+    pthread_mutex_unlock(&(ssl_locks[type]));
+  }
+}
+} // namespace
+
+void setup_ssl_lock()
+{
+  ssl_locks = new pthread_mutex_t[CRYPTO_num_locks()];
+  for(int i = 0; i < CRYPTO_num_locks(); ++i) {
+    // Always returns 0
+    pthread_mutex_init(&(ssl_locks[i]), 0);
+  }
+  CRYPTO_set_locking_callback(ssl_locking_cb);
+}
+
+void teardown_ssl_lock()
+{
+  CRYPTO_set_locking_callback(0);
+  for(int i = 0; i < CRYPTO_num_locks(); ++i) {
+    pthread_mutex_destroy(&(ssl_locks[i]));
+  }
+  delete [] ssl_locks;
+}
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+
 namespace {
 timeval base_tv;
 } // namespace
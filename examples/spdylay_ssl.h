@@ -55,6 +55,7 @@ public:
   int submit_request(const std::string& hostport, const std::string& path,
                      uint8_t pri, void *stream_user_data);
   int submit_settings(int flags, spdylay_settings_entry *iv, size_t niv);
+  int submit_goaway(uint32_t status_code);
   bool would_block(int r);
   void* user_data();
 private:
@@ -69,7 +70,16 @@ private:
 
 int connect_to(const std::string& host, uint16_t port);
 
-int make_listen_socket(const std::string& host, uint16_t port, int family);
+// Initiates the connection to |host| and |port| and returns the
+// non-blocking socket without waiting for the connection to be
+// established. Only the first address of |host| is tried.
+int nonblock_connect_to(const std::string& host, uint16_t port);
+
+// Creates the listening socket bound to |host| and |port|. If
+// |reuseport| is true, SO_REUSEPORT is set so that several sockets
+// can be bound to the same address, if the platform supports it.
+int make_listen_socket(const std::string& host, uint16_t port, int family,
+                       bool reuseport = false);
 
 int make_non_block(int fd);
 
@@ -130,6 +140,14 @@ void setup_ssl_ctx(SSL_CTX *ssl_ctx, void *next_proto_select_cb_arg);
 
 int ssl_handshake(SSL *ssl, int fd);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// Installs the locking callbacks so that OpenSSL can be used from
+// multiple threads. OpenSSL 1.1.0 and later do not need them.
+void setup_ssl_lock();
+
+void teardown_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+
 void reset_timer();
 
 void get_timer(timeval *tv);
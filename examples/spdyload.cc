@@ -0,0 +1,1066 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif // HAVE_CONFIG_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <spdylay/spdylay.h>
+
+#include "spdylay_ssl.h"
+#include "uri.h"
+
+namespace spdylay {
+
+namespace {
+struct Config {
+  std::string host;
+  uint16_t port;
+  // The value of :host header field.
+  std::string hostport;
+  // The paths requested in turn.
+  std::vector<std::string> paths;
+  size_t num_requests;
+  size_t num_clients;
+  size_t num_threads;
+  size_t max_concurrent_streams;
+  // If nonzero, requests are issued for this number of seconds
+  // instead of num_requests.
+  int duration;
+  int spdy_version;
+  int window_bits;
+  // If positive, requests are issued at this rate (requests per
+  // second) regardless of the responses (open-loop).
+  double rate;
+  // If true, the intervals between requests are exponentially
+  // distributed. Otherwise they are constant.
+  bool poisson;
+  Config()
+    : port(0),
+      num_requests(1),
+      num_clients(1),
+      num_threads(1),
+      max_concurrent_streams(1),
+      duration(0),
+      spdy_version(-1),
+      window_bits(-1),
+      rate(0),
+      poisson(false)
+  {}
+};
+} // namespace
+
+namespace {
+Config config;
+} // namespace
+
+namespace {
+int64_t now_usec()
+{
+  timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+} // namespace
+
+namespace {
+// Histogram of the latency in microseconds. Like HdrHistogram, a
+// value is counted in the bucket whose width is 1/64 of the
+// magnitude of the value, so the reported percentiles are accurate
+// within about 1.6%. The memory and the time to record a value are
+// constant.
+class Histogram {
+public:
+  Histogram()
+    : counts_(NUM_BUCKETS, 0), count_(0), min_(0), max_(0), sum_(0), sumsq_(0)
+  {}
+  void record(int64_t v)
+  {
+    if(v < 0) {
+      v = 0;
+    }
+    ++counts_[index(v)];
+    if(count_ == 0 || v < min_) {
+      min_ = v;
+    }
+    if(v > max_) {
+      max_ = v;
+    }
+    ++count_;
+    sum_ += v;
+    sumsq_ += static_cast<double>(v)*v;
+  }
+  void merge(const Histogram& other)
+  {
+    if(other.count_ == 0) {
+      return;
+    }
+    for(size_t i = 0; i < NUM_BUCKETS; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    if(count_ == 0 || other.min_ < min_) {
+      min_ = other.min_;
+    }
+    if(other.max_ > max_) {
+      max_ = other.max_;
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    sumsq_ += other.sumsq_;
+  }
+  uint64_t count() const
+  {
+    return count_;
+  }
+  int64_t min() const
+  {
+    return min_;
+  }
+  int64_t max() const
+  {
+    return max_;
+  }
+  double mean() const
+  {
+    return count_ == 0 ? 0 : sum_/count_;
+  }
+  double sd() const
+  {
+    if(count_ < 2) {
+      return 0;
+    }
+    double m = mean();
+    double var = sumsq_/count_-m*m;
+    return var > 0 ? sqrt(var) : 0;
+  }
+  // Returns the smallest value which is greater than or equal to |p|
+  // percent of the recorded values.
+  int64_t percentile(double p) const
+  {
+    if(count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(ceil(p/100*count_));
+    if(rank == 0) {
+      rank = 1;
+    }
+    uint64_t n = 0;
+    for(size_t i = 0; i < NUM_BUCKETS; ++i) {
+      n += counts_[i];
+      if(n >= rank) {
+        return std::min(value(i), max_);
+      }
+    }
+    return max_;
+  }
+private:
+  static const int SUB_BUCKET_BITS = 7;
+  static const size_t NUM_BUCKETS =
+    (64-SUB_BUCKET_BITS+2) << (SUB_BUCKET_BITS-1);
+  static size_t index(int64_t v)
+  {
+    uint64_t u = v;
+    if(u < (1u << SUB_BUCKET_BITS)) {
+      return u;
+    }
+    int shift = 63-__builtin_clzll(u)-(SUB_BUCKET_BITS-1);
+    return (static_cast<size_t>(shift) << (SUB_BUCKET_BITS-1))+(u >> shift);
+  }
+  // Returns the largest value counted in the bucket |i|.
+  static int64_t value(size_t i)
+  {
+    if(i < (1u << SUB_BUCKET_BITS)) {
+      return i;
+    }
+    int shift = (i >> (SUB_BUCKET_BITS-1))-1;
+    uint64_t top = i-(static_cast<uint64_t>(shift) << (SUB_BUCKET_BITS-1));
+    return ((top+1) << shift)-1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  int64_t min_;
+  int64_t max_;
+  double sum_;
+  double sumsq_;
+};
+} // namespace
+
+namespace {
+struct Stats {
+  // The number of requests submitted.
+  size_t req_started;
+  // The number of responses received completely.
+  size_t req_done;
+  // The number of responses with 2xx or 3xx status code.
+  size_t req_success;
+  // The number of the requests which were reset or lost with the
+  // connection.
+  size_t req_error;
+  // The number of responses per status code class. Index 0 is used
+  // for the invalid status code.
+  size_t status[6];
+  // The number of bytes of the response bodies.
+  uint64_t bytes_body;
+  // The maximum number of requests which were due but waiting for a
+  // free stream in open-loop mode.
+  size_t max_backlog;
+  // Time to SYN_REPLY from the time the request was issued.
+  Histogram ttfb;
+  // Time to the end of response from the time the request was issued.
+  Histogram complete;
+  int64_t start_time;
+  int64_t end_time;
+  Stats()
+    : req_started(0), req_done(0), req_success(0), req_error(0),
+      bytes_body(0), max_backlog(0), start_time(0), end_time(0)
+  {
+    memset(status, 0, sizeof(status));
+  }
+  void merge(const Stats& other)
+  {
+    req_started += other.req_started;
+    req_done += other.req_done;
+    req_success += other.req_success;
+    req_error += other.req_error;
+    for(size_t i = 0; i < 6; ++i) {
+      status[i] += other.status[i];
+    }
+    bytes_body += other.bytes_body;
+    max_backlog = std::max(max_backlog, other.max_backlog);
+    ttfb.merge(other.ttfb);
+    complete.merge(other.complete);
+    if(start_time == 0 || other.start_time < start_time) {
+      start_time = other.start_time;
+    }
+    if(other.end_time > end_time) {
+      end_time = other.end_time;
+    }
+  }
+};
+} // namespace
+
+namespace {
+struct Stream {
+  // The time when the request was issued. In open-loop mode, this is
+  // the time when the request was scheduled to be issued, so that the
+  // time waiting for a free stream is included in the latency.
+  int64_t request_time;
+  int64_t first_byte_time;
+  int status;
+};
+} // namespace
+
+namespace {
+class Worker;
+} // namespace
+
+namespace {
+// A SPDY session to the server. Up to max_concurrent_streams
+// requests are in flight at a time.
+struct Client {
+  Worker *worker;
+  int fd;
+  SSL *ssl;
+  Spdylay *sc;
+  // Stream objects are reused for the subsequent requests.
+  std::vector<Stream> streams;
+  std::vector<Stream*> free_streams;
+  Client(Worker *worker)
+    : worker(worker), fd(-1), ssl(0), sc(0),
+      streams(config.max_concurrent_streams)
+  {
+    for(size_t i = 0; i < streams.size(); ++i) {
+      free_streams.push_back(&streams[i]);
+    }
+  }
+  ~Client()
+  {
+    disconnect();
+  }
+  int connect(SSL_CTX *ssl_ctx, std::string *next_proto,
+              const spdylay_session_callbacks *callbacks);
+  void disconnect()
+  {
+    delete sc;
+    sc = 0;
+    if(ssl) {
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+      ssl = 0;
+    }
+    if(fd != -1) {
+      shutdown(fd, SHUT_WR);
+      close(fd);
+      fd = -1;
+    }
+  }
+  size_t num_streams() const
+  {
+    return streams.size()-free_streams.size();
+  }
+  void submit_request(int64_t request_time);
+  void submit_requests();
+  void on_stream_close(Stream *strm, spdylay_status_code status_code);
+};
+} // namespace
+
+namespace {
+class Worker {
+public:
+  Worker(size_t num_clients, size_t num_requests, double rate,
+         unsigned short seed)
+    : ssl_ctx_(0),
+      num_clients_(num_clients),
+      num_requests_left_(num_requests),
+      deadline_(0),
+      next_path_(0),
+      rate_(rate),
+      next_arrival_(0),
+      next_client_(0)
+  {
+    rand_state_[0] = 0x330e;
+    rand_state_[1] = seed;
+    rand_state_[2] = 0;
+  }
+  ~Worker()
+  {
+    for(size_t i = 0; i < clients_.size(); ++i) {
+      delete clients_[i];
+    }
+    if(ssl_ctx_) {
+      SSL_CTX_free(ssl_ctx_);
+    }
+  }
+  int run();
+  // Returns true if another request should be issued.
+  bool more_requests(int64_t now) const
+  {
+    if(config.duration > 0) {
+      return now < deadline_;
+    } else {
+      return num_requests_left_ > 0;
+    }
+  }
+  // Counts a request against the limit given by -n.
+  void consume_request()
+  {
+    if(num_requests_left_ > 0) {
+      --num_requests_left_;
+    }
+  }
+  // Returns the path of the next request.
+  const std::string& next_path()
+  {
+    const std::string& path = config.paths[next_path_];
+    next_path_ = (next_path_+1) % config.paths.size();
+    return path;
+  }
+  Stats stats;
+private:
+  bool open_loop() const
+  {
+    return rate_ > 0;
+  }
+  // Returns the interval to the next request in microseconds.
+  int64_t arrival_interval();
+  // Queues the requests which are due by |now| in open-loop mode.
+  void schedule_requests(int64_t now);
+  // Assigns the queued requests to the free streams of the
+  // connections in turn.
+  void dispatch_requests();
+  bool has_free_stream() const;
+  // Returns the timeout for poll() in milliseconds.
+  int poll_timeout(int64_t now) const;
+  // Returns true if the requests remain to be issued.
+  bool has_pending_requests(int64_t now) const;
+
+  SSL_CTX *ssl_ctx_;
+  std::string next_proto_;
+  std::vector<Client*> clients_;
+  size_t num_clients_;
+  size_t num_requests_left_;
+  int64_t deadline_;
+  size_t next_path_;
+  double rate_;
+  // The time when the next request is due in open-loop mode.
+  int64_t next_arrival_;
+  // The due times of the requests waiting for a free stream.
+  std::deque<int64_t> backlog_;
+  size_t next_client_;
+  unsigned short rand_state_[3];
+};
+} // namespace
+
+namespace {
+Client* get_client(void *user_data)
+{
+  return reinterpret_cast<Client*>
+    (reinterpret_cast<Spdylay*>(user_data)->user_data());
+}
+} // namespace
+
+namespace {
+void on_ctrl_recv_callback2
+(spdylay_session *session, spdylay_frame_type type, spdylay_frame *frame,
+ void *user_data)
+{
+  if(type != SPDYLAY_SYN_REPLY) {
+    return;
+  }
+  Stream *strm = reinterpret_cast<Stream*>
+    (spdylay_session_get_stream_user_data(session,
+                                          frame->syn_reply.stream_id));
+  if(!strm) {
+    return;
+  }
+  strm->first_byte_time = now_usec();
+  char **nv = frame->syn_reply.nv;
+  for(size_t i = 0; nv[i]; i += 2) {
+    // SPDY/2 uses "status" header field.
+    if(strcmp(nv[i], ":status") == 0 || strcmp(nv[i], "status") == 0) {
+      strm->status = atoi(nv[i+1]);
+      break;
+    }
+  }
+}
+} // namespace
+
+namespace {
+void on_data_chunk_recv_callback
+(spdylay_session *session, uint8_t flags, int32_t stream_id,
+ const uint8_t *data, size_t len, void *user_data)
+{
+  get_client(user_data)->worker->stats.bytes_body += len;
+}
+} // namespace
+
+namespace {
+void on_stream_close_callback
+(spdylay_session *session, int32_t stream_id, spdylay_status_code status_code,
+ void *user_data)
+{
+  Stream *strm = reinterpret_cast<Stream*>
+    (spdylay_session_get_stream_user_data(session, stream_id));
+  if(strm) {
+    get_client(user_data)->on_stream_close(strm, status_code);
+  }
+}
+} // namespace
+
+int Client::connect(SSL_CTX *ssl_ctx, std::string *next_proto,
+                    const spdylay_session_callbacks *callbacks)
+{
+  fd = connect_to(config.host, config.port);
+  if(fd == -1) {
+    std::cerr << "Could not connect to the host" << std::endl;
+    return -1;
+  }
+  ssl = SSL_new(ssl_ctx);
+  if(!ssl) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  if(!SSL_set_tlsext_host_name(ssl, config.host.c_str())) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  if(ssl_handshake(ssl, fd) == -1) {
+    return -1;
+  }
+  make_non_block(fd);
+  set_tcp_nodelay(fd);
+  int spdy_version = spdylay_npn_get_version
+    (reinterpret_cast<const unsigned char*>(next_proto->c_str()),
+     next_proto->size());
+  if(spdy_version <= 0) {
+    return -1;
+  }
+  sc = new Spdylay(fd, ssl, spdy_version, callbacks, this);
+  if(spdy_version >= SPDYLAY_PROTO_SPDY3 && config.window_bits != -1) {
+    spdylay_settings_entry iv[1];
+    iv[0].settings_id = SPDYLAY_SETTINGS_INITIAL_WINDOW_SIZE;
+    iv[0].flags = SPDYLAY_ID_FLAG_SETTINGS_NONE;
+    iv[0].value = 1 << config.window_bits;
+    int rv = sc->submit_settings(SPDYLAY_FLAG_SETTINGS_NONE, iv, 1);
+    assert(rv == 0);
+  }
+  return 0;
+}
+
+void Client::submit_request(int64_t request_time)
+{
+  Stream *strm = free_streams.back();
+  free_streams.pop_back();
+  strm->request_time = request_time;
+  strm->first_byte_time = -1;
+  strm->status = 0;
+  int rv = sc->submit_request(config.hostport, worker->next_path(), 3, strm);
+  assert(rv == 0);
+  ++worker->stats.req_started;
+}
+
+void Client::submit_requests()
+{
+  int64_t now = now_usec();
+  while(!free_streams.empty() && worker->more_requests(now)) {
+    worker->consume_request();
+    submit_request(now);
+  }
+}
+
+void Client::on_stream_close(Stream *strm, spdylay_status_code status_code)
+{
+  Stats& stats = worker->stats;
+  if(status_code == SPDYLAY_OK && strm->first_byte_time != -1) {
+    int64_t now = now_usec();
+    ++stats.req_done;
+    int status_class = strm->status/100;
+    if(status_class < 1 || status_class > 5) {
+      status_class = 0;
+    }
+    ++stats.status[status_class];
+    if(status_class == 2 || status_class == 3) {
+      ++stats.req_success;
+    }
+    stats.ttfb.record(strm->first_byte_time-strm->request_time);
+    stats.complete.record(now-strm->request_time);
+  } else {
+    ++stats.req_error;
+  }
+  free_streams.push_back(strm);
+}
+
+int64_t Worker::arrival_interval()
+{
+  double interval = 1000000.0/rate_;
+  if(config.poisson) {
+    // 1-erand48() is in (0, 1], so that log() is finite.
+    interval *= -log(1-erand48(rand_state_));
+  }
+  return static_cast<int64_t>(interval);
+}
+
+void Worker::schedule_requests(int64_t now)
+{
+  while(next_arrival_ <= now && more_requests(next_arrival_)) {
+    consume_request();
+    backlog_.push_back(next_arrival_);
+    next_arrival_ += arrival_interval();
+  }
+  stats.max_backlog = std::max(stats.max_backlog, backlog_.size());
+}
+
+void Worker::dispatch_requests()
+{
+  while(!backlog_.empty()) {
+    size_t i;
+    for(i = 0; i < clients_.size(); ++i) {
+      Client *client = clients_[next_client_];
+      next_client_ = (next_client_+1) % clients_.size();
+      if(client->fd != -1 && !client->free_streams.empty()) {
+        client->submit_request(backlog_.front());
+        backlog_.pop_front();
+        break;
+      }
+    }
+    if(i == clients_.size()) {
+      // All streams are busy.
+      break;
+    }
+  }
+}
+
+bool Worker::has_free_stream() const
+{
+  for(size_t i = 0; i < clients_.size(); ++i) {
+    if(clients_[i]->fd != -1 && !clients_[i]->free_streams.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int Worker::poll_timeout(int64_t now) const
+{
+  int64_t wakeup;
+  if(open_loop()) {
+    if(!backlog_.empty() && has_free_stream()) {
+      return 0;
+    }
+    if(!more_requests(next_arrival_)) {
+      return -1;
+    }
+    wakeup = next_arrival_;
+  } else if(config.duration > 0) {
+    // Wake up at the deadline to close the idle connections.
+    wakeup = deadline_;
+  } else {
+    return -1;
+  }
+  return now < wakeup ? (wakeup-now+999)/1000 : 0;
+}
+
+bool Worker::has_pending_requests(int64_t now) const
+{
+  if(open_loop()) {
+    return !backlog_.empty() || more_requests(next_arrival_);
+  } else {
+    return more_requests(now);
+  }
+}
+
+int Worker::run()
+{
+  ssl_ctx_ = SSL_CTX_new(SSLv23_client_method());
+  if(!ssl_ctx_) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  switch(config.spdy_version) {
+  case SPDYLAY_PROTO_SPDY2:
+    next_proto_ = "spdy/2";
+    break;
+  case SPDYLAY_PROTO_SPDY3:
+    next_proto_ = "spdy/3";
+    break;
+  }
+  setup_ssl_ctx(ssl_ctx_, &next_proto_);
+  spdylay_session_callbacks callbacks;
+  memset(&callbacks, 0, sizeof(spdylay_session_callbacks));
+  callbacks.send_callback = send_callback;
+  callbacks.recv_callback = recv_callback;
+  callbacks.on_ctrl_recv_callback = on_ctrl_recv_callback2;
+  callbacks.on_data_chunk_recv_callback = on_data_chunk_recv_callback;
+  callbacks.on_stream_close_callback = on_stream_close_callback;
+  // The connections are established before the measurement starts.
+  for(size_t i = 0; i < num_clients_; ++i) {
+    Client *client = new Client(this);
+    clients_.push_back(client);
+    if(client->connect(ssl_ctx_, &next_proto_, &callbacks) != 0) {
+      return -1;
+    }
+  }
+  stats.start_time = now_usec();
+  if(config.duration > 0) {
+    deadline_ = stats.start_time+config.duration*1000000LL;
+  }
+  std::vector<pollfd> pollfds(clients_.size());
+  size_t num_active = clients_.size();
+  next_arrival_ = stats.start_time;
+  for(size_t i = 0; i < clients_.size(); ++i) {
+    if(!open_loop()) {
+      clients_[i]->submit_requests();
+    }
+    pollfds[i].fd = clients_[i]->fd;
+    ctl_poll(&pollfds[i], clients_[i]->sc);
+  }
+  while(num_active > 0) {
+    int nfds = poll(&pollfds[0], pollfds.size(), poll_timeout(now_usec()));
+    if(nfds == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return -1;
+    }
+    int64_t now = now_usec();
+    if(open_loop()) {
+      schedule_requests(now);
+      dispatch_requests();
+    }
+    for(size_t i = 0; i < clients_.size(); ++i) {
+      Client *client = clients_[i];
+      if(client->fd == -1) {
+        continue;
+      }
+      int rv = 0;
+      if(pollfds[i].revents & (POLLIN | POLLOUT)) {
+        if((rv = client->sc->recv()) == 0) {
+          if(!open_loop()) {
+            client->submit_requests();
+          }
+          rv = client->sc->send();
+        }
+      } else if(pollfds[i].revents & (POLLHUP | POLLERR)) {
+        rv = -1;
+      } else if(open_loop()) {
+        // Send the requests dispatched above.
+        rv = client->sc->send();
+      }
+      if(rv != 0) {
+        // The requests in flight are lost.
+        stats.req_error += client->num_streams();
+      } else if(client->num_streams() > 0 || has_pending_requests(now)) {
+        ctl_poll(&pollfds[i], client->sc);
+        continue;
+      }
+      client->disconnect();
+      pollfds[i].fd = -1;
+      --num_active;
+    }
+  }
+  stats.end_time = now_usec();
+  return 0;
+}
+
+namespace {
+void* run_worker(void *arg)
+{
+  Worker *worker = reinterpret_cast<Worker*>(arg);
+  if(worker->run() != 0) {
+    return worker;
+  }
+  return 0;
+}
+} // namespace
+
+namespace {
+void print_latency(const char *name, const Histogram& hist)
+{
+  const double percentiles[] = { 50, 90, 99, 99.9 };
+  std::cout << std::setw(18) << std::left << name << std::right
+            << std::setw(9) << hist.min()/1000.0
+            << std::setw(9) << hist.max()/1000.0
+            << std::setw(9) << hist.mean()/1000.0
+            << std::setw(9) << hist.sd()/1000.0;
+  for(size_t i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); ++i) {
+    std::cout << std::setw(9) << hist.percentile(percentiles[i])/1000.0;
+  }
+  std::cout << "\n";
+}
+} // namespace
+
+namespace {
+void print_stats(const Stats& stats)
+{
+  double elapsed = (stats.end_time-stats.start_time)/1000000.0;
+  std::cout << std::fixed << std::setprecision(2)
+            << "finished in " << elapsed << "s, "
+            << (elapsed > 0 ? stats.req_done/elapsed : 0) << " req/s, "
+            << (elapsed > 0 ? stats.bytes_body/elapsed/1024/1024 : 0)
+            << "MB/s\n"
+            << "requests: " << stats.req_started << " started, "
+            << stats.req_done << " done, "
+            << stats.req_success << " succeeded, "
+            << stats.req_done-stats.req_success << " failed, "
+            << stats.req_error << " errored\n"
+            << "status codes: " << stats.status[2] << " 2xx, "
+            << stats.status[3] << " 3xx, "
+            << stats.status[4] << " 4xx, "
+            << stats.status[5] << " 5xx\n"
+            << "traffic: " << stats.bytes_body << " bytes (response body)\n";
+  if(config.rate > 0) {
+    std::cout << "schedule: " << config.rate << " req/s, "
+              << (config.poisson ? "poisson" : "constant") << " interval, "
+              << stats.max_backlog << " max backlog\n";
+  }
+  std::cout << std::setprecision(3)
+            << std::setw(18) << std::left << "latency (ms)" << std::right
+            << std::setw(9) << "min" << std::setw(9) << "max"
+            << std::setw(9) << "mean" << std::setw(9) << "sd"
+            << std::setw(9) << "p50" << std::setw(9) << "p90"
+            << std::setw(9) << "p99" << std::setw(9) << "p99.9" << "\n";
+  print_latency("time to 1st byte", stats.ttfb);
+  print_latency("request complete", stats.complete);
+  std::cout << std::flush;
+}
+} // namespace
+
+namespace {
+int run()
+{
+  std::vector<Worker*> workers;
+  for(size_t i = 0; i < config.num_threads; ++i) {
+    size_t num_clients = config.num_clients/config.num_threads +
+      (i < config.num_clients%config.num_threads ? 1 : 0);
+    size_t num_requests = config.num_requests/config.num_threads +
+      (i < config.num_requests%config.num_threads ? 1 : 0);
+    workers.push_back(new Worker(num_clients, num_requests,
+                                 config.rate/config.num_threads, i));
+  }
+  int rv = 0;
+  if(workers.size() == 1) {
+    rv = workers[0]->run();
+  } else {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    setup_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+    std::vector<pthread_t> threads(workers.size());
+    for(size_t i = 0; i < workers.size(); ++i) {
+      int r = pthread_create(&threads[i], 0, run_worker, workers[i]);
+      if(r != 0) {
+        std::cerr << "pthread_create() failed: " << strerror(r) << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    for(size_t i = 0; i < threads.size(); ++i) {
+      void *res;
+      pthread_join(threads[i], &res);
+      if(res) {
+        rv = -1;
+      }
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    teardown_ssl_lock();
+#endif // OPENSSL_VERSION_NUMBER < 0x10100000L
+  }
+  Stats stats;
+  for(size_t i = 0; i < workers.size(); ++i) {
+    stats.merge(workers[i]->stats);
+    delete workers[i];
+  }
+  if(rv == 0) {
+    print_stats(stats);
+  }
+  return rv;
+}
+} // namespace
+
+namespace {
+void print_usage(std::ostream& out)
+{
+  out << "Usage: spdyload [-23h] [-n <N>] [-c <N>] [-m <N>] [-t <N>]\n"
+      << "                [-D <SECONDS>] [-r <RATE>] [--poisson]\n"
+      << "                [-w <WINDOW_BITS>] <URI>...\n"
+      << "\n"
+      << "Generates the load to SPDY server and reports the request rate\n"
+      << "and the latency distribution. The URIs are requested in turn.\n"
+      << "They must have the same host and port."
+      << std::endl;
+}
+} // namespace
+
+namespace {
+void print_help(std::ostream& out)
+{
+  print_usage(out);
+  out << "\n"
+      << "OPTIONS:\n"
+      << "    -n, --requests=<N> The total number of requests.\n"
+      << "                       Default: " << config.num_requests << "\n"
+      << "    -c, --clients=<N>  The number of concurrent connections.\n"
+      << "                       Default: " << config.num_clients << "\n"
+      << "    -m, --max-concurrent-streams=<N>\n"
+      << "                       The maximum number of requests in flight\n"
+      << "                       per connection.\n"
+      << "                       Default: " << config.max_concurrent_streams
+      << "\n"
+      << "    -t, --threads=<N>  The number of threads. The connections are\n"
+      << "                       distributed among the threads.\n"
+      << "                       Default: " << config.num_threads << "\n"
+      << "    -D, --duration=<SECONDS>\n"
+      << "                       Issue requests for <SECONDS> instead of\n"
+      << "                       the number of requests given by -n.\n"
+      << "    -r, --rate=<RATE>  Issue <RATE> requests per second in total\n"
+      << "                       regardless of the responses. The latency\n"
+      << "                       is measured from the time when the\n"
+      << "                       request is scheduled, including the time\n"
+      << "                       waiting for a free stream. Without this\n"
+      << "                       option, the next request is issued when\n"
+      << "                       the response is received.\n"
+      << "    --poisson          With -r, the intervals between requests\n"
+      << "                       are exponentially distributed instead of\n"
+      << "                       constant.\n"
+      << "    -w, --window-bits=<N>\n"
+      << "                       Sets the initial window size to 2**<N>.\n"
+      << "    -2, --spdy2        Only use SPDY/2.\n"
+      << "    -3, --spdy3        Only use SPDY/3.\n"
+      << "    -h, --help         Print this help.\n"
+      << std::endl;
+}
+} // namespace
+
+namespace {
+size_t parse_count(const char *optname, const char *arg)
+{
+  errno = 0;
+  char *end;
+  unsigned long int n = strtoul(arg, &end, 10);
+  if(errno != 0 || *end != '\0' || n == 0) {
+    std::cerr << optname << ": specify the positive integer" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return n;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  while(1) {
+    int flag;
+    static option long_options[] = {
+      {"requests", required_argument, 0, 'n' },
+      {"clients", required_argument, 0, 'c' },
+      {"max-concurrent-streams", required_argument, 0, 'm' },
+      {"threads", required_argument, 0, 't' },
+      {"duration", required_argument, 0, 'D' },
+      {"rate", required_argument, 0, 'r' },
+      {"poisson", no_argument, &flag, 1 },
+      {"window-bits", required_argument, 0, 'w' },
+      {"spdy2", no_argument, 0, '2' },
+      {"spdy3", no_argument, 0, '3' },
+      {"help", no_argument, 0, 'h' },
+      {0, 0, 0, 0 }
+    };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "23D:c:hm:n:r:t:w:", long_options,
+                        &option_index);
+    if(c == -1) {
+      break;
+    }
+    switch(c) {
+    case 'n':
+      config.num_requests = parse_count("-n", optarg);
+      break;
+    case 'c':
+      config.num_clients = parse_count("-c", optarg);
+      break;
+    case 'm':
+      config.max_concurrent_streams = parse_count("-m", optarg);
+      break;
+    case 't':
+      config.num_threads = parse_count("-t", optarg);
+      break;
+    case 'D':
+      config.duration = parse_count("-D", optarg);
+      break;
+    case 'r': {
+      errno = 0;
+      char *end;
+      double rate = strtod(optarg, &end);
+      if(errno != 0 || *end != '\0' || !(rate > 0)) {
+        std::cerr << "-r: specify the positive number" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      config.rate = rate;
+      break;
+    }
+    case 'w': {
+      errno = 0;
+      unsigned long int n = strtoul(optarg, 0, 10);
+      if(errno == 0 && n < 31) {
+        config.window_bits = n;
+      } else {
+        std::cerr << "-w: specify the integer in the range [0, 30], inclusive"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case '2':
+      config.spdy_version = SPDYLAY_PROTO_SPDY2;
+      break;
+    case '3':
+      config.spdy_version = SPDYLAY_PROTO_SPDY3;
+      break;
+    case 'h':
+      print_help(std::cout);
+      exit(EXIT_SUCCESS);
+    case '?':
+      exit(EXIT_FAILURE);
+    case 0:
+      switch(flag) {
+      case 1:
+        // --poisson
+        config.poisson = true;
+        break;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if(argc-optind < 1) {
+    print_usage(std::cerr);
+    std::cerr << "Too few arguments" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  for(int i = optind; i < argc; ++i) {
+    uri::UriStruct us;
+    if(!uri::parse(us, argv[i])) {
+      std::cerr << "Invalid URI: " << argv[i] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if(i == optind) {
+      config.host = us.host;
+      config.port = us.port;
+      std::stringstream ss;
+      if(us.ipv6LiteralAddress) {
+        ss << "[" << us.host << "]";
+      } else {
+        ss << us.host;
+      }
+      if(us.port != 443) {
+        ss << ":" << us.port;
+      }
+      config.hostport = ss.str();
+    } else if(config.host != us.host || config.port != us.port) {
+      std::cerr << "All URIs must have the same host and port: " << argv[i]
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    config.paths.push_back(us.dir+us.file+us.query);
+  }
+  if(config.num_threads > config.num_clients) {
+    config.num_threads = config.num_clients;
+  }
+  struct sigaction act;
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &act, 0);
+  SSL_load_error_strings();
+  SSL_library_init();
+  return run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace spdylay
+
+int main(int argc, char **argv)
+{
+  return spdylay::main(argc, argv);
+}
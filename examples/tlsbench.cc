@@ -0,0 +1,267 @@
+/*
+ * Spdylay - SPDY Library
+ *
+ * Copyright (c) 2012 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "spdylay_ssl.h"
+
+namespace spdylay {
+
+namespace {
+struct Config {
+  size_t num_handshakes;
+  bool resume;
+  bool no_ticket;
+  Config()
+    : num_handshakes(1000),
+      resume(true),
+      no_ticket(false)
+  {}
+};
+} // namespace
+
+namespace {
+Config config;
+} // namespace
+
+namespace {
+// The session received last. Session tickets of TLSv1.3 are received
+// after the handshake, so we capture them in this callback.
+SSL_SESSION *last_session = 0;
+} // namespace
+
+namespace {
+int new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+  if(last_session) {
+    SSL_SESSION_free(last_session);
+  }
+  last_session = session;
+  // We take the ownership of |session|.
+  return 1;
+}
+} // namespace
+
+namespace {
+// Performs one handshake with |host| and |port|. If |resumed| is not
+// NULL, it is set to true when the session was resumed. Returns 0 if
+// it succeeds, or -1.
+int handshake(SSL_CTX *ssl_ctx, const std::string& host, uint16_t port,
+              bool *resumed)
+{
+  int fd = connect_to(host, port);
+  if(fd == -1) {
+    std::cerr << "Could not connect to the host" << std::endl;
+    return -1;
+  }
+  set_tcp_nodelay(fd);
+  SSL *ssl = SSL_new(ssl_ctx);
+  if(!ssl) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    close(fd);
+    return -1;
+  }
+  if(config.resume && last_session) {
+    SSL_set_session(ssl, last_session);
+  }
+  int rv = ssl_handshake(ssl, fd);
+  if(rv == 0) {
+    *resumed = SSL_session_reused(ssl);
+    SSL_shutdown(ssl);
+    // Read until the server closes the connection so that the session
+    // tickets sent after the handshake are processed.
+    char buf[256];
+    while(SSL_read(ssl, buf, sizeof(buf)) > 0);
+  }
+  SSL_free(ssl);
+  shutdown(fd, SHUT_WR);
+  close(fd);
+  return rv;
+}
+} // namespace
+
+namespace {
+int run(const std::string& host, uint16_t port)
+{
+  SSL_CTX *ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if(!ssl_ctx) {
+    std::cerr << ERR_error_string(ERR_get_error(), 0) << std::endl;
+    return -1;
+  }
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 |
+                      SSL_OP_NO_COMPRESSION);
+  if(config.no_ticket) {
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+  }
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+                                 SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_cb);
+
+  size_t num_resumed = 0;
+  size_t num_failed = 0;
+  reset_timer();
+  for(size_t i = 0; i < config.num_handshakes; ++i) {
+    bool resumed = false;
+    if(handshake(ssl_ctx, host, port, &resumed) == 0) {
+      if(resumed) {
+        ++num_resumed;
+      }
+    } else {
+      ++num_failed;
+    }
+  }
+  timeval tv;
+  get_timer(&tv);
+  double elapsed = tv.tv_sec + tv.tv_usec/1000000.0;
+  std::cout << "handshakes: " << config.num_handshakes
+            << ", resumed: " << num_resumed
+            << ", full: " << config.num_handshakes-num_resumed-num_failed
+            << ", failed: " << num_failed << "\n"
+            << "time: " << std::fixed << std::setprecision(3) << elapsed
+            << " sec, " << std::setprecision(1)
+            << (elapsed > 0 ? config.num_handshakes/elapsed : 0)
+            << " handshakes/sec"
+            << std::endl;
+  if(last_session) {
+    SSL_SESSION_free(last_session);
+  }
+  SSL_CTX_free(ssl_ctx);
+  return num_failed == 0 ? 0 : -1;
+}
+} // namespace
+
+namespace {
+void print_usage(std::ostream& out)
+{
+  out << "Usage: tlsbench [-h] [-n <NUM>] [--no-resume] [--no-ticket]\n"
+      << "                <HOST> <PORT>\n"
+      << "\n"
+      << "Measures the rate of TLS handshakes with the server by connecting\n"
+      << "to it one after another."
+      << std::endl;
+}
+} // namespace
+
+namespace {
+void print_help(std::ostream& out)
+{
+  print_usage(out);
+  out << "\n"
+      << "OPTIONS:\n"
+      << "    -n, --handshakes=<NUM>\n"
+      << "                       The number of handshakes to perform.\n"
+      << "                       Default: " << config.num_handshakes << "\n"
+      << "    --no-resume        Do not resume the session. Every handshake\n"
+      << "                       is the full handshake.\n"
+      << "    --no-ticket        Do not use session tickets. The session is\n"
+      << "                       resumed using the server side session\n"
+      << "                       cache.\n"
+      << "    -h, --help         Print this help.\n"
+      << std::endl;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  while(1) {
+    int flag;
+    static option long_options[] = {
+      {"handshakes", required_argument, 0, 'n' },
+      {"help", no_argument, 0, 'h' },
+      {"no-resume", no_argument, &flag, 1 },
+      {"no-ticket", no_argument, &flag, 2 },
+      {0, 0, 0, 0 }
+    };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "hn:", long_options, &option_index);
+    if(c == -1) {
+      break;
+    }
+    switch(c) {
+    case 'h':
+      print_help(std::cout);
+      exit(EXIT_SUCCESS);
+    case 'n':
+      config.num_handshakes = strtoul(optarg, 0, 10);
+      break;
+    case '?':
+      exit(EXIT_FAILURE);
+    case 0:
+      switch(flag) {
+      case 1:
+        // --no-resume
+        config.resume = false;
+        break;
+      case 2:
+        // --no-ticket
+        config.no_ticket = true;
+        break;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if(argc-optind < 2) {
+    print_usage(std::cerr);
+    std::cerr << "Too few arguments" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string host = argv[optind];
+  errno = 0;
+  unsigned long int port = strtoul(argv[optind+1], 0, 10);
+  if(errno != 0 || port == 0 || port > 65535) {
+    std::cerr << "Invalid port: " << argv[optind+1] << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction act;
+  memset(&act, 0, sizeof(struct sigaction));
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &act, 0);
+  SSL_load_error_strings();
+  SSL_library_init();
+  return run(host, port) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace spdylay
+
+int main(int argc, char **argv)
+{
+  return spdylay::main(argc, argv);
+}
@@ -103,8 +103,9 @@ std::string percentDecode
 std::string http_date(time_t t)
 {
   char buf[32];
-  tm* tms = gmtime(&t); // returned struct is statically allocated.
-  size_t r = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", tms);
+  tm tms;
+  gmtime_r(&t, &tms);
+  size_t r = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tms);
   return std::string(&buf[0], &buf[r]);
 }
 